@@ -0,0 +1,187 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+#include <QCL/qcl.hpp>
+
+#include <cassert>
+#include <memory>
+#include <vector>
+
+#include "memory_pool.hpp"
+
+namespace spatialcl {
+
+/// Events that an operation waits for before it starts
+using event_list = std::vector<cl::Event>;
+
+/// Makes all commands that are subsequently enqueued in the command queue of
+/// \c ctx wait for \c wait_events. Since the command queues are in-order,
+/// this is only required for events of other command queues (e.g. of a
+/// \c transfer_queue) or user events. Does nothing if \c wait_events is
+/// \c nullptr or empty.
+inline void enqueue_wait_for_events(const qcl::device_context_ptr& ctx,
+                                    const event_list* wait_events)
+{
+  if(wait_events == nullptr || wait_events->empty())
+    return;
+
+  cl_int err = ctx->get_command_queue().enqueueBarrierWithWaitList(wait_events);
+  qcl::check_cl_error(err, "Could not enqueue barrier for wait list");
+}
+
+/// Stores in \c *evt an event that completes once all commands that have
+/// been enqueued so far in the command queue of \c ctx have completed.
+/// Operations that consist of several kernels and transfers use this to
+/// provide a single event. Does nothing if \c evt is \c nullptr.
+inline void enqueue_completion_event(const qcl::device_context_ptr& ctx,
+                                     cl::Event* evt)
+{
+  if(evt == nullptr)
+    return;
+
+  cl_int err = ctx->get_command_queue().enqueueMarkerWithWaitList(nullptr, evt);
+  qcl::check_cl_error(err, "Could not enqueue marker");
+}
+
+/// Submits a batch of queries that are executed with the same engine
+/// on the same tree, e.g. one query handler per kind of particle or per
+/// output target. Only the first query waits for \c wait_events; the
+/// others follow on the in-order command queue. The batch is flushed to
+/// the device at once and the host does not block.
+/// \param evt If not \c nullptr, receives an event that completes once
+/// all queries of the batch have completed
+template<class Query_engine, class Tree_type, class Handler_module>
+void enqueue_query_batch(Query_engine& engine,
+                         const Tree_type& tree,
+                         const std::vector<Handler_module*>& handlers,
+                         cl::Event* evt = nullptr,
+                         const event_list* wait_events = nullptr)
+{
+  for(std::size_t i = 0; i < handlers.size(); ++i)
+  {
+    cl_int err = engine(tree,
+                        *handlers[i],
+                        nullptr,
+                        i == 0 ? wait_events : nullptr);
+    qcl::check_cl_error(err, "Could not enqueue query of batch");
+  }
+  if(handlers.empty())
+    enqueue_wait_for_events(tree.get_device_context(), wait_events);
+
+  enqueue_completion_event(tree.get_device_context(), evt);
+
+  cl_int err = tree.get_device_context()->get_command_queue().flush();
+  qcl::check_cl_error(err, "Could not flush query batch");
+}
+
+/// A second, in-order command queue on the device of a device context.
+/// Transfers enqueued here can overlap with the kernels of the main
+/// command queue, e.g. the upload of the particles of the next frame
+/// with the queries of the current frame. Pass the returned events as
+/// wait list to the operations that use the transferred data.
+///
+/// Buffers of the memory pool of the device context (see
+/// \c device_memory_pool), which include the node buffers of the trees,
+/// must not be transferred here, since the pool only orders the reuse of
+/// its buffers with respect to the command queue of the device context.
+class transfer_queue
+{
+public:
+  explicit transfer_queue(const qcl::device_context_ptr& ctx)
+    : _queue{ctx->get_context(), ctx->get_device()},
+      _pool{get_memory_pool(ctx)}
+  {}
+
+  /// Enqueues a non-blocking upload. The host memory must remain valid
+  /// until \c evt has completed.
+  template<class T>
+  void upload(const cl::Buffer& buffer,
+              const T* data,
+              std::size_t num_elements,
+              cl::Event* evt = nullptr,
+              const event_list* wait_events = nullptr,
+              std::size_t offset = 0)
+  {
+    assert(!_pool->is_in_use(buffer) &&
+           "Pooled buffers cannot be used on a transfer_queue");
+    cl_int err = _queue.enqueueWriteBuffer(buffer, CL_FALSE,
+                                           offset * sizeof(T),
+                                           num_elements * sizeof(T),
+                                           data, wait_events, evt);
+    qcl::check_cl_error(err, "Could not enqueue upload");
+  }
+
+  /// Enqueues a non-blocking download. The host memory must remain valid
+  /// and may not be read until \c evt has completed.
+  template<class T>
+  void download(const cl::Buffer& buffer,
+                T* data,
+                std::size_t num_elements,
+                cl::Event* evt = nullptr,
+                const event_list* wait_events = nullptr,
+                std::size_t offset = 0)
+  {
+    assert(!_pool->is_in_use(buffer) &&
+           "Pooled buffers cannot be used on a transfer_queue");
+    cl_int err = _queue.enqueueReadBuffer(buffer, CL_FALSE,
+                                          offset * sizeof(T),
+                                          num_elements * sizeof(T),
+                                          data, wait_events, evt);
+    qcl::check_cl_error(err, "Could not enqueue download");
+  }
+
+  /// Submits all enqueued transfers to the device
+  void flush()
+  {
+    cl_int err = _queue.flush();
+    qcl::check_cl_error(err, "Could not flush transfer queue");
+  }
+
+  /// Blocks until all enqueued transfers have completed
+  void finish()
+  {
+    cl_int err = _queue.finish();
+    qcl::check_cl_error(err, "Error while waiting for the transfer queue");
+  }
+
+  const cl::CommandQueue& get_command_queue() const
+  {
+    return _queue;
+  }
+
+private:
+  cl::CommandQueue _queue;
+  std::shared_ptr<device_memory_pool> _pool;
+};
+
+}
+
+#endif
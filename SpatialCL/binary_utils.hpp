@@ -26,6 +26,9 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef BINARY_UTILS_HPP
+#define BINARY_UTILS_HPP
+
 #include <cstddef>
 
 namespace spatialcl{
@@ -70,3 +73,5 @@ struct is_small_power2
 }
 }
 }
+
+#endif
@@ -0,0 +1,376 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUILD_PROFILER_HPP
+#define BUILD_PROFILER_HPP
+
+#include <QCL/qcl.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "context_registry.hpp"
+
+namespace spatialcl {
+
+/// The execution time of one stage of a tree construction
+struct build_stage_timing
+{
+  std::string name;
+  /// The stage depth. Stages enqueued while another stage is
+  /// open are nested in this stage.
+  std::size_t depth;
+  double seconds;
+};
+
+/// The stages of one or several tree constructions,
+/// in the order in which they have been enqueued
+class build_profile_report
+{
+public:
+  void add_stage(const build_stage_timing& stage)
+  {
+    _stages.push_back(stage);
+  }
+
+  const std::vector<build_stage_timing>& get_stages() const
+  {
+    return _stages;
+  }
+
+  /// \return The sum of the times of all stages that
+  /// are not nested in other stages
+  double get_total_time() const
+  {
+    double result = 0.0;
+    for(const build_stage_timing& stage : _stages)
+      if(stage.depth == 0)
+        result += stage.seconds;
+    return result;
+  }
+
+  bool empty() const
+  {
+    return _stages.empty();
+  }
+
+  void print(std::ostream& ostr) const
+  {
+    for(const build_stage_timing& stage : _stages)
+      ostr << std::string(2 * (stage.depth + 1), ' ')
+           << stage.name << ": " << stage.seconds << "s" << std::endl;
+  }
+
+private:
+  std::vector<build_stage_timing> _stages;
+};
+
+/// Accumulates the stage times of several reports by stage name,
+/// like \c common::cumulative_timer does for a single time
+class cumulative_build_profile
+{
+public:
+  void add(const build_profile_report& report)
+  {
+    for(const build_stage_timing& stage : report.get_stages())
+    {
+      auto it = _stages.find(stage.name);
+      if(it == _stages.end())
+      {
+        _stage_names.push_back(stage.name);
+        it = _stages.insert(std::make_pair(stage.name, accumulated_stage{0.0, 0})).first;
+      }
+      it->second.total_time += stage.seconds;
+      ++it->second.num_runs;
+    }
+  }
+
+  void reset()
+  {
+    _stages.clear();
+    _stage_names.clear();
+  }
+
+  /// \return The names of all stages, in the order of their first occurrence
+  const std::vector<std::string>& get_stage_names() const
+  {
+    return _stage_names;
+  }
+
+  double get_total_time(const std::string& stage_name) const
+  {
+    auto it = _stages.find(stage_name);
+    return it == _stages.end() ? 0.0 : it->second.total_time;
+  }
+
+  unsigned get_num_runs(const std::string& stage_name) const
+  {
+    auto it = _stages.find(stage_name);
+    return it == _stages.end() ? 0 : it->second.num_runs;
+  }
+
+  double get_average_time(const std::string& stage_name) const
+  {
+    const unsigned num_runs = get_num_runs(stage_name);
+    if(num_runs == 0)
+      return 0.0;
+    return get_total_time(stage_name) / static_cast<double>(num_runs);
+  }
+
+  void print(std::ostream& ostr) const
+  {
+    for(const std::string& name : _stage_names)
+      ostr << "  " << name << ": " << get_average_time(name) << "s average over "
+           << get_num_runs(name) << " runs, " << get_total_time(name) << "s total"
+           << std::endl;
+  }
+
+private:
+  struct accumulated_stage
+  {
+    double total_time;
+    unsigned num_runs;
+  };
+
+  std::map<std::string, accumulated_stage> _stages;
+  std::vector<std::string> _stage_names;
+};
+
+/// Times the stages of tree constructions (e.g. the extent reduction,
+/// the key generation, the sort and the node construction) that are
+/// enqueued in the command queue of a device context. The profiler
+/// is disabled by default. While disabled, no commands are enqueued and
+/// the queue is never waited for, but each stage still looks up the
+/// profiler of the context (see \c get_build_profiler(), which locks
+/// a mutex and searches a map) and checks the flag under the lock of
+/// the profiler. Stages are only opened around whole construction steps,
+/// so this is small compared to the kernels of the step.
+///
+/// Stages are delimited by markers in the command queue. If the queue has
+/// been created with \c CL_QUEUE_PROFILING_ENABLE, the stage times are
+/// obtained from the profiling information of the markers and do not change
+/// the execution. Otherwise, the profiler waits for the queue at the
+/// boundaries of the stages and measures the wall-clock time, which
+/// serializes the construction with the host.
+class build_profiler
+{
+public:
+  explicit build_profiler(const qcl::device_context_ptr& ctx)
+    : _ctx{ctx.get()}, _enabled{false}
+  {
+    cl_command_queue_properties properties = 0;
+    cl_int err = ctx->get_command_queue().getInfo(CL_QUEUE_PROPERTIES, &properties);
+    qcl::check_cl_error(err, "Could not query command queue properties");
+    _uses_device_profiling = (properties & CL_QUEUE_PROFILING_ENABLE) != 0;
+  }
+
+  void enable()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _enabled = true;
+  }
+
+  /// Disables the profiler. Stages that have already been
+  /// recorded remain available through \c collect().
+  void disable()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _enabled = false;
+  }
+
+  bool is_enabled() const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _enabled;
+  }
+
+  bool uses_device_profiling() const
+  {
+    return _uses_device_profiling;
+  }
+
+  /// Opens a stage. Does nothing if the profiler is disabled.
+  /// \return Whether a stage has been opened, which must then
+  /// be closed with \c end_stage()
+  bool begin_stage(const char* name)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    if(!_enabled)
+      return false;
+
+    // The name is only copied for recorded stages
+    recorded_stage stage;
+    stage.name = name;
+    stage.depth = _open_stages.size();
+    this->mark(stage.begin_marker, stage.begin_host_time);
+
+    _open_stages.push_back(_stages.size());
+    _stages.push_back(stage);
+    return true;
+  }
+
+  /// Closes the stage that has been opened last
+  void end_stage()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    if(_open_stages.empty())
+      return;
+
+    recorded_stage& stage = _stages[_open_stages.back()];
+    _open_stages.pop_back();
+    this->mark(stage.end_marker, stage.end_host_time);
+  }
+
+  /// Waits for all closed stages to complete and returns their
+  /// timings. The returned stages are removed from the profiler.
+  build_profile_report collect()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    build_profile_report report;
+    // Stages that are still open remain in the profiler
+    const std::size_t num_collected_stages =
+        _open_stages.empty() ? _stages.size() : _open_stages.front();
+
+    for(std::size_t i = 0; i < num_collected_stages; ++i)
+    {
+      const recorded_stage& stage = _stages[i];
+
+      double seconds = stage.end_host_time - stage.begin_host_time;
+      if(_uses_device_profiling)
+      {
+        cl_int err = stage.end_marker.wait();
+        qcl::check_cl_error(err, "Error while waiting for build stage");
+
+        cl_ulong begin = 0;
+        cl_ulong end = 0;
+        err = stage.begin_marker.getProfilingInfo(CL_PROFILING_COMMAND_END, &begin);
+        qcl::check_cl_error(err, "Could not obtain profiling information");
+        err = stage.end_marker.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+        qcl::check_cl_error(err, "Could not obtain profiling information");
+
+        seconds = static_cast<double>(end - begin) * 1.e-9;
+      }
+      report.add_stage(build_stage_timing{stage.name, stage.depth, seconds});
+    }
+
+    _stages.erase(_stages.begin(), _stages.begin() + num_collected_stages);
+    for(std::size_t& open_stage : _open_stages)
+      open_stage -= num_collected_stages;
+
+    return report;
+  }
+
+private:
+  struct recorded_stage
+  {
+    std::string name;
+    std::size_t depth;
+    cl::Event begin_marker;
+    cl::Event end_marker;
+    double begin_host_time = 0.0;
+    double end_host_time = 0.0;
+  };
+
+  void mark(cl::Event& marker, double& host_time)
+  {
+    if(_uses_device_profiling)
+    {
+      cl_int err = _ctx->get_command_queue().enqueueMarkerWithWaitList(nullptr, &marker);
+      qcl::check_cl_error(err, "Could not enqueue marker");
+    }
+    else
+    {
+      cl_int err = _ctx->get_command_queue().finish();
+      qcl::check_cl_error(err, "Error while waiting for build stage");
+
+      auto now = std::chrono::high_resolution_clock::now().time_since_epoch();
+      host_time = static_cast<double>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()) * 1.e-9;
+    }
+  }
+
+  // The profiler is owned by the registry of get_build_profiler(),
+  // which only hands it out while the context is alive
+  qcl::device_context_ptr::element_type* _ctx;
+  bool _enabled;
+  bool _uses_device_profiling;
+
+  std::vector<recorded_stage> _stages;
+  std::vector<std::size_t> _open_stages;
+  mutable std::mutex _mutex;
+};
+
+/// \return The build profiler of the device context \c ctx, which is
+/// created on first use and shared by all trees of the context.
+/// The profiler is released once the context has been destroyed.
+inline std::shared_ptr<build_profiler>
+get_build_profiler(const qcl::device_context_ptr& ctx)
+{
+  static context_registry<build_profiler> registry;
+  return registry.get(ctx, [](const qcl::device_context_ptr& c){
+    return std::make_shared<build_profiler>(c);
+  });
+}
+
+/// Times the commands that are enqueued in the command queue
+/// of \c ctx during the lifetime of the object as one build stage,
+/// if the build profiler of \c ctx is enabled.
+class build_stage_scope
+{
+public:
+  build_stage_scope(const qcl::device_context_ptr& ctx,
+                    const char* name)
+    : _profiler{get_build_profiler(ctx)}
+  {
+    _is_open = _profiler->begin_stage(name);
+  }
+
+  ~build_stage_scope()
+  {
+    if(_is_open)
+      _profiler->end_stage();
+  }
+
+  build_stage_scope(const build_stage_scope&) = delete;
+  build_stage_scope& operator=(const build_stage_scope&) = delete;
+
+private:
+  std::shared_ptr<build_profiler> _profiler;
+  bool _is_open;
+};
+
+}
+
+#endif
@@ -29,6 +29,8 @@
 #ifndef CONFIGURATION_HPP
 #define CONFIGURATION_HPP
 
+#include <type_traits>
+
 #include <QCL/qcl.hpp>
 #include <QCL/qcl_module.hpp>
 #include <QCL/qcl_boost_compat.hpp>
@@ -82,6 +84,8 @@ struct configuration
                 "Only 2D and 3D is supported");
 
 private:
+  static constexpr int scalar_is_double = std::is_same<scalar, double>::value ? 1 : 0;
+
   QCL_MAKE_SOURCE(
     QCL_IMPORT_TYPE(cell_index_type)
     QCL_IMPORT_TYPE(vector_type)
@@ -89,7 +93,15 @@ private:
     QCL_IMPORT_TYPE(particle_type)
     QCL_IMPORT_TYPE(scalar)
     QCL_IMPORT_CONSTANT(dimension)
+    QCL_IMPORT_CONSTANT(scalar_is_double)
     R"(
+     // The largest finite value of the scalar type
+     #if scalar_is_double
+      #define SCALAR_MAX DBL_MAX
+     #else
+      #define SCALAR_MAX FLT_MAX
+     #endif
+
      #if dimension == 2
       #define PARTICLE_POSITION(p) p.s01
       #define CONVERT_VECTOR_TO_CELL_INDEX(v) convert_uint2(v)
@@ -125,10 +137,12 @@ public:
   using type_system = typename Tree_type::type_system;
   using node_type0 = typename Tree_type::node_type0;
   using node_type1 = typename Tree_type::node_type1;
+  using node_codec = typename Tree_type::node_codec;
 
 private:
   QCL_MAKE_SOURCE(
     QCL_INCLUDE_MODULE(configuration<type_system>)
+    QCL_INCLUDE_MODULE(node_codec)
     QCL_IMPORT_TYPE(node_type0)
     QCL_IMPORT_TYPE(node_type1)
     QCL_RAW()
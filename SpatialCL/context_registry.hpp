@@ -0,0 +1,88 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CONTEXT_REGISTRY_HPP
+#define CONTEXT_REGISTRY_HPP
+
+#include <QCL/qcl.hpp>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace spatialcl {
+
+/// Associates one shared object of type \c T with each device context,
+/// e.g. the memory pool of a context. The objects are created on first
+/// use and released once their context has been destroyed.
+template<class T>
+class context_registry
+{
+public:
+  /// \return The object of \c ctx. If none exists yet, it is
+  /// created by calling \c create(ctx), which must return a
+  /// \c std::shared_ptr<T>.
+  template<class Factory>
+  std::shared_ptr<T> get(const qcl::device_context_ptr& ctx, Factory create)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    // Drop the objects of destroyed contexts, so that they do not
+    // accumulate, and so that a new context created at the address of
+    // a destroyed one does not receive the object of the old context.
+    for(auto it = _entries.begin(); it != _entries.end();)
+    {
+      if(it->second.ctx.expired())
+        it = _entries.erase(it);
+      else
+        ++it;
+    }
+
+    auto it = _entries.find(ctx.get());
+    if(it == _entries.end())
+      it = _entries.insert(std::make_pair(ctx.get(), entry{ctx, create(ctx)})).first;
+    return it->second.object;
+  }
+
+private:
+  using context_type = qcl::device_context_ptr::element_type;
+
+  struct entry
+  {
+    std::weak_ptr<context_type> ctx;
+    std::shared_ptr<T> object;
+  };
+
+  std::map<const void*, entry> _entries;
+  std::mutex _mutex;
+};
+
+}
+
+#endif
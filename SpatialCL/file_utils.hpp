@@ -0,0 +1,147 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FILE_UTILS_HPP
+#define FILE_UTILS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SPATIALCL_FILE_UTILS_POSIX
+#endif
+
+namespace spatialcl{
+namespace utils{
+namespace file{
+
+/// \return \c prefix followed by a suffix that is unique among all threads
+/// and processes, e.g. to name files that several instances write to the
+/// same directory
+inline std::string get_unique_name(const std::string& prefix)
+{
+  // The process id distinguishes processes on the same host, the
+  // random key processes on different hosts sharing a directory,
+  // and the counter the threads and calls within a process.
+  static const std::uint64_t process_key = []{
+    std::random_device rd;
+    return (static_cast<std::uint64_t>(rd()) << 32) ^ rd();
+  }();
+  static std::atomic<std::uint64_t> counter{0};
+
+  std::stringstream result;
+  result << prefix << "." << std::hex;
+#ifdef SPATIALCL_FILE_UTILS_POSIX
+  result << static_cast<std::uint64_t>(getpid()) << ".";
+#endif
+  result << process_key << "." << counter++;
+  return result.str();
+}
+
+/// \return The name of a temporary file in the directory of \c filename
+/// that no other thread or process uses at the same time. Files can be
+/// written to this temporary file first and then be renamed to
+/// \c filename, such that readers never see incomplete files even if
+/// several processes write the same file concurrently.
+inline std::string get_unique_temporary_filename(const std::string& filename)
+{
+  return get_unique_name(filename) + ".tmp";
+}
+
+/// Creates a new, empty directory that no other thread or process uses.
+/// The directory is created in the directory given by the \c TMPDIR
+/// environment variable, or in /tmp if it is not set.
+/// \param prefix The prefix of the directory name
+/// \return The path of the created directory
+inline std::string create_temporary_directory(const std::string& prefix = "spatialcl")
+{
+#ifdef SPATIALCL_FILE_UTILS_POSIX
+  const char* tmpdir = std::getenv("TMPDIR");
+  std::string base = (tmpdir != nullptr && *tmpdir != '\0') ? tmpdir : "/tmp";
+  std::string path_template = base + "/" + prefix + ".XXXXXX";
+
+  std::vector<char> path{path_template.begin(), path_template.end()};
+  path.push_back('\0');
+  if(mkdtemp(path.data()) == nullptr)
+    throw std::runtime_error{"Could not create temporary directory "+path_template};
+  return std::string{path.data()};
+#else
+  throw std::runtime_error{"Temporary directories are not supported on this platform"};
+#endif
+}
+
+/// \return The paths of the entries of the directory \c path, except
+/// for "." and "..". Empty if the directory cannot be read.
+inline std::vector<std::string> list_directory(const std::string& path)
+{
+  std::vector<std::string> entries;
+#ifdef SPATIALCL_FILE_UTILS_POSIX
+  DIR* dir = opendir(path.c_str());
+  if(dir == nullptr)
+    return entries;
+
+  while(dirent* entry = readdir(dir))
+  {
+    const std::string name = entry->d_name;
+    if(name != "." && name != "..")
+      entries.push_back(path + "/" + name);
+  }
+  closedir(dir);
+#endif
+  return entries;
+}
+
+/// Removes the directory \c path together with the files it contains.
+/// Subdirectories are not removed.
+/// \return Whether the directory has been removed
+inline bool remove_directory(const std::string& path)
+{
+#ifdef SPATIALCL_FILE_UTILS_POSIX
+  for(const std::string& file : list_directory(path))
+    std::remove(file.c_str());
+  return rmdir(path.c_str()) == 0;
+#else
+  return false;
+#endif
+}
+
+}
+}
+}
+
+#endif
@@ -41,8 +41,8 @@ QCL_STANDALONE_SOURCE
   QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
   QCL_RAW
   (
-    // Calculates minimum distance squared to a box. Assumes
-    // that the point is outside of the box
+    // Calculates minimum distance squared to a box,
+    // or 0 if the box contains the point
     scalar box_distance2(vector_type point,
                          vector_type box_min,
                          vector_type box_max)
@@ -96,6 +96,29 @@ QCL_STANDALONE_SOURCE
       return box_contains_point(box_min, box_max,
                                 PARTICLE_POSITION(p));
     }
+
+    int box_contains_box(vector_type outer_min,
+                         vector_type outer_max,
+                         vector_type inner_min,
+                         vector_type inner_max)
+    {
+      int_vector_type contains = (outer_min <= inner_min) &&
+                                 (outer_max >= inner_max);
+      return DIMENSIONALITY_SWITCH(contains.x & contains.y & 1,
+                                   contains.x & contains.y & contains.z & 1);
+    }
+
+    // Checks if all corners of a box are within the sphere
+    // around center with the squared radius radius2
+    int sphere_contains_box(vector_type center,
+                            scalar radius2,
+                            vector_type box_min,
+                            vector_type box_max)
+    {
+      vector_type delta = fmax(fabs(center - box_min),
+                               fabs(center - box_max));
+      return VECTOR_NORM2(delta) <= radius2;
+    }
   )
 )
 
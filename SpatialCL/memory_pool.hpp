@@ -0,0 +1,258 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MEMORY_POOL_HPP
+#define MEMORY_POOL_HPP
+
+#include <QCL/qcl.hpp>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "context_registry.hpp"
+
+namespace spatialcl {
+
+/// A pool of device buffers for the node and temporary storage of the trees, sorters
+/// and queries. Released buffers are kept in size classes and handed out
+/// again for requests of the same size class, which avoids the
+/// allocation and release of buffers in every tree rebuild or query.
+/// The size classes are quarters of powers of two, so that at most 25%
+/// of an allocation is unused.
+///
+/// Buffers are used and released without synchronization with the device.
+/// This is safe as long as all users of pooled buffers enqueue their commands
+/// in the (in-order) command queue of the device context, since a buffer
+/// that is handed out again can then only be accessed after all commands
+/// of its previous user. Pooled buffers must therefore not be used in other
+/// command queues, in particular not in a \c transfer_queue (which asserts
+/// this with \c is_in_use()). This includes the node buffers of the trees.
+class device_memory_pool : public std::enable_shared_from_this<device_memory_pool>
+{
+public:
+  /// A buffer from the pool holding \c size() elements of type \c T.
+  /// The buffer is returned to the pool when the array is destroyed.
+  /// Note: Pass \c get_buffer() (not the array itself) as kernel argument.
+  template<class T>
+  class pooled_array
+  {
+  public:
+    /// An empty array without buffer
+    pooled_array()
+      : _size_class{0}, _size{0}
+    {}
+
+    pooled_array(const std::shared_ptr<device_memory_pool>& pool,
+                 const cl::Buffer& buffer,
+                 std::size_t size_class,
+                 std::size_t num_elements)
+      : _pool{pool}, _buffer{buffer}, _size_class{size_class}, _size{num_elements}
+    {}
+
+    pooled_array(pooled_array&& other)
+      : _pool{std::move(other._pool)},
+        _buffer{std::move(other._buffer)},
+        _size_class{other._size_class},
+        _size{other._size}
+    {
+      other._pool.reset();
+    }
+
+    pooled_array(const pooled_array&) = delete;
+    pooled_array& operator=(const pooled_array&) = delete;
+
+    /// Returns the current buffer to the pool and takes over
+    /// the buffer of \c other
+    pooled_array& operator=(pooled_array&& other)
+    {
+      if(this != &other)
+      {
+        if(_pool)
+          _pool->release(_buffer, _size_class);
+
+        _pool = std::move(other._pool);
+        _buffer = std::move(other._buffer);
+        _size_class = other._size_class;
+        _size = other._size;
+        other._pool.reset();
+      }
+      return *this;
+    }
+
+    ~pooled_array()
+    {
+      if(_pool)
+        _pool->release(_buffer, _size_class);
+    }
+
+    const cl::Buffer& get_buffer() const
+    {
+      return _buffer;
+    }
+
+    std::size_t size() const
+    {
+      return _size;
+    }
+
+  private:
+    std::shared_ptr<device_memory_pool> _pool;
+    cl::Buffer _buffer;
+    std::size_t _size_class;
+    std::size_t _size;
+  };
+
+  /// \param max_cached_bytes The maximum total size of the buffers that
+  /// are kept for reuse. Buffers that are released when the cache is
+  /// full are freed.
+  device_memory_pool(const qcl::device_context_ptr& ctx,
+                     std::size_t max_cached_bytes = default_max_cached_bytes)
+    : _context{ctx->get_context()},
+      _max_cached_bytes{max_cached_bytes},
+      _num_cached_bytes{0}
+  {}
+
+  /// \return A buffer for at least \c num_elements elements of type \c T.
+  /// Like for \c qcl::device_array, at least one element is allocated.
+  template<class T>
+  pooled_array<T> allocate(std::size_t num_elements)
+  {
+    const std::size_t size_class =
+        get_size_class(std::max<std::size_t>(num_elements, 1) * sizeof(T));
+
+    return pooled_array<T>{this->shared_from_this(),
+                           this->acquire(size_class),
+                           size_class,
+                           num_elements};
+  }
+
+  /// \return Whether \c buffer has been handed out by this pool and
+  /// has not yet been released
+  bool is_in_use(const cl::Buffer& buffer) const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _buffers_in_use.find(buffer()) != _buffers_in_use.end();
+  }
+
+  /// Frees all cached buffers
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _cached_buffers.clear();
+    _num_cached_bytes = 0;
+  }
+
+  /// \return The total size of the buffers that are currently kept for reuse
+  std::size_t get_num_cached_bytes() const
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _num_cached_bytes;
+  }
+
+  /// \return The size in bytes that is allocated for a request of
+  /// \c num_bytes bytes
+  static std::size_t get_size_class(std::size_t num_bytes)
+  {
+    if(num_bytes <= min_size_class)
+      return min_size_class;
+
+    std::size_t power_of_two = min_size_class;
+    while(power_of_two < num_bytes)
+      power_of_two <<= 1;
+
+    const std::size_t granularity = power_of_two / 4;
+    return (num_bytes + granularity - 1) / granularity * granularity;
+  }
+
+  static constexpr std::size_t min_size_class = 256;
+  static constexpr std::size_t default_max_cached_bytes = std::size_t{1} << 30;
+
+private:
+  cl::Buffer acquire(std::size_t size_class)
+  {
+    {
+      std::lock_guard<std::mutex> lock{_mutex};
+      auto it = _cached_buffers.find(size_class);
+      if(it != _cached_buffers.end() && !it->second.empty())
+      {
+        cl::Buffer buffer = it->second.back();
+        it->second.pop_back();
+        _num_cached_bytes -= size_class;
+        _buffers_in_use.insert(buffer());
+        return buffer;
+      }
+    }
+
+    cl_int err = CL_SUCCESS;
+    cl::Buffer buffer{_context, CL_MEM_READ_WRITE, size_class, nullptr, &err};
+    qcl::check_cl_error(err, "Could not allocate pooled buffer");
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    _buffers_in_use.insert(buffer());
+    return buffer;
+  }
+
+  void release(const cl::Buffer& buffer, std::size_t size_class)
+  {
+    std::lock_guard<std::mutex> lock{_mutex};
+    _buffers_in_use.erase(buffer());
+    if(_num_cached_bytes + size_class > _max_cached_bytes)
+      return;
+
+    _cached_buffers[size_class].push_back(buffer);
+    _num_cached_bytes += size_class;
+  }
+
+  cl::Context _context;
+  std::size_t _max_cached_bytes;
+  std::size_t _num_cached_bytes;
+  std::map<std::size_t, std::vector<cl::Buffer>> _cached_buffers;
+  std::set<cl_mem> _buffers_in_use;
+  mutable std::mutex _mutex;
+};
+
+/// \return The memory pool of the device context \c ctx, which is
+/// created on first use and shared by all users of the context.
+/// The pool is released once the context has been destroyed.
+inline std::shared_ptr<device_memory_pool>
+get_memory_pool(const qcl::device_context_ptr& ctx)
+{
+  static context_registry<device_memory_pool> registry;
+  return registry.get(ctx, [](const qcl::device_context_ptr& c){
+    return std::make_shared<device_memory_pool>(c);
+  });
+}
+
+}
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTICLE_EXTENT_HPP
+#define PARTICLE_EXTENT_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include "async.hpp"
+#include "configuration.hpp"
+#include "memory_pool.hpp"
+
+namespace spatialcl {
+
+/// Calculates the bounding box of all particles in one pass over
+/// the particle data. The result remains on the device, such that
+/// subsequent kernels (e.g. the space filling curves) can read it
+/// without a round trip to the host.
+/// The first stage reduces the particles to one bounding box per
+/// work group, the second stage reduces those with a single work group.
+template<class Type_descriptor>
+class particle_extent
+{
+public:
+  QCL_MAKE_MODULE(particle_extent)
+
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+
+  /// Calculates the extent of the particles.
+  /// \param particles The particles
+  /// \param num_particles The number of particles
+  /// \param extent_out A buffer of (at least) two \c vector_type elements.
+  /// The minimum corner of the bounding box will be written to the first element,
+  /// the maximum corner to the second element.
+  /// \param evt If not \c nullptr, receives an event that completes
+  /// once the extent has been written
+  /// \param wait_events If not \c nullptr, the reduction only starts
+  /// once these events have completed
+  void operator()(const qcl::device_context_ptr& ctx,
+                  const cl::Buffer& particles,
+                  std::size_t num_particles,
+                  const cl::Buffer& extent_out,
+                  cl::Event* evt = nullptr,
+                  const event_list* wait_events = nullptr) const
+  {
+    std::size_t num_groups = (num_particles + group_size - 1) / group_size;
+    if(num_groups > max_num_groups)
+      num_groups = max_num_groups;
+    if(num_groups == 0)
+      num_groups = 1;
+
+    auto partial_extents = get_memory_pool(ctx)->allocate<vector_type>(2 * num_groups);
+
+    enqueue_wait_for_events(ctx, wait_events);
+
+    cl_int err = particle_extent_partial(ctx,
+                                         cl::NDRange{num_groups * group_size},
+                                         cl::NDRange{group_size})(
+          particles,
+          static_cast<cl_ulong>(num_particles),
+          partial_extents.get_buffer());
+    qcl::check_cl_error(err, "Could not enqueue particle_extent_partial kernel");
+
+    err = particle_extent_final(ctx,
+                                cl::NDRange{group_size},
+                                cl::NDRange{group_size})(
+          partial_extents.get_buffer(),
+          static_cast<cl_ulong>(num_groups),
+          extent_out);
+    qcl::check_cl_error(err, "Could not enqueue particle_extent_final kernel");
+
+    enqueue_completion_event(ctx, evt);
+  }
+
+private:
+  static constexpr std::size_t group_size = 256;
+  static constexpr std::size_t max_num_groups = 256;
+
+  QCL_ENTRYPOINT(particle_extent_partial)
+  QCL_ENTRYPOINT(particle_extent_final)
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_IMPORT_CONSTANT(group_size)
+    QCL_RAW
+    (
+      void extent_local_reduction(__local vector_type* local_min,
+                                  __local vector_type* local_max)
+      {
+        const size_t lid = get_local_id(0);
+
+        for(size_t i = group_size/2; i > 0; i >>= 1)
+        {
+          if(lid < i)
+          {
+            local_min[lid] = fmin(local_min[lid], local_min[lid + i]);
+            local_max[lid] = fmax(local_max[lid], local_max[lid + i]);
+          }
+          barrier(CLK_LOCAL_MEM_FENCE);
+        }
+      }
+
+      __kernel void particle_extent_partial(__global particle_type* particles,
+                                            ulong num_particles,
+                                            __global vector_type* partial_extents)
+      {
+        __local vector_type local_min [group_size];
+        __local vector_type local_max [group_size];
+
+        vector_type current_min = (vector_type)(SCALAR_MAX);
+        vector_type current_max = (vector_type)(-SCALAR_MAX);
+
+        for(size_t tid = get_global_id(0);
+            tid < num_particles;
+            tid += get_global_size(0))
+        {
+          vector_type position = PARTICLE_POSITION(particles[tid]);
+          current_min = fmin(current_min, position);
+          current_max = fmax(current_max, position);
+        }
+
+        const size_t lid = get_local_id(0);
+        local_min[lid] = current_min;
+        local_max[lid] = current_max;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        extent_local_reduction(local_min, local_max);
+
+        if(lid == 0)
+        {
+          partial_extents[2 * get_group_id(0)    ] = local_min[0];
+          partial_extents[2 * get_group_id(0) + 1] = local_max[0];
+        }
+      }
+
+      __kernel void particle_extent_final(__global vector_type* partial_extents,
+                                          ulong num_partial_extents,
+                                          __global vector_type* extent_out)
+      {
+        __local vector_type local_min [group_size];
+        __local vector_type local_max [group_size];
+
+        vector_type current_min = (vector_type)(SCALAR_MAX);
+        vector_type current_max = (vector_type)(-SCALAR_MAX);
+
+        const size_t lid = get_local_id(0);
+        for(size_t i = lid; i < num_partial_extents; i += group_size)
+        {
+          current_min = fmin(current_min, partial_extents[2 * i    ]);
+          current_max = fmax(current_max, partial_extents[2 * i + 1]);
+        }
+
+        local_min[lid] = current_min;
+        local_max[lid] = current_max;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        extent_local_reduction(local_min, local_max);
+
+        if(lid == 0)
+        {
+          extent_out[0] = local_min[0];
+          extent_out[1] = local_max[0];
+        }
+      }
+    )
+  )
+};
+
+}
+
+#endif
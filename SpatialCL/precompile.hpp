@@ -0,0 +1,54 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PRECOMPILE_HPP
+#define PRECOMPILE_HPP
+
+#include <QCL/qcl.hpp>
+
+namespace spatialcl {
+
+/// Compiles the kernels of the given query engines (or any other classes
+/// with a \c precompile(ctx) member function), such that later queries
+/// do not pay the compilation time. Useful to move the compilation of
+/// all used engine and handler instantiations to the startup of a process.
+///
+/// The compiled programs are kept for the lifetime of the process. The
+/// programs built by boost.compute (sorts, scans, reductions) can in
+/// addition be cached on disk across processes by configuring with
+/// \c -DSPATIALCL_OFFLINE_CACHE=ON, which enables the offline cache of
+/// boost.compute.
+template<class... Engines>
+void precompile(const qcl::device_context_ptr& ctx)
+{
+  int expansion[] = {0, (Engines{}.precompile(ctx), 0)...};
+  (void)expansion;
+}
+
+}
+
+#endif
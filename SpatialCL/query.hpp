@@ -31,9 +31,21 @@
 
 #include "query/query_engine_dfs.hpp"
 #include "query/query_engine_grouped_dfs.hpp"
+#include "query/query_engine_wide_dfs.hpp"
+#include "query/query_engine_forest_dfs.hpp"
+#include "query/query_engine_host_dfs.hpp"
+#include "query/query_engine_tuned_grouped_dfs.hpp"
 
 #include "query/query_knn.hpp"
 #include "query/query_range.hpp"
+#include "query/query_aggregate.hpp"
+#include "query/query_range_csr.hpp"
+#include "query/neighbor_list.hpp"
+#include "query/query_reordering.hpp"
+#include "query/distributed_query.hpp"
+#include "query/query_dispatch.hpp"
+
+#include "precompile.hpp"
 
 namespace spatialcl {
 namespace query {
@@ -62,6 +74,90 @@ using grouped_dfs_query_engine = query::engine::grouped_depth_first
     Group_size
   >;
 
+template<class Tree_type, class Handler>
+using wide_dfs_query_engine = query::engine::wide_depth_first
+  <
+    Tree_type,
+    Handler
+  >;
+
+/// Engines that count the visited nodes and tested particles,
+/// see \c engine::query_instrumentation
+template<class Tree_type, class Handler>
+using instrumented_relaxed_dfs_query_engine = query::engine::depth_first
+  <
+    Tree_type,
+    Handler,
+    engine::HIERARCHICAL_ITERATION_RELAXED,
+    256,
+    engine::DFS_SCHEDULING_STATIC,
+    engine::DFS_INSTRUMENTATION_ENABLED
+  >;
+
+template<class Tree_type, class Handler, std::size_t Group_size = 64>
+using instrumented_grouped_dfs_query_engine = query::engine::grouped_depth_first
+  <
+    Tree_type,
+    Handler,
+    Group_size,
+    8, 8, 8, 32, 3,
+    engine::DFS_SCHEDULING_STATIC,
+    engine::DFS_INSTRUMENTATION_ENABLED
+  >;
+
+/// Grouped engine whose template parameters are selected per device,
+/// see \c engine::tuned_grouped_depth_first
+template<class Tree_type,
+         class Handler,
+         class Parameter_space = engine::default_grouped_dfs_parameter_space>
+using tuned_grouped_dfs_query_engine = query::engine::tuned_grouped_depth_first
+  <
+    Tree_type,
+    Handler,
+    Parameter_space
+  >;
+
+/// Depth-first engines for a \c particle_bvh_forest, processing
+/// the queries of all trees of the forest in one launch
+template<class Forest_type, class Handler>
+using strict_dfs_forest_query_engine = query::engine::forest_depth_first
+  <
+    Forest_type,
+    Handler,
+    engine::HIERARCHICAL_ITERATION_STRICT
+  >;
+
+template<class Forest_type, class Handler>
+using relaxed_dfs_forest_query_engine = query::engine::forest_depth_first
+  <
+    Forest_type,
+    Handler,
+    engine::HIERARCHICAL_ITERATION_RELAXED
+  >;
+
+/// Relaxed depth-first engine with persistent work groups that fetch new
+/// queries once they are done, see \c engine::query_scheduler
+template<class Tree_type, class Handler, std::size_t Group_size = 256>
+using persistent_relaxed_dfs_query_engine = query::engine::depth_first
+  <
+    Tree_type,
+    Handler,
+    engine::HIERARCHICAL_ITERATION_RELAXED,
+    Group_size,
+    engine::DFS_SCHEDULING_PERSISTENT
+  >;
+
+/// Grouped depth-first engine with persistent work groups, whose subgroups
+/// fetch batches of adjacent queries once they are done
+template<class Tree_type, class Handler, std::size_t Group_size = 64>
+using persistent_grouped_dfs_query_engine = query::engine::grouped_depth_first
+  <
+    Tree_type,
+    Handler,
+    Group_size,
+    8, 8, 8, 32, 3,
+    engine::DFS_SCHEDULING_PERSISTENT
+  >;
 
 
 /************** Range Queries ***************************/
@@ -90,6 +186,145 @@ using grouped_dfs_range_query_engine = grouped_dfs_query_engine
     Group_size
   >;
 
+template<class Tree_type, std::size_t Max_retrieved_particles>
+using wide_dfs_range_query_engine = wide_dfs_query_engine
+  <
+    Tree_type,
+    box_range_query<typename Tree_type::type_system, Max_retrieved_particles>
+  >;
+
+template<class Tree_type,
+         std::size_t Max_retrieved_particles,
+         class Parameter_space = engine::default_grouped_dfs_parameter_space>
+using tuned_grouped_dfs_range_query_engine = tuned_grouped_dfs_query_engine
+  <
+    Tree_type,
+    box_range_query<typename Tree_type::type_system, Max_retrieved_particles>,
+    Parameter_space
+  >;
+
+/// Range query engines for a \c particle_mixed_precision_bvh_tree
+template<class Tree_type, std::size_t Max_retrieved_particles>
+using relaxed_dfs_mixed_precision_range_query_engine = relaxed_dfs_query_engine
+  <
+    Tree_type,
+    mixed_precision_box_range_query<typename Tree_type::type_system,
+                                    Max_retrieved_particles>
+  >;
+
+template<class Tree_type,
+         std::size_t Max_retrieved_particles,
+         std::size_t Group_size = 64>
+using grouped_dfs_mixed_precision_range_query_engine = grouped_dfs_query_engine
+  <
+    Tree_type,
+    mixed_precision_box_range_query<typename Tree_type::type_system,
+                                    Max_retrieved_particles>,
+    Group_size
+  >;
+
+template<class Forest_type, std::size_t Max_retrieved_particles>
+using relaxed_dfs_forest_range_query_engine = relaxed_dfs_forest_query_engine
+  <
+    Forest_type,
+    box_range_query<typename Forest_type::type_system, Max_retrieved_particles>
+  >;
+
+template<class Tree_type, range_query_output Output = RANGE_OUTPUT_INDICES>
+using strict_dfs_csr_range_query = csr_range_query
+  <
+    strict_dfs_query_engine
+    <
+      Tree_type,
+      box_range_count_query<typename Tree_type::type_system>
+    >,
+    strict_dfs_query_engine
+    <
+      Tree_type,
+      box_range_fill_query<typename Tree_type::type_system, Output>
+    >
+  >;
+
+template<class Tree_type, range_query_output Output = RANGE_OUTPUT_INDICES>
+using relaxed_dfs_csr_range_query = csr_range_query
+  <
+    relaxed_dfs_query_engine
+    <
+      Tree_type,
+      box_range_count_query<typename Tree_type::type_system>
+    >,
+    relaxed_dfs_query_engine
+    <
+      Tree_type,
+      box_range_fill_query<typename Tree_type::type_system, Output>
+    >
+  >;
+
+template<class Tree_type,
+         range_query_output Output = RANGE_OUTPUT_INDICES,
+         std::size_t Group_size = 64>
+using grouped_dfs_csr_range_query = csr_range_query
+  <
+    grouped_dfs_query_engine
+    <
+      Tree_type,
+      box_range_count_query<typename Tree_type::type_system>,
+      Group_size
+    >,
+    grouped_dfs_query_engine
+    <
+      Tree_type,
+      box_range_fill_query<typename Tree_type::type_system, Output>,
+      Group_size
+    >
+  >;
+
+template<class Tree_type, range_query_output Output = RANGE_OUTPUT_INDICES>
+using wide_dfs_csr_range_query = csr_range_query
+  <
+    wide_dfs_query_engine
+    <
+      Tree_type,
+      box_range_count_query<typename Tree_type::type_system>
+    >,
+    wide_dfs_query_engine
+    <
+      Tree_type,
+      box_range_fill_query<typename Tree_type::type_system, Output>
+    >
+  >;
+
+template<class Tree_type, std::size_t Max_retrieved_particles>
+using strict_dfs_sphere_range_query_engine = strict_dfs_query_engine
+  <
+    Tree_type,
+    sphere_range_query<typename Tree_type::type_system, Max_retrieved_particles>
+  >;
+
+template<class Tree_type, std::size_t Max_retrieved_particles>
+using relaxed_dfs_sphere_range_query_engine = relaxed_dfs_query_engine
+  <
+    Tree_type,
+    sphere_range_query<typename Tree_type::type_system, Max_retrieved_particles>
+  >;
+
+template<class Tree_type,
+         std::size_t Max_retrieved_particles,
+         std::size_t Group_size = 64>
+using grouped_dfs_sphere_range_query_engine = grouped_dfs_query_engine
+  <
+    Tree_type,
+    sphere_range_query<typename Tree_type::type_system, Max_retrieved_particles>,
+    Group_size
+  >;
+
+template<class Tree_type, std::size_t Max_retrieved_particles>
+using wide_dfs_sphere_range_query_engine = wide_dfs_query_engine
+  <
+    Tree_type,
+    sphere_range_query<typename Tree_type::type_system, Max_retrieved_particles>
+  >;
+
 template<class Tree_type, std::size_t Max_retrieved_particles>
 using default_range_query_engine = relaxed_dfs_range_query_engine
   <
@@ -98,6 +333,40 @@ using default_range_query_engine = relaxed_dfs_range_query_engine
   >;
 
 
+/********** Neighbor Lists ****************************/
+
+template<class Tree_type>
+using relaxed_dfs_neighbor_list = neighbor_list
+  <
+    relaxed_dfs_query_engine
+    <
+      Tree_type,
+      fixed_radius_neighbor_count_query<typename Tree_type::type_system>
+    >,
+    relaxed_dfs_query_engine
+    <
+      Tree_type,
+      fixed_radius_neighbor_fill_query<typename Tree_type::type_system>
+    >
+  >;
+
+template<class Tree_type, std::size_t Group_size = 64>
+using grouped_dfs_neighbor_list = neighbor_list
+  <
+    grouped_dfs_query_engine
+    <
+      Tree_type,
+      fixed_radius_neighbor_count_query<typename Tree_type::type_system>,
+      Group_size
+    >,
+    grouped_dfs_query_engine
+    <
+      Tree_type,
+      fixed_radius_neighbor_fill_query<typename Tree_type::type_system>,
+      Group_size
+    >
+  >;
+
 /********** KNN Queries ********************************/
 
 template<class Tree_type, std::size_t K>
@@ -124,6 +393,94 @@ using grouped_dfs_knn_query_engine = grouped_dfs_query_engine
     Group_size
   >;
 
+template<class Tree_type,
+         std::size_t K,
+         class Parameter_space = engine::default_grouped_dfs_parameter_space>
+using tuned_grouped_dfs_knn_query_engine = tuned_grouped_dfs_query_engine
+  <
+    Tree_type,
+    knn_query<typename Tree_type::type_system, K>,
+    Parameter_space
+  >;
+
+template<class Tree_type, std::size_t K>
+using wide_dfs_knn_query_engine = wide_dfs_query_engine
+  <
+    Tree_type,
+    knn_query<typename Tree_type::type_system, K>
+  >;
+
+template<class Forest_type, std::size_t K>
+using relaxed_dfs_forest_knn_query_engine = relaxed_dfs_forest_query_engine
+  <
+    Forest_type,
+    knn_query<typename Forest_type::type_system, K>
+  >;
+
+template<class Tree_type, std::size_t K, int Output_flags = KNN_OUTPUT_PARTICLES>
+using strict_dfs_sorted_knn_query_engine = strict_dfs_query_engine
+  <
+    Tree_type,
+    sorted_knn_query<typename Tree_type::type_system, K, Output_flags>
+  >;
+
+template<class Tree_type, std::size_t K, int Output_flags = KNN_OUTPUT_PARTICLES>
+using relaxed_dfs_sorted_knn_query_engine = relaxed_dfs_query_engine
+  <
+    Tree_type,
+    sorted_knn_query<typename Tree_type::type_system, K, Output_flags>
+  >;
+
+template<class Tree_type,
+         std::size_t K,
+         int Output_flags = KNN_OUTPUT_PARTICLES,
+         std::size_t Group_size = 64>
+using grouped_dfs_sorted_knn_query_engine = grouped_dfs_query_engine
+  <
+    Tree_type,
+    sorted_knn_query<typename Tree_type::type_system, K, Output_flags>,
+    Group_size
+  >;
+
+template<class Tree_type, std::size_t K, int Output_flags = KNN_OUTPUT_PARTICLES>
+using wide_dfs_sorted_knn_query_engine = wide_dfs_query_engine
+  <
+    Tree_type,
+    sorted_knn_query<typename Tree_type::type_system, K, Output_flags>
+  >;
+
+template<class Tree_type, std::size_t K, int Output_flags = KNN_OUTPUT_PARTICLES>
+using strict_dfs_approximate_knn_query_engine = strict_dfs_query_engine
+  <
+    Tree_type,
+    approximate_knn_query<typename Tree_type::type_system, K, Output_flags>
+  >;
+
+template<class Tree_type, std::size_t K, int Output_flags = KNN_OUTPUT_PARTICLES>
+using relaxed_dfs_approximate_knn_query_engine = relaxed_dfs_query_engine
+  <
+    Tree_type,
+    approximate_knn_query<typename Tree_type::type_system, K, Output_flags>
+  >;
+
+template<class Tree_type,
+         std::size_t K,
+         int Output_flags = KNN_OUTPUT_PARTICLES,
+         std::size_t Group_size = 64>
+using grouped_dfs_approximate_knn_query_engine = grouped_dfs_query_engine
+  <
+    Tree_type,
+    approximate_knn_query<typename Tree_type::type_system, K, Output_flags>,
+    Group_size
+  >;
+
+template<class Tree_type, std::size_t K, int Output_flags = KNN_OUTPUT_PARTICLES>
+using wide_dfs_approximate_knn_query_engine = wide_dfs_query_engine
+  <
+    Tree_type,
+    approximate_knn_query<typename Tree_type::type_system, K, Output_flags>
+  >;
+
 template<class Tree_type, std::size_t K>
 using default_knn_query_engine = relaxed_dfs_knn_query_engine
   <
@@ -131,6 +488,27 @@ using default_knn_query_engine = relaxed_dfs_knn_query_engine
     K
   >;
 
+
+
+/// Range queries on a \c distributed_tree whose slices are trees
+/// of type \c Tree_type
+template<class Tree_type, std::size_t Max_retrieved_particles>
+using distributed_range_query = distributed_box_range_query
+  <
+    relaxed_dfs_range_query_engine<Tree_type, Max_retrieved_particles>
+  >;
+
+/// KNN queries on a \c distributed_tree whose slices are trees
+/// of type \c Tree_type. The distances are always required to
+/// merge the results of the devices.
+template<class Tree_type,
+         std::size_t K,
+         int Output_flags = KNN_OUTPUT_PARTICLES | KNN_OUTPUT_DISTANCES>
+using distributed_sorted_knn_query = distributed_knn_query
+  <
+    relaxed_dfs_sorted_knn_query_engine<Tree_type, K, Output_flags>
+  >;
+
 }
 }
 
@@ -0,0 +1,409 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DISTRIBUTED_QUERY_HPP
+#define DISTRIBUTED_QUERY_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <vector>
+
+#include "../configuration.hpp"
+#include "../tree/distributed_tree.hpp"
+#include "query_knn.hpp"
+
+namespace spatialcl {
+namespace query {
+
+/// The queries in this file run on trees that are partitioned into slices,
+/// each of which is a tree over a contiguous range of the sorted particles,
+/// i.e. \c distributed_tree and \c out_of_core_tree. Queries are only
+/// executed on the slices that may contain results.
+
+/// Box range query on a partitioned tree. Each query only runs on the
+/// slices whose bounding boxes it overlaps, and the results of these slices
+/// are concatenated. Like for \c box_range_query, at most
+/// \c max_retrieved_particles particles are stored per query.
+/// \tparam Range_query_engine A query engine with a \c box_range_query
+/// handler, e.g. \c default_range_query_engine. One engine is created
+/// per slice.
+template<class Range_query_engine>
+class distributed_box_range_query
+{
+public:
+  using handler_type = typename Range_query_engine::handler_type;
+  using type_system = typename Range_query_engine::type_system;
+  using particle_type = typename configuration<type_system>::particle_type;
+  using vector_type = typename configuration<type_system>::vector_type;
+
+  static constexpr std::size_t max_retrieved_particles =
+      handler_type::max_retrieved_particles;
+
+  /// Executes the queries and blocks until the results are available.
+  /// \param results Receives the particles, at most
+  /// \c max_retrieved_particles per query starting at
+  /// \c query_id*max_retrieved_particles
+  /// \param num_results Receives the number of particles of each query
+  template<class Partitioned_tree>
+  void operator()(Partitioned_tree& tree,
+                  const std::vector<vector_type>& queries_min,
+                  const std::vector<vector_type>& queries_max,
+                  std::vector<particle_type>& results,
+                  std::vector<cl_uint>& num_results)
+  {
+    assert(queries_min.size() == queries_max.size());
+    const std::size_t num_queries = queries_min.size();
+    const std::size_t num_slices = tree.get_num_slices();
+
+    _engines.resize(num_slices);
+    std::vector<slice_batch> batches(num_slices);
+
+    // Enqueue the queries on all devices before reading any results,
+    // such that all devices work concurrently
+    for(std::size_t slice = 0; slice < num_slices; ++slice)
+    {
+      slice_batch& batch = batches[slice];
+      for(std::size_t i = 0; i < num_queries; ++i)
+        if(tree.slice_overlaps_box(slice, queries_min[i], queries_max[i]))
+          batch.query_ids.push_back(i);
+
+      if(batch.query_ids.empty())
+        continue;
+
+      const std::size_t num_batch_queries = batch.query_ids.size();
+      std::vector<vector_type> batch_queries_min(num_batch_queries);
+      std::vector<vector_type> batch_queries_max(num_batch_queries);
+      for(std::size_t i = 0; i < num_batch_queries; ++i)
+      {
+        batch_queries_min[i] = queries_min[batch.query_ids[i]];
+        batch_queries_max[i] = queries_max[batch.query_ids[i]];
+      }
+
+      const qcl::device_context_ptr& ctx = tree.get_slice_context(slice);
+      batch.queries_min = qcl::device_array<vector_type>{ctx, batch_queries_min};
+      batch.queries_max = qcl::device_array<vector_type>{ctx, batch_queries_max};
+      batch.results = qcl::device_array<particle_type>{
+        ctx, num_batch_queries * max_retrieved_particles
+      };
+      batch.num_results = qcl::device_array<cl_uint>{ctx, num_batch_queries};
+
+      handler_type handler{
+        batch.queries_min.get_buffer(),
+        batch.queries_max.get_buffer(),
+        batch.results.get_buffer(),
+        batch.num_results.get_buffer(),
+        num_batch_queries
+      };
+
+      cl_int err = _engines[slice](tree.get_slice_tree(slice), handler);
+      qcl::check_cl_error(err, "Could not enqueue distributed range query");
+      err = ctx->get_command_queue().flush();
+      qcl::check_cl_error(err, "Could not flush command queue");
+    }
+
+    results.assign(num_queries * max_retrieved_particles, particle_type{});
+    num_results.assign(num_queries, 0);
+
+    for(slice_batch& batch : batches)
+    {
+      if(batch.query_ids.empty())
+        continue;
+
+      std::vector<particle_type> batch_results;
+      std::vector<cl_uint> batch_num_results;
+      batch.results.read(batch_results);
+      batch.num_results.read(batch_num_results);
+
+      for(std::size_t i = 0; i < batch.query_ids.size(); ++i)
+      {
+        const std::size_t query_id = batch.query_ids[i];
+        for(std::size_t j = 0;
+            j < batch_num_results[i] && num_results[query_id] < max_retrieved_particles;
+            ++j, ++num_results[query_id])
+        {
+          results[query_id * max_retrieved_particles + num_results[query_id]] =
+              batch_results[i * max_retrieved_particles + j];
+        }
+      }
+    }
+  }
+
+private:
+  struct slice_batch
+  {
+    std::vector<std::size_t> query_ids;
+    qcl::device_array<vector_type> queries_min;
+    qcl::device_array<vector_type> queries_max;
+    qcl::device_array<particle_type> results;
+    qcl::device_array<cl_uint> num_results;
+  };
+
+  std::vector<Range_query_engine> _engines;
+};
+
+/// KNN query on a partitioned tree, which runs in two rounds.
+/// First, each query runs on the slice that is nearest to the
+/// query point. Afterwards, it only runs on the other slices that
+/// are closer to the query point than the K-th neighbor found so far. The
+/// candidates of all slices are then merged by distance. In the common
+/// case of queries deep inside a slice, the first round already finds
+/// all neighbors.
+/// \tparam Knn_query_engine A query engine with a \c sorted_knn_query (or
+/// \c approximate_knn_query) handler that stores the distances
+/// (\c KNN_OUTPUT_DISTANCES). One engine is created per slice.
+template<class Knn_query_engine>
+class distributed_knn_query
+{
+public:
+  using handler_type = typename Knn_query_engine::handler_type;
+  using type_system = typename Knn_query_engine::type_system;
+  using particle_type = typename configuration<type_system>::particle_type;
+  using vector_type = typename configuration<type_system>::vector_type;
+  using scalar = typename configuration<type_system>::scalar;
+
+  static constexpr std::size_t num_neighbors = handler_type::num_neighbors;
+  static constexpr int output_flags = handler_type::output_flags;
+
+  static_assert((output_flags & KNN_OUTPUT_DISTANCES) != 0,
+                "Merging the results of several slices requires the distances");
+
+  /// Executes the queries and blocks until the results are available.
+  /// The results are stored as by \c sorted_knn_query, sorted by distance
+  /// and starting at \c query_id*K. Outputs that are not selected by the
+  /// handler remain empty. Particle indices refer to the concatenated sorted
+  /// particles of all slices (see \c distributed_tree::get_particle_offset()).
+  template<class Partitioned_tree>
+  void operator()(Partitioned_tree& tree,
+                  const std::vector<vector_type>& query_points,
+                  std::vector<particle_type>& results,
+                  std::vector<scalar>& result_distances2,
+                  std::vector<cl_ulong>& result_indices)
+  {
+    const std::size_t num_queries = query_points.size();
+    const std::size_t num_slices = tree.get_num_slices();
+
+    _engines.resize(num_slices);
+
+    // First round: the nearest slice of each query
+    std::vector<std::size_t> nearest_slice(num_queries, 0);
+    std::vector<slice_batch> first_round(num_slices);
+    for(std::size_t i = 0; i < num_queries; ++i)
+    {
+      for(std::size_t slice = 1; slice < num_slices; ++slice)
+        if(tree.get_slice_distance2(slice, query_points[i]) <
+           tree.get_slice_distance2(nearest_slice[i], query_points[i]))
+          nearest_slice[i] = slice;
+
+      if(num_slices > 0)
+        first_round[nearest_slice[i]].query_ids.push_back(i);
+    }
+    this->execute(tree, query_points, first_round);
+
+    // Second round: all other slices that may contain closer particles
+    std::vector<scalar> max_distances2(num_queries, std::numeric_limits<scalar>::max());
+    for(const slice_batch& batch : first_round)
+      for(std::size_t i = 0; i < batch.query_ids.size(); ++i)
+        max_distances2[batch.query_ids[i]] =
+            batch.distances2[(i + 1) * num_neighbors - 1];
+
+    std::vector<slice_batch> second_round(num_slices);
+    for(std::size_t i = 0; i < num_queries; ++i)
+      for(std::size_t slice = 0; slice < num_slices; ++slice)
+        if(slice != nearest_slice[i] &&
+           tree.get_slice_distance2(slice, query_points[i]) < max_distances2[i])
+          second_round[slice].query_ids.push_back(i);
+    this->execute(tree, query_points, second_round);
+
+    this->merge(tree, num_queries, first_round, second_round,
+                results, result_distances2, result_indices);
+  }
+
+private:
+  static constexpr bool store_particles = (output_flags & KNN_OUTPUT_PARTICLES) != 0;
+  static constexpr bool store_indices = (output_flags & KNN_OUTPUT_INDICES) != 0;
+
+  struct slice_batch
+  {
+    std::vector<std::size_t> query_ids;
+    std::vector<particle_type> particles;
+    std::vector<scalar> distances2;
+    std::vector<cl_ulong> indices;
+  };
+
+  struct slice_buffers
+  {
+    qcl::device_array<vector_type> query_points;
+    qcl::device_array<particle_type> particles;
+    qcl::device_array<scalar> distances2;
+    qcl::device_array<cl_ulong> indices;
+  };
+
+  /// Runs the queries of each batch on its slice and
+  /// downloads the results into the batch
+  template<class Partitioned_tree>
+  void execute(Partitioned_tree& tree,
+               const std::vector<vector_type>& query_points,
+               std::vector<slice_batch>& batches)
+  {
+    std::vector<slice_buffers> buffers(batches.size());
+
+    for(std::size_t slice = 0; slice < batches.size(); ++slice)
+    {
+      const slice_batch& batch = batches[slice];
+      if(batch.query_ids.empty())
+        continue;
+
+      const std::size_t num_batch_queries = batch.query_ids.size();
+      const std::size_t num_batch_results = num_batch_queries * num_neighbors;
+
+      std::vector<vector_type> batch_points(num_batch_queries);
+      for(std::size_t i = 0; i < num_batch_queries; ++i)
+        batch_points[i] = query_points[batch.query_ids[i]];
+
+      const qcl::device_context_ptr& ctx = tree.get_slice_context(slice);
+      slice_buffers& current_buffers = buffers[slice];
+      // Result buffers of outputs that are not selected are
+      // ignored by the handler, but must not be empty
+      current_buffers.query_points = qcl::device_array<vector_type>{ctx, batch_points};
+      current_buffers.particles = qcl::device_array<particle_type>{
+        ctx, store_particles ? num_batch_results : 1
+      };
+      current_buffers.distances2 = qcl::device_array<scalar>{ctx, num_batch_results};
+      current_buffers.indices = qcl::device_array<cl_ulong>{
+        ctx, store_indices ? num_batch_results : 1
+      };
+
+      handler_type handler{
+        current_buffers.query_points.get_buffer(),
+        current_buffers.particles.get_buffer(),
+        current_buffers.distances2.get_buffer(),
+        current_buffers.indices.get_buffer(),
+        num_batch_queries
+      };
+
+      cl_int err = _engines[slice](tree.get_slice_tree(slice), handler);
+      qcl::check_cl_error(err, "Could not enqueue distributed KNN query");
+      err = ctx->get_command_queue().flush();
+      qcl::check_cl_error(err, "Could not flush command queue");
+    }
+
+    for(std::size_t slice = 0; slice < batches.size(); ++slice)
+    {
+      slice_batch& batch = batches[slice];
+      if(batch.query_ids.empty())
+        continue;
+
+      buffers[slice].distances2.read(batch.distances2);
+      if(store_particles)
+        buffers[slice].particles.read(batch.particles);
+      if(store_indices)
+        buffers[slice].indices.read(batch.indices);
+    }
+  }
+
+  /// Merges the candidates of both rounds by distance
+  template<class Partitioned_tree>
+  void merge(const Partitioned_tree& tree,
+             std::size_t num_queries,
+             const std::vector<slice_batch>& first_round,
+             const std::vector<slice_batch>& second_round,
+             std::vector<particle_type>& results,
+             std::vector<scalar>& result_distances2,
+             std::vector<cl_ulong>& result_indices) const
+  {
+    struct candidate
+    {
+      scalar distance2;
+      std::size_t slice;
+      const slice_batch* batch;
+      std::size_t result_idx;
+    };
+
+    std::vector<std::vector<candidate>> candidates(num_queries);
+    auto collect = [&](const std::vector<slice_batch>& round){
+      for(std::size_t slice = 0; slice < round.size(); ++slice)
+      {
+        const slice_batch& batch = round[slice];
+        for(std::size_t i = 0; i < batch.query_ids.size(); ++i)
+          for(std::size_t j = i * num_neighbors; j < (i + 1) * num_neighbors; ++j)
+            candidates[batch.query_ids[i]].push_back(
+                  candidate{batch.distances2[j], slice, &batch, j});
+      }
+    };
+    collect(first_round);
+    collect(second_round);
+
+    result_distances2.assign(num_queries * num_neighbors,
+                             std::numeric_limits<scalar>::max());
+    results.assign(store_particles ? num_queries * num_neighbors : 0,
+                   particle_type{});
+    result_indices.assign(store_indices ? num_queries * num_neighbors : 0,
+                          static_cast<cl_ulong>(handler_type::invalid_index));
+
+    for(std::size_t query_id = 0; query_id < num_queries; ++query_id)
+    {
+      std::vector<candidate>& query_candidates = candidates[query_id];
+      const std::size_t num_merged = std::min(query_candidates.size(),
+                                              static_cast<std::size_t>(num_neighbors));
+
+      std::partial_sort(query_candidates.begin(),
+                        query_candidates.begin() + num_merged,
+                        query_candidates.end(),
+                        [](const candidate& a, const candidate& b){
+        return a.distance2 < b.distance2;
+      });
+
+      for(std::size_t i = 0; i < num_merged; ++i)
+      {
+        const candidate& c = query_candidates[i];
+        const std::size_t result_idx = query_id * num_neighbors + i;
+
+        result_distances2[result_idx] = c.distance2;
+        if(store_particles)
+          results[result_idx] = c.batch->particles[c.result_idx];
+        if(store_indices)
+        {
+          const cl_ulong index = c.batch->indices[c.result_idx];
+          result_indices[result_idx] = (index == handler_type::invalid_index) ?
+                index : index + tree.get_particle_offset(c.slice);
+        }
+      }
+    }
+  }
+
+  std::vector<Knn_query_engine> _engines;
+};
+
+}
+}
+
+#endif
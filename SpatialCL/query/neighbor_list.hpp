@@ -0,0 +1,361 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NEIGHBOR_LIST_HPP
+#define NEIGHBOR_LIST_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <cassert>
+
+#include "../configuration.hpp"
+#include "../math/geometry.hpp"
+
+#include "query_base.hpp"
+#include "query_range_csr.hpp"
+
+namespace spatialcl {
+namespace query {
+
+/// First phase of \c neighbor_list. Query \c i is the sorted particle \c i
+/// of the tree, and counts all particles within the distance \c radii[i]
+/// of it, including the particle itself. Like \c box_range_count_query,
+/// the counts are stored in a buffer of \c num_particles+1 elements
+/// with a trailing 0.
+template<class Type_descriptor>
+class fixed_radius_neighbor_count_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(fixed_radius_neighbor_count_query)
+
+  fixed_radius_neighbor_count_query(const cl::Buffer& radii,
+                                    const cl::Buffer& result_counts,
+                                    std::size_t num_particles)
+    : _radii{radii},
+      _counts{result_counts},
+      _num_particles{num_particles}
+  {
+    assert(num_particles > 0);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_radii,
+                               _counts,
+                               static_cast<cl_ulong>(_num_particles));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_particles;
+  }
+
+  virtual ~fixed_radius_neighbor_count_query(){}
+
+private:
+  cl::Buffer _radii;
+  cl::Buffer _counts;
+  std::size_t _num_particles;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_corner,
+                        bbox_max_corner)
+        *selection_result_ptr = box_distance2(query_position,
+                                              CLIP_TO_VECTOR(bbox_min_corner),
+                                              CLIP_TO_VECTOR(bbox_max_corner))
+                                <= query_radius2;
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+      {
+        vector_type delta = PARTICLE_POSITION(current_particle) - query_position;
+        *selection_result_ptr = VECTOR_NORM2(delta) <= query_radius2;
+        if(*selection_result_ptr)
+          ++num_neighbors;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+      {
+        vector_type delta = current_position - query_position;
+        *selection_result_ptr = VECTOR_NORM2(delta) <= query_radius2;
+        if(*selection_result_ptr)
+          ++num_neighbors;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_corner,
+                                    current_bbox_max_corner)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+        __global scalar* query_radii, \
+        __global ulong* query_result_counts, \
+        ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+        vector_type query_position;
+        scalar query_radius2 = 0.0f;
+        ulong num_neighbors = 0;
+
+        if(get_query_id() < num_queries)
+        {
+          query_position = PARTICLE_POSITION(particles[get_query_id()]);
+          query_radius2 = query_radii[get_query_id()] * query_radii[get_query_id()];
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+        if(get_query_id() < num_queries)
+        {
+          query_result_counts[get_query_id()] = num_neighbors;
+          if(get_query_id() == num_queries - 1)
+            query_result_counts[num_queries] = 0;
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
+/// Last phase of \c neighbor_list. Stores the indices of the neighbors
+/// of particle \c i from \c offsets[i] on.
+template<class Type_descriptor>
+class fixed_radius_neighbor_fill_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(fixed_radius_neighbor_fill_query)
+
+  fixed_radius_neighbor_fill_query(const cl::Buffer& radii,
+                                   const cl::Buffer& offsets,
+                                   const cl::Buffer& neighbor_indices,
+                                   std::size_t num_particles)
+    : _radii{radii},
+      _offsets{offsets},
+      _neighbor_indices{neighbor_indices},
+      _num_particles{num_particles}
+  {
+    assert(num_particles > 0);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_radii,
+                               _offsets,
+                               _neighbor_indices,
+                               static_cast<cl_ulong>(_num_particles));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_particles;
+  }
+
+  virtual ~fixed_radius_neighbor_fill_query(){}
+
+private:
+  cl::Buffer _radii;
+  cl::Buffer _offsets;
+  cl::Buffer _neighbor_indices;
+  std::size_t _num_particles;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_corner,
+                        bbox_max_corner)
+        *selection_result_ptr = box_distance2(query_position,
+                                              CLIP_TO_VECTOR(bbox_min_corner),
+                                              CLIP_TO_VECTOR(bbox_max_corner))
+                                <= query_radius2;
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+      {
+        vector_type delta = PARTICLE_POSITION(current_particle) - query_position;
+        *selection_result_ptr = VECTOR_NORM2(delta) <= query_radius2;
+        if(*selection_result_ptr)
+        {
+          neighbor_indices[result_pos] = particle_idx;
+          ++result_pos;
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+      {
+        vector_type delta = current_position - query_position;
+        *selection_result_ptr = VECTOR_NORM2(delta) <= query_radius2;
+        if(*selection_result_ptr)
+        {
+          neighbor_indices[result_pos] = particle_idx;
+          ++result_pos;
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_corner,
+                                    current_bbox_max_corner)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+        __global scalar* query_radii, \
+        __global ulong* query_result_offsets, \
+        __global ulong* neighbor_indices, \
+        ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+        vector_type query_position;
+        scalar query_radius2 = 0.0f;
+        ulong result_pos = 0;
+
+        if(get_query_id() < num_queries)
+        {
+          query_position = PARTICLE_POSITION(particles[get_query_id()]);
+          query_radius2 = query_radii[get_query_id()] * query_radii[get_query_id()];
+          result_pos = query_result_offsets[get_query_id()];
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
+/// Builds the list of all neighbors of all particles of a tree, i.e. the
+/// particles \c j with |x_i - x_j| <= h_i for each particle \c i, including
+/// \c i itself. The indices are indices in the sorted particle array of the
+/// tree, and the radii \c h_i must be given in this order as well.
+///
+/// The list is stored in CSR format: the neighbors of particle \c i are
+/// the elements \c [offsets[i], offsets[i+1]) of the neighbor indices,
+/// such that the list can be reused for several evaluations over the
+/// neighbors until the particles move. The list is built by a
+/// \c csr_query_driver: the neighbors are counted by \c Count_engine,
+/// the counts are scanned and the indices are stored by \c Fill_engine.
+///
+/// Since the queries are the particles in the order of the space filling
+/// curve, consecutive queries are close to each other. With
+/// \c grouped_depth_first engines, the particles of a group therefore share
+/// most of their traversal (see \c grouped_dfs_neighbor_list).
+template<class Count_engine, class Fill_engine>
+class neighbor_list
+{
+public:
+  using count_handler_type = typename Count_engine::handler_type;
+  using fill_handler_type = typename Fill_engine::handler_type;
+
+  /// Builds the neighbor list. The previous list is discarded.
+  /// \param radii The radius of each sorted particle (as \c scalar)
+  template<class Tree_type>
+  void operator()(const Tree_type& tree, const cl::Buffer& radii)
+  {
+    const std::size_t num_particles = tree.get_num_particles();
+
+    _driver(tree,
+            num_particles,
+            [&](const cl::Buffer& offsets){
+              return count_handler_type{
+                radii,
+                offsets,
+                num_particles
+              };
+            },
+            [&](const cl::Buffer& offsets, const cl::Buffer& neighbor_indices){
+              return fill_handler_type{
+                radii,
+                offsets,
+                neighbor_indices,
+                num_particles
+              };
+            });
+  }
+
+  /// \return The \c num_particles+1 offsets of the neighbors of each particle
+  const device_memory_pool::pooled_array<cl_ulong>& get_offsets() const
+  {
+    return _driver.get_offsets();
+  }
+
+  /// \return The indices of the neighbors of all particles. The buffer
+  /// has room for at least one element even if there are no neighbors.
+  const device_memory_pool::pooled_array<cl_ulong>& get_neighbor_indices() const
+  {
+    return _driver.get_results();
+  }
+
+  std::size_t get_num_neighbors() const
+  {
+    return _driver.get_num_results();
+  }
+
+  std::size_t get_num_particles() const
+  {
+    return _driver.get_num_queries();
+  }
+
+private:
+  csr_query_driver<Count_engine, Fill_engine, cl_ulong> _driver;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTICLE_ACCESS_HPP
+#define PARTICLE_ACCESS_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+
+#include "../configuration.hpp"
+#include "../tree/particle_tree.hpp"
+
+namespace spatialcl {
+namespace query {
+namespace engine {
+
+/// Defines how the query engines pass particles to the handler.
+/// Handlers can define
+/// \code
+/// dfs_position_processor(selection_result_ptr, particle_idx, current_position)
+/// \endcode
+/// in addition to \c dfs_particle_processor. If the tree stores the particle
+/// positions separately (see \c tree_provides_particle_positions), the engines
+/// then only load the position of the particle (as \c vector_type) and
+/// call the position processor instead of the particle processor.
+/// In both processors, the full particle can be obtained with
+/// \c dfs_load_particle(particle_idx).
+///
+/// Handlers that need to know which particles a discarded node contains can
+/// define
+/// \code
+/// dfs_subtree_discard_event(node_key_ptr, node_idx, bbox_min_corner, bbox_max_corner)
+/// \endcode
+/// which the engines then call instead of \c dfs_unique_node_discard_event.
+/// The discarded subtree contains the particles from
+/// \c dfs_get_node_particles_begin(node_key_ptr) to
+/// \c dfs_get_node_particles_end(node_key_ptr). Each particle of the tree is
+/// either contained in exactly one discarded subtree of a query, or it is
+/// passed to the particle processor of the query.
+///
+/// Handlers that define \c dfs_reordered_queries additionally receive a
+/// \c __global \c uint* \c query_permutation as first kernel argument after
+/// the tree (before the arguments of \c declare_full_query_parameter_set()),
+/// and work item \c tid then processes the query \c query_permutation[tid].
+/// Since handlers access their queries and results through
+/// \c get_query_id(), results remain in the original query order
+/// (see \c reordered_query).
+///
+/// This module must be included after the handler module.
+template<class Tree_type>
+class particle_access
+{
+public:
+  QCL_MAKE_MODULE(particle_access)
+
+  static constexpr int use_particle_positions =
+      tree_provides_particle_positions<Tree_type>::value ? 1 : 0;
+
+  /// Adds the particle positions to the arguments of the query
+  /// kernel, if the tree provides them
+  static void push_particle_positions(qcl::kernel_call& call,
+                                      const cl::Buffer* particle_positions)
+  {
+    if(particle_positions != nullptr)
+      call.partial_argument_list(*particle_positions);
+  }
+
+private:
+  QCL_MAKE_SOURCE
+  (
+    QCL_IMPORT_CONSTANT(use_particle_positions)
+    R"(
+      #if use_particle_positions
+        #define PARTICLE_POSITIONS_PARAMETER __global vector_type* particle_positions,
+      #else
+        #define PARTICLE_POSITIONS_PARAMETER
+      #endif
+
+      #define dfs_load_particle(particle_idx) (particles[particle_idx])
+
+      #ifdef dfs_reordered_queries
+        #define DFS_QUERY_PERMUTATION_PARAMETER __global uint* query_permutation,
+        #define DFS_DECLARE_QUERY_ID(thread_id) \
+          const size_t query_id = ((thread_id) < get_num_queries()) ? \
+                                  (size_t)query_permutation[thread_id] : (thread_id)
+      #else
+        #define DFS_QUERY_PERMUTATION_PARAMETER
+        #define DFS_DECLARE_QUERY_ID(thread_id) const size_t query_id = (thread_id)
+      #endif
+
+      #define dfs_get_node_particles_begin(node_key_ptr) \
+        binary_tree_get_leaves_begin(node_key_ptr, effective_num_levels)
+      #define dfs_get_node_particles_end(node_key_ptr) \
+        min(binary_tree_get_leaves_end(node_key_ptr, effective_num_levels), \
+            (index_type)num_particles)
+
+      #ifdef dfs_subtree_discard_event
+        #define DFS_DISCARD_NODE(node_key_ptr, node_idx, node_value0, node_value1) \
+          dfs_subtree_discard_event(node_key_ptr, node_idx, node_value0, node_value1)
+      #else
+        #define DFS_DISCARD_NODE(node_key_ptr, node_idx, node_value0, node_value1) \
+          dfs_unique_node_discard_event(node_idx, node_value0, node_value1)
+      #endif
+
+      #if use_particle_positions && defined(dfs_position_processor)
+        #define dfs_cached_particle_type vector_type
+        #define DFS_LOAD_PARTICLE(particle_idx) (particle_positions[particle_idx])
+        #define DFS_PROCESS_PARTICLE(selection_result_ptr, particle_idx, value) \
+          dfs_position_processor(selection_result_ptr, particle_idx, value)
+      #else
+        #define dfs_cached_particle_type particle_type
+        #define DFS_LOAD_PARTICLE(particle_idx) (particles[particle_idx])
+        #define DFS_PROCESS_PARTICLE(selection_result_ptr, particle_idx, value) \
+          dfs_particle_processor(selection_result_ptr, particle_idx, value)
+      #endif
+    )"
+  )
+};
+
+}
+}
+}
+
+#endif
@@ -0,0 +1,551 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_AGGREGATE_HPP
+#define QUERY_AGGREGATE_HPP
+
+#include <cassert>
+
+#include "../configuration.hpp"
+#include "../math/geometry.hpp"
+
+#include "query_base.hpp"
+
+namespace spatialcl {
+namespace query {
+
+/// Counts the particles within each query box. Nodes that are entirely
+/// inside the box are not descended into; instead, all particles of the
+/// node are counted when the engine discards the node
+/// (see \c dfs_subtree_discard_event). The counts are stored as \c cl_uint.
+template<class Type_descriptor>
+class box_count_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(box_count_query)
+
+  box_count_query(const cl::Buffer& query_ranges_min,
+                  const cl::Buffer& query_ranges_max,
+                  const cl::Buffer& result_counts,
+                  std::size_t num_queries)
+    : _query_ranges_min{query_ranges_min},
+      _query_ranges_max{query_ranges_max},
+      _counts{result_counts},
+      _num_queries{num_queries}
+  {
+    assert(num_queries > 0);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_query_ranges_min,
+                               _query_ranges_max,
+                               _counts,
+                               static_cast<cl_ulong>(_num_queries));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_queries;
+  }
+
+  virtual ~box_count_query(){}
+
+private:
+  cl::Buffer _query_ranges_min;
+  cl::Buffer _query_ranges_max;
+  cl::Buffer _counts;
+  std::size_t _num_queries;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_corner,
+                        bbox_max_corner)
+      {
+        // Contained nodes are accepted as a whole in the discard event
+        *selection_result_ptr =
+            box_box_intersection(CLIP_TO_VECTOR(bbox_min_corner),
+                                 CLIP_TO_VECTOR(bbox_max_corner),
+                                 query_range_min,
+                                 query_range_max) &&
+           !box_contains_box(query_range_min,
+                             query_range_max,
+                             CLIP_TO_VECTOR(bbox_min_corner),
+                             CLIP_TO_VECTOR(bbox_max_corner));
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+      {
+        *selection_result_ptr = box_contains_particle(query_range_min,
+                                                      query_range_max,
+                                                      current_particle);
+        if(*selection_result_ptr)
+          ++num_selected_particles;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+      {
+        *selection_result_ptr = box_contains_point(query_range_min,
+                                                   query_range_max,
+                                                   current_position);
+        if(*selection_result_ptr)
+          ++num_selected_particles;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_subtree_discard_event(node_key_ptr,
+                                node_idx,
+                                current_bbox_min_corner,
+                                current_bbox_max_corner)
+      {
+        if(box_contains_box(query_range_min,
+                            query_range_max,
+                            CLIP_TO_VECTOR(current_bbox_min_corner),
+                            CLIP_TO_VECTOR(current_bbox_max_corner)))
+          num_selected_particles += (uint)(dfs_get_node_particles_end(node_key_ptr) -
+                                           dfs_get_node_particles_begin(node_key_ptr));
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_corner,
+                                    current_bbox_max_corner)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+        __global vector_type* query_ranges_min, \
+        __global vector_type* query_ranges_max, \
+        __global uint* query_result_counts, \
+        ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+        vector_type query_range_min;
+        vector_type query_range_max;
+        uint num_selected_particles = 0;
+
+        if(get_query_id() < num_queries)
+        {
+          query_range_min = query_ranges_min[get_query_id()];
+          query_range_max = query_ranges_max[get_query_id()];
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+        if(get_query_id() < num_queries)
+          query_result_counts[get_query_id()] = num_selected_particles;
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
+/// Counts the particles within each query sphere. Like \c box_count_query,
+/// nodes that are entirely within the sphere are counted as a whole.
+template<class Type_descriptor>
+class sphere_count_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(sphere_count_query)
+
+  /// \param query_centers The centers of the spheres (as \c vector_type)
+  /// \param query_radii The radii of the spheres (as \c scalar)
+  sphere_count_query(const cl::Buffer& query_centers,
+                     const cl::Buffer& query_radii,
+                     const cl::Buffer& result_counts,
+                     std::size_t num_queries)
+    : _query_centers{query_centers},
+      _query_radii{query_radii},
+      _counts{result_counts},
+      _num_queries{num_queries}
+  {
+    assert(num_queries > 0);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_query_centers,
+                               _query_radii,
+                               _counts,
+                               static_cast<cl_ulong>(_num_queries));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_queries;
+  }
+
+  virtual ~sphere_count_query(){}
+
+private:
+  cl::Buffer _query_centers;
+  cl::Buffer _query_radii;
+  cl::Buffer _counts;
+  std::size_t _num_queries;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_corner,
+                        bbox_max_corner)
+      {
+        // Contained nodes are accepted as a whole in the discard event
+        *selection_result_ptr =
+            box_distance2(query_center,
+                          CLIP_TO_VECTOR(bbox_min_corner),
+                          CLIP_TO_VECTOR(bbox_max_corner)) <= query_radius2 &&
+           !sphere_contains_box(query_center,
+                                query_radius2,
+                                CLIP_TO_VECTOR(bbox_min_corner),
+                                CLIP_TO_VECTOR(bbox_max_corner));
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+      {
+        vector_type delta = PARTICLE_POSITION(current_particle) - query_center;
+        *selection_result_ptr = VECTOR_NORM2(delta) <= query_radius2;
+        if(*selection_result_ptr)
+          ++num_selected_particles;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+      {
+        vector_type delta = current_position - query_center;
+        *selection_result_ptr = VECTOR_NORM2(delta) <= query_radius2;
+        if(*selection_result_ptr)
+          ++num_selected_particles;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_subtree_discard_event(node_key_ptr,
+                                node_idx,
+                                current_bbox_min_corner,
+                                current_bbox_max_corner)
+      {
+        if(sphere_contains_box(query_center,
+                               query_radius2,
+                               CLIP_TO_VECTOR(current_bbox_min_corner),
+                               CLIP_TO_VECTOR(current_bbox_max_corner)))
+          num_selected_particles += (uint)(dfs_get_node_particles_end(node_key_ptr) -
+                                           dfs_get_node_particles_begin(node_key_ptr));
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_corner,
+                                    current_bbox_max_corner)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+        __global vector_type* query_centers, \
+        __global scalar* query_radii, \
+        __global uint* query_result_counts, \
+        ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+        vector_type query_center;
+        scalar query_radius2 = 0.0f;
+        uint num_selected_particles = 0;
+
+        if(get_query_id() < num_queries)
+        {
+          query_center = query_centers[get_query_id()];
+          query_radius2 = query_radii[get_query_id()] * query_radii[get_query_id()];
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+        if(get_query_id() < num_queries)
+          query_result_counts[get_query_id()] = num_selected_particles;
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
+enum reduction_operation
+{
+  REDUCTION_SUM = 0,
+  REDUCTION_MIN = 1,
+  REDUCTION_MAX = 2
+};
+
+/// Reduces the component \c Component of all particles within each query
+/// box with the given operation. The results are stored as \c scalar; queries
+/// without particles yield 0 for sums, and the largest finite value of
+/// the scalar type (\c FLT_MAX or \c DBL_MAX) for minima, or its
+/// negative for maxima.
+///
+/// Like the counts, nodes that are entirely inside the query box are not
+/// descended into. Instead, the aggregate of the node is reduced when the
+/// engine discards the node (see \c dfs_subtree_discard_event). The node
+/// aggregates are therefore taken from a \c particle_aggregate_bvh_tree
+/// over the same component, see \c get_node_aggregates(). Since the
+/// aggregates are indexed in the layout of the binary tree nodes, the
+/// query must be executed with one of the engines for binary trees, such as
+/// the \c relaxed_dfs_query_engine or the \c grouped_dfs_query_engine.
+/// \tparam Component The index of the reduced particle component
+template<class Type_descriptor,
+         std::size_t Component,
+         reduction_operation Operation = REDUCTION_SUM>
+class box_reduction_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(box_reduction_query)
+
+  static_assert(Component < Type_descriptor::particle_dimension,
+                "The reduced component must be a component of the particles");
+
+  /// \param node_aggregates The aggregates of the reduced component
+  /// for each node of the queried tree, see \c get_node_aggregates()
+  box_reduction_query(const cl::Buffer& query_ranges_min,
+                      const cl::Buffer& query_ranges_max,
+                      const cl::Buffer& node_aggregates,
+                      const cl::Buffer& results,
+                      std::size_t num_queries)
+    : _query_ranges_min{query_ranges_min},
+      _query_ranges_max{query_ranges_max},
+      _node_aggregates{node_aggregates},
+      _results{results},
+      _num_queries{num_queries}
+  {
+    assert(num_queries > 0);
+  }
+
+  /// \return The node aggregates of \c tree that are required by this
+  /// reduction, i.e. the node sums for \c REDUCTION_SUM and the
+  /// node extrema otherwise.
+  /// \tparam Tree_type A \c particle_aggregate_bvh_tree
+  template<class Tree_type>
+  static const cl::Buffer& get_node_aggregates(const Tree_type& tree)
+  {
+    static_assert(Tree_type::aggregated_component == Component,
+                  "The tree must aggregate the reduced component");
+    return Operation == REDUCTION_SUM ? tree.get_node_sums()
+                                      : tree.get_node_extrema();
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_query_ranges_min,
+                               _query_ranges_max,
+                               _node_aggregates,
+                               _results,
+                               static_cast<cl_ulong>(_num_queries));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_queries;
+  }
+
+  virtual ~box_reduction_query(){}
+
+private:
+  static constexpr int reduced_component = static_cast<int>(Component);
+  static constexpr int reduction_op = static_cast<int>(Operation);
+
+  cl::Buffer _query_ranges_min;
+  cl::Buffer _query_ranges_max;
+  cl::Buffer _node_aggregates;
+  cl::Buffer _results;
+  std::size_t _num_queries;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_IMPORT_CONSTANT(reduced_component)
+    QCL_IMPORT_CONSTANT(reduction_op)
+    R"(
+      #if reduction_op == 0
+        #define REDUCTION_IDENTITY ((scalar)0)
+        #define REDUCE(a, b) ((a) + (b))
+      #elif reduction_op == 1
+        #define REDUCTION_IDENTITY ((scalar)SCALAR_MAX)
+        #define REDUCE(a, b) fmin(a, b)
+      #elif reduction_op == 2
+        #define REDUCTION_IDENTITY ((scalar)-SCALAR_MAX)
+        #define REDUCE(a, b) fmax(a, b)
+      #else
+        #error Invalid reduction operation
+      #endif
+    )"
+    QCL_RAW(
+      scalar reduction_get_component(particle_type p)
+      {
+        return ((scalar*)&p)[reduced_component];
+      }
+
+      /// The sums are stored as one scalar per node, the extrema
+      /// as pairs of minimum and maximum.
+      scalar reduction_get_node_aggregate(__global scalar* node_aggregates,
+                                          ulong node_idx)
+      {
+      #if reduction_op == 0
+        return node_aggregates[node_idx];
+      #else
+        return node_aggregates[2 * node_idx + (reduction_op == 2)];
+      #endif
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_corner,
+                        bbox_max_corner)
+      {
+        // Contained nodes are reduced as a whole in the discard event
+        *selection_result_ptr =
+            box_box_intersection(CLIP_TO_VECTOR(bbox_min_corner),
+                                 CLIP_TO_VECTOR(bbox_max_corner),
+                                 query_range_min,
+                                 query_range_max) &&
+           !box_contains_box(query_range_min,
+                             query_range_max,
+                             CLIP_TO_VECTOR(bbox_min_corner),
+                             CLIP_TO_VECTOR(bbox_max_corner));
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+      {
+        *selection_result_ptr = box_contains_particle(query_range_min,
+                                                      query_range_max,
+                                                      current_particle);
+        if(*selection_result_ptr)
+          reduction_result = REDUCE(reduction_result,
+                                    reduction_get_component(current_particle));
+      }
+    )
+    // The particles are only loaded entirely if they are inside the box
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+      {
+        *selection_result_ptr = box_contains_point(query_range_min,
+                                                   query_range_max,
+                                                   current_position);
+        if(*selection_result_ptr)
+          reduction_result = REDUCE(reduction_result,
+                                    reduction_get_component(dfs_load_particle(particle_idx)));
+      }
+    )
+    // The node index of the discard event is not necessarily an index
+    // into the binary node layout, so it is recalculated from the key.
+    QCL_PREPROCESSOR(define,
+      dfs_subtree_discard_event(node_key_ptr,
+                                node_idx,
+                                current_bbox_min_corner,
+                                current_bbox_max_corner)
+      {
+        if(box_contains_box(query_range_min,
+                            query_range_max,
+                            CLIP_TO_VECTOR(current_bbox_min_corner),
+                            CLIP_TO_VECTOR(current_bbox_max_corner)))
+          reduction_result = REDUCE(reduction_result,
+                reduction_get_node_aggregate(node_aggregates,
+                      binary_tree_key_encode_node_index(node_key_ptr,
+                                                        effective_num_levels,
+                                                        num_particles,
+                                                        leaf_bucket_depth)));
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_corner,
+                                    current_bbox_max_corner)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+        __global vector_type* query_ranges_min, \
+        __global vector_type* query_ranges_max, \
+        __global scalar* node_aggregates, \
+        __global scalar* query_results, \
+        ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+        vector_type query_range_min;
+        vector_type query_range_max;
+        scalar reduction_result = REDUCTION_IDENTITY;
+
+        if(get_query_id() < num_queries)
+        {
+          query_range_min = query_ranges_min[get_query_id()];
+          query_range_max = query_ranges_max[get_query_id()];
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+        if(get_query_id() < num_queries)
+          query_results[get_query_id()] = reduction_result;
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_DISPATCH_HPP
+#define QUERY_DISPATCH_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "../configuration.hpp"
+#include "query_engine_dfs.hpp"
+#include "query_engine_host_dfs.hpp"
+#include "query_range.hpp"
+
+namespace spatialcl {
+namespace query {
+
+/// Executes box range queries on the host or on the device, depending on
+/// the number of queries. Small batches (e.g. for interactive picking) are
+/// processed by \c engine::host_depth_first on a host copy of the tree,
+/// which avoids the kernel launch and the transfers of the queries and
+/// results. Larger batches are uploaded and executed by the device engine.
+/// Both paths yield the results in the layout of \c box_range_query.
+///
+/// The host copy is created when it is needed for the first time. If the
+/// tree is refitted or rebuilt afterwards, \c update_host_mirror() must be
+/// called before the next query.
+/// \tparam Device_engine The engine for large batches, with
+/// \c box_range_query as handler
+template<class Tree_type,
+         std::size_t Max_retrieved_particles,
+         class Device_engine = engine::depth_first<
+           Tree_type,
+           box_range_query<typename Tree_type::type_system, Max_retrieved_particles>,
+           engine::HIERARCHICAL_ITERATION_RELAXED
+         >>
+class box_range_query_dispatcher
+{
+public:
+  using type_system = typename Tree_type::type_system;
+  using particle_type = typename configuration<type_system>::particle_type;
+  using vector_type = typename configuration<type_system>::vector_type;
+
+  using host_handler_type = host_box_range_query<type_system, Max_retrieved_particles>;
+  using device_handler_type = typename Device_engine::handler_type;
+
+  /// \param max_host_batch_size Batches of up to this many queries
+  /// are executed on the host
+  /// \param max_host_threads The maximum number of threads for
+  /// queries on the host
+  explicit box_range_query_dispatcher(const Tree_type& tree,
+                                      std::size_t max_host_batch_size = 128,
+                                      std::size_t max_host_threads =
+                                        std::max(std::thread::hardware_concurrency(), 1u))
+    : _tree{&tree},
+      _max_host_batch_size{max_host_batch_size},
+      _host_engine{max_host_threads}
+  {}
+
+  /// \return Whether a batch of the given size is executed on the host
+  bool is_host_batch(std::size_t num_queries) const
+  {
+    return num_queries <= _max_host_batch_size;
+  }
+
+  /// Executes the queries and stores the results on the host. Blocks
+  /// until the results are available.
+  void operator()(const std::vector<vector_type>& query_ranges_min,
+                  const std::vector<vector_type>& query_ranges_max,
+                  std::vector<particle_type>& result_retrieved_particles,
+                  std::vector<cl_uint>& result_num_retrieved_particles)
+  {
+    assert(query_ranges_min.size() == query_ranges_max.size());
+
+    const std::size_t num_queries = query_ranges_min.size();
+    if(num_queries == 0)
+    {
+      result_retrieved_particles.clear();
+      result_num_retrieved_particles.clear();
+      return;
+    }
+
+    if(is_host_batch(num_queries))
+    {
+      if(!_host_mirror)
+        this->update_host_mirror();
+
+      host_handler_type handler{query_ranges_min,
+                                query_ranges_max,
+                                result_retrieved_particles,
+                                result_num_retrieved_particles};
+      _host_engine(*_host_mirror, handler);
+    }
+    else
+    {
+      const qcl::device_context_ptr& ctx = _tree->get_device_context();
+
+      qcl::device_array<vector_type> queries_min{ctx, query_ranges_min};
+      qcl::device_array<vector_type> queries_max{ctx, query_ranges_max};
+      qcl::device_array<particle_type> result{ctx, num_queries * Max_retrieved_particles};
+      qcl::device_array<cl_uint> num_results{ctx, num_queries};
+
+      device_handler_type handler{queries_min.get_buffer(),
+                                  queries_max.get_buffer(),
+                                  result.get_buffer(),
+                                  num_results.get_buffer(),
+                                  num_queries};
+
+      cl_int err = _device_engine(*_tree, handler);
+      qcl::check_cl_error(err, "Could not enqueue range query");
+
+      result.read(result_retrieved_particles);
+      num_results.read(result_num_retrieved_particles);
+    }
+  }
+
+  /// Downloads the tree to the host again. Blocks until the
+  /// download has completed.
+  void update_host_mirror()
+  {
+    if(_host_mirror)
+      _host_mirror->update(*_tree);
+    else
+      _host_mirror.reset(new engine::host_tree_mirror<Tree_type>{*_tree});
+  }
+
+private:
+  const Tree_type* _tree;
+  std::size_t _max_host_batch_size;
+
+  std::unique_ptr<engine::host_tree_mirror<Tree_type>> _host_mirror;
+  engine::host_depth_first<Tree_type> _host_engine;
+  Device_engine _device_engine;
+};
+
+}
+}
+
+#endif
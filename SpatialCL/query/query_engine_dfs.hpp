@@ -34,6 +34,11 @@
 
 #include "../configuration.hpp"
 #include "../tree/binary_tree.hpp"
+#include "../binary_utils.hpp"
+#include "../async.hpp"
+#include "particle_access.hpp"
+#include "query_scheduling.hpp"
+#include "query_instrumentation.hpp"
 
 
 namespace spatialcl {
@@ -46,107 +51,57 @@ enum depth_first_iteration_strategy
   HIERARCHICAL_ITERATION_RELAXED = 1
 };
 
-/// Depth-first query.
-/// \tparam Tree_type the tree type on which this query operates
-/// \tparam Handler_module A query handler, fulfilling the dfs handler concept
-/// \tparam group_size The OpenCL group size of the query. A 0 will correspond
-/// to a cl::NullRange and will hence allow the OpenCL implementation to choose
-/// the group size
-template<class Tree_type,
-         class Handler_module,
-         depth_first_iteration_strategy Iteration_strategy,
-         std::size_t group_size = 256>
-class depth_first
+/// The traversal of a single binary tree by the depth-first engines.
+/// Defines the macros
+/// \code
+/// DECLARE_CHILD_ORDER_STATE
+/// QUERY_NODE_LEVEL(particles, node_values0, node_values1, num_particles,
+///                  effective_num_levels, current_node, num_covered_particles)
+/// \endcode
+/// where \c QUERY_NODE_LEVEL processes the node \c current_node and advances
+/// it to the next node of the traversal. The state of the node codec must be
+/// available as \c node_codec_state (see node_codec.hpp). A query is complete once
+/// \c num_covered_particles (starting at 0 with the root as current
+/// node) reaches \c num_particles. This module must be included after
+/// the handler, the tree configuration, \c particle_access and
+/// \c query_instrumentation.
+template<depth_first_iteration_strategy Iteration_strategy,
+         std::size_t Leaf_bucket_size>
+class depth_first_traversal
 {
 public:
-  QCL_MAKE_MODULE(depth_first)
+  QCL_MAKE_MODULE(depth_first_traversal)
 
-  using handler_type = Handler_module;
-  using type_system = typename Tree_type::type_system;
+  static constexpr std::size_t leaf_bucket_size = Leaf_bucket_size;
+  static constexpr std::size_t leaf_bucket_depth =
+      spatialcl::utils::binary::small_binary_logarithm<leaf_bucket_size>::value;
 
-  /// Execute query
-  cl_int operator()(const Tree_type& tree,
-                    Handler_module& handler,
-                    cl::Event* evt = nullptr)
-  {
-    return this->run(tree.get_device_context(),
-                     tree.get_sorted_particles(),
-                     tree.get_node_values0(),
-                     tree.get_node_values1(),
-                     tree.get_num_particles(),
-                     tree.get_effective_num_particles(),
-                     tree.get_effective_num_levels(),
-                     handler,
-                     evt);
-  }
 private:
-  cl_int run(const qcl::device_context_ptr& ctx,
-             const cl::Buffer& particles,
-             const cl::Buffer& node_values0,
-             const cl::Buffer& node_values1,
-             std::size_t num_particles,
-             std::size_t effective_num_particles,
-             std::size_t effective_num_levels,
-             Handler_module& handler,
-             cl::Event* evt = nullptr)
-  {
-
-    cl::NDRange local_size = cl::NullRange;
-    if(group_size > 0)
-      local_size = cl::NDRange{group_size};
-
-    qcl::kernel_call call = query(ctx,
-                                  cl::NDRange{handler.get_num_independent_queries()},
-                                  local_size,
-                                  evt);
-
-    call.partial_argument_list(particles,
-                               node_values0,
-                               node_values1,
-                               static_cast<cl_ulong>(num_particles),
-                               static_cast<cl_ulong>(effective_num_particles),
-                               static_cast<cl_ulong>(effective_num_levels));
-
-    handler.push_full_arguments(call);
-    return call.enqueue_kernel();
-  }
-
-  QCL_ENTRYPOINT(query)
   QCL_MAKE_SOURCE(
-    QCL_INCLUDE_MODULE(tree_configuration<Tree_type>)
-    QCL_INCLUDE_MODULE(Handler_module)
-    QCL_INCLUDE_MODULE(binary_tree)
     QCL_IMPORT_CONSTANT(Iteration_strategy)
-    QCL_IMPORT_CONSTANT(group_size)
+    QCL_IMPORT_CONSTANT(leaf_bucket_size)
+    QCL_IMPORT_CONSTANT(leaf_bucket_depth)
     QCL_RAW(
         ulong load_node(binary_tree_key_t* node,
-                       __global node_type0* node_values0,
-                       __global node_type1* node_values1,
+                       __global storage_node_type0* node_values0,
+                       __global storage_node_type1* node_values1,
                        ulong effective_num_levels,
-                       ulong effective_num_particles,
+                       ulong num_particles,
+                       node_codec_state_t node_codec_state,
                        node_type0* node_value0_out,
                        node_type1* node_value1_out)
         {
-          ulong idx = binary_tree_key_encode_global_id(node,effective_num_levels);
-          idx -= effective_num_particles;
+          ulong idx = binary_tree_key_encode_node_index(node,
+                                                        effective_num_levels,
+                                                        num_particles,
+                                                        leaf_bucket_depth);
 
-          *node_value0_out = node_values0[idx];
-          *node_value1_out = node_values1[idx];
-
-          return idx;
-        }
-
-        ulong load_particle(binary_tree_key_t* node,
-                       __global particle_type* particles,
-                       ulong effective_num_levels,
-                       ulong effective_num_particles,
-                       particle_type* particle_out)
-        {
+          load_tree_node(node_values0,
+                         node_values1,
+                         idx,
+                         node_value0_out,
+                         node_value1_out);
 
-          // Since particles are at the lowest level, we know that for them
-          // the index equals the local node id
-          ulong idx = node->local_node_id;
-          *particle_out = particles[idx];
           return idx;
         }
 
@@ -169,149 +124,472 @@ private:
         #error Invalid iteration strategy
       #endif
 
-      #if group_size > 0
-        #define KERNEL_ATTRIBUTES __attribute__((reqd_work_group_size(group_size,1,1)))
+      #ifdef dfs_child_order
+        // For each level, a bit stores whether the right child of the
+        // current pair of siblings has been visited first. The iteration
+        // strategy does not matter in this case. The values of the child
+        // descended into have already been loaded to decide the order,
+        // and are kept for the next node level.
+        #define DECLARE_CHILD_ORDER_STATE \
+          ulong right_child_first_levels = 0; \
+          int has_prefetched_node = 0; \
+          node_type0 prefetched_values0; \
+          node_type1 prefetched_values1
+        #define DESCEND_TO_FIRST_CHILD DESCEND_IN_CHILD_ORDER
+        #define ADVANCE_TO_NEXT_NODE ADVANCE_IN_CHILD_ORDER
+        #define LOAD_CURRENT_NODE LOAD_PREFETCHED_NODE
       #else
-        #define KERNEL_ATTRIBUTES
+        #define DECLARE_CHILD_ORDER_STATE
+        #define DESCEND_TO_FIRST_CHILD DESCEND_IN_TREE_ORDER
+        #define ADVANCE_TO_NEXT_NODE ADVANCE_IN_TREE_ORDER
+        #define LOAD_CURRENT_NODE LOAD_NODE
       #endif
       )"
-      QCL_PREPROCESSOR(define, get_query_id() tid)
       QCL_PREPROCESSOR(define,
-        QUERY_NODE_LEVEL(node_values0,
-                         node_values1,
-                         effective_num_particles,
-                         effective_num_levels,
-                         current_node,
-                         num_covered_particles)
+        QUERY_LEAF_BUCKET(particles,
+                          num_particles,
+                          effective_num_levels,
+                          current_node)
         {
-          node_type0 current_node_values0;
-          node_type1 current_node_values1;
+          // Process all particles of the bucket linearly
+          const ulong particles_begin = binary_tree_get_leaves_begin(&current_node,
+                                                                     effective_num_levels);
+          const ulong particles_end = min(particles_begin + leaf_bucket_size,
+                                          num_particles);
+          DFS_COUNT_PARTICLES_TESTED(particles_end - particles_begin);
+
+          for(ulong particle_idx = particles_begin;
+              particle_idx < particles_end;
+              ++particle_idx)
+          {
+            dfs_cached_particle_type current_particle = DFS_LOAD_PARTICLE(particle_idx);
 
-          ulong node_idx = load_node(&current_node,
-                                     node_values0,
-                                     node_values1,
-                                     effective_num_levels,
-                                     effective_num_particles,
-                                     &current_node_values0,
-                                     &current_node_values1);
+            int particle_selected = 0;
+            DFS_PROCESS_PARTICLE(&particle_selected,
+                                 particle_idx,
+                                 current_particle);
+          }
+        }
+      )
+      QCL_PREPROCESSOR(define,
+        LOAD_NODE(node_values0,
+                  node_values1,
+                  num_particles,
+                  effective_num_levels,
+                  current_node,
+                  node_idx,
+                  current_node_values0,
+                  current_node_values1)
+        {
+          node_idx = load_node(&current_node,
+                               node_values0,
+                               node_values1,
+                               effective_num_levels,
+                               num_particles,
+                               node_codec_state,
+                               &current_node_values0,
+                               &current_node_values1);
+        }
+      )
+      QCL_PREPROCESSOR(define,
+        LOAD_PREFETCHED_NODE(node_values0,
+                             node_values1,
+                             num_particles,
+                             effective_num_levels,
+                             current_node,
+                             node_idx,
+                             current_node_values0,
+                             current_node_values1)
+        {
+          if(has_prefetched_node)
+          {
+            node_idx = binary_tree_key_encode_node_index(&current_node,
+                                                         effective_num_levels,
+                                                         num_particles,
+                                                         leaf_bucket_depth);
+            current_node_values0 = prefetched_values0;
+            current_node_values1 = prefetched_values1;
+            has_prefetched_node = 0;
+          }
+          else
+          {
+            LOAD_NODE(node_values0,
+                      node_values1,
+                      num_particles,
+                      effective_num_levels,
+                      current_node,
+                      node_idx,
+                      current_node_values0,
+                      current_node_values1);
+          }
+        }
+      )
+      QCL_PREPROCESSOR(define,
+        DESCEND_IN_TREE_ORDER(node_values0,
+                              node_values1,
+                              num_particles,
+                              effective_num_levels,
+                              current_node)
+        {
+          current_node = binary_tree_get_children_begin(&current_node);
+        }
+      )
+      QCL_PREPROCESSOR(define,
+        ADVANCE_IN_TREE_ORDER(num_particles,
+                              effective_num_levels,
+                              current_node,
+                              num_covered_particles)
+        {
+          num_covered_particles += BT_LEAVES_PER_NODE(current_node.level,
+                                                      effective_num_levels);
 
-          int node_selected = 0;
-          dfs_node_selector(&node_selected,
-                            &current_node,
-                            node_idx,
-                            current_node_values0,
-                            current_node_values1);
-          if(node_selected)
+          if(binary_tree_is_right_child(&current_node))
           {
-            current_node = binary_tree_get_children_begin(&current_node);
+            // if we are at a right child node, go up to the parent's
+            // sibling...
+            current_node = NEXT_PARENT(current_node);
+            current_node.local_node_id++;
           }
           else
+            // otherwise, first investigate the sibling
+            current_node.local_node_id++;
+        }
+      )
+      QCL_PREPROCESSOR(define,
+        DESCEND_IN_CHILD_ORDER(node_values0,
+                               node_values1,
+                               num_particles,
+                               effective_num_levels,
+                               current_node)
+        {
+          binary_tree_key_t left_child = binary_tree_get_children_begin(&current_node);
+          binary_tree_key_t right_child = binary_tree_get_children_last(&current_node);
+
+          int right_child_first = 0;
+          if(binary_tree_is_node_used(&right_child, effective_num_levels, num_particles))
           {
-            dfs_unique_node_discard_event(node_idx,
-                                          current_node_values0,
-                                          current_node_values1);
+            node_type0 left_values0;
+            node_type1 left_values1;
+            node_type0 right_values0;
+            node_type1 right_values1;
+            load_node(&left_child, node_values0, node_values1,
+                      effective_num_levels, num_particles, node_codec_state,
+                      &left_values0, &left_values1);
+            load_node(&right_child, node_values0, node_values1,
+                      effective_num_levels, num_particles, node_codec_state,
+                      &right_values0, &right_values1);
+
+            dfs_child_order(&right_child_first,
+                            &left_child,
+                            left_values0,
+                            left_values1,
+                            right_values0,
+                            right_values1);
+
+            prefetched_values0 = right_child_first ? right_values0 : left_values0;
+            prefetched_values1 = right_child_first ? right_values1 : left_values1;
+            has_prefetched_node = 1;
+          }
 
-            num_covered_particles += BT_LEAVES_PER_NODE(current_node.level,
-                                                        effective_num_levels);
+          right_child_first_levels &= ~(1ul << left_child.level);
+          if(right_child_first)
+          {
+            right_child_first_levels |= 1ul << left_child.level;
+            current_node = right_child;
+          }
+          else
+            current_node = left_child;
+        }
+      )
+      QCL_PREPROCESSOR(define,
+        ADVANCE_IN_CHILD_ORDER(num_particles,
+                               effective_num_levels,
+                               current_node,
+                               num_covered_particles)
+        {
+          // Only count the real particles, since the last
+          // node is not necessarily visited last
+          const ulong leaves_begin = binary_tree_get_leaves_begin(&current_node,
+                                                                  effective_num_levels);
+          num_covered_particles += min(binary_tree_get_leaves_end(&current_node,
+                                                                  effective_num_levels),
+                                       num_particles) - leaves_begin;
+
+          // Go up until we are at a node that has been visited before
+          // its (used) sibling, and continue with the sibling.
+          while(current_node.level > 0)
+          {
+            binary_tree_key_t sibling = current_node;
+            sibling.local_node_id ^= 1;
+
+            const int visited_first =
+                binary_tree_is_right_child(&current_node) ==
+                (int)((right_child_first_levels >> current_node.level) & 1);
 
-            if(binary_tree_is_right_child(&current_node))
+            if(visited_first &&
+               binary_tree_is_node_used(&sibling, effective_num_levels, num_particles))
             {
-              // if we are at a right child node, go up to the parent's
-              // sibling...
-              current_node = NEXT_PARENT(current_node);
-              current_node.local_node_id++;
+              current_node = sibling;
+              break;
             }
-            else
-              // otherwise, first investigate the sibling
-              current_node.local_node_id++;
+            current_node = binary_tree_get_parent(&current_node);
           }
         }
       )
       QCL_PREPROCESSOR(define,
-        QUERY_PARTICLE_LEVEL(particles,
-                             effective_num_particles,
-                             effective_num_levels,
-                             current_node,
-                             num_covered_particles)
+        QUERY_NODE_LEVEL(particles,
+                         node_values0,
+                         node_values1,
+                         num_particles,
+                         effective_num_levels,
+                         current_node,
+                         num_covered_particles)
         {
-          particle_type current_particle;
+          node_type0 current_node_values0;
+          node_type1 current_node_values1;
+
+          ulong node_idx;
+          LOAD_CURRENT_NODE(node_values0,
+                            node_values1,
+                            num_particles,
+                            effective_num_levels,
+                            current_node,
+                            node_idx,
+                            current_node_values0,
+                            current_node_values1);
 
-          ulong particle_idx = load_particle(&current_node,
-                                             particles,
-                                             effective_num_levels,
-                                             effective_num_particles,
-                                             &current_particle);
+          int node_selected = 0;
+          dfs_node_selector(&node_selected,
+                            &current_node,
+                            node_idx,
+                            current_node_values0,
+                            current_node_values1);
+          DFS_COUNT_NODES_VISITED(1);
+          DFS_COUNT_NODES_SELECTED(node_selected != 0);
 
-          int particle_selected = 0;
-          dfs_particle_processor(&particle_selected,
-                                 particle_idx,
-                                 current_particle);
-          if(particle_selected)
+          const uint leaf_bucket_level = effective_num_levels - 1 - leaf_bucket_depth;
+
+          if(node_selected && current_node.level < leaf_bucket_level)
           {
-            // Move to next particle
-            current_node.local_node_id++;
+            DESCEND_TO_FIRST_CHILD(node_values0,
+                                   node_values1,
+                                   num_particles,
+                                   effective_num_levels,
+                                   current_node);
           }
           else
           {
-            if(binary_tree_is_right_child(&current_node))
+            if(node_selected)
             {
-              // if we are at a right child node, go up to the parent's
-              // sibling...
-              current_node = NEXT_PARENT(current_node);
-              current_node.local_node_id++;
+              QUERY_LEAF_BUCKET(particles,
+                                num_particles,
+                                effective_num_levels,
+                                current_node);
             }
             else
-              // otherwise, first investigate the sibling
-              current_node.local_node_id++;
+            {
+              DFS_DISCARD_NODE(&current_node,
+                               node_idx,
+                               current_node_values0,
+                               current_node_values1);
+            }
+
+            ADVANCE_TO_NEXT_NODE(num_particles,
+                                 effective_num_levels,
+                                 current_node,
+                                 num_covered_particles);
           }
-          num_covered_particles++;
         }
       )
+  )
+};
+
+/// Depth-first query. If a leaf bucket of the tree is selected, all its
+/// particles are passed to the particle processor of the handler.
+///
+/// By default, the left child of a node is always visited first. Handlers
+/// can change this by defining
+/// \code
+/// dfs_child_order(right_child_first_ptr, left_child_key_ptr,
+///                 left_child_values0, left_child_values1,
+///                 right_child_values0, right_child_values1)
+/// \endcode
+/// which must set \c *right_child_first_ptr to a non-zero value if the right
+/// child should be visited first. This is e.g. useful to visit the closer
+/// child first in nearest neighbor queries. The children of a node are
+/// only compared if both exist.
+/// \tparam Tree_type the tree type on which this query operates
+/// \tparam Handler_module A query handler, fulfilling the dfs handler concept
+/// \tparam group_size The OpenCL group size of the query. A 0 will correspond
+/// to a cl::NullRange and will hence allow the OpenCL implementation to choose
+/// the group size
+/// \tparam Scheduling How the queries are distributed among the work items,
+/// see \c query_scheduler. Persistent scheduling requires a group size > 0.
+/// \tparam Instrumentation Whether the engine counts the visited nodes and
+/// tested particles of each query, see \c get_instrumentation()
+template<class Tree_type,
+         class Handler_module,
+         depth_first_iteration_strategy Iteration_strategy,
+         std::size_t group_size = 256,
+         dfs_scheduling Scheduling = DFS_SCHEDULING_STATIC,
+         dfs_instrumentation Instrumentation = DFS_INSTRUMENTATION_DISABLED>
+class depth_first
+{
+public:
+  QCL_MAKE_MODULE(depth_first)
+
+  using handler_type = Handler_module;
+  using type_system = typename Tree_type::type_system;
+
+  static constexpr std::size_t leaf_bucket_size = Tree_type::leaf_bucket_size;
+  static constexpr std::size_t leaf_bucket_depth =
+      spatialcl::utils::binary::small_binary_logarithm<leaf_bucket_size>::value;
+
+  static_assert(Scheduling == DFS_SCHEDULING_STATIC || group_size > 0,
+                "Persistent scheduling requires a fixed group size");
+
+  /// Compiles the query kernel without executing a query,
+  /// see \c spatialcl::precompile()
+  void precompile(const qcl::device_context_ptr& ctx)
+  {
+    query(ctx, cl::NDRange{1}, cl::NullRange);
+  }
+
+  /// Execute query
+  /// \param evt If not \c nullptr, receives the event of the query kernel
+  /// \param wait_events If not \c nullptr, the query only starts once
+  /// these events have completed (see \c enqueue_wait_for_events())
+  cl_int operator()(const Tree_type& tree,
+                    Handler_module& handler,
+                    cl::Event* evt = nullptr,
+                    const event_list* wait_events = nullptr)
+  {
+    return this->run(tree.get_device_context(),
+                     tree.get_sorted_particles(),
+                     get_particle_positions_if_available(tree),
+                     tree.get_node_values0(),
+                     tree.get_node_values1(),
+                     tree.get_num_particles(),
+                     tree.get_effective_num_levels(),
+                     handler,
+                     evt,
+                     wait_events);
+  }
+
+  /// \return The traversal counters of the last query, with one entry
+  /// for each query. Only collected with \c DFS_INSTRUMENTATION_ENABLED.
+  const query_instrumentation<Instrumentation>& get_instrumentation() const
+  {
+    return _instrumentation;
+  }
+private:
+  cl_int run(const qcl::device_context_ptr& ctx,
+             const cl::Buffer& particles,
+             const cl::Buffer* particle_positions,
+             const cl::Buffer& node_values0,
+             const cl::Buffer& node_values1,
+             std::size_t num_particles,
+             std::size_t effective_num_levels,
+             Handler_module& handler,
+             cl::Event* evt = nullptr,
+             const event_list* wait_events = nullptr)
+  {
+    enqueue_wait_for_events(ctx, wait_events);
+
+    cl::NDRange local_size = cl::NullRange;
+    if(group_size > 0)
+      local_size = cl::NDRange{group_size};
+
+    const std::size_t global_size =
+        _scheduler.get_global_size(ctx,
+                                   handler.get_num_independent_queries(),
+                                   group_size);
+
+    qcl::kernel_call call = query(ctx,
+                                  cl::NDRange{global_size},
+                                  local_size,
+                                  evt);
+
+    call.partial_argument_list(particles);
+    particle_access<Tree_type>::push_particle_positions(call, particle_positions);
+    call.partial_argument_list(node_values0,
+                               node_values1,
+                               static_cast<cl_ulong>(num_particles),
+                               static_cast<cl_ulong>(effective_num_levels));
+    _scheduler.push_arguments(ctx, call);
+    _instrumentation.push_arguments(ctx, call, handler.get_num_independent_queries());
+
+    handler.push_full_arguments(call);
+    return call.enqueue_kernel();
+  }
+
+  using traversal = depth_first_traversal<Iteration_strategy, leaf_bucket_size>;
+
+  query_scheduler<Scheduling> _scheduler;
+  query_instrumentation<Instrumentation> _instrumentation;
+
+  QCL_ENTRYPOINT(query)
+  QCL_MAKE_SOURCE(
+    QCL_INCLUDE_MODULE(tree_configuration<Tree_type>)
+    QCL_INCLUDE_MODULE(Handler_module)
+    QCL_INCLUDE_MODULE(particle_access<Tree_type>)
+    QCL_INCLUDE_MODULE(query_scheduler<Scheduling>)
+    QCL_INCLUDE_MODULE(query_instrumentation<Instrumentation>)
+    QCL_INCLUDE_MODULE(binary_tree)
+    QCL_INCLUDE_MODULE(traversal)
+    QCL_IMPORT_CONSTANT(group_size)
+    R"(
+      #if group_size > 0
+        #define KERNEL_ATTRIBUTES __attribute__((reqd_work_group_size(group_size,1,1)))
+      #else
+        #define KERNEL_ATTRIBUTES
+      #endif
+    )"
+    QCL_PREPROCESSOR(define, get_query_id() query_id)
       QCL_RAW(
         __kernel void query(__global particle_type* particles,
-                            __global node_type0* node_values0,
-                            __global node_type1* node_values1,
+                            PARTICLE_POSITIONS_PARAMETER
+                            __global storage_node_type0* node_values0,
+                            __global storage_node_type1* node_values1,
                             ulong num_particles,
-                            ulong effective_num_particles,
                             ulong effective_num_levels,
+                            DFS_SCHEDULER_PARAMETER
+                            DFS_INSTRUMENTATION_PARAMETER
+                            DFS_QUERY_PERMUTATION_PARAMETER
                             declare_full_query_parameter_set())
           KERNEL_ATTRIBUTES
         {
-          for(size_t tid = get_global_id(0);
+          const node_codec_state_t node_codec_state =
+              node_codec_init_state(node_values0, node_values1);
+
+          for(size_t tid = DFS_FIRST_QUERY();
               tid < get_num_queries();
-              tid += get_global_size(0))
+              tid = DFS_NEXT_QUERY(tid))
           {
+            DFS_DECLARE_QUERY_ID(tid);
             at_query_init();
 
             binary_tree_key_t current_node;
             current_node.level = 0;
             current_node.local_node_id = 0;
 
+            DECLARE_CHILD_ORDER_STATE;
+            DFS_DECLARE_COUNTERS;
+
             ulong num_covered_particles = 0;
             while(num_covered_particles < num_particles)
             {
-              int particle_level_reached = (current_node.level == effective_num_levels-1);
-
-              if(particle_level_reached)
-              {
-                QUERY_PARTICLE_LEVEL(particles,
-                                     effective_num_particles,
-                                     effective_num_levels,
-                                     current_node,
-                                     num_covered_particles);
-              }
-              else
-              {
-                QUERY_NODE_LEVEL(node_values0,
-                                 node_values1,
-                                 effective_num_particles,
-                                 effective_num_levels,
-                                 current_node,
-                                 num_covered_particles);
-              }
+              QUERY_NODE_LEVEL(particles,
+                               node_values0,
+                               node_values1,
+                               num_particles,
+                               effective_num_levels,
+                               current_node,
+                               num_covered_particles);
             }
 
             at_query_exit();
+            DFS_COMMIT_COUNTERS(query_id);
           }
         }
       )
@@ -0,0 +1,201 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_ENGINE_FOREST_DFS_HPP
+#define QUERY_ENGINE_FOREST_DFS_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+
+#include "../configuration.hpp"
+#include "../tree/binary_tree.hpp"
+#include "../tree/particle_bvh_forest.hpp"
+#include "../binary_utils.hpp"
+#include "../async.hpp"
+#include "particle_access.hpp"
+#include "query_engine_dfs.hpp"
+
+
+namespace spatialcl {
+namespace query {
+namespace engine {
+
+/// Depth-first query on a \c particle_bvh_forest. Each query operates on
+/// one tree of the forest, given by a \c cl_uint tree index per query, and
+/// the queries of all trees are processed in a single kernel launch. The
+/// traversal of each tree is the one of \c depth_first, hence handlers
+/// fulfilling the dfs handler concept (including \c dfs_child_order)
+/// can be used without changes. Within a query, \c particles,
+/// \c num_particles and all particle indices refer to the tree of the
+/// query, so e.g. the particle indices returned by a handler are indices
+/// into the particles of this tree.
+/// \tparam Forest_type the forest type on which this query operates
+/// \tparam Handler_module A query handler, fulfilling the dfs handler concept
+/// \tparam group_size The OpenCL group size of the query. A 0 will correspond
+/// to a cl::NullRange and will hence allow the OpenCL implementation to choose
+/// the group size
+template<class Forest_type,
+         class Handler_module,
+         depth_first_iteration_strategy Iteration_strategy,
+         std::size_t group_size = 256>
+class forest_depth_first
+{
+public:
+  QCL_MAKE_MODULE(forest_depth_first)
+
+  using handler_type = Handler_module;
+  using type_system = typename Forest_type::type_system;
+
+  static constexpr std::size_t leaf_bucket_size = Forest_type::leaf_bucket_size;
+
+  /// Compiles the query kernel without executing a query,
+  /// see \c spatialcl::precompile()
+  void precompile(const qcl::device_context_ptr& ctx)
+  {
+    query(ctx, cl::NDRange{1}, cl::NullRange);
+  }
+
+  /// Execute query
+  /// \param query_tree_ids A buffer of \c cl_uint with the index of the
+  /// tree of each query
+  /// \param evt If not \c nullptr, receives the event of the query kernel
+  /// \param wait_events If not \c nullptr, the query only starts once
+  /// these events have completed (see \c enqueue_wait_for_events())
+  cl_int operator()(const Forest_type& forest,
+                    const cl::Buffer& query_tree_ids,
+                    Handler_module& handler,
+                    cl::Event* evt = nullptr,
+                    const event_list* wait_events = nullptr)
+  {
+    enqueue_wait_for_events(forest.get_device_context(), wait_events);
+
+    cl::NDRange local_size = cl::NullRange;
+    if(group_size > 0)
+      local_size = cl::NDRange{group_size};
+
+    qcl::kernel_call call = query(forest.get_device_context(),
+                                  cl::NDRange{handler.get_num_independent_queries()},
+                                  local_size,
+                                  evt);
+
+    call.partial_argument_list(forest.get_sorted_particles(),
+                               forest.get_node_values0(),
+                               forest.get_node_values1(),
+                               forest.get_tree_particle_offsets(),
+                               forest.get_tree_node_offsets(),
+                               forest.get_tree_num_levels(),
+                               query_tree_ids);
+
+    handler.push_full_arguments(call);
+    return call.enqueue_kernel();
+  }
+private:
+  using traversal = depth_first_traversal<Iteration_strategy, leaf_bucket_size>;
+
+  QCL_ENTRYPOINT(query)
+  QCL_MAKE_SOURCE(
+    QCL_INCLUDE_MODULE(tree_configuration<Forest_type>)
+    QCL_INCLUDE_MODULE(Handler_module)
+    QCL_INCLUDE_MODULE(particle_access<Forest_type>)
+    QCL_INCLUDE_MODULE(query_instrumentation<DFS_INSTRUMENTATION_DISABLED>)
+    QCL_INCLUDE_MODULE(binary_tree)
+    QCL_INCLUDE_MODULE(traversal)
+    QCL_IMPORT_CONSTANT(group_size)
+    R"(
+      #if group_size > 0
+        #define KERNEL_ATTRIBUTES __attribute__((reqd_work_group_size(group_size,1,1)))
+      #else
+        #define KERNEL_ATTRIBUTES
+      #endif
+    )"
+    QCL_PREPROCESSOR(define, get_query_id() query_id)
+    QCL_RAW(
+      __kernel void query(__global particle_type* forest_particles,
+                          __global storage_node_type0* forest_node_values0,
+                          __global storage_node_type1* forest_node_values1,
+                          __global ulong* tree_particle_offsets,
+                          __global ulong* tree_node_offsets,
+                          __global uint* tree_num_levels,
+                          __global uint* query_tree_ids,
+                          DFS_QUERY_PERMUTATION_PARAMETER
+                          declare_full_query_parameter_set())
+        KERNEL_ATTRIBUTES
+      {
+        for(size_t tid = get_global_id(0);
+            tid < get_num_queries();
+            tid += get_global_size(0))
+        {
+          DFS_DECLARE_QUERY_ID(tid);
+
+          // The data of the tree of this query, named like the
+          // arguments of the single tree engines such that the
+          // handler and the traversal operate on this tree only
+          const uint tree_id = query_tree_ids[query_id];
+          const ulong particles_begin = tree_particle_offsets[tree_id];
+          const ulong nodes_begin = tree_node_offsets[tree_id];
+
+          __global particle_type* particles = forest_particles + particles_begin;
+          __global storage_node_type0* node_values0 = forest_node_values0 + nodes_begin;
+          __global storage_node_type1* node_values1 = forest_node_values1 + nodes_begin;
+          const ulong num_particles = tree_particle_offsets[tree_id + 1] - particles_begin;
+          const ulong effective_num_levels = tree_num_levels[tree_id];
+          const node_codec_state_t node_codec_state =
+              node_codec_init_state(node_values0, node_values1);
+
+          at_query_init();
+
+          binary_tree_key_t current_node;
+          current_node.level = 0;
+          current_node.local_node_id = 0;
+
+          DECLARE_CHILD_ORDER_STATE;
+
+          ulong num_covered_particles = 0;
+          while(num_covered_particles < num_particles)
+          {
+            QUERY_NODE_LEVEL(particles,
+                             node_values0,
+                             node_values1,
+                             num_particles,
+                             effective_num_levels,
+                             current_node,
+                             num_covered_particles);
+          }
+
+          at_query_exit();
+        }
+      }
+    )
+  )
+};
+
+}
+}
+}
+
+#endif
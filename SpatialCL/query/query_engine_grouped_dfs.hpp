@@ -32,15 +32,109 @@
 #include <QCL/qcl.hpp>
 #include <QCL/qcl_module.hpp>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "../configuration.hpp"
 #include "../tree/binary_tree.hpp"
 #include "../cl_utils.hpp"
 #include "../binary_utils.hpp"
+#include "../async.hpp"
+#include "particle_access.hpp"
+#include "query_scheduling.hpp"
+#include "query_instrumentation.hpp"
+
+// Vendor specific device queries, defined by cl_nv_device_attribute_query,
+// cl_amd_device_attribute_query and cl_intel_required_subgroup_size
+#ifndef CL_DEVICE_WARP_SIZE_NV
+  #define CL_DEVICE_WARP_SIZE_NV 0x4003
+#endif
+#ifndef CL_DEVICE_WAVEFRONT_WIDTH_AMD
+  #define CL_DEVICE_WAVEFRONT_WIDTH_AMD 0x4043
+#endif
+#ifndef CL_DEVICE_SUB_GROUP_SIZES_INTEL
+  #define CL_DEVICE_SUB_GROUP_SIZES_INTEL 0x4108
+#endif
 
 namespace spatialcl {
 namespace query {
 namespace engine {
 
+enum dfs_subgroup_operations
+{
+  /// Native sub-group operations are used if the device supports them
+  /// and the native sub-groups match the subgroups of the engine
+  DFS_SUBGROUPS_NATIVE = 0,
+  /// The subgroups always synchronize and reduce through local memory.
+  /// This is mainly useful to compare both implementations.
+  DFS_SUBGROUPS_EMULATED = 1
+};
+
+namespace detail {
+
+inline bool device_has_extension(const cl::Device& device,
+                                 const std::string& extension)
+{
+  const std::string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+  return extensions.find(extension) != std::string::npos;
+}
+
+}
+
+/// \return Whether the device of \c ctx supports sub-group operations
+/// (\c cl_khr_subgroups or \c cl_intel_subgroups), i.e. whether
+/// \c grouped_depth_first can use native sub-groups on this device
+inline bool device_supports_subgroups(const qcl::device_context_ptr& ctx)
+{
+  return detail::device_has_extension(ctx->get_device(), "cl_khr_subgroups") ||
+         detail::device_has_extension(ctx->get_device(), "cl_intel_subgroups");
+}
+
+/// \return The number of work items that execute in lockstep on the device
+/// of \c ctx, i.e. the warp size on NVIDIA, the wavefront size on AMD and
+/// the preferred sub-group size on Intel devices, or 0 if the device does not
+/// report it. A \c grouped_depth_first engine can only use native sub-groups
+/// if its \c subgroup_size equals the sub-group size that the compiler
+/// chooses for the query kernel, which is typically this size.
+/// On Intel devices, 16 is preferred if available, since the engine then
+/// requests it with \c intel_reqd_sub_group_size.
+inline std::size_t get_native_subgroup_size(const qcl::device_context_ptr& ctx)
+{
+  const cl::Device& device = ctx->get_device();
+
+  if(detail::device_has_extension(device, "cl_intel_required_subgroup_size"))
+  {
+    std::size_t sizes_bytes = 0;
+    if(clGetDeviceInfo(device(), CL_DEVICE_SUB_GROUP_SIZES_INTEL,
+                       0, nullptr, &sizes_bytes) == CL_SUCCESS &&
+       sizes_bytes >= sizeof(std::size_t))
+    {
+      std::vector<std::size_t> sizes(sizes_bytes / sizeof(std::size_t));
+      if(clGetDeviceInfo(device(), CL_DEVICE_SUB_GROUP_SIZES_INTEL,
+                         sizes_bytes, sizes.data(), nullptr) == CL_SUCCESS)
+      {
+        if(std::find(sizes.begin(), sizes.end(), 16) != sizes.end())
+          return 16;
+        return *std::max_element(sizes.begin(), sizes.end());
+      }
+    }
+  }
+
+  cl_uint size = 0;
+  if(detail::device_has_extension(device, "cl_nv_device_attribute_query") &&
+     clGetDeviceInfo(device(), CL_DEVICE_WARP_SIZE_NV,
+                     sizeof(cl_uint), &size, nullptr) == CL_SUCCESS)
+    return size;
+
+  if(detail::device_has_extension(device, "cl_amd_device_attribute_query") &&
+     clGetDeviceInfo(device(), CL_DEVICE_WAVEFRONT_WIDTH_AMD,
+                     sizeof(cl_uint), &size, nullptr) == CL_SUCCESS)
+    return size;
+
+  return 0;
+}
+
 /// The grouped depth first query engine is a depth-first query engine
 /// that can be faster than the relaxed and strict depth-first engines
 /// if 
@@ -56,11 +150,41 @@ namespace engine {
 /// the same work group want to access very different parts of the tree.
 /// At the node levels, a number of nodes will be loaded collectively into local
 /// memory where they are processed by the entire subgroup.
-/// Similarly, at the particle level particles are loaded collectively into local memory
-/// where they are processed by the entire subgroup.
+/// Similarly, the particles of selected leaf buckets are loaded collectively into
+/// local memory in batches of \c particle_batch_load_size particles,
+/// where they are processed by the entire subgroup. If the leaf buckets are
+/// smaller than a batch, a batch also covers the leaf buckets following
+/// the selected one.
 /// This means that the algorithm locally converges to the optimal brute-force
 /// local memory based algorithm if enough time is spent at the particle level.
 ///
+/// Since all work items of a subgroup share their path through the tree,
+/// the children of a node can only be visited in an order that is uniform
+/// across the subgroup. If the handler defines \c dfs_child_order
+/// (see \c depth_first), the subgroup therefore descends one level at a time,
+/// and the queries that have selected a node vote on the order of its
+/// children: the right child is visited first if more queries prefer it
+/// than the left child. For each level, the outcome of the vote is kept in
+/// one bit of the traversal state shared by the subgroup. In this mode,
+/// the \c node_batch_load_size and the \c vertical_level_stride_size are not
+/// used, except that \c node_batch_load_size must be at least 2 to cache
+/// both children.
+///
+/// If the device supports \c cl_khr_subgroups or \c cl_intel_subgroups and
+/// the native sub-groups of the kernel have exactly \c subgroup_size work items,
+/// the subgroups synchronize with \c sub_group_barrier() and use sub-group
+/// reductions and broadcasts instead of local memory. Otherwise, the engine
+/// falls back to local memory and relies on the \c group_coherence_size.
+/// On devices with \c cl_intel_required_subgroup_size, subgroup sizes of 8 and 16
+/// request a matching native sub-group size.
+/// Note that the default \c subgroup_size of 8 only matches the native
+/// sub-groups of some Intel devices. The native sub-groups are typically 16
+/// work items wide on Intel, 32 on NVIDIA and 64 on AMD GPUs (see
+/// \c get_native_subgroup_size()); in particular, native sub-groups that
+/// span the entire work group are used if \c subgroup_size equals
+/// \c group_size. The \c tuned_grouped_depth_first engine prefers parameter
+/// sets whose subgroup size matches the device.
+///
 /// This query engine satisfies the DFS query engine interface concept.
 /// \tparam Tree_type The tree type
 /// \tparam Handler_module The query handler. Must satisfy the DFS concept.
@@ -80,6 +204,15 @@ namespace engine {
 /// remove explicit synchronization (e.g. barrier()) calls if the synchronization
 /// is among that many work items. On nvidia GPUs, this should equal the warp size
 /// (typically 32), on AMD GPUs it should equal the wavefront size (typically 64).
+/// \tparam vertical_level_stride_size How many levels the subgroup descends at once
+/// \tparam Scheduling How the queries are distributed among the subgroups. With
+/// persistent scheduling, the subgroups fetch batches of \c subgroup_size
+/// adjacent queries, see \c query_scheduler.
+/// \tparam Instrumentation Whether the engine counts the visited nodes,
+/// tested particles and divergent steps of the queries, summed per
+/// subgroup, see \c get_instrumentation()
+/// \tparam Subgroup_operations Whether native sub-group operations may be
+/// used, see \c dfs_subgroup_operations
 template<class Tree_type,
          class Handler_module,
          std::size_t group_size = 64,
@@ -88,7 +221,10 @@ template<class Tree_type,
          std::size_t particle_batch_load_size = 8,
          std::size_t group_coherence_size = 32,
          std::size_t vertical_level_stride_size =
-            spatialcl::utils::binary::small_binary_logarithm<node_batch_load_size>::value
+            spatialcl::utils::binary::small_binary_logarithm<node_batch_load_size>::value,
+         dfs_scheduling Scheduling = DFS_SCHEDULING_STATIC,
+         dfs_instrumentation Instrumentation = DFS_INSTRUMENTATION_DISABLED,
+         dfs_subgroup_operations Subgroup_operations = DFS_SUBGROUPS_NATIVE
          >
 class grouped_depth_first
 {
@@ -104,6 +240,10 @@ public:
   using node_type0 = typename Tree_type::node_type0;
   using node_type1 = typename Tree_type::node_type1;
 
+  static constexpr std::size_t leaf_bucket_size = Tree_type::leaf_bucket_size;
+  static constexpr std::size_t leaf_bucket_depth =
+      spatialcl::utils::binary::small_binary_logarithm<leaf_bucket_size>::value;
+
   static_assert(group_size > 0, "group size must be > 0");
   static_assert(node_batch_load_size > 0, "node_batch_load_size must be > 0");
   static_assert(particle_batch_load_size > 0, "particle_batch_load_size must be > 0");
@@ -151,51 +291,89 @@ public:
                 subgroup_size >= particle_batch_load_size,
                 "Currently, the subgroup size cannot be smaller than the batch load size");
 
+  /// Compiles the query kernel without executing a query,
+  /// see \c spatialcl::precompile()
+  void precompile(const qcl::device_context_ptr& ctx)
+  {
+    query(ctx, cl::NDRange{1}, cl::NullRange);
+  }
+
   /// Execute query
+  /// \param evt If not \c nullptr, receives the event of the query kernel
+  /// \param wait_events If not \c nullptr, the query only starts once
+  /// these events have completed (see \c enqueue_wait_for_events())
   cl_int operator()(const Tree_type& tree,
                     Handler_module& handler,
-                    cl::Event* evt = nullptr)
+                    cl::Event* evt = nullptr,
+                    const event_list* wait_events = nullptr)
   {
     return this->run(tree.get_device_context(),
                      tree.get_sorted_particles(),
+                     get_particle_positions_if_available(tree),
                      tree.get_node_values0(),
                      tree.get_node_values1(),
                      tree.get_num_particles(),
-                     tree.get_effective_num_particles(),
                      tree.get_effective_num_levels(),
                      handler,
-                     evt);
+                     evt,
+                     wait_events);
   }
 
+  /// \return The traversal counters of the last query, with one entry
+  /// for each group of \c subgroup_size adjacent queries (i.e. the queries
+  /// \c subgroup_size*i to \c subgroup_size*(i+1)-1 for entry \c i).
+  /// Each entry is the sum of the counters of these queries, see
+  /// \c dfs_traversal_counters.
+  /// Only collected with \c DFS_INSTRUMENTATION_ENABLED.
+  const query_instrumentation<Instrumentation>& get_instrumentation() const
+  {
+    return _instrumentation;
+  }
 
 private:
   cl_int run(const qcl::device_context_ptr& ctx,
              const cl::Buffer& particles,
+             const cl::Buffer* particle_positions,
              const cl::Buffer& node_values0,
              const cl::Buffer& node_values1,
              std::size_t num_particles,
-             std::size_t effective_num_particles,
              std::size_t effective_num_levels,
              Handler_module& handler,
-             cl::Event* evt = nullptr)
+             cl::Event* evt = nullptr,
+             const event_list* wait_events = nullptr)
   {
+    enqueue_wait_for_events(ctx, wait_events);
+
+    const std::size_t global_size =
+        _scheduler.get_global_size(ctx,
+                                   handler.get_num_independent_queries(),
+                                   group_size);
+
     qcl::kernel_call call = query(ctx,
-                                  cl::NDRange{handler.get_num_independent_queries()},
+                                  cl::NDRange{global_size},
                                   cl::NDRange{group_size},
                                   evt);
 
 
-    call.partial_argument_list(particles,
-                               node_values0,
+    call.partial_argument_list(particles);
+    particle_access<Tree_type>::push_particle_positions(call, particle_positions);
+    call.partial_argument_list(node_values0,
                                node_values1,
                                static_cast<cl_ulong>(num_particles),
-                               static_cast<cl_ulong>(effective_num_particles),
                                static_cast<cl_ulong>(effective_num_levels));
+    _scheduler.push_arguments(ctx, call);
+    _instrumentation.push_arguments(ctx,
+                                    call,
+                                    handler.get_num_independent_queries(),
+                                    subgroup_size);
 
     handler.push_full_arguments(call);
     return call.enqueue_kernel();
   }
 
+  query_scheduler<Scheduling> _scheduler;
+  query_instrumentation<Instrumentation> _instrumentation;
+
   // In C++11, std::max is not constexpr (fixed in C++14).
   // We use the following workaround:
   template<class T>
@@ -212,6 +390,8 @@ private:
                                 node_type1_size));
 
   static constexpr std::size_t num_subgroups = group_size / subgroup_size;
+  static constexpr int allow_native_subgroups =
+      (Subgroup_operations == DFS_SUBGROUPS_NATIVE) ? 1 : 0;
   // Number of particle and node elements in the cache for each subgroup.
   // The +cache_data_unit-1 term rounds up the integer division to ensure
   // that there is always enough space allocated.
@@ -235,6 +415,9 @@ private:
   QCL_MAKE_SOURCE(
     QCL_INCLUDE_MODULE(tree_configuration<Tree_type>)
     QCL_INCLUDE_MODULE(Handler_module)
+    QCL_INCLUDE_MODULE(particle_access<Tree_type>)
+    QCL_INCLUDE_MODULE(query_scheduler<Scheduling>)
+    QCL_INCLUDE_MODULE(query_instrumentation<Instrumentation>)
     QCL_INCLUDE_MODULE(binary_tree)
     QCL_IMPORT_CONSTANT(group_size)
     QCL_IMPORT_CONSTANT(group_coherence_size)
@@ -243,12 +426,15 @@ private:
     QCL_IMPORT_CONSTANT(vertical_level_stride_size)
     QCL_IMPORT_CONSTANT(subgroup_size)
     QCL_IMPORT_CONSTANT(num_subgroups)
+    QCL_IMPORT_CONSTANT(allow_native_subgroups)
     QCL_IMPORT_CONSTANT(total_cache_size)
     QCL_IMPORT_CONSTANT(subgroup_cache_size)
     QCL_IMPORT_CONSTANT(particle_type_size)
     QCL_IMPORT_CONSTANT(node_type0_size)
     QCL_IMPORT_CONSTANT(node_type1_size)
     QCL_IMPORT_CONSTANT(required_node_type0_cache_size)
+    QCL_IMPORT_CONSTANT(leaf_bucket_size)
+    QCL_IMPORT_CONSTANT(leaf_bucket_depth)
     R"(
       #if subgroup_size < group_size
         // If we use multiple subgroups, we don't need barriers because
@@ -264,6 +450,63 @@ private:
         #define fast_barrier(flags) barrier(flags)
       #endif
 
+      #if allow_native_subgroups && \
+          (defined(cl_khr_subgroups) || defined(cl_intel_subgroups))
+        #ifdef cl_khr_subgroups
+          #pragma OPENCL EXTENSION cl_khr_subgroups : enable
+        #endif
+        #ifdef cl_intel_subgroups
+          #pragma OPENCL EXTENSION cl_intel_subgroups : enable
+        #endif
+
+        // The native sub-groups can only replace our subgroups if they
+        // consist of the same work items. As for the subgroups, we assume
+        // that consecutive work items form a sub-group.
+        #define native_subgroups_usable() \
+          (get_max_sub_group_size() == subgroup_size && \
+           get_num_sub_groups() == num_subgroups)
+
+        #define subgroup_native_min(x) sub_group_reduce_min(x)
+        #define subgroup_native_sum(x) sub_group_reduce_add(x)
+        #define subgroup_native_broadcast_first(x) sub_group_broadcast(x, 0)
+
+        // Chooses between real sub-group synchronization and the fallback.
+        // The condition is uniform across the work group.
+        #define subgroup_barrier(flags)           \
+          do {                                    \
+            if(native_subgroups_usable())         \
+              sub_group_barrier(flags);           \
+            else                                  \
+            { fast_barrier(flags); }              \
+          } while(0)
+      #else
+        #define native_subgroups_usable() 0
+        #define subgroup_native_min(x) (x)
+        #define subgroup_native_sum(x) (x)
+        #define subgroup_native_broadcast_first(x) (x)
+        #define subgroup_barrier(flags) fast_barrier(flags)
+      #endif
+
+      #if allow_native_subgroups && defined(cl_intel_required_subgroup_size) && \
+          (subgroup_size == 8 || subgroup_size == 16)
+        #define SUBGROUP_KERNEL_ATTRIBUTES \
+          __attribute__((intel_reqd_sub_group_size(subgroup_size)))
+      #else
+        #define SUBGROUP_KERNEL_ATTRIBUTES
+      #endif
+
+      #if defined(dfs_child_order) && node_batch_load_size < 2
+        #error The child order requires a node_batch_load_size of at least 2
+      #endif
+
+      #ifdef dfs_child_order
+        // For each level, a bit stores whether the subgroup has visited
+        // the right child of the current pair of siblings first.
+        #define DECLARE_GROUP_CHILD_ORDER_STATE ulong right_child_first_levels = 0
+      #else
+        #define DECLARE_GROUP_CHILD_ORDER_STATE
+      #endif
+
       #if particle_type_size >= node_type0_size && particle_type_size >= node_type1_size
         #define cache_unit_type particle_type
       #elif node_type0_size >= particle_type_size && node_type0_size >= node_type1_size
@@ -275,15 +518,20 @@ private:
     QCL_RAW(
       ulong get_node_index(binary_tree_key_t* node,
                            ulong effective_num_levels,
-                           ulong effective_num_particles)
+                           ulong num_particles)
       {
-        return binary_tree_key_encode_global_id(node,effective_num_levels)
-               - effective_num_particles;
+        return binary_tree_key_encode_node_index(node,
+                                                 effective_num_levels,
+                                                 num_particles,
+                                                 leaf_bucket_depth);
       }
 
       int subgroup_node_idx_min(volatile __local int* subgroup_mem,
                                 const size_t subgroup_lid)
       {
+        if(native_subgroups_usable())
+          return subgroup_native_min(subgroup_mem[subgroup_lid]);
+
         for(int i = subgroup_size/2; i > 0; i >>= 1)
         {
           if(subgroup_lid < i)
@@ -296,85 +544,124 @@ private:
         return result;
       }
 
+      int subgroup_int_sum(volatile __local int* subgroup_mem,
+                           const size_t subgroup_lid)
+      {
+        if(native_subgroups_usable())
+          return subgroup_native_sum(subgroup_mem[subgroup_lid]);
+
+        for(int i = subgroup_size/2; i > 0; i >>= 1)
+        {
+          if(subgroup_lid < i)
+            subgroup_mem[subgroup_lid] += subgroup_mem[subgroup_lid+i];
+          fast_barrier(CLK_LOCAL_MEM_FENCE);
+        }
+        int result = subgroup_mem[0];
+        fast_barrier(CLK_LOCAL_MEM_FENCE);
+        return result;
+      }
+
     )
-    QCL_PREPROCESSOR(define, get_query_id() tid)
+    R"(
+      #if persistent_scheduling
+        // The first work item of the subgroup fetches a batch of
+        // subgroup_size queries and broadcasts it to the subgroup
+        size_t subgroup_fetch_queries(__global uint* query_counter,
+                                      volatile __local uint* subgroup_queries_begin_ptr,
+                                      const size_t subgroup_lid)
+        {
+          if(native_subgroups_usable())
+          {
+            uint queries_begin = 0;
+            if(subgroup_lid == 0)
+              queries_begin = (uint)dfs_fetch_query_batch(subgroup_size);
+            return subgroup_native_broadcast_first(queries_begin);
+          }
+
+          // Make sure the previous batch has been read by all work items
+          fast_barrier(CLK_LOCAL_MEM_FENCE);
+          if(subgroup_lid == 0)
+            *subgroup_queries_begin_ptr = (uint)dfs_fetch_query_batch(subgroup_size);
+          fast_barrier(CLK_LOCAL_MEM_FENCE);
+          return *subgroup_queries_begin_ptr;
+        }
+
+        #define SUBGROUP_FIRST_QUERY() \
+          subgroup_fetch_queries(query_counter, subgroup_queries_begin_ptr, subgroup_lid)
+        #define SUBGROUP_NEXT_QUERY(queries_begin) SUBGROUP_FIRST_QUERY()
+      #else
+        #define SUBGROUP_FIRST_QUERY() (get_global_id(0) - subgroup_lid)
+        #define SUBGROUP_NEXT_QUERY(queries_begin) ((queries_begin) + get_global_size(0))
+      #endif
+    )"
+    QCL_PREPROCESSOR(define, get_query_id() query_id)
     QCL_PREPROCESSOR(define,
       QUERY_PARTICLE_LEVEL(particles,
-                           effective_num_particles,
                            num_particles,
                            effective_num_levels,
                            group_start_node,
                            num_covered_particles,
                            subgroup_lid,
-                           subgroup_selection_map,
                            subgroup_cache)
       {
-        volatile __local particle_type* subgroup_particle_cache =
-                         (__local particle_type*)subgroup_cache;
+        // Depending on the handler and the tree, the cache
+        // either contains the particles or only their positions
+        volatile __local dfs_cached_particle_type* subgroup_particle_cache =
+                         (__local dfs_cached_particle_type*)subgroup_cache;
 
         ulong particle_idx_begin = group_start_node.local_node_id;
-        const int num_available_particles = min((int)particle_batch_load_size, 
-                                                (int)(num_particles-num_covered_particles));
+        // Batches start at a leaf bucket and may extend into the following
+        // leaf buckets, which then need not be tested at the node level.
+        // Since the batch and bucket sizes are powers of two, a batch
+        // either ends at the end of a leaf bucket or within the bucket it
+        // started in.
+        const int num_available_particles =
+            (int)min((ulong)particle_batch_load_size,
+                     num_particles - particle_idx_begin);
         
         // Load particles collectively into the cache
         if(subgroup_lid < num_available_particles)
           subgroup_particle_cache[subgroup_lid] =
-                         particles[particle_idx_begin + subgroup_lid];
+                         DFS_LOAD_PARTICLE(particle_idx_begin + subgroup_lid);
 
-        //*subgroup_selection_map = 0;
-        subgroup_selection_map[subgroup_lid] = num_available_particles;
-        fast_barrier(CLK_LOCAL_MEM_FENCE);
+        subgroup_barrier(CLK_LOCAL_MEM_FENCE);
 
         // For each query, iterate over the particles in the
-        // cache and check if particles should be selected.
+        // cache and pass them to the particle processor.
         if(tid < get_num_queries())
         {
-          int any_particle_selected = 0;
+          DFS_COUNT_PARTICLES_TESTED(num_available_particles);
           for(int i = 0; i < num_available_particles; ++i)
           {
             int particle_selected = 0;
 
-            dfs_particle_processor(&particle_selected,
-                                   (particle_idx_begin + i),
-                                   subgroup_particle_cache[i]);
-
-            any_particle_selected |= particle_selected;
+            DFS_PROCESS_PARTICLE(&particle_selected,
+                                 (particle_idx_begin + i),
+                                 subgroup_particle_cache[i]);
           }
-
-          // If the query has decided to select some particle,
-          // mark this in the level state
-          if(any_particle_selected)
-            //*subgroup_selection_map = 1;
-            subgroup_selection_map[subgroup_lid] = -1;
         }
-        fast_barrier(CLK_LOCAL_MEM_FENCE);
+        subgroup_barrier(CLK_LOCAL_MEM_FENCE);
 
         // Update the local_node_id - from now on, it contains
         // the position where the next processed block would start
         // in case we remain at the particle level.
         group_start_node.local_node_id += num_available_particles;
+        num_covered_particles += num_available_particles;
 
-        //int go_up = !(*subgroup_selection_map);
-        int go_up = (subgroup_node_idx_min(subgroup_selection_map, subgroup_lid)!=-1);
-        fast_barrier(CLK_LOCAL_MEM_FENCE);
-
-        if(go_up)
+        // Once the last leaf bucket of the batch has been processed, the
+        // subgroup moves up to the next leaf bucket.
+        if((group_start_node.local_node_id & (leaf_bucket_size - 1)) == 0 ||
+           group_start_node.local_node_id >= num_particles)
         {
-          // No query/work item was interested in any particles from
-          // this region, so the entire work group should move up in the tree
-          //group_start_node.level--;
-          //group_start_node.local_node_id >>= 1;
-          group_start_node.level -= vertical_level_stride_size;
-          group_start_node.local_node_id >>= vertical_level_stride_size;
+          group_start_node.level -= leaf_bucket_depth;
+          group_start_node.local_node_id = (group_start_node.local_node_id + leaf_bucket_size - 1)
+                                         >> leaf_bucket_depth;
         }
-
-        num_covered_particles += num_available_particles;
       }
     )
     QCL_PREPROCESSOR(define,
       QUERY_NODE_LEVEL(node_values0,
                        node_values1,
-                       effective_num_particles,
                        num_particles,
                        effective_num_levels,
                        group_start_node,
@@ -392,13 +679,16 @@ private:
 
         const ulong node_idx_begin = get_node_index(&group_start_node,
                                                     effective_num_levels,
-                                                    effective_num_particles);
+                                                    num_particles);
         
         // The number of available nodes is either the distance to the next
         // aligned node or (if we are at the last segment before the data ends)
-        // the distance to the end of the data array
+        // the distance to the end of the level. The alignment refers to the
+        // position within the level, since the level offsets in the compact
+        // node storage are not aligned.
         const int num_available_nodes =
-            min((int)(node_batch_load_size - node_idx_begin % node_batch_load_size),
+            min((int)(node_batch_load_size -
+                      group_start_node.local_node_id % node_batch_load_size),
                 (int)(binary_tree_get_num_populated_nodes(group_start_node.level,
                                                           effective_num_levels,
                                                           num_particles) -
@@ -408,13 +698,16 @@ private:
         // Load nodes collectively into the cache
         if(subgroup_lid < num_available_nodes)
         {
-          node_values0_cache[subgroup_lid] =
-                             node_values0[node_idx_begin + subgroup_lid];
-          node_values1_cache[subgroup_lid] =
-                             node_values1[node_idx_begin + subgroup_lid];
+          load_tree_node(node_values0,
+                         node_values1,
+                         node_idx_begin + subgroup_lid,
+                         node_values0_cache + subgroup_lid,
+                         node_values1_cache + subgroup_lid);
         }
         subgroup_first_selected_nodes[subgroup_lid] = num_available_nodes;
-        fast_barrier(CLK_LOCAL_MEM_FENCE);
+        // The reduction below may overwrite the selection of this query
+        int query_first_selected_node = num_available_nodes;
+        subgroup_barrier(CLK_LOCAL_MEM_FENCE);
 
         // For each query, iterate over the nodes in the
         // cache and check if nodes should be selected.
@@ -432,18 +725,21 @@ private:
                               (node_idx_begin + i),
                               node_values0_cache[i],
                               node_values1_cache[i]);
+            DFS_COUNT_NODES_VISITED(1);
 
             // If the query has decided to select some nodes,
             // mark this work item as having selected nodes
             // in the first_selected_nodes local memory area
             if (node_selected)
             {
+              DFS_COUNT_NODES_SELECTED(1);
               subgroup_first_selected_nodes[subgroup_lid] = i;
+              query_first_selected_node = i;
               break;
             }
           }
         }
-        fast_barrier(CLK_LOCAL_MEM_FENCE);
+        subgroup_barrier(CLK_LOCAL_MEM_FENCE);
 
         // We must investigate deeper levels, if at least
         // one query of the subgroup wants to investigate deeper levels.
@@ -455,12 +751,22 @@ private:
         const int first_node = subgroup_node_idx_min(subgroup_first_selected_nodes,
                                                      subgroup_lid);
 
+        // The query is taken along to a node that it did not select
+        if(tid < get_num_queries())
+          DFS_COUNT_DIVERGENT_STEPS(first_node < num_available_nodes &&
+                                    query_first_selected_node != first_node);
+
         // Trigger the discard event for all skipped nodes
         if(tid < get_num_queries())
           for (int i = 0; i < first_node; ++i)
-            dfs_unique_node_discard_event(node_idx_begin + i,
-                                          node_values0_cache[i],
-                                          node_values1_cache[i]);
+          {
+            binary_tree_key_t discarded_node = group_start_node;
+            discarded_node.local_node_id += i;
+            DFS_DISCARD_NODE(&discarded_node,
+                             (node_idx_begin + i),
+                             node_values0_cache[i],
+                             node_values1_cache[i]);
+          }
 
         // Advance the number of covered particles
         num_covered_particles +=
@@ -473,9 +779,13 @@ private:
 
           // Calculate the vertical stride, i.e. how many levels we
           // are moving deeper. min() makes sure that we do not go deeper
-          // than the lowest level.
+          // than the leaf buckets. From a leaf bucket, we move directly
+          // to its particles.
+          const uint leaf_bucket_level = effective_num_levels - 1 - leaf_bucket_depth;
           uint vertical_stride = min((uint)vertical_level_stride_size, 
-                                     (uint)(effective_num_levels - group_start_node.level - 1));
+                                     (uint)(leaf_bucket_level - group_start_node.level));
+          if(group_start_node.level == leaf_bucket_level)
+            vertical_stride = leaf_bucket_depth;
 
           group_start_node.level += vertical_stride;
           group_start_node.local_node_id += first_node;
@@ -492,15 +802,257 @@ private:
         }
       }
     )
+    QCL_PREPROCESSOR(define,
+      ADVANCE_GROUP_IN_CHILD_ORDER(num_particles,
+                                   effective_num_levels,
+                                   group_start_node,
+                                   num_covered_particles)
+      {
+        // Only count the real particles, since the last
+        // node is not necessarily visited last
+        const ulong leaves_begin = binary_tree_get_leaves_begin(&group_start_node,
+                                                                effective_num_levels);
+        num_covered_particles += min(binary_tree_get_leaves_end(&group_start_node,
+                                                                effective_num_levels),
+                                     num_particles) - leaves_begin;
+
+        // Go up until we are at a node that has been visited before
+        // its (used) sibling, and continue with the sibling.
+        while(group_start_node.level > 0)
+        {
+          binary_tree_key_t sibling = group_start_node;
+          sibling.local_node_id ^= 1;
+
+          const int visited_first =
+              binary_tree_is_right_child(&group_start_node) ==
+              (int)((right_child_first_levels >> group_start_node.level) & 1);
+
+          if(visited_first &&
+             binary_tree_is_node_used(&sibling, effective_num_levels, num_particles))
+          {
+            group_start_node = sibling;
+            break;
+          }
+          group_start_node = binary_tree_get_parent(&group_start_node);
+        }
+      }
+    )
+    // Processes the node group_start_node with the entire subgroup. The node
+    // is descended into if any query selects it, and the children are then
+    // visited in the order preferred by the majority of the selecting queries.
+    // Selected leaf buckets are processed immediately, in batches of
+    // particle_batch_load_size particles.
+    QCL_PREPROCESSOR(define,
+      QUERY_NODE_IN_CHILD_ORDER(particles,
+                                node_values0,
+                                node_values1,
+                                num_particles,
+                                effective_num_levels,
+                                group_start_node,
+                                num_covered_particles,
+                                subgroup_lid,
+                                subgroup_votes,
+                                subgroup_cache)
+      {
+        __local node_type0* const node_values0_cache =
+                       (__local node_type0*)subgroup_cache;
+        __local node_type1* const node_values1_cache =
+                       (__local node_type1*)(subgroup_cache + required_node_type0_cache_size);
+
+        const ulong node_idx = get_node_index(&group_start_node,
+                                              effective_num_levels,
+                                              num_particles);
+
+        // Make sure that the cache of the previous step has been read
+        subgroup_barrier(CLK_LOCAL_MEM_FENCE);
+        if(subgroup_lid == 0)
+          load_tree_node(node_values0,
+                         node_values1,
+                         node_idx,
+                         node_values0_cache,
+                         node_values1_cache);
+        subgroup_barrier(CLK_LOCAL_MEM_FENCE);
+
+        int node_selected = 0;
+        if(tid < get_num_queries())
+        {
+          dfs_node_selector(&node_selected,
+                            &group_start_node,
+                            node_idx,
+                            node_values0_cache[0],
+                            node_values1_cache[0]);
+          DFS_COUNT_NODES_VISITED(1);
+          DFS_COUNT_NODES_SELECTED(node_selected != 0);
+        }
+
+        subgroup_votes[subgroup_lid] = node_selected ? 0 : 1;
+        subgroup_barrier(CLK_LOCAL_MEM_FENCE);
+        const int group_selected = (subgroup_node_idx_min(subgroup_votes,
+                                                          subgroup_lid) == 0);
+
+        // The query is taken along to a node that it did not select
+        if(tid < get_num_queries())
+          DFS_COUNT_DIVERGENT_STEPS(group_selected && !node_selected);
+
+        const uint leaf_bucket_level = effective_num_levels - 1 - leaf_bucket_depth;
+
+        if(group_selected && group_start_node.level < leaf_bucket_level)
+        {
+          binary_tree_key_t left_child = binary_tree_get_children_begin(&group_start_node);
+          binary_tree_key_t right_child = binary_tree_get_children_last(&group_start_node);
+
+          int right_child_first = 0;
+          if(binary_tree_is_node_used(&right_child, effective_num_levels, num_particles))
+          {
+            // Both children are consecutive in the node storage
+            const ulong left_child_idx = get_node_index(&left_child,
+                                                        effective_num_levels,
+                                                        num_particles);
+            if(subgroup_lid < 2)
+              load_tree_node(node_values0,
+                             node_values1,
+                             left_child_idx + subgroup_lid,
+                             node_values0_cache + subgroup_lid,
+                             node_values1_cache + subgroup_lid);
+            subgroup_barrier(CLK_LOCAL_MEM_FENCE);
+
+            int query_right_child_first = 0;
+            if(tid < get_num_queries() && node_selected)
+              dfs_child_order(&query_right_child_first,
+                              &left_child,
+                              node_values0_cache[0],
+                              node_values1_cache[0],
+                              node_values0_cache[1],
+                              node_values1_cache[1]);
+
+            // Queries that have not selected the node do not vote
+            subgroup_votes[subgroup_lid] =
+                node_selected ? (query_right_child_first ? 1 : -1) : 0;
+            subgroup_barrier(CLK_LOCAL_MEM_FENCE);
+            right_child_first = (subgroup_int_sum(subgroup_votes, subgroup_lid) > 0);
+          }
+
+          right_child_first_levels &= ~(1ul << left_child.level);
+          if(right_child_first)
+          {
+            right_child_first_levels |= 1ul << left_child.level;
+            group_start_node = right_child;
+          }
+          else
+            group_start_node = left_child;
+        }
+        else
+        {
+          if(group_selected)
+          {
+            volatile __local dfs_cached_particle_type* subgroup_particle_cache =
+                             (__local dfs_cached_particle_type*)subgroup_cache;
+
+            const ulong bucket_begin = binary_tree_get_leaves_begin(&group_start_node,
+                                                                    effective_num_levels);
+            const ulong bucket_end = min(binary_tree_get_leaves_end(&group_start_node,
+                                                                    effective_num_levels),
+                                         num_particles);
+
+            for(ulong batch_begin = bucket_begin;
+                batch_begin < bucket_end;
+                batch_begin += particle_batch_load_size)
+            {
+              const int num_available_particles =
+                  (int)min((ulong)particle_batch_load_size, bucket_end - batch_begin);
+
+              // The node values in the cache are not needed anymore
+              subgroup_barrier(CLK_LOCAL_MEM_FENCE);
+              if(subgroup_lid < num_available_particles)
+                subgroup_particle_cache[subgroup_lid] =
+                               DFS_LOAD_PARTICLE(batch_begin + subgroup_lid);
+              subgroup_barrier(CLK_LOCAL_MEM_FENCE);
+
+              if(tid < get_num_queries())
+              {
+                DFS_COUNT_PARTICLES_TESTED(num_available_particles);
+                for(int i = 0; i < num_available_particles; ++i)
+                {
+                  int particle_selected = 0;
+
+                  DFS_PROCESS_PARTICLE(&particle_selected,
+                                       (batch_begin + i),
+                                       subgroup_particle_cache[i]);
+                }
+              }
+            }
+          }
+          else if(tid < get_num_queries())
+          {
+            DFS_DISCARD_NODE(&group_start_node,
+                             node_idx,
+                             node_values0_cache[0],
+                             node_values1_cache[0]);
+          }
+
+          ADVANCE_GROUP_IN_CHILD_ORDER(num_particles,
+                                       effective_num_levels,
+                                       group_start_node,
+                                       num_covered_particles);
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      QUERY_IN_TREE_ORDER(particles,
+                          node_values0,
+                          node_values1,
+                          num_particles,
+                          effective_num_levels,
+                          group_start_node,
+                          num_covered_particles,
+                          subgroup_lid,
+                          subgroup_first_selected_nodes,
+                          subgroup_cache)
+      {
+        if (group_start_node.level == effective_num_levels - 1)
+        {
+          QUERY_PARTICLE_LEVEL(particles,
+                               num_particles,
+                               effective_num_levels,
+                               group_start_node,
+                               num_covered_particles,
+                               subgroup_lid,
+                               subgroup_cache);
+        }
+        else
+        {
+          QUERY_NODE_LEVEL(node_values0,
+                           node_values1,
+                           num_particles,
+                           effective_num_levels,
+                           group_start_node,
+                           num_covered_particles,
+                           subgroup_lid,
+                           subgroup_first_selected_nodes,
+                           subgroup_cache);
+        }
+      }
+    )
+    R"(
+      #ifdef dfs_child_order
+        #define QUERY_NEXT_STEP QUERY_NODE_IN_CHILD_ORDER
+      #else
+        #define QUERY_NEXT_STEP QUERY_IN_TREE_ORDER
+      #endif
+    )"
     QCL_RAW(
     
       __kernel void query(__global particle_type* particles,
-                          __global node_type0* restrict node_values0,
-                          __global node_type1* restrict node_values1,
+                          PARTICLE_POSITIONS_PARAMETER
+                          __global storage_node_type0* restrict node_values0,
+                          __global storage_node_type1* restrict node_values1,
                           ulong num_particles,
-                          ulong effective_num_particles,
                           ulong effective_num_levels,
+                          DFS_SCHEDULER_PARAMETER
+                          DFS_INSTRUMENTATION_PARAMETER
+                          DFS_QUERY_PERMUTATION_PARAMETER
                           declare_full_query_parameter_set())
+        SUBGROUP_KERNEL_ATTRIBUTES
       {
         __local int node_selection_map [group_size];
         // This cache will be used both for particles and nodes.
@@ -513,50 +1065,55 @@ private:
         const int subgroup_id = get_local_id(0) / subgroup_size;
         const int subgroup_lid = get_local_id(0) % subgroup_size;
 
+        const node_codec_state_t node_codec_state =
+            node_codec_init_state(node_values0, node_values1);
+
         volatile __local cache_unit_type* const subgroup_cache =
                   cache + subgroup_id * subgroup_cache_size;
         //volatile __local float* const subgroup_cache = cache + subgroup_id*subgroup_size*8;
         volatile __local int* const subgroup_node_selection_map =
                   node_selection_map + subgroup_id * subgroup_size;
+        // Only used with persistent scheduling
+        __local uint queries_begin_buffer [num_subgroups];
+        volatile __local uint* const subgroup_queries_begin_ptr =
+                  queries_begin_buffer + subgroup_id;
+
+        // All work items of a subgroup process adjacent queries
+        // and move through the tree together
+        for(size_t subgroup_queries_begin = SUBGROUP_FIRST_QUERY();
+            subgroup_queries_begin < get_num_queries();
+            subgroup_queries_begin = SUBGROUP_NEXT_QUERY(subgroup_queries_begin))
+        {
+          const size_t tid = subgroup_queries_begin + subgroup_lid;
+          DFS_DECLARE_QUERY_ID(tid);
 
-        size_t tid = get_global_id(0);
-
-        at_query_init();
+          at_query_init();
+          DFS_DECLARE_COUNTERS;
 
-        binary_tree_key_t group_start_node;
-        group_start_node.level = 0;
-        group_start_node.local_node_id = 0;
+          binary_tree_key_t group_start_node;
+          group_start_node.level = 0;
+          group_start_node.local_node_id = 0;
+          DECLARE_GROUP_CHILD_ORDER_STATE;
 
-        for(ulong num_covered_particles = 0;
-            num_covered_particles < num_particles;)
-        {
-          if (group_start_node.level == effective_num_levels - 1)
+          for(ulong num_covered_particles = 0;
+              num_covered_particles < num_particles;)
           {
-            QUERY_PARTICLE_LEVEL(particles,
-                                 effective_num_particles,
-                                 num_particles,
-                                 effective_num_levels,
-                                 group_start_node,
-                                 num_covered_particles,
-                                 subgroup_lid,
-                                 subgroup_node_selection_map,
-                                 subgroup_cache);
-          }
-          else
-          {
-            QUERY_NODE_LEVEL(node_values0,
-                             node_values1,
-                             effective_num_particles,
-                             num_particles,
-                             effective_num_levels,
-                             group_start_node,
-                             num_covered_particles,
-                             subgroup_lid,
-                             subgroup_node_selection_map,
-                             subgroup_cache);
+            QUERY_NEXT_STEP(particles,
+                            node_values0,
+                            node_values1,
+                            num_particles,
+                            effective_num_levels,
+                            group_start_node,
+                            num_covered_particles,
+                            subgroup_lid,
+                            subgroup_node_selection_map,
+                            subgroup_cache);
           }
+          at_query_exit();
+          // Each query adds its counters to the entry of its subgroup
+          if(tid < get_num_queries())
+            DFS_COMMIT_COUNTERS(subgroup_queries_begin / subgroup_size);
         }
-        at_query_exit();
       }
 
     )
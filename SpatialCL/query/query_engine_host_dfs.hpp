@@ -0,0 +1,412 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_ENGINE_HOST_DFS_HPP
+#define QUERY_ENGINE_HOST_DFS_HPP
+
+#include <QCL/qcl.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <thread>
+#include <vector>
+
+#include "../configuration.hpp"
+#include "../tree/binary_tree.hpp"
+#include "../binary_utils.hpp"
+
+namespace spatialcl {
+namespace query {
+namespace engine {
+
+/// Host copy of the sorted particles and the bounding boxes of a BVH,
+/// in the same compact layout as on the device. Since the full precision
+/// bounding boxes are copied, this works for all trees that provide
+/// \c get_bbox_min_corners() and \c get_bbox_max_corners().
+/// The mirror is not updated automatically: After the tree has been refitted
+/// or rebuilt, \c update() must be called.
+template<class Tree_type>
+class host_tree_mirror
+{
+public:
+  using type_system = typename Tree_type::type_system;
+  using particle_type = typename configuration<type_system>::particle_type;
+  using vector_type = typename configuration<type_system>::vector_type;
+
+  static constexpr std::size_t leaf_bucket_size = Tree_type::leaf_bucket_size;
+
+  explicit host_tree_mirror(const Tree_type& tree)
+  {
+    this->update(tree);
+  }
+
+  /// Downloads the particles and nodes of the tree again.
+  /// Blocks until the data is available.
+  void update(const Tree_type& tree)
+  {
+    _num_particles = tree.get_num_particles();
+    _effective_num_levels = tree.get_effective_num_levels();
+
+    _particles.resize(_num_particles);
+    _bbox_min_corners.resize(tree.get_num_nodes());
+    _bbox_max_corners.resize(tree.get_num_nodes());
+
+    download(tree, tree.get_sorted_particles(), _particles);
+    download(tree, tree.get_bbox_min_corners(), _bbox_min_corners);
+    download(tree, tree.get_bbox_max_corners(), _bbox_max_corners);
+  }
+
+  const std::vector<particle_type>& get_sorted_particles() const
+  {
+    return _particles;
+  }
+
+  const std::vector<vector_type>& get_bbox_min_corners() const
+  {
+    return _bbox_min_corners;
+  }
+
+  const std::vector<vector_type>& get_bbox_max_corners() const
+  {
+    return _bbox_max_corners;
+  }
+
+  std::size_t get_num_particles() const
+  {
+    return _num_particles;
+  }
+
+  std::size_t get_effective_num_levels() const
+  {
+    return _effective_num_levels;
+  }
+
+private:
+  template<class T>
+  static void download(const Tree_type& tree,
+                       const cl::Buffer& buffer,
+                       std::vector<T>& out)
+  {
+    if(out.empty())
+      return;
+
+    cl_int err = tree.get_device_context()->get_command_queue().enqueueReadBuffer(
+          buffer, CL_TRUE, 0, out.size() * sizeof(T), out.data());
+    qcl::check_cl_error(err, "Could not download tree data to the host");
+  }
+
+  std::size_t _num_particles;
+  std::size_t _effective_num_levels;
+
+  std::vector<particle_type> _particles;
+  std::vector<vector_type> _bbox_min_corners;
+  std::vector<vector_type> _bbox_max_corners;
+};
+
+/// Geometric tests for the host handlers. The tests are evaluated without
+/// branches over all components of the vectors, such that the compiler
+/// can evaluate each test with a few SIMD instructions.
+template<class Type_descriptor>
+struct host_geometry
+{
+  using scalar = typename Type_descriptor::scalar;
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+  using particle_type = typename configuration<Type_descriptor>::particle_type;
+
+  static constexpr std::size_t dimension = Type_descriptor::dimension;
+
+  static bool box_box_intersection(const vector_type& a_min,
+                                   const vector_type& a_max,
+                                   const vector_type& b_min,
+                                   const vector_type& b_max)
+  {
+    int result = 1;
+    for(std::size_t i = 0; i < dimension; ++i)
+      result &= static_cast<int>(a_min.s[i] <= b_max.s[i]) &
+                static_cast<int>(b_min.s[i] <= a_max.s[i]);
+    return result != 0;
+  }
+
+  static bool box_contains_particle(const vector_type& box_min,
+                                    const vector_type& box_max,
+                                    const particle_type& particle)
+  {
+    int result = 1;
+    for(std::size_t i = 0; i < dimension; ++i)
+      result &= static_cast<int>(box_min.s[i] <= particle.s[i]) &
+                static_cast<int>(particle.s[i] <= box_max.s[i]);
+    return result != 0;
+  }
+};
+
+/// Depth-first query on the host, intended for small batches of queries
+/// where the latency of a kernel launch and the transfers of the queries
+/// and results dominate. The traversal is the relaxed traversal of
+/// \c depth_first on a \c host_tree_mirror. Batches that are large enough
+/// are distributed among several threads, including the calling thread.
+/// Smaller batches run on the calling thread only, since starting a thread
+/// would take longer than the queries themselves.
+///
+/// Host handlers follow the semantics of the dfs handler concept,
+/// expressed as member functions:
+/// \code
+/// std::size_t get_num_queries() const;
+/// query_state at_query_init(std::size_t query_id);
+/// bool dfs_node_selector(query_state& state, std::size_t node_idx,
+///                        const vector_type& bbox_min_corner,
+///                        const vector_type& bbox_max_corner);
+/// void dfs_particle_processor(query_state& state, std::size_t particle_idx,
+///                             const particle_type& particle);
+/// void at_query_exit(query_state& state);
+/// \endcode
+/// where \c query_state holds the private state of one query. These
+/// functions are called concurrently for different queries.
+/// \tparam Tree_type The tree type of the mirror
+template<class Tree_type>
+class host_depth_first
+{
+public:
+  using particle_type = typename host_tree_mirror<Tree_type>::particle_type;
+  using vector_type = typename host_tree_mirror<Tree_type>::vector_type;
+
+  static constexpr std::size_t leaf_bucket_size = Tree_type::leaf_bucket_size;
+  static constexpr std::size_t leaf_bucket_depth =
+      spatialcl::utils::binary::small_binary_logarithm<leaf_bucket_size>::value;
+
+  /// \param max_num_threads The maximum number of threads
+  /// \param min_queries_per_thread Additional threads are only started
+  /// if each thread processes at least this many queries
+  explicit host_depth_first(std::size_t max_num_threads =
+                              std::max(std::thread::hardware_concurrency(), 1u),
+                            std::size_t min_queries_per_thread = 64)
+    : _max_num_threads{std::max<std::size_t>(max_num_threads, 1)},
+      _min_queries_per_thread{std::max<std::size_t>(min_queries_per_thread, 1)}
+  {}
+
+  /// Executes all queries of the handler. Blocks until the queries
+  /// have completed.
+  template<class Handler>
+  void operator()(const host_tree_mirror<Tree_type>& tree,
+                  Handler& handler) const
+  {
+    const std::size_t num_queries = handler.get_num_queries();
+    const std::size_t num_threads =
+        std::max<std::size_t>(std::min(_max_num_threads,
+                                       num_queries / _min_queries_per_thread), 1);
+
+    auto run_queries = [&](std::size_t thread_id){
+      for(std::size_t query_id = thread_id;
+          query_id < num_queries;
+          query_id += num_threads)
+        this->run_query(tree, handler, query_id);
+    };
+
+    // The calling thread processes the queries of the first thread
+    std::vector<std::thread> threads;
+    for(std::size_t thread_id = 1; thread_id < num_threads; ++thread_id)
+      threads.push_back(std::thread{run_queries, thread_id});
+
+    run_queries(0);
+
+    for(std::thread& t : threads)
+      t.join();
+  }
+
+private:
+  template<class Handler>
+  void run_query(const host_tree_mirror<Tree_type>& tree,
+                 Handler& handler,
+                 std::size_t query_id) const
+  {
+    auto state = handler.at_query_init(query_id);
+
+    const std::size_t num_particles = tree.get_num_particles();
+    const std::size_t num_levels = tree.get_effective_num_levels();
+    const unsigned leaf_bucket_level =
+        static_cast<unsigned>(num_levels - 1 - leaf_bucket_depth);
+
+    const std::vector<particle_type>& particles = tree.get_sorted_particles();
+    const std::vector<vector_type>& bbox_min_corners = tree.get_bbox_min_corners();
+    const std::vector<vector_type>& bbox_max_corners = tree.get_bbox_max_corners();
+
+    unsigned level = 0;
+    std::size_t local_node_id = 0;
+    std::size_t num_covered_particles = 0;
+
+    while(num_covered_particles < num_particles)
+    {
+      const std::size_t node_idx = binary_tree::get_node_index(level,
+                                                               local_node_id,
+                                                               num_levels,
+                                                               num_particles,
+                                                               leaf_bucket_size);
+
+      const bool node_selected = handler.dfs_node_selector(state,
+                                                           node_idx,
+                                                           bbox_min_corners[node_idx],
+                                                           bbox_max_corners[node_idx]);
+
+      if(node_selected && level < leaf_bucket_level)
+      {
+        // Descend to the left child
+        ++level;
+        local_node_id <<= 1;
+        continue;
+      }
+
+      const std::size_t leaves_per_node = std::size_t{1} << (num_levels - 1 - level);
+      if(node_selected)
+      {
+        // Process all particles of the bucket linearly
+        const std::size_t particles_begin = local_node_id * leaves_per_node;
+        const std::size_t particles_end = std::min(particles_begin + leaf_bucket_size,
+                                                   num_particles);
+        for(std::size_t particle_idx = particles_begin;
+            particle_idx < particles_end;
+            ++particle_idx)
+          handler.dfs_particle_processor(state, particle_idx, particles[particle_idx]);
+      }
+
+      num_covered_particles += leaves_per_node;
+
+      // Continue with the sibling, or with the parent's
+      // sibling if this is a right child
+      if(local_node_id & 1)
+      {
+        --level;
+        local_node_id >>= 1;
+      }
+      ++local_node_id;
+    }
+
+    handler.at_query_exit(state);
+  }
+
+  std::size_t _max_num_threads;
+  std::size_t _min_queries_per_thread;
+};
+
+}
+
+/// Host handler for box range queries, with the same results as
+/// \c box_range_query: For query i, the selected particles are stored
+/// at the positions [i*Max_retrieved_particles, (i+1)*Max_retrieved_particles)
+/// of the results, and their number (at most \c Max_retrieved_particles)
+/// at position i of the numbers of results.
+template<class Type_descriptor,
+         std::size_t Max_retrieved_particles>
+class host_box_range_query
+{
+public:
+  static constexpr std::size_t max_retrieved_particles = Max_retrieved_particles;
+
+  using particle_type = typename configuration<Type_descriptor>::particle_type;
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+  using geometry = engine::host_geometry<Type_descriptor>;
+
+  struct query_state
+  {
+    std::size_t query_id;
+    vector_type range_min;
+    vector_type range_max;
+    cl_uint num_selected_particles;
+  };
+
+  /// Resizes the result vectors to fit the results of all queries
+  host_box_range_query(const std::vector<vector_type>& query_ranges_min,
+                       const std::vector<vector_type>& query_ranges_max,
+                       std::vector<particle_type>& result_retrieved_particles,
+                       std::vector<cl_uint>& result_num_retrieved_particles)
+    : _query_ranges_min{&query_ranges_min},
+      _query_ranges_max{&query_ranges_max},
+      _result{&result_retrieved_particles},
+      _num_selected_particles{&result_num_retrieved_particles}
+  {
+    assert(query_ranges_min.size() == query_ranges_max.size());
+
+    _result->resize(query_ranges_min.size() * max_retrieved_particles);
+    _num_selected_particles->resize(query_ranges_min.size());
+  }
+
+  std::size_t get_num_queries() const
+  {
+    return _query_ranges_min->size();
+  }
+
+  query_state at_query_init(std::size_t query_id) const
+  {
+    query_state state;
+    state.query_id = query_id;
+    state.range_min = (*_query_ranges_min)[query_id];
+    state.range_max = (*_query_ranges_max)[query_id];
+    state.num_selected_particles = 0;
+    return state;
+  }
+
+  bool dfs_node_selector(query_state& state,
+                         std::size_t node_idx,
+                         const vector_type& bbox_min_corner,
+                         const vector_type& bbox_max_corner) const
+  {
+    return geometry::box_box_intersection(bbox_min_corner,
+                                          bbox_max_corner,
+                                          state.range_min,
+                                          state.range_max);
+  }
+
+  void dfs_particle_processor(query_state& state,
+                              std::size_t particle_idx,
+                              const particle_type& particle) const
+  {
+    if(geometry::box_contains_particle(state.range_min, state.range_max, particle))
+    {
+      if(state.num_selected_particles < max_retrieved_particles)
+      {
+        (*_result)[state.query_id * max_retrieved_particles
+                   + state.num_selected_particles] = particle;
+        ++state.num_selected_particles;
+      }
+    }
+  }
+
+  void at_query_exit(query_state& state) const
+  {
+    (*_num_selected_particles)[state.query_id] = state.num_selected_particles;
+  }
+
+private:
+  const std::vector<vector_type>* _query_ranges_min;
+  const std::vector<vector_type>* _query_ranges_max;
+  std::vector<particle_type>* _result;
+  std::vector<cl_uint>* _num_selected_particles;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,681 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_ENGINE_TUNED_GROUPED_DFS_HPP
+#define QUERY_ENGINE_TUNED_GROUPED_DFS_HPP
+
+#include <QCL/qcl.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "../async.hpp"
+#include "../binary_utils.hpp"
+#include "../file_utils.hpp"
+#include "query_engine_grouped_dfs.hpp"
+
+namespace spatialcl {
+namespace query {
+namespace engine {
+
+namespace detail {
+
+template<std::size_t N, bool Is_power2 = utils::binary::is_small_power2<N>::value>
+struct binary_logarithm_if_valid
+{
+  static constexpr std::size_t value = utils::binary::small_binary_logarithm<N>::value;
+};
+
+template<std::size_t N>
+struct binary_logarithm_if_valid<N, false>
+{
+  static constexpr std::size_t value = 0;
+};
+
+}
+
+/// One set of template parameters of \c grouped_depth_first, see
+/// its documentation for the meaning of the parameters. Unlike the engine,
+/// parameter sets may be invalid, such that parameter spaces can be written
+/// as cartesian products. Invalid parameter sets are skipped by the tuner
+/// and never instantiate the engine.
+template<std::size_t Group_size,
+         std::size_t Subgroup_size,
+         std::size_t Node_batch_load_size,
+         std::size_t Particle_batch_load_size,
+         std::size_t Group_coherence_size,
+         std::size_t Vertical_level_stride_size =
+           detail::binary_logarithm_if_valid<Node_batch_load_size>::value>
+struct grouped_dfs_parameters
+{
+  static constexpr std::size_t group_size = Group_size;
+  static constexpr std::size_t subgroup_size = Subgroup_size;
+  static constexpr std::size_t node_batch_load_size = Node_batch_load_size;
+  static constexpr std::size_t particle_batch_load_size = Particle_batch_load_size;
+  static constexpr std::size_t group_coherence_size = Group_coherence_size;
+  static constexpr std::size_t vertical_level_stride_size = Vertical_level_stride_size;
+
+  /// Whether the parameters satisfy the static assertions
+  /// of \c grouped_depth_first
+  static constexpr bool is_valid =
+      Group_size > 0 && Subgroup_size > 0 &&
+      Node_batch_load_size > 0 && Particle_batch_load_size > 0 &&
+      Group_coherence_size > 0 && Vertical_level_stride_size > 0 &&
+      utils::binary::is_small_power2<Group_size>::value &&
+      utils::binary::is_small_power2<Node_batch_load_size>::value &&
+      utils::binary::is_small_power2<Particle_batch_load_size>::value &&
+      Particle_batch_load_size <= Group_size &&
+      Node_batch_load_size <= Group_size &&
+      Particle_batch_load_size >= Node_batch_load_size &&
+      Vertical_level_stride_size <=
+        detail::binary_logarithm_if_valid<Node_batch_load_size>::value &&
+      Subgroup_size <= Group_size &&
+      (Subgroup_size <= Group_coherence_size || Subgroup_size == Group_size) &&
+      (Group_coherence_size % Subgroup_size == 0 || Subgroup_size == Group_size) &&
+      Group_size % Subgroup_size == 0 &&
+      Subgroup_size >= Node_batch_load_size &&
+      Subgroup_size >= Particle_batch_load_size;
+
+  template<class Tree_type, class Handler_module>
+  using engine_type = grouped_depth_first<Tree_type,
+                                          Handler_module,
+                                          Group_size,
+                                          Subgroup_size,
+                                          Node_batch_load_size,
+                                          Particle_batch_load_size,
+                                          Group_coherence_size,
+                                          Vertical_level_stride_size>;
+
+  /// \return A name that identifies the parameters in a tuning database,
+  /// e.g. \c "g64_s8_n8_p8_c32_v3"
+  static std::string get_name()
+  {
+    std::stringstream sstr;
+    sstr << "g" << Group_size
+         << "_s" << Subgroup_size
+         << "_n" << Node_batch_load_size
+         << "_p" << Particle_batch_load_size
+         << "_c" << Group_coherence_size
+         << "_v" << Vertical_level_stride_size;
+    return sstr.str();
+  }
+};
+
+/// The candidate parameter sets of a \c tuned_grouped_depth_first engine.
+/// Without tuning results, the parameter set is selected as described in
+/// \c tuned_grouped_depth_first.
+template<class... Parameter_sets>
+struct grouped_dfs_parameter_space
+{};
+
+/// Covers the group sizes from 32 to 256, subgroups from 8 work items to
+/// the full work group, and group coherence sizes of 32 (NVIDIA warps,
+/// Intel) and 64 (AMD wavefronts). The first set equals the default
+/// parameters of \c grouped_depth_first.
+using default_grouped_dfs_parameter_space = grouped_dfs_parameter_space
+  <
+    grouped_dfs_parameters< 64,  8,  8,  8, 32>,
+    grouped_dfs_parameters< 32,  8,  8,  8, 32>,
+    grouped_dfs_parameters<128,  8,  8,  8, 32>,
+    grouped_dfs_parameters<256,  8,  8,  8, 32>,
+    grouped_dfs_parameters< 64,  8,  8,  8, 32, 1>,
+    grouped_dfs_parameters< 64, 16,  8, 16, 32>,
+    grouped_dfs_parameters< 64, 16, 16, 16, 32>,
+    grouped_dfs_parameters<128, 16, 16, 16, 32>,
+    grouped_dfs_parameters< 64, 32, 16, 32, 32>,
+    grouped_dfs_parameters<128, 32, 32, 32, 32>,
+    grouped_dfs_parameters< 32, 32,  8,  8, 32>,
+    grouped_dfs_parameters< 64,  8,  8,  8, 64>,
+    grouped_dfs_parameters<128, 16, 16, 16, 64>,
+    grouped_dfs_parameters<256, 64, 16, 32, 64>,
+    grouped_dfs_parameters< 64, 64, 16, 16, 64>
+  >;
+
+/// Stores the fastest parameter set of \c tuned_grouped_depth_first for
+/// each device and workload, such that the tuning only needs to be carried
+/// out once per device. The database is stored as a text file with one
+/// line (device, workload, parameters, time) per tuned workload, separated
+/// by tabs. Devices are identified by their name and their device and
+/// driver versions, since different drivers may favor different parameters.
+class grouped_dfs_tuning_database
+{
+public:
+  /// Creates an empty database that is not associated with a file
+  grouped_dfs_tuning_database() = default;
+
+  /// Loads the database from \c filename, if the file exists.
+  /// Otherwise, the database is empty and created by \c save().
+  /// \throws std::runtime_error if the file exists but is malformed
+  explicit grouped_dfs_tuning_database(const std::string& filename)
+    : _filename{filename}
+  {
+    std::ifstream file{filename.c_str()};
+    if(!file.is_open())
+      return;
+
+    std::string line;
+    while(std::getline(file, line))
+    {
+      if(line.empty())
+        continue;
+
+      std::vector<std::string> fields;
+      std::stringstream sstr{line};
+      std::string field;
+      while(std::getline(sstr, field, '\t'))
+        fields.push_back(field);
+
+      if(fields.size() != 4)
+        throw std::runtime_error{"Invalid entry in tuning database " + filename};
+
+      entry e;
+      e.parameters = fields[2];
+      e.seconds = std::strtod(fields[3].c_str(), nullptr);
+      _entries[std::make_pair(fields[0], fields[1])] = e;
+    }
+  }
+
+  /// \return A key that identifies the device of \c ctx
+  static std::string get_device_key(const qcl::device_context_ptr& ctx)
+  {
+    const cl::Device& device = ctx->get_device();
+    // Tabs would break the file format
+    std::string key = device.getInfo<CL_DEVICE_NAME>() + " / " +
+                      device.getInfo<CL_DEVICE_VERSION>() + " / " +
+                      device.getInfo<CL_DRIVER_VERSION>();
+    for(char& c : key)
+      if(c == '\t' || c == '\n' || c == '\0')
+        c = ' ';
+    return key;
+  }
+
+  /// Looks up the fastest parameters for a workload on a device
+  /// \return Whether the workload has been tuned on the device
+  bool lookup(const std::string& device_key,
+              const std::string& workload,
+              std::string& parameters_out) const
+  {
+    auto it = _entries.find(std::make_pair(device_key, workload));
+    if(it == _entries.end())
+      return false;
+    parameters_out = it->second.parameters;
+    return true;
+  }
+
+  /// Sets the fastest parameters for a workload on a device,
+  /// replacing previous results
+  void store(const std::string& device_key,
+             const std::string& workload,
+             const std::string& parameters,
+             double seconds)
+  {
+    entry e;
+    e.parameters = parameters;
+    e.seconds = seconds;
+    _entries[std::make_pair(device_key, workload)] = e;
+  }
+
+  /// Writes the database to the file it has been loaded from
+  /// \throws std::runtime_error if the database is not associated
+  /// with a file, or if the file cannot be written
+  void save() const
+  {
+    if(_filename.empty())
+      throw std::runtime_error{"Tuning database is not associated with a file"};
+    this->save(_filename);
+  }
+
+  /// Writes the database to \c filename. The database is written to a
+  /// temporary file that is then renamed to \c filename, so that a program
+  /// loading the database at the same time either sees the old or the new
+  /// database. If several processes save concurrently, the last rename wins
+  /// and the entries added by the other processes are lost; they are
+  /// tuned again when needed.
+  /// \throws std::runtime_error if the file cannot be written
+  void save(const std::string& filename) const
+  {
+    const std::string temporary_filename =
+        utils::file::get_unique_temporary_filename(filename);
+    bool success = false;
+    {
+      std::ofstream file{temporary_filename.c_str(), std::ios::trunc};
+      if(!file.is_open())
+        throw std::runtime_error{"Could not open tuning database " + filename};
+
+      file.precision(9);
+      for(const auto& e : _entries)
+        file << e.first.first << "\t" << e.first.second << "\t"
+             << e.second.parameters << "\t" << e.second.seconds << "\n";
+
+      success = file.good();
+    }
+    if(!success || std::rename(temporary_filename.c_str(), filename.c_str()) != 0)
+    {
+      std::remove(temporary_filename.c_str());
+      throw std::runtime_error{"Could not write tuning database " + filename};
+    }
+  }
+
+private:
+  struct entry
+  {
+    std::string parameters;
+    double seconds;
+  };
+
+  std::string _filename;
+  std::map<std::pair<std::string, std::string>, entry> _entries;
+};
+
+/// The runtime of one parameter set, as measured by
+/// \c tuned_grouped_depth_first::tune()
+struct grouped_dfs_tuning_result
+{
+  std::string parameters;
+  /// The average runtime of the query, or infinity if the
+  /// parameters cannot be used on the device
+  double seconds;
+};
+
+namespace detail {
+
+/// Wraps the engine of a valid parameter set. Invalid
+/// parameter sets do not instantiate the engine.
+template<class Parameters,
+         class Tree_type,
+         class Handler_module,
+         bool Is_valid = Parameters::is_valid>
+class grouped_dfs_candidate
+{
+public:
+  static constexpr bool is_valid = true;
+  static constexpr std::size_t group_size = Parameters::group_size;
+
+  void precompile(const qcl::device_context_ptr& ctx)
+  {
+    _engine.precompile(ctx);
+  }
+
+  cl_int operator()(const Tree_type& tree,
+                    Handler_module& handler,
+                    cl::Event* evt,
+                    const event_list* wait_events)
+  {
+    return _engine(tree, handler, evt, wait_events);
+  }
+
+private:
+  typename Parameters::template engine_type<Tree_type, Handler_module> _engine;
+};
+
+template<class Parameters, class Tree_type, class Handler_module>
+class grouped_dfs_candidate<Parameters, Tree_type, Handler_module, false>
+{
+public:
+  static constexpr bool is_valid = false;
+  static constexpr std::size_t group_size = Parameters::group_size;
+
+  void precompile(const qcl::device_context_ptr&)
+  {}
+
+  cl_int operator()(const Tree_type&,
+                    Handler_module&,
+                    cl::Event*,
+                    const event_list*)
+  {
+    return CL_INVALID_OPERATION;
+  }
+};
+
+/// Applies \c f to the candidate \c idx of a tuple of candidates. C++11 has
+/// no generic lambdas, so the functors are classes with templated call operators.
+template<std::size_t I, std::size_t N>
+struct candidate_dispatch
+{
+  template<class Candidate_tuple, class F>
+  static void apply(Candidate_tuple& candidates, std::size_t idx, F& f)
+  {
+    if(idx == I)
+      f(std::get<I>(candidates));
+    else
+      candidate_dispatch<I + 1, N>::apply(candidates, idx, f);
+  }
+};
+
+template<std::size_t N>
+struct candidate_dispatch<N, N>
+{
+  template<class Candidate_tuple, class F>
+  static void apply(Candidate_tuple&, std::size_t, F&)
+  {
+    throw std::out_of_range{"Invalid grouped_depth_first candidate"};
+  }
+};
+
+}
+
+template<class Tree_type,
+         class Handler_module,
+         class Parameter_space = default_grouped_dfs_parameter_space>
+class tuned_grouped_depth_first;
+
+/// Wraps one \c grouped_depth_first engine for each parameter set of
+/// \c Parameter_space and executes queries with the parameters selected for
+/// the device, which are determined by \c tune() or loaded from a
+/// \c grouped_dfs_tuning_database. On devices without tuning results,
+/// the first valid parameter set whose subgroup size equals the native
+/// sub-group size of the device (see \c get_native_subgroup_size()) is used,
+/// such that the engine can use native sub-group operations. If there is no
+/// such parameter set, or the native sub-group size is unknown, the first
+/// valid parameter set is used. The query kernels are only compiled
+/// for the candidates that are tuned or selected.
+///
+/// Since the best parameters depend on the queries, tuning results are stored
+/// under a workload name, e.g. \c "knn8" and \c "range_small". Workloads
+/// should be tuned with representative queries and tree sizes.
+///
+/// Apart from being default constructible with a workload name, this engine
+/// satisfies the DFS query engine interface concept.
+template<class Tree_type,
+         class Handler_module,
+         class... Parameter_sets>
+class tuned_grouped_depth_first<Tree_type,
+                                Handler_module,
+                                grouped_dfs_parameter_space<Parameter_sets...>>
+{
+public:
+  using handler_type = Handler_module;
+  using type_system = typename Tree_type::type_system;
+
+  static constexpr std::size_t num_candidates = sizeof...(Parameter_sets);
+
+  static_assert(num_candidates > 0, "The parameter space must not be empty");
+
+  /// \param workload The name under which tuning results are looked up
+  /// and stored
+  /// \param database If not \c nullptr, the parameters are loaded from
+  /// this database and the results of \c tune() are stored in it
+  explicit tuned_grouped_depth_first(
+      const std::string& workload = "default",
+      const std::shared_ptr<grouped_dfs_tuning_database>& database = nullptr)
+    : _workload{workload},
+      _database{database}
+  {}
+
+  /// \return The names of all parameter sets (including invalid ones)
+  static std::vector<std::string> get_parameter_names()
+  {
+    return std::vector<std::string>{Parameter_sets::get_name()...};
+  }
+
+  /// \return The name of the parameters that are used on the device of \c ctx
+  std::string get_selected_parameters(const qcl::device_context_ptr& ctx)
+  {
+    return get_parameter_names()[this->select(ctx)];
+  }
+
+  /// Compiles the query kernel of the selected parameters
+  void precompile(const qcl::device_context_ptr& ctx)
+  {
+    precompile_functor f{ctx};
+    detail::candidate_dispatch<0, num_candidates>::apply(_candidates, this->select(ctx), f);
+  }
+
+  /// Execute query, see \c grouped_depth_first::operator()
+  cl_int operator()(const Tree_type& tree,
+                    Handler_module& handler,
+                    cl::Event* evt = nullptr,
+                    const event_list* wait_events = nullptr)
+  {
+    query_functor f{tree, handler, evt, wait_events};
+    detail::candidate_dispatch<0, num_candidates>::apply(
+          _candidates, this->select(tree.get_device_context()), f);
+    return f.err;
+  }
+
+  /// Executes the queries of \c handler with all valid parameter sets and
+  /// selects the fastest for the device of \c tree. If a database has
+  /// been set, the result is stored in it (but not saved to disk).
+  /// Parameter sets that cannot be executed on the device, e.g. because the
+  /// group size exceeds the maximum work group size, are skipped. The
+  /// compilation of the kernels is not included in the measured times.
+  /// Note: This function blocks until all measurements are finished,
+  /// and may take several seconds due to the kernel compilations.
+  /// \param num_runs The number of timed queries per parameter set
+  /// \return The measured times of all parameter sets
+  std::vector<grouped_dfs_tuning_result> tune(const Tree_type& tree,
+                                              Handler_module& handler,
+                                              std::size_t num_runs = 5)
+  {
+    const qcl::device_context_ptr& ctx = tree.get_device_context();
+    const std::vector<std::string> names = get_parameter_names();
+
+    std::vector<grouped_dfs_tuning_result> results;
+    std::size_t best_candidate = num_candidates;
+    double best_time = std::numeric_limits<double>::infinity();
+
+    for(std::size_t i = 0; i < num_candidates; ++i)
+    {
+      tuning_functor f{tree, handler, num_runs};
+      detail::candidate_dispatch<0, num_candidates>::apply(_candidates, i, f);
+
+      if(f.is_valid)
+        results.push_back(grouped_dfs_tuning_result{names[i], f.seconds});
+
+      if(f.seconds < best_time)
+      {
+        best_time = f.seconds;
+        best_candidate = i;
+      }
+    }
+
+    if(best_candidate == num_candidates)
+      throw std::runtime_error{"No grouped_depth_first parameter set could be executed"};
+
+    _selection[get_device_id(ctx)] = best_candidate;
+    if(_database)
+      _database->store(grouped_dfs_tuning_database::get_device_key(ctx),
+                       _workload,
+                       names[best_candidate],
+                       best_time);
+    return results;
+  }
+
+private:
+  using candidate_tuple = std::tuple<
+    detail::grouped_dfs_candidate<Parameter_sets, Tree_type, Handler_module>...
+  >;
+
+  struct precompile_functor
+  {
+    const qcl::device_context_ptr& ctx;
+
+    template<class Candidate>
+    void operator()(Candidate& candidate)
+    {
+      candidate.precompile(ctx);
+    }
+  };
+
+  struct query_functor
+  {
+    const Tree_type& tree;
+    Handler_module& handler;
+    cl::Event* evt;
+    const event_list* wait_events;
+    cl_int err;
+
+    query_functor(const Tree_type& t, Handler_module& h,
+                  cl::Event* e, const event_list* w)
+      : tree(t), handler(h), evt{e}, wait_events{w}, err{CL_SUCCESS}
+    {}
+
+    template<class Candidate>
+    void operator()(Candidate& candidate)
+    {
+      err = candidate(tree, handler, evt, wait_events);
+    }
+  };
+
+  struct tuning_functor
+  {
+    const Tree_type& tree;
+    Handler_module& handler;
+    std::size_t num_runs;
+    bool is_valid;
+    double seconds;
+
+    tuning_functor(const Tree_type& t, Handler_module& h, std::size_t runs)
+      : tree(t), handler(h), num_runs{runs}, is_valid{false},
+        seconds{std::numeric_limits<double>::infinity()}
+    {}
+
+    template<class Candidate>
+    void operator()(Candidate& candidate)
+    {
+      if(!Candidate::is_valid)
+        return;
+      is_valid = true;
+
+      const qcl::device_context_ptr& ctx = tree.get_device_context();
+      if(Candidate::group_size >
+         ctx->get_device().getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>())
+        return;
+
+      try
+      {
+        candidate.precompile(ctx);
+
+        // The first query is not timed, since it may
+        // include the allocation of internal buffers
+        if(candidate(tree, handler, nullptr, nullptr) != CL_SUCCESS ||
+           ctx->get_command_queue().finish() != CL_SUCCESS)
+          return;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for(std::size_t run = 0; run < num_runs; ++run)
+          if(candidate(tree, handler, nullptr, nullptr) != CL_SUCCESS)
+            return;
+        if(ctx->get_command_queue().finish() != CL_SUCCESS)
+          return;
+        auto stop = std::chrono::high_resolution_clock::now();
+
+        const auto ticks =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+        seconds = static_cast<double>(ticks) * 1.e-9 /
+                  static_cast<double>(std::max<std::size_t>(num_runs, 1));
+      }
+      catch(std::exception&)
+      {
+        // E.g. the kernel requires too many resources on this device
+        seconds = std::numeric_limits<double>::infinity();
+      }
+    }
+  };
+
+  static cl_device_id get_device_id(const qcl::device_context_ptr& ctx)
+  {
+    return ctx->get_device()();
+  }
+
+  /// \return The first valid candidate that matches the native sub-group
+  /// size of the device and fits into a work group, or the first valid
+  /// candidate if there is none
+  static std::size_t get_default_candidate(const qcl::device_context_ptr& ctx)
+  {
+    const bool is_valid [] = {Parameter_sets::is_valid...};
+    const std::size_t subgroup_sizes [] = {Parameter_sets::subgroup_size...};
+    const std::size_t group_sizes [] = {Parameter_sets::group_size...};
+
+    const std::size_t native_subgroup_size = get_native_subgroup_size(ctx);
+    const std::size_t max_group_size =
+        ctx->get_device().getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    if(native_subgroup_size > 0)
+      for(std::size_t i = 0; i < num_candidates; ++i)
+        if(is_valid[i] &&
+           subgroup_sizes[i] == native_subgroup_size &&
+           group_sizes[i] <= max_group_size)
+          return i;
+
+    for(std::size_t i = 0; i < num_candidates; ++i)
+      if(is_valid[i])
+        return i;
+    throw std::runtime_error{"The parameter space contains no valid parameter set"};
+  }
+
+  std::size_t select(const qcl::device_context_ptr& ctx)
+  {
+    const cl_device_id device = get_device_id(ctx);
+    auto it = _selection.find(device);
+    if(it != _selection.end())
+      return it->second;
+
+    std::size_t candidate = get_default_candidate(ctx);
+
+    std::string parameters;
+    if(_database &&
+       _database->lookup(grouped_dfs_tuning_database::get_device_key(ctx),
+                         _workload,
+                         parameters))
+    {
+      // Results of other parameter spaces may not be available
+      const std::vector<std::string> names = get_parameter_names();
+      const bool is_valid [] = {Parameter_sets::is_valid...};
+      for(std::size_t i = 0; i < num_candidates; ++i)
+        if(is_valid[i] && names[i] == parameters)
+          candidate = i;
+    }
+
+    _selection[device] = candidate;
+    return candidate;
+  }
+
+  std::string _workload;
+  std::shared_ptr<grouped_dfs_tuning_database> _database;
+  std::map<cl_device_id, std::size_t> _selection;
+  candidate_tuple _candidates;
+};
+
+}
+}
+}
+
+#endif
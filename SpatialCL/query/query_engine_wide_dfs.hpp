@@ -0,0 +1,445 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_ENGINE_WIDE_DFS_HPP
+#define QUERY_ENGINE_WIDE_DFS_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+
+#include <utility>
+
+#include "../configuration.hpp"
+#include "../tree/binary_tree.hpp"
+#include "../tree/particle_wide_bvh_tree.hpp"
+#include "../binary_utils.hpp"
+#include "../async.hpp"
+#include "particle_access.hpp"
+
+
+namespace spatialcl {
+namespace query {
+namespace engine {
+
+/// Depth-first query on the wide nodes of a \c particle_wide_bvh_tree.
+/// When a node is selected, all its children are loaded from their contiguous
+/// storage and tested at once, and the selected children are remembered
+/// in a bit mask per level. The traversal then continues with the first
+/// selected child, such that the number of dependent loads per query is
+/// reduced by the binary logarithm of the branching factor.
+///
+/// Handlers fulfilling the dfs handler concept can be used without changes,
+/// the engine then calls \c dfs_node_selector for each child. Additionally,
+/// handlers can define
+/// \code
+/// dfs_node_group_selector(selection_mask_ptr,
+///                         first_node_key_ptr,
+///                         first_node_index,
+///                         num_nodes,
+///                         node_values0_ptr,
+///                         node_values1_ptr)
+/// \endcode
+/// to test all \c num_nodes siblings together (\c box_range_query and
+/// \c knn_query do this). The node values are given as
+/// \c __global pointers to the first sibling, and bit i of the \c uint
+/// pointed to by \c selection_mask_ptr must be set if sibling i is selected.
+/// If the handler defines \c dfs_child_order (see \c depth_first), the
+/// pending children are visited in the order defined by repeatedly comparing
+/// them with this function. Otherwise, they are visited in tree order.
+/// \tparam Tree_type the tree type on which this query operates, must
+/// provide wide nodes (see \c particle_wide_bvh_tree)
+/// \tparam Handler_module A query handler, fulfilling the dfs handler concept
+/// \tparam group_size The OpenCL group size of the query. A 0 will correspond
+/// to a cl::NullRange and will hence allow the OpenCL implementation to choose
+/// the group size
+template<class Tree_type,
+         class Handler_module,
+         std::size_t group_size = 256>
+class wide_depth_first
+{
+public:
+  QCL_MAKE_MODULE(wide_depth_first)
+
+  using handler_type = Handler_module;
+  using type_system = typename Tree_type::type_system;
+  using layout = typename Tree_type::layout;
+
+  static constexpr std::size_t leaf_bucket_size = Tree_type::leaf_bucket_size;
+  static constexpr std::size_t leaf_bucket_depth =
+      spatialcl::utils::binary::small_binary_logarithm<leaf_bucket_size>::value;
+  static constexpr std::size_t max_num_wide_levels = layout::max_num_levels;
+
+  /// Compiles the query kernel without executing a query,
+  /// see \c spatialcl::precompile()
+  void precompile(const qcl::device_context_ptr& ctx)
+  {
+    query(ctx, cl::NDRange{1}, cl::NullRange);
+  }
+
+  /// Execute query
+  /// \param evt If not \c nullptr, receives the event of the query kernel
+  /// \param wait_events If not \c nullptr, the query only starts once
+  /// these events have completed (see \c enqueue_wait_for_events())
+  cl_int operator()(const Tree_type& tree,
+                    Handler_module& handler,
+                    cl::Event* evt = nullptr,
+                    const event_list* wait_events = nullptr)
+  {
+    enqueue_wait_for_events(tree.get_device_context(), wait_events);
+
+    cl::NDRange local_size = cl::NullRange;
+    if(group_size > 0)
+      local_size = cl::NDRange{group_size};
+
+    qcl::kernel_call call = query(tree.get_device_context(),
+                                  cl::NDRange{handler.get_num_independent_queries()},
+                                  local_size,
+                                  evt);
+
+    call.partial_argument_list(tree.get_sorted_particles());
+    particle_access<Tree_type>::push_particle_positions(
+          call, get_particle_positions_if_available(tree));
+    call.partial_argument_list(tree.get_wide_node_values0(),
+                               tree.get_wide_node_values1(),
+                               static_cast<cl_ulong>(tree.get_num_particles()),
+                               static_cast<cl_ulong>(tree.get_effective_num_levels()),
+                               static_cast<cl_ulong>(tree.get_num_wide_nodes()));
+
+    handler.push_full_arguments(call);
+    return call.enqueue_kernel();
+  }
+private:
+
+  QCL_ENTRYPOINT(query)
+  QCL_MAKE_SOURCE(
+    QCL_INCLUDE_MODULE(tree_configuration<Tree_type>)
+    QCL_INCLUDE_MODULE(Handler_module)
+    QCL_INCLUDE_MODULE(particle_access<Tree_type>)
+    QCL_INCLUDE_MODULE(layout)
+    QCL_IMPORT_CONSTANT(group_size)
+    QCL_IMPORT_CONSTANT(leaf_bucket_size)
+    QCL_IMPORT_CONSTANT(leaf_bucket_depth)
+    QCL_IMPORT_CONSTANT(max_num_wide_levels)
+    R"(
+      #if group_size > 0
+        #define KERNEL_ATTRIBUTES __attribute__((reqd_work_group_size(group_size,1,1)))
+      #else
+        #define KERNEL_ATTRIBUTES
+      #endif
+
+      #ifndef dfs_node_group_selector
+        // Default implementation for handlers that only
+        // provide a selector for single nodes
+        #define dfs_node_group_selector(selection_mask_ptr,                 \
+                                        first_node_key_ptr,                 \
+                                        first_node_index,                   \
+                                        num_nodes,                          \
+                                        node_values0_ptr,                   \
+                                        node_values1_ptr)                   \
+        {                                                                   \
+          *(selection_mask_ptr) = 0;                                        \
+          binary_tree_key_t sibling_key = *(first_node_key_ptr);            \
+          for(uint sibling = 0; sibling < (num_nodes); ++sibling)           \
+          {                                                                 \
+            node_type0 sibling_value0 = (node_values0_ptr)[sibling];        \
+            node_type1 sibling_value1 = (node_values1_ptr)[sibling];        \
+            int sibling_selected = 0;                                       \
+            dfs_node_selector(&sibling_selected,                            \
+                              &sibling_key,                                 \
+                              (first_node_index) + sibling,                 \
+                              sibling_value0,                               \
+                              sibling_value1);                              \
+            if(sibling_selected)                                            \
+              *(selection_mask_ptr) |= 1u << sibling;                       \
+            sibling_key.local_node_id++;                                    \
+          }                                                                 \
+        }
+      #endif
+
+      #ifdef dfs_child_order
+        #define SELECT_NEXT_CHILD SELECT_NEXT_CHILD_IN_CHILD_ORDER
+      #else
+        #define SELECT_NEXT_CHILD SELECT_NEXT_CHILD_IN_TREE_ORDER
+      #endif
+    )"
+    QCL_PREPROCESSOR(define, get_query_id() query_id)
+    QCL_PREPROCESSOR(define,
+      SELECT_NEXT_CHILD_IN_TREE_ORDER(node_values0,
+                                      node_values1,
+                                      siblings_begin,
+                                      level_offset,
+                                      pending_mask,
+                                      selected_sibling)
+      {
+        selected_sibling = popcount((pending_mask & (~pending_mask + 1)) - 1);
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      SELECT_NEXT_CHILD_IN_CHILD_ORDER(node_values0,
+                                       node_values1,
+                                       siblings_begin,
+                                       level_offset,
+                                       pending_mask,
+                                       selected_sibling)
+      {
+        const index_type first_sibling_idx = level_offset + siblings_begin.local_node_id;
+
+        selected_sibling = popcount((pending_mask & (~pending_mask + 1)) - 1);
+        binary_tree_key_t selected_key = siblings_begin;
+        selected_key.local_node_id += selected_sibling;
+
+        for(uint candidate = selected_sibling + 1;
+            candidate < branching_factor;
+            ++candidate)
+        {
+          if(pending_mask & (1u << candidate))
+          {
+            int candidate_first = 0;
+            dfs_child_order(&candidate_first,
+                            &selected_key,
+                            node_values0[first_sibling_idx + selected_sibling],
+                            node_values1[first_sibling_idx + selected_sibling],
+                            node_values0[first_sibling_idx + candidate],
+                            node_values1[first_sibling_idx + candidate]);
+            if(candidate_first)
+            {
+              selected_sibling = candidate;
+              selected_key.local_node_id = siblings_begin.local_node_id + candidate;
+            }
+          }
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      QUERY_LEAF_BUCKET(particles,
+                        num_particles,
+                        effective_num_levels,
+                        current_node)
+      {
+        // Process all particles of the bucket linearly
+        const ulong particles_begin = binary_tree_get_leaves_begin(&current_node,
+                                                                   effective_num_levels);
+        const ulong particles_end = min(particles_begin + leaf_bucket_size,
+                                        num_particles);
+
+        for(ulong particle_idx = particles_begin;
+            particle_idx < particles_end;
+            ++particle_idx)
+        {
+          dfs_cached_particle_type current_particle = DFS_LOAD_PARTICLE(particle_idx);
+
+          int particle_selected = 0;
+          DFS_PROCESS_PARTICLE(&particle_selected,
+                               particle_idx,
+                               current_particle);
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      SELECT_SIBLINGS(node_values0,
+                      node_values1,
+                      num_particles,
+                      effective_num_levels,
+                      siblings_begin,
+                      level_offset,
+                      selection_mask_ptr)
+      {
+        const index_type num_level_nodes = wide_tree_get_num_nodes(siblings_begin.level,
+                                                                   effective_num_levels,
+                                                                   num_particles);
+        const uint num_siblings =
+            (uint)min((index_type)branching_factor,
+                      num_level_nodes - siblings_begin.local_node_id);
+        const index_type first_sibling_idx = level_offset + siblings_begin.local_node_id;
+
+        dfs_node_group_selector(selection_mask_ptr,
+                                &siblings_begin,
+                                first_sibling_idx,
+                                num_siblings,
+                                node_values0 + first_sibling_idx,
+                                node_values1 + first_sibling_idx);
+
+        // Notify the handler about the siblings that have been discarded
+        for(uint sibling = 0; sibling < num_siblings; ++sibling)
+        {
+          if(!(*(selection_mask_ptr) & (1u << sibling)))
+          {
+            binary_tree_key_t discarded_node = siblings_begin;
+            discarded_node.local_node_id += sibling;
+            DFS_DISCARD_NODE(&discarded_node,
+                             first_sibling_idx + sibling,
+                             node_values0[first_sibling_idx + sibling],
+                             node_values1[first_sibling_idx + sibling]);
+          }
+        }
+      }
+    )
+    QCL_RAW(
+      __kernel void query(__global particle_type* particles,
+                          PARTICLE_POSITIONS_PARAMETER
+                          __global node_type0* node_values0,
+                          __global node_type1* node_values1,
+                          ulong num_particles,
+                          ulong effective_num_levels,
+                          ulong num_wide_nodes,
+                          DFS_QUERY_PERMUTATION_PARAMETER
+                          declare_full_query_parameter_set())
+        KERNEL_ATTRIBUTES
+      {
+        const uint leaf_bucket_level = effective_num_levels - 1 - leaf_bucket_depth;
+        const uint top_level = wide_tree_get_top_level(leaf_bucket_level);
+
+        for(size_t tid = get_global_id(0);
+            tid < get_num_queries();
+            tid += get_global_size(0))
+        {
+          DFS_DECLARE_QUERY_ID(tid);
+          at_query_init();
+
+          // The children of the current node that remain to be
+          // investigated, for each wide level
+          uint pending_children [max_num_wide_levels];
+          uint depth = 0;
+
+          // The first sibling of the nodes at the current depth
+          binary_tree_key_t siblings_begin;
+          binary_tree_key_init(&siblings_begin, top_level, 0);
+
+          // The top level is stored last
+          index_type level_offset = num_wide_nodes - wide_tree_get_num_nodes(top_level,
+                                                                             effective_num_levels,
+                                                                             num_particles);
+          pending_children[0] = 0;
+          if(num_particles > 0)
+            SELECT_SIBLINGS(node_values0,
+                            node_values1,
+                            num_particles,
+                            effective_num_levels,
+                            siblings_begin,
+                            level_offset,
+                            &pending_children[0]);
+
+          while(1)
+          {
+            if(pending_children[depth] == 0)
+            {
+              // All siblings are done, go up to the parent's siblings
+              if(depth == 0)
+                break;
+
+              level_offset += wide_tree_get_num_nodes(siblings_begin.level,
+                                                      effective_num_levels,
+                                                      num_particles);
+              siblings_begin = wide_tree_get_parent(&siblings_begin);
+              siblings_begin = wide_tree_get_siblings_begin(&siblings_begin);
+              --depth;
+            }
+            else
+            {
+              // Continue with the next pending child
+              uint sibling = 0;
+              SELECT_NEXT_CHILD(node_values0,
+                                node_values1,
+                                siblings_begin,
+                                level_offset,
+                                pending_children[depth],
+                                sibling);
+              pending_children[depth] &= ~(1u << sibling);
+
+              binary_tree_key_t current_node = siblings_begin;
+              current_node.local_node_id += sibling;
+
+              if(current_node.level == leaf_bucket_level)
+              {
+                QUERY_LEAF_BUCKET(particles,
+                                  num_particles,
+                                  effective_num_levels,
+                                  current_node);
+              }
+              else
+              {
+                siblings_begin = wide_tree_get_children_begin(&current_node);
+                level_offset -= wide_tree_get_num_nodes(siblings_begin.level,
+                                                        effective_num_levels,
+                                                        num_particles);
+                ++depth;
+
+                SELECT_SIBLINGS(node_values0,
+                                node_values1,
+                                num_particles,
+                                effective_num_levels,
+                                siblings_begin,
+                                level_offset,
+                                &pending_children[depth]);
+              }
+            }
+          }
+
+          at_query_exit();
+        }
+      }
+    )
+  )
+};
+
+/// Makes \c wide_depth_first test each sibling separately with the
+/// \c dfs_node_selector of \c Handler, even if \c Handler defines a
+/// \c dfs_node_group_selector. Both must select the same nodes, so this
+/// can be used to verify or benchmark a group selector.
+/// \tparam Handler The query handler, must satisfy the dfs handler concept
+template<class Handler>
+class per_node_selection : public Handler
+{
+public:
+  QCL_MAKE_MODULE(per_node_selection)
+
+  using base_handler_type = Handler;
+
+  /// \param handler_args The arguments of the constructor of \c Handler
+  template<class... Args>
+  per_node_selection(Args&&... handler_args)
+    : Handler{std::forward<Args>(handler_args)...}
+  {}
+
+  virtual ~per_node_selection(){}
+
+private:
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(Handler)
+    R"(
+      #undef dfs_node_group_selector
+    )"
+  )
+};
+
+}
+}
+}
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_INSTRUMENTATION_HPP
+#define QUERY_INSTRUMENTATION_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+#include <vector>
+
+namespace spatialcl {
+namespace query {
+namespace engine {
+
+enum dfs_instrumentation
+{
+  /// The engines do not count anything. The counters are removed
+  /// entirely from the query kernels.
+  DFS_INSTRUMENTATION_DISABLED = 0,
+  /// The engines accumulate traversal counters, see \c query_instrumentation
+  DFS_INSTRUMENTATION_ENABLED = 1
+};
+
+/// The traversal counters of one query (\c depth_first), or the sums of
+/// the counters of the queries of one subgroup (\c grouped_depth_first).
+/// In both engines, each query counts the steps of its own work item, so
+/// an entry of the grouped engine is up to \c subgroup_size times larger
+/// than an entry of \c depth_first. Divide by the number of queries (see
+/// \c query_instrumentation::get_num_queries()) to compare the engines.
+struct dfs_traversal_counters
+{
+  /// The number of nodes passed to the node selector
+  cl_uint nodes_visited;
+  /// The number of nodes that have been selected by the node selector
+  cl_uint nodes_selected;
+  /// The number of particles passed to the particle processor
+  cl_uint particles_tested;
+  /// Only counted by the grouped engine: The number of times a query has
+  /// been taken along to a node it did not select, because another query
+  /// of its subgroup selected it
+  cl_uint divergent_steps;
+};
+
+/// The sums of the \c dfs_traversal_counters over all queries or
+/// subgroups of a query, i.e. the sums over all queries in both
+/// engines. The sums are 64 bit wide, since they can
+/// exceed the range of the 32 bit counters of single entries.
+struct dfs_traversal_totals
+{
+  cl_ulong nodes_visited;
+  cl_ulong nodes_selected;
+  cl_ulong particles_tested;
+  cl_ulong divergent_steps;
+};
+
+/// Collects traversal counters in the query engines. The counters are
+/// accumulated in private memory during a query and added to a device
+/// buffer at the end of the query, with one entry of \c num_counters
+/// \c uint values (in the order of \c dfs_traversal_counters) for each counted
+/// query or subgroup. With \c DFS_INSTRUMENTATION_DISABLED, all counting
+/// macros expand to nothing, so the query kernels are unchanged.
+///
+/// Engines must declare \c DFS_INSTRUMENTATION_PARAMETER as kernel parameter,
+/// \c DFS_DECLARE_COUNTERS at the beginning of each query, and call
+/// \c DFS_COMMIT_COUNTERS(entry) at its end. In between, they count with
+/// \c DFS_COUNT_NODES_VISITED(n), \c DFS_COUNT_NODES_SELECTED(n),
+/// \c DFS_COUNT_PARTICLES_TESTED(n) and \c DFS_COUNT_DIVERGENT_STEPS(n).
+template<dfs_instrumentation Instrumentation>
+class query_instrumentation
+{
+public:
+  QCL_MAKE_MODULE(query_instrumentation)
+
+  static constexpr int instrumentation_enabled =
+      (Instrumentation == DFS_INSTRUMENTATION_ENABLED) ? 1 : 0;
+
+  static constexpr std::size_t num_counters = 4;
+
+  static_assert(sizeof(dfs_traversal_counters) == num_counters * sizeof(cl_uint),
+                "dfs_traversal_counters must consist of num_counters cl_uints");
+
+  /// Resets the counters to 0 and adds them to the arguments of the
+  /// query kernel. Must be called before each execution of the query kernel.
+  /// \param num_queries The number of queries
+  /// \param queries_per_entry The number of adjacent queries whose
+  /// counters are summed in one entry, 1 for entries per query
+  void push_arguments(const qcl::device_context_ptr& ctx,
+                      qcl::kernel_call& call,
+                      std::size_t num_queries,
+                      std::size_t queries_per_entry = 1)
+  {
+    if(!instrumentation_enabled)
+      return;
+
+    const std::size_t num_entries =
+        (num_queries + queries_per_entry - 1) / queries_per_entry;
+
+    // Buffers cannot be empty, so we allocate at least one entry
+    const std::size_t num_values = std::max<std::size_t>(num_entries, 1) * num_counters;
+    if(_counters.size() != num_values)
+      _counters = qcl::device_array<cl_uint>{ctx, num_values};
+    _num_entries = num_entries;
+    _num_queries = num_queries;
+    _queries_per_entry = queries_per_entry;
+    _ctx = ctx;
+
+    // As for the query counter of the query_scheduler, the in-order queue
+    // guarantees that the query starts with zero counters.
+    cl_int err = dfs_reset_instrumentation_counters(ctx,
+                                                    cl::NDRange{num_values},
+                                                    cl::NullRange)(
+          _counters,
+          static_cast<cl_ulong>(num_values));
+    qcl::check_cl_error(err, "Could not enqueue dfs_reset_instrumentation_counters kernel");
+
+    call.partial_argument_list(_counters);
+  }
+
+  /// \return The device buffer with the counters of the last query,
+  /// see \c dfs_traversal_counters
+  const cl::Buffer& get_counter_buffer() const
+  {
+    return _counters.get_buffer();
+  }
+
+  /// \return The number of counted queries or subgroups of the last query
+  std::size_t get_num_entries() const
+  {
+    return _num_entries;
+  }
+
+  /// \return The number of queries of the last query kernel. Dividing
+  /// the totals by this number yields the mean counters per query, which
+  /// can be compared between the engines.
+  std::size_t get_num_queries() const
+  {
+    return _num_queries;
+  }
+
+  /// \return The number of adjacent queries whose counters are summed
+  /// in one entry, i.e. entry \c i contains the queries
+  /// \c i*get_queries_per_entry() to \c (i+1)*get_queries_per_entry()-1
+  std::size_t get_queries_per_entry() const
+  {
+    return _queries_per_entry;
+  }
+
+  /// Reads the counters of the last query (blocking).
+  void read_counters(std::vector<dfs_traversal_counters>& out) const
+  {
+    out.resize(_num_entries);
+    if(_num_entries == 0)
+      return;
+
+    cl_int err = _ctx->get_command_queue().enqueueReadBuffer(
+          _counters.get_buffer(), CL_TRUE, 0,
+          _num_entries * sizeof(dfs_traversal_counters),
+          out.data());
+    qcl::check_cl_error(err, "Could not read instrumentation counters");
+  }
+
+  /// \return The sums of the counters of the last query over all
+  /// queries or subgroups (blocking).
+  dfs_traversal_totals get_total_counters() const
+  {
+    std::vector<dfs_traversal_counters> counters;
+    this->read_counters(counters);
+
+    dfs_traversal_totals result{0, 0, 0, 0};
+    for(const dfs_traversal_counters& c : counters)
+    {
+      result.nodes_visited += c.nodes_visited;
+      result.nodes_selected += c.nodes_selected;
+      result.particles_tested += c.particles_tested;
+      result.divergent_steps += c.divergent_steps;
+    }
+    return result;
+  }
+
+private:
+  qcl::device_context_ptr _ctx;
+  qcl::device_array<cl_uint> _counters;
+  std::size_t _num_entries = 0;
+  std::size_t _num_queries = 0;
+  std::size_t _queries_per_entry = 1;
+
+  QCL_ENTRYPOINT(dfs_reset_instrumentation_counters)
+  QCL_MAKE_SOURCE
+  (
+    QCL_IMPORT_CONSTANT(instrumentation_enabled)
+    QCL_IMPORT_CONSTANT(num_counters)
+    R"(
+      #if instrumentation_enabled
+        #define DFS_INSTRUMENTATION_PARAMETER __global uint* instrumentation_counters,
+        #define DFS_DECLARE_COUNTERS \
+          uint dfs_nodes_visited = 0; \
+          uint dfs_nodes_selected = 0; \
+          uint dfs_particles_tested = 0; \
+          uint dfs_divergent_steps = 0
+        #define DFS_COUNT_NODES_VISITED(n) (dfs_nodes_visited += (uint)(n))
+        #define DFS_COUNT_NODES_SELECTED(n) (dfs_nodes_selected += (uint)(n))
+        #define DFS_COUNT_PARTICLES_TESTED(n) (dfs_particles_tested += (uint)(n))
+        #define DFS_COUNT_DIVERGENT_STEPS(n) (dfs_divergent_steps += (uint)(n))
+        #define DFS_COMMIT_COUNTERS(entry) \
+          do { \
+            __global uint* dfs_entry_counters = \
+              instrumentation_counters + (entry) * num_counters; \
+            atomic_add(dfs_entry_counters + 0, dfs_nodes_visited); \
+            atomic_add(dfs_entry_counters + 1, dfs_nodes_selected); \
+            atomic_add(dfs_entry_counters + 2, dfs_particles_tested); \
+            atomic_add(dfs_entry_counters + 3, dfs_divergent_steps); \
+          } while(0)
+      #else
+        #define DFS_INSTRUMENTATION_PARAMETER
+        #define DFS_DECLARE_COUNTERS
+        #define DFS_COUNT_NODES_VISITED(n)
+        #define DFS_COUNT_NODES_SELECTED(n)
+        #define DFS_COUNT_PARTICLES_TESTED(n)
+        #define DFS_COUNT_DIVERGENT_STEPS(n)
+        #define DFS_COMMIT_COUNTERS(entry)
+      #endif
+    )"
+    QCL_RAW
+    (
+      __kernel void dfs_reset_instrumentation_counters(__global uint* counters,
+                                                       ulong num_values)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_values;
+            tid += get_global_size(0))
+          counters[tid] = 0;
+      }
+    )
+  )
+};
+
+}
+}
+}
+
+#endif
@@ -30,6 +30,9 @@
 #define QUERY_KNN_HPP
 
 
+#include <cassert>
+#include <limits>
+
 #include "../configuration.hpp"
 #include "../math/geometry.hpp"
 
@@ -106,12 +109,6 @@ private:
       candidates[*max_distance_idx] = particle;
       knn_update_max_distance(max_distance_idx, candidate_distances2);
     })
-    // depth-first-serach for knn queries is currently
-    // implemented rather inefficiently, because the DFS
-    // query interface currently does not provide a means
-    // to compare sibling nodes. This is however required
-    // for efficient KNN queries to decide which path down
-    // the tree is the better one.
     QCL_PREPROCESSOR(define,
       dfs_node_selector(selection_result_ptr,
                         current_node_key_ptr,
@@ -119,28 +116,63 @@ private:
                         bbox_min_corner,
                         bbox_max_corner)
       {
-        scalar dist2 = 0.0f;
-        if(!box_contains_particle(CLIP_TO_VECTOR(bbox_min_corner),
-                                  CLIP_TO_VECTOR(bbox_max_corner),
-                                  query_position))
-        {
-          dist2 = box_distance2(query_position,
-                                CLIP_TO_VECTOR(bbox_min_corner),
-                                CLIP_TO_VECTOR(bbox_max_corner));
-        }
-        
+        scalar dist2 = box_distance2(query_position,
+                                     CLIP_TO_VECTOR(bbox_min_corner),
+                                     CLIP_TO_VECTOR(bbox_max_corner));
+
         *selection_result_ptr =
             dist2 < candidate_distances2[max_distance_idx];
       }
 
     )
+    // Tests all siblings of a wide node against the current maximum
+    // distance, which is only loaded once (see \c engine::wide_depth_first)
     QCL_PREPROCESSOR(define,
-      dfs_particle_processor(selection_result_ptr,
-                             particle_idx,
-                             current_particle)
+      dfs_node_group_selector(selection_mask_ptr,
+                              first_node_key_ptr,
+                              first_node_index,
+                              num_nodes,
+                              node_values0_ptr,
+                              node_values1_ptr)
+      {
+        const scalar group_max_dist2 = candidate_distances2[max_distance_idx];
+        uint group_selection_mask = 0;
+        for(uint sibling = 0; sibling < (num_nodes); ++sibling)
+          group_selection_mask |=
+              (uint)(box_distance2(query_position,
+                                   CLIP_TO_VECTOR((node_values0_ptr)[sibling]),
+                                   CLIP_TO_VECTOR((node_values1_ptr)[sibling])) <
+                     group_max_dist2) << sibling;
+        *(selection_mask_ptr) = group_selection_mask;
+      }
+    )
+    // Visit the closer child first, such that good candidates are found
+    // early and more nodes can be discarded
+    QCL_PREPROCESSOR(define,
+      dfs_child_order(right_child_first_ptr,
+                      left_child_key_ptr,
+                      left_bbox_min_corner,
+                      left_bbox_max_corner,
+                      right_bbox_min_corner,
+                      right_bbox_max_corner)
+      {
+        *right_child_first_ptr =
+            box_distance2(query_position,
+                          CLIP_TO_VECTOR(right_bbox_min_corner),
+                          CLIP_TO_VECTOR(right_bbox_max_corner)) <
+            box_distance2(query_position,
+                          CLIP_TO_VECTOR(left_bbox_min_corner),
+                          CLIP_TO_VECTOR(left_bbox_max_corner));
+      }
+    )
+    // Shared by the particle and the position processor. The particle
+    // is only evaluated if it becomes a candidate.
+    QCL_PREPROCESSOR(define,
+      KNN_PROCESS_POSITION(selection_result_ptr,
+                           position,
+                           particle)
       {
-        vector_type delta = PARTICLE_POSITION(current_particle)
-                          - query_position;
+        vector_type delta = (position) - query_position;
         scalar dist2 = VECTOR_NORM2(delta);
 
         *selection_result_ptr =
@@ -148,7 +180,7 @@ private:
 
         if(*selection_result_ptr)
         {
-          knn_add_candidate_particle(current_particle,
+          knn_add_candidate_particle(particle,
                                      dist2,
                                      &max_distance_idx,
                                      candidate_distances2,
@@ -156,6 +188,24 @@ private:
         }
       }
     )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+        KNN_PROCESS_POSITION(selection_result_ptr,
+                             PARTICLE_POSITION(current_particle),
+                             current_particle)
+    )
+    // Used instead of dfs_particle_processor if the tree stores the particle
+    // positions separately. Only the selected particles are loaded entirely.
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+        KNN_PROCESS_POSITION(selection_result_ptr,
+                             current_position,
+                             dfs_load_particle(particle_idx))
+    )
     QCL_PREPROCESSOR(define,
       dfs_unique_node_discard_event(node_idx,
                                     current_bbox_min_corner,
@@ -174,7 +224,7 @@ private:
         particle_type candidates    [K];
 
         for(int i = 0; i < K; ++i)
-          candidate_distances2[i] = FLT_MAX;
+          candidate_distances2[i] = SCALAR_MAX;
 
         uint max_distance_idx = 0;
 
@@ -199,6 +249,564 @@ private:
 };
 
 
+/// Selects the outputs of \c sorted_knn_query
+enum knn_output
+{
+  KNN_OUTPUT_PARTICLES = 1,
+  KNN_OUTPUT_DISTANCES = 2,
+  KNN_OUTPUT_INDICES = 4
+};
+
+/// Candidate storage of \c sorted_knn_query and \c approximate_knn_query.
+/// Only the squared distances and the indices of the candidate particles are
+/// kept. The candidates are kept in a list sorted by distance if K is at most
+/// \c Max_sorted_list_size; the insertion into this list is fully unrolled,
+/// such that the list can be held in registers. For larger K, the candidates
+/// are kept in a max-heap. In both cases, the current maximum distance
+/// is available without searching the candidates.
+///
+/// Handlers use \c SORTED_KNN_DECLARE_CANDIDATES in \c at_query_init(),
+/// \c SORTED_KNN_RESULT_PARAMETERS in their parameter set and
+/// \c SORTED_KNN_STORE_RESULTS(query_id) in \c at_query_exit().
+template<class Type_descriptor,
+         std::size_t K,
+         int Output_flags,
+         std::size_t Max_sorted_list_size>
+class knn_candidate_list
+{
+public:
+  QCL_MAKE_MODULE(knn_candidate_list)
+
+  static constexpr int store_particles  = (Output_flags & KNN_OUTPUT_PARTICLES) ? 1 : 0;
+  static constexpr int store_distances  = (Output_flags & KNN_OUTPUT_DISTANCES) ? 1 : 0;
+  static constexpr int store_indices    = (Output_flags & KNN_OUTPUT_INDICES) ? 1 : 0;
+  static constexpr int use_heap = (K > Max_sorted_list_size) ? 1 : 0;
+
+  /// Appends the result buffers of the selected outputs to the
+  /// arguments of the query kernel
+  static void push_result_buffers(qcl::kernel_call& call,
+                                  const cl::Buffer& results,
+                                  const cl::Buffer& result_distances2,
+                                  const cl::Buffer& result_indices)
+  {
+    if(store_particles)
+      call.partial_argument_list(results);
+    if(store_distances)
+      call.partial_argument_list(result_distances2);
+    if(store_indices)
+      call.partial_argument_list(result_indices);
+  }
+
+private:
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_IMPORT_CONSTANT(K)
+    QCL_IMPORT_CONSTANT(store_particles)
+    QCL_IMPORT_CONSTANT(store_distances)
+    QCL_IMPORT_CONSTANT(store_indices)
+    QCL_IMPORT_CONSTANT(use_heap)
+    R"(
+      #define SORTED_KNN_INVALID_INDEX ULONG_MAX
+
+      #if use_heap
+        // Max-heap with the largest distance at the root
+        #define sorted_knn_max_distance2(candidate_distances2) \
+          ((candidate_distances2)[0])
+
+        void sorted_knn_sift_down(uint node,
+                                  uint heap_size,
+                                  scalar* candidate_distances2,
+                                  ulong* candidate_indices)
+        {
+          const scalar dist2 = candidate_distances2[node];
+          const ulong particle_idx = candidate_indices[node];
+
+          for(uint child = 2 * node + 1; child < heap_size; child = 2 * node + 1)
+          {
+            if(child + 1 < heap_size &&
+               candidate_distances2[child + 1] > candidate_distances2[child])
+              ++child;
+
+            if(candidate_distances2[child] <= dist2)
+              break;
+
+            candidate_distances2[node] = candidate_distances2[child];
+            candidate_indices[node] = candidate_indices[child];
+            node = child;
+          }
+          candidate_distances2[node] = dist2;
+          candidate_indices[node] = particle_idx;
+        }
+
+        void sorted_knn_add_candidate(scalar dist2,
+                                      ulong particle_idx,
+                                      scalar* candidate_distances2,
+                                      ulong* candidate_indices)
+        {
+          // Replace the farthest candidate
+          candidate_distances2[0] = dist2;
+          candidate_indices[0] = particle_idx;
+          sorted_knn_sift_down(0, K, candidate_distances2, candidate_indices);
+        }
+
+        /// Sorts the heap by ascending distance (heap sort)
+        void sorted_knn_finalize(scalar* candidate_distances2,
+                                 ulong* candidate_indices)
+        {
+          for(uint heap_end = K - 1; heap_end > 0; --heap_end)
+          {
+            const scalar max_dist2 = candidate_distances2[0];
+            const ulong max_idx = candidate_indices[0];
+
+            candidate_distances2[0] = candidate_distances2[heap_end];
+            candidate_indices[0] = candidate_indices[heap_end];
+            candidate_distances2[heap_end] = max_dist2;
+            candidate_indices[heap_end] = max_idx;
+
+            sorted_knn_sift_down(0, heap_end, candidate_distances2, candidate_indices);
+          }
+        }
+      #else
+        // List sorted by ascending distance
+        #define sorted_knn_max_distance2(candidate_distances2) \
+          ((candidate_distances2)[K - 1])
+
+        void sorted_knn_add_candidate(scalar dist2,
+                                      ulong particle_idx,
+                                      scalar* candidate_distances2,
+                                      ulong* candidate_indices)
+        {
+          // Replace the farthest candidate and move the new candidate
+          // to its position. All indices are known at compile time
+          // after unrolling, which allows keeping the list in registers.
+          candidate_distances2[K - 1] = dist2;
+          candidate_indices[K - 1] = particle_idx;
+
+          #pragma unroll
+          for(int i = K - 1; i > 0; --i)
+          {
+            const scalar lower_dist2 = candidate_distances2[i - 1];
+            const ulong lower_idx = candidate_indices[i - 1];
+            const int swap_candidates = candidate_distances2[i] < lower_dist2;
+
+            candidate_distances2[i - 1] = swap_candidates ? candidate_distances2[i] : lower_dist2;
+            candidate_indices[i - 1] = swap_candidates ? candidate_indices[i] : lower_idx;
+            candidate_distances2[i] = swap_candidates ? lower_dist2 : candidate_distances2[i];
+            candidate_indices[i] = swap_candidates ? lower_idx : candidate_indices[i];
+          }
+        }
+
+        #define sorted_knn_finalize(candidate_distances2, candidate_indices)
+      #endif
+
+      #if store_particles
+        #define SORTED_KNN_PARTICLE_RESULT_PARAMETER __global particle_type* query_result,
+        #define SORTED_KNN_STORE_PARTICLE(result_idx, particle_idx) \
+          query_result[result_idx] = ((particle_idx) == SORTED_KNN_INVALID_INDEX) ? \
+                                     (particle_type)(0) : dfs_load_particle(particle_idx)
+      #else
+        #define SORTED_KNN_PARTICLE_RESULT_PARAMETER
+        #define SORTED_KNN_STORE_PARTICLE(result_idx, particle_idx)
+      #endif
+
+      #if store_distances
+        #define SORTED_KNN_DISTANCE_RESULT_PARAMETER __global scalar* query_result_distances2,
+        #define SORTED_KNN_STORE_DISTANCE(result_idx, dist2) \
+          query_result_distances2[result_idx] = (dist2)
+      #else
+        #define SORTED_KNN_DISTANCE_RESULT_PARAMETER
+        #define SORTED_KNN_STORE_DISTANCE(result_idx, dist2)
+      #endif
+
+      #if store_indices
+        #define SORTED_KNN_INDEX_RESULT_PARAMETER __global ulong* query_result_indices,
+        #define SORTED_KNN_STORE_INDEX(result_idx, particle_idx) \
+          query_result_indices[result_idx] = (particle_idx)
+      #else
+        #define SORTED_KNN_INDEX_RESULT_PARAMETER
+        #define SORTED_KNN_STORE_INDEX(result_idx, particle_idx)
+      #endif
+
+
+      #define SORTED_KNN_RESULT_PARAMETERS \
+         SORTED_KNN_PARTICLE_RESULT_PARAMETER \
+         SORTED_KNN_DISTANCE_RESULT_PARAMETER \
+         SORTED_KNN_INDEX_RESULT_PARAMETER
+    )"
+    QCL_PREPROCESSOR(define,
+      SORTED_KNN_DECLARE_CANDIDATES
+
+        scalar candidate_distances2 [K];
+        ulong candidate_indices     [K];
+
+        for(int i = 0; i < K; ++i)
+        {
+          candidate_distances2[i] = SCALAR_MAX;
+          candidate_indices[i] = SORTED_KNN_INVALID_INDEX;
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      SORTED_KNN_STORE_RESULTS(query_id)
+      {
+        sorted_knn_finalize(candidate_distances2, candidate_indices);
+
+        for(int i = 0; i < K; ++i)
+        {
+          const ulong result_idx = (query_id)*K + i;
+          SORTED_KNN_STORE_PARTICLE(result_idx, candidate_indices[i]);
+          SORTED_KNN_STORE_DISTANCE(result_idx, candidate_distances2[i]);
+          SORTED_KNN_STORE_INDEX(result_idx, candidate_indices[i]);
+        }
+      }
+    )
+  )
+};
+
+/// The dfs handler macros shared by \c sorted_knn_query and
+/// \c approximate_knn_query. Must be included after the candidate list.
+/// The including handler defines
+/// \code
+/// SORTED_KNN_SELECT_NODE(node_distance2)
+/// SORTED_KNN_COUNT_VISITED_PARTICLE(particle_idx)
+/// \endcode
+/// which decide whether a node at the given squared distance is descended
+/// into, and are notified of each tested particle, respectively.
+class sorted_knn_traversal
+{
+public:
+  QCL_MAKE_MODULE(sorted_knn_traversal)
+private:
+  QCL_MAKE_SOURCE
+  (
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_corner,
+                        bbox_max_corner)
+      {
+        scalar dist2 = box_distance2(query_position,
+                                     CLIP_TO_VECTOR(bbox_min_corner),
+                                     CLIP_TO_VECTOR(bbox_max_corner));
+
+        *selection_result_ptr = SORTED_KNN_SELECT_NODE(dist2);
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_child_order(right_child_first_ptr,
+                      left_child_key_ptr,
+                      left_bbox_min_corner,
+                      left_bbox_max_corner,
+                      right_bbox_min_corner,
+                      right_bbox_max_corner)
+      {
+        *right_child_first_ptr =
+            box_distance2(query_position,
+                          CLIP_TO_VECTOR(right_bbox_min_corner),
+                          CLIP_TO_VECTOR(right_bbox_max_corner)) <
+            box_distance2(query_position,
+                          CLIP_TO_VECTOR(left_bbox_min_corner),
+                          CLIP_TO_VECTOR(left_bbox_max_corner));
+      }
+    )
+    // Shared by the particle and the position processor
+    QCL_PREPROCESSOR(define,
+      SORTED_KNN_PROCESS_POSITION(selection_result_ptr,
+                                  particle_idx,
+                                  position)
+      {
+        vector_type delta = (position) - query_position;
+        scalar dist2 = VECTOR_NORM2(delta);
+        SORTED_KNN_COUNT_VISITED_PARTICLE(particle_idx);
+
+        *selection_result_ptr =
+               dist2 < sorted_knn_max_distance2(candidate_distances2);
+
+        if(*selection_result_ptr)
+          sorted_knn_add_candidate(dist2,
+                                   particle_idx,
+                                   candidate_distances2,
+                                   candidate_indices);
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+        SORTED_KNN_PROCESS_POSITION(selection_result_ptr,
+                                    particle_idx,
+                                    PARTICLE_POSITION(current_particle))
+    )
+    // Used instead of dfs_particle_processor if the tree stores the particle
+    // positions separately. The particles are only loaded when storing the results.
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+        SORTED_KNN_PROCESS_POSITION(selection_result_ptr,
+                                    particle_idx,
+                                    current_position)
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_corner,
+                                    current_bbox_max_corner)
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+        if(get_query_id() < num_queries)
+          SORTED_KNN_STORE_RESULTS(get_query_id())
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
+/// KNN query handler that only keeps the squared distances and the indices of
+/// the candidate particles during the traversal (see \c knn_candidate_list).
+///
+/// The results of each query are stored sorted by distance, starting with
+/// the nearest neighbor at \c query_id*K. Depending on \c Output_flags
+/// (a combination of \c knn_output values), the particles, the squared
+/// distances (as \c scalar) and the indices of the particles in the
+/// sorted particle array of the tree (as \c cl_ulong) are stored.
+/// If fewer than K particles exist, the remaining results consist of zero
+/// particles, a distance of the largest finite scalar and the index \c invalid_index.
+template<class Type_descriptor,
+         std::size_t K,
+         int Output_flags = KNN_OUTPUT_PARTICLES,
+         std::size_t Max_sorted_list_size = 16>
+class sorted_knn_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(sorted_knn_query)
+
+  static_assert(K > 0, "K must be non-zero");
+  static_assert(Output_flags != 0, "At least one output must be selected");
+
+  using candidate_list = knn_candidate_list<
+    Type_descriptor, K, Output_flags, Max_sorted_list_size
+  >;
+
+  static constexpr cl_ulong invalid_index = std::numeric_limits<cl_ulong>::max();
+
+  static constexpr std::size_t num_neighbors = K;
+  static constexpr int output_flags = Output_flags;
+
+  /// Only stores the particles
+  sorted_knn_query(const cl::Buffer& query_points,
+                   const cl::Buffer& results,
+                   std::size_t num_queries)
+    : _query_points{query_points},
+      _results{results},
+      _num_queries{num_queries}
+  {
+    static_assert(Output_flags == KNN_OUTPUT_PARTICLES,
+                  "Result buffers must be provided for all selected outputs");
+  }
+
+  /// \param results Receives the particles if \c KNN_OUTPUT_PARTICLES is set
+  /// \param result_distances2 Receives the squared distances if
+  /// \c KNN_OUTPUT_DISTANCES is set
+  /// \param result_indices Receives the particle indices if
+  /// \c KNN_OUTPUT_INDICES is set
+  /// Buffers of outputs that are not selected are ignored.
+  sorted_knn_query(const cl::Buffer& query_points,
+                   const cl::Buffer& results,
+                   const cl::Buffer& result_distances2,
+                   const cl::Buffer& result_indices,
+                   std::size_t num_queries)
+    : _query_points{query_points},
+      _results{results},
+      _result_distances2{result_distances2},
+      _result_indices{result_indices},
+      _num_queries{num_queries}
+  {
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_query_points);
+    candidate_list::push_result_buffers(call,
+                                        _results,
+                                        _result_distances2,
+                                        _result_indices);
+    call.partial_argument_list(static_cast<cl_ulong>(_num_queries));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_queries;
+  }
+
+  virtual ~sorted_knn_query(){}
+
+private:
+  cl::Buffer _query_points;
+  cl::Buffer _results;
+  cl::Buffer _result_distances2;
+  cl::Buffer _result_indices;
+  std::size_t _num_queries;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(candidate_list)
+    QCL_INCLUDE_MODULE(sorted_knn_traversal)
+    QCL_PREPROCESSOR(define,
+      SORTED_KNN_SELECT_NODE(node_distance2)
+        ((node_distance2) < sorted_knn_max_distance2(candidate_distances2))
+    )
+    QCL_PREPROCESSOR(define,
+      SORTED_KNN_COUNT_VISITED_PARTICLE(particle_idx)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+         __global vector_type* query_positions, \
+         SORTED_KNN_RESULT_PARAMETERS \
+         ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+
+        SORTED_KNN_DECLARE_CANDIDATES
+
+        vector_type query_position;
+        if(get_query_id() < num_queries)
+          query_position = query_positions[get_query_id()];
+    )
+  )
+};
+
+/// KNN query handler for applications that do not require the exact
+/// nearest neighbors. It behaves like \c sorted_knn_query, but
+/// - discards nodes that are farther away than the current K-th
+///   nearest candidate divided by (1 + \c epsilon). The distance of each
+///   returned neighbor is then at most (1 + \c epsilon) times the distance
+///   of the true neighbor of the same rank.
+/// - optionally stops descending into the tree once a query has visited
+///   \c max_visited_leaves leaf buckets. This bounds the work per query,
+///   but the results are no longer guaranteed to satisfy the error bound.
+///   A value of 0 disables this limit.
+/// With \c epsilon = 0 and no leaf limit, the results are exact.
+template<class Type_descriptor,
+         std::size_t K,
+         int Output_flags = KNN_OUTPUT_PARTICLES,
+         std::size_t Max_sorted_list_size = 16>
+class approximate_knn_query : public sorted_knn_query<Type_descriptor,
+                                                      K,
+                                                      Output_flags,
+                                                      Max_sorted_list_size>
+{
+public:
+  QCL_MAKE_MODULE(approximate_knn_query)
+
+  using base_type = sorted_knn_query<
+    Type_descriptor, K, Output_flags, Max_sorted_list_size
+  >;
+  using candidate_list = typename base_type::candidate_list;
+  using scalar = typename configuration<Type_descriptor>::scalar;
+
+  /// Only stores the particles
+  /// \param max_visited_leaves The maximum number of leaf buckets whose
+  /// particles a query tests, or 0 for no limit. Since the limit is only
+  /// checked when a node is selected, the bucket that reaches the limit
+  /// is still tested completely.
+  approximate_knn_query(const cl::Buffer& query_points,
+                        const cl::Buffer& results,
+                        std::size_t num_queries,
+                        scalar epsilon,
+                        std::size_t max_visited_leaves = 0)
+    : base_type{query_points, results, num_queries},
+      _epsilon{epsilon},
+      _max_visited_leaves{max_visited_leaves}
+  {
+    assert(epsilon >= 0);
+  }
+
+  /// See \c sorted_knn_query for the result buffers
+  approximate_knn_query(const cl::Buffer& query_points,
+                        const cl::Buffer& results,
+                        const cl::Buffer& result_distances2,
+                        const cl::Buffer& result_indices,
+                        std::size_t num_queries,
+                        scalar epsilon,
+                        std::size_t max_visited_leaves = 0)
+    : base_type{query_points,
+                results,
+                result_distances2,
+                result_indices,
+                num_queries},
+      _epsilon{epsilon},
+      _max_visited_leaves{max_visited_leaves}
+  {
+    assert(epsilon >= 0);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    base_type::push_full_arguments(call);
+    call.partial_argument_list(_epsilon,
+                               static_cast<cl_ulong>(_max_visited_leaves));
+  }
+
+  virtual ~approximate_knn_query(){}
+
+private:
+  scalar _epsilon;
+  std::size_t _max_visited_leaves;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(candidate_list)
+    QCL_INCLUDE_MODULE(sorted_knn_traversal)
+    QCL_PREPROCESSOR(define,
+      SORTED_KNN_SELECT_NODE(node_distance2)
+        ((num_visited_leaves < visited_leaf_limit) &&
+         ((node_distance2) * pruning_factor2 < sorted_knn_max_distance2(candidate_distances2)))
+    )
+    // The particles of a leaf bucket are tested consecutively,
+    // so a new leaf is visited whenever the bucket index changes
+    QCL_PREPROCESSOR(define,
+      SORTED_KNN_COUNT_VISITED_PARTICLE(particle_idx)
+      {
+        const ulong leaf_idx = (particle_idx) / leaf_bucket_size;
+        if(leaf_idx != last_visited_leaf)
+        {
+          last_visited_leaf = leaf_idx;
+          ++num_visited_leaves;
+        }
+      }
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+         __global vector_type* query_positions, \
+         SORTED_KNN_RESULT_PARAMETERS \
+         ulong num_queries, \
+         scalar epsilon, \
+         ulong max_visited_leaves
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+
+        SORTED_KNN_DECLARE_CANDIDATES
+
+        const scalar pruning_factor2 = (1.0f + epsilon) * (1.0f + epsilon);
+        const ulong visited_leaf_limit =
+            (max_visited_leaves == 0) ? ULONG_MAX : max_visited_leaves;
+        ulong num_visited_leaves = 0;
+        ulong last_visited_leaf = ULONG_MAX;
+
+        vector_type query_position;
+        if(get_query_id() < num_queries)
+          query_position = query_positions[get_query_id()];
+    )
+  )
+};
+
 }
 }
 
@@ -31,6 +31,7 @@
 
 #include "../configuration.hpp"
 #include "../math/geometry.hpp"
+#include "../tree/node_codec.hpp"
 
 #include "query_base.hpp"
 
@@ -44,6 +45,7 @@ class box_range_query : public basic_query
 public:  
   QCL_MAKE_MODULE(box_range_query)
 
+  static constexpr std::size_t max_retrieved_particles = Max_retrieved_particles;
 
   box_range_query(const cl::Buffer& query_ranges_min,
                   const cl::Buffer& query_ranges_max,
@@ -99,6 +101,26 @@ private:
                                       query_range_min,
                                       query_range_max);
     )
+    // Tests all siblings of a wide node without branches,
+    // see \c engine::wide_depth_first
+    QCL_PREPROCESSOR(define,
+      dfs_node_group_selector(selection_mask_ptr,
+                              first_node_key_ptr,
+                              first_node_index,
+                              num_nodes,
+                              node_values0_ptr,
+                              node_values1_ptr)
+      {
+        uint group_selection_mask = 0;
+        for(uint sibling = 0; sibling < (num_nodes); ++sibling)
+          group_selection_mask |=
+              (uint)box_box_intersection(CLIP_TO_VECTOR((node_values0_ptr)[sibling]),
+                                         CLIP_TO_VECTOR((node_values1_ptr)[sibling]),
+                                         query_range_min,
+                                         query_range_max) << sibling;
+        *(selection_mask_ptr) = group_selection_mask;
+      }
+    )
     QCL_PREPROCESSOR(define,
       dfs_particle_processor(selection_result_ptr,
                              particle_idx,
@@ -119,6 +141,28 @@ private:
         }
       }
     )
+    // Used instead of dfs_particle_processor if the tree stores the particle
+    // positions separately. Only the selected particles are loaded entirely.
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+      {
+        *selection_result_ptr = box_contains_point(query_range_min,
+                                                   query_range_max,
+                                                   current_position);
+        if(*selection_result_ptr)
+        {
+          if(num_selected_particles < Max_retrieved_particles)
+          {
+            ulong result_pos = get_query_id()*Max_retrieved_particles
+                             + num_selected_particles;
+            query_result[result_pos] = dfs_load_particle(particle_idx);
+            ++num_selected_particles;
+          }
+        }
+      }
+    )
     QCL_PREPROCESSOR(define,
       dfs_unique_node_discard_event(node_idx,
                                     current_bbox_min_corner,
@@ -160,6 +204,308 @@ private:
 };
 
 
+/// Box range query for a \c particle_mixed_precision_bvh_tree. The query
+/// boxes are converted to single precision offsets relative to the origin
+/// of the subtree that is being traversed, such that all node tests run in
+/// single precision. A query is only converted again when the traversal
+/// enters a node with another origin, which happens about once per subtree
+/// because the traversal is depth-first. The particles
+/// are tested in the precision of \c Type_descriptor, hence the results
+/// equal those of \c box_range_query.
+template<class Type_descriptor,
+         std::size_t Max_retrieved_particles>
+class mixed_precision_box_range_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(mixed_precision_box_range_query)
+
+  static constexpr std::size_t max_retrieved_particles = Max_retrieved_particles;
+
+  /// \param coordinate_origin The origins of the node offsets,
+  /// see \c particle_mixed_precision_bvh_tree::get_coordinate_origin()
+  mixed_precision_box_range_query(const cl::Buffer& query_ranges_min,
+                                  const cl::Buffer& query_ranges_max,
+                                  const cl::Buffer& result_retrieved_particles,
+                                  const cl::Buffer& result_num_retrieved_particles,
+                                  std::size_t num_queries,
+                                  const cl::Buffer& coordinate_origin)
+    : _query_ranges_min{query_ranges_min},
+      _query_ranges_max{query_ranges_max},
+      _result{result_retrieved_particles},
+      _num_selected_particles{result_num_retrieved_particles},
+      _coordinate_origin{coordinate_origin},
+      _num_queries{num_queries}
+  {
+    assert(num_queries > 0);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_query_ranges_min,
+                               _query_ranges_max,
+                               _result,
+                               _num_selected_particles,
+                               _coordinate_origin,
+                               static_cast<cl_ulong>(_num_queries));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_queries;
+  }
+
+  virtual ~mixed_precision_box_range_query(){}
+
+private:
+  cl::Buffer _query_ranges_min;
+  cl::Buffer _query_ranges_max;
+  cl::Buffer _result;
+  cl::Buffer _num_selected_particles;
+  cl::Buffer _coordinate_origin;
+  std::size_t _num_queries;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_INCLUDE_MODULE(mixed_precision_bbox_codec<Type_descriptor>)
+    QCL_IMPORT_CONSTANT(Max_retrieved_particles)
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_offset,
+                        bbox_max_offset)
+      {
+        const uint origin_index = mixed_precision_get_origin_index(current_node_key_ptr);
+        if(origin_index != query_origin_index)
+        {
+          query_origin_index = origin_index;
+          query_range_min_offset = mixed_precision_offset_min(query_range_min,
+                                                              coordinate_origin[origin_index]);
+          query_range_max_offset = mixed_precision_offset_max(query_range_max,
+                                                              coordinate_origin[origin_index]);
+        }
+        *selection_result_ptr = mixed_precision_offset_box_intersection(
+                                      bbox_min_offset,
+                                      bbox_max_offset,
+                                      query_range_min_offset,
+                                      query_range_max_offset);
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+      {
+        *selection_result_ptr = box_contains_particle(query_range_min,
+                                                      query_range_max,
+                                                      current_particle);
+        if(*selection_result_ptr)
+        {
+          if(num_selected_particles < Max_retrieved_particles)
+          {
+            ulong result_pos = get_query_id()*Max_retrieved_particles
+                             + num_selected_particles;
+            query_result[result_pos] = current_particle;
+            ++num_selected_particles;
+          }
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_offset,
+                                    current_bbox_max_offset)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+        __global vector_type* query_ranges_min, \
+        __global vector_type* query_ranges_max, \
+        __global particle_type* query_result, \
+        __global uint* num_retrieved_particles, \
+        __global vector_type* coordinate_origin, \
+        ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+        vector_type query_range_min;
+        vector_type query_range_max;
+        offset_vector_type query_range_min_offset;
+        offset_vector_type query_range_max_offset;
+        uint query_origin_index = 0;
+        uint num_selected_particles = 0;
+
+        if(get_query_id() < num_queries)
+        {
+          query_range_min = query_ranges_min[get_query_id()];
+          query_range_max = query_ranges_max[get_query_id()];
+          // The traversal starts at the root, which uses the first origin
+          query_range_min_offset = mixed_precision_offset_min(query_range_min,
+                                                              coordinate_origin[0]);
+          query_range_max_offset = mixed_precision_offset_max(query_range_max,
+                                                              coordinate_origin[0]);
+          num_retrieved_particles[get_query_id()] = 0;
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+        if(get_query_id() < num_queries)
+        {
+          num_retrieved_particles[get_query_id()] = num_selected_particles;
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
+
+/// Range query for spheres. Like \c box_range_query, at most
+/// \c Max_retrieved_particles particles are stored for each query,
+/// starting at \c query_id*Max_retrieved_particles.
+template<class Type_descriptor,
+         std::size_t Max_retrieved_particles>
+class sphere_range_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(sphere_range_query)
+
+  /// \param query_centers The centers of the spheres (as \c vector_type)
+  /// \param query_radii The radii of the spheres (as \c scalar)
+  sphere_range_query(const cl::Buffer& query_centers,
+                     const cl::Buffer& query_radii,
+                     const cl::Buffer& result_retrieved_particles,
+                     const cl::Buffer& result_num_retrieved_particles,
+                     std::size_t num_queries)
+    : _query_centers{query_centers},
+      _query_radii{query_radii},
+      _result{result_retrieved_particles},
+      _num_selected_particles{result_num_retrieved_particles},
+      _num_queries{num_queries}
+  {
+    assert(num_queries > 0);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_query_centers,
+                               _query_radii,
+                               _result,
+                               _num_selected_particles,
+                               static_cast<cl_ulong>(_num_queries));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_queries;
+  }
+
+  virtual ~sphere_range_query(){}
+
+private:
+  cl::Buffer _query_centers;
+  cl::Buffer _query_radii;
+  cl::Buffer _result;
+  cl::Buffer _num_selected_particles;
+  std::size_t _num_queries;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_IMPORT_CONSTANT(Max_retrieved_particles)
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_corner,
+                        bbox_max_corner)
+        *selection_result_ptr = box_distance2(query_center,
+                                              CLIP_TO_VECTOR(bbox_min_corner),
+                                              CLIP_TO_VECTOR(bbox_max_corner))
+                                <= query_radius2;
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+      {
+        vector_type delta = PARTICLE_POSITION(current_particle) - query_center;
+        *selection_result_ptr = VECTOR_NORM2(delta) <= query_radius2;
+        if(*selection_result_ptr)
+        {
+          if(num_selected_particles < Max_retrieved_particles)
+          {
+            ulong result_pos = get_query_id()*Max_retrieved_particles
+                             + num_selected_particles;
+            query_result[result_pos] = current_particle;
+            ++num_selected_particles;
+          }
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+      {
+        vector_type delta = current_position - query_center;
+        *selection_result_ptr = VECTOR_NORM2(delta) <= query_radius2;
+        if(*selection_result_ptr)
+        {
+          if(num_selected_particles < Max_retrieved_particles)
+          {
+            ulong result_pos = get_query_id()*Max_retrieved_particles
+                             + num_selected_particles;
+            query_result[result_pos] = dfs_load_particle(particle_idx);
+            ++num_selected_particles;
+          }
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_corner,
+                                    current_bbox_max_corner)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+        __global vector_type* query_centers, \
+        __global scalar* query_radii, \
+        __global particle_type* query_result, \
+        __global uint* num_retrieved_particles, \
+        ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+        vector_type query_center;
+        scalar query_radius2 = 0.0f;
+        uint num_selected_particles = 0;
+
+        if(get_query_id() < num_queries)
+        {
+          query_center = query_centers[get_query_id()];
+          query_radius2 = query_radii[get_query_id()] * query_radii[get_query_id()];
+          num_retrieved_particles[get_query_id()] = 0;
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+        if(get_query_id() < num_queries)
+        {
+          num_retrieved_particles[get_query_id()] = num_selected_particles;
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
 }
 }
 
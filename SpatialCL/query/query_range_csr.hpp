@@ -0,0 +1,524 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_RANGE_CSR_HPP
+#define QUERY_RANGE_CSR_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+#include <QCL/qcl_boost_compat.hpp>
+
+#include <boost/compute.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <type_traits>
+
+#include "../configuration.hpp"
+#include "../math/geometry.hpp"
+#include "../memory_pool.hpp"
+
+#include "query_base.hpp"
+
+namespace spatialcl {
+namespace query {
+
+/// Selects whether \c box_range_fill_query stores the indices of the
+/// selected particles in the sorted particle array of the tree (as
+/// \c cl_ulong), or the particles themselves.
+enum range_query_output
+{
+  RANGE_OUTPUT_INDICES = 0,
+  RANGE_OUTPUT_PARTICLES = 1
+};
+
+/// First phase of \c csr_range_query. Counts the particles inside
+/// each query box. The counts are stored as \c cl_ulong in a buffer with
+/// room for \c num_queries+1 elements; the last element is set to 0, such
+/// that an exclusive scan over all elements yields the CSR offsets
+/// including the total number of results.
+template<class Type_descriptor>
+class box_range_count_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(box_range_count_query)
+
+  box_range_count_query(const cl::Buffer& query_ranges_min,
+                        const cl::Buffer& query_ranges_max,
+                        const cl::Buffer& result_counts,
+                        std::size_t num_queries)
+    : _query_ranges_min{query_ranges_min},
+      _query_ranges_max{query_ranges_max},
+      _counts{result_counts},
+      _num_queries{num_queries}
+  {
+    assert(num_queries > 0);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_query_ranges_min,
+                               _query_ranges_max,
+                               _counts,
+                               static_cast<cl_ulong>(_num_queries));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_queries;
+  }
+
+  virtual ~box_range_count_query(){}
+
+private:
+  cl::Buffer _query_ranges_min;
+  cl::Buffer _query_ranges_max;
+  cl::Buffer _counts;
+  std::size_t _num_queries;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_corner,
+                        bbox_max_corner)
+        *selection_result_ptr = box_box_intersection(
+                                      CLIP_TO_VECTOR(bbox_min_corner),
+                                      CLIP_TO_VECTOR(bbox_max_corner),
+                                      query_range_min,
+                                      query_range_max);
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+      {
+        *selection_result_ptr = box_contains_particle(query_range_min,
+                                                      query_range_max,
+                                                      current_particle);
+        if(*selection_result_ptr)
+          ++num_selected_particles;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+      {
+        *selection_result_ptr = box_contains_point(query_range_min,
+                                                   query_range_max,
+                                                   current_position);
+        if(*selection_result_ptr)
+          ++num_selected_particles;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_corner,
+                                    current_bbox_max_corner)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+        __global vector_type* query_ranges_min, \
+        __global vector_type* query_ranges_max, \
+        __global ulong* query_result_counts, \
+        ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+        vector_type query_range_min;
+        vector_type query_range_max;
+        ulong num_selected_particles = 0;
+
+        if(get_query_id() < num_queries)
+        {
+          query_range_min = query_ranges_min[get_query_id()];
+          query_range_max = query_ranges_max[get_query_id()];
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+        if(get_query_id() < num_queries)
+        {
+          query_result_counts[get_query_id()] = num_selected_particles;
+          if(get_query_id() == num_queries - 1)
+            query_result_counts[num_queries] = 0;
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
+/// Last phase of \c csr_range_query. Stores the results of query \c i
+/// from \c offsets[i] on, where the offsets are the exclusive scan
+/// of the counts of \c box_range_count_query.
+/// \tparam Output Whether particle indices or particles are stored,
+/// see \c range_query_output
+template<class Type_descriptor, range_query_output Output>
+class box_range_fill_query : public basic_query
+{
+public:
+  QCL_MAKE_MODULE(box_range_fill_query)
+
+  using result_type = typename std::conditional<
+    Output == RANGE_OUTPUT_PARTICLES,
+    typename configuration<Type_descriptor>::particle_type,
+    cl_ulong
+  >::type;
+
+  box_range_fill_query(const cl::Buffer& query_ranges_min,
+                       const cl::Buffer& query_ranges_max,
+                       const cl::Buffer& offsets,
+                       const cl::Buffer& results,
+                       std::size_t num_queries)
+    : _query_ranges_min{query_ranges_min},
+      _query_ranges_max{query_ranges_max},
+      _offsets{offsets},
+      _results{results},
+      _num_queries{num_queries}
+  {
+    assert(num_queries > 0);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_query_ranges_min,
+                               _query_ranges_max,
+                               _offsets,
+                               _results,
+                               static_cast<cl_ulong>(_num_queries));
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _num_queries;
+  }
+
+  virtual ~box_range_fill_query(){}
+
+private:
+  static constexpr int store_particles = (Output == RANGE_OUTPUT_PARTICLES) ? 1 : 0;
+
+  cl::Buffer _query_ranges_min;
+  cl::Buffer _query_ranges_max;
+  cl::Buffer _offsets;
+  cl::Buffer _results;
+  std::size_t _num_queries;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(math::geometry<Type_descriptor>)
+    QCL_IMPORT_CONSTANT(store_particles)
+    R"(
+      #if store_particles
+        #define BOX_RANGE_FILL_RESULT_PARAMETER __global particle_type* query_result,
+        #define BOX_RANGE_FILL_STORE(result_pos, particle_idx, particle) \
+          query_result[result_pos] = (particle)
+      #else
+        #define BOX_RANGE_FILL_RESULT_PARAMETER __global ulong* query_result,
+        #define BOX_RANGE_FILL_STORE(result_pos, particle_idx, particle) \
+          query_result[result_pos] = (particle_idx)
+      #endif
+    )"
+    QCL_PREPROCESSOR(define,
+      dfs_node_selector(selection_result_ptr,
+                        current_node_key_ptr,
+                        node_index,
+                        bbox_min_corner,
+                        bbox_max_corner)
+        *selection_result_ptr = box_box_intersection(
+                                      CLIP_TO_VECTOR(bbox_min_corner),
+                                      CLIP_TO_VECTOR(bbox_max_corner),
+                                      query_range_min,
+                                      query_range_max);
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_particle_processor(selection_result_ptr,
+                             particle_idx,
+                             current_particle)
+      {
+        *selection_result_ptr = box_contains_particle(query_range_min,
+                                                      query_range_max,
+                                                      current_particle);
+        if(*selection_result_ptr)
+        {
+          BOX_RANGE_FILL_STORE(result_pos, particle_idx, current_particle);
+          ++result_pos;
+        }
+      }
+    )
+    // The particles are only loaded if they are stored
+    QCL_PREPROCESSOR(define,
+      dfs_position_processor(selection_result_ptr,
+                             particle_idx,
+                             current_position)
+      {
+        *selection_result_ptr = box_contains_point(query_range_min,
+                                                   query_range_max,
+                                                   current_position);
+        if(*selection_result_ptr)
+        {
+          BOX_RANGE_FILL_STORE(result_pos, particle_idx, dfs_load_particle(particle_idx));
+          ++result_pos;
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      dfs_unique_node_discard_event(node_idx,
+                                    current_bbox_min_corner,
+                                    current_bbox_max_corner)
+    )
+    R"(
+      #define declare_full_query_parameter_set() \
+        __global vector_type* query_ranges_min, \
+        __global vector_type* query_ranges_max, \
+        __global ulong* query_result_offsets, \
+        BOX_RANGE_FILL_RESULT_PARAMETER \
+        ulong num_queries
+    )"
+    QCL_PREPROCESSOR(define,
+      at_query_init()
+        vector_type query_range_min;
+        vector_type query_range_max;
+        ulong result_pos = 0;
+
+        if(get_query_id() < num_queries)
+        {
+          query_range_min = query_ranges_min[get_query_id()];
+          query_range_max = query_ranges_max[get_query_id()];
+          result_pos = query_result_offsets[get_query_id()];
+        }
+    )
+    QCL_PREPROCESSOR(define,
+      at_query_exit()
+    )
+    QCL_PREPROCESSOR(define,
+      get_num_queries()
+        num_queries
+    )
+  )
+};
+
+/// Executes queries without a limit on the number of results per query
+/// and stores the results in compressed sparse row (CSR) format: the
+/// results of query \c i are the elements \c [offsets[i], offsets[i+1])
+/// of the result array. This requires three steps:
+/// 1. The results of each query are counted with \c Count_engine by a
+///    handler that writes the counts to the offsets.
+/// 2. The counts are scanned on the device to obtain the offsets.
+/// 3. The results are written with \c Fill_engine by a handler that stores
+///    the results of each query starting at its offset.
+/// Since the result array can only be allocated once the total number of
+/// results is known, it is read back after the second step.
+///
+/// The offsets and results are allocated from the memory pool of the
+/// device context (see \c get_memory_pool()), such that repeated
+/// queries reuse the buffers of the previous results.
+template<class Count_engine, class Fill_engine, class Result_type>
+class csr_query_driver
+{
+public:
+  using result_type = Result_type;
+  template<class T>
+  using array_type = device_memory_pool::pooled_array<T>;
+
+  /// Executes the queries. The previous results are discarded.
+  /// \param make_count_handler Returns the handler of \c Count_engine
+  /// when called with the buffer of the \c num_queries+1 offsets
+  /// \param make_fill_handler Returns the handler of \c Fill_engine
+  /// when called with the buffers of the offsets and of the results
+  template<class Tree_type, class Count_handler_factory, class Fill_handler_factory>
+  void operator()(const Tree_type& tree,
+                  std::size_t num_queries,
+                  Count_handler_factory make_count_handler,
+                  Fill_handler_factory make_fill_handler)
+  {
+    const qcl::device_context_ptr& ctx = tree.get_device_context();
+    const std::shared_ptr<device_memory_pool> pool = get_memory_pool(ctx);
+    // Return the buffers of the previous results to the pool first,
+    // so that they can be reused for the new results
+    _offsets = array_type<cl_ulong>{};
+    _results = array_type<result_type>{};
+
+    _num_queries = num_queries;
+    _offsets = pool->allocate<cl_ulong>(num_queries + 1);
+    _num_results = 0;
+
+    if(num_queries == 0)
+    {
+      _results = pool->allocate<result_type>(1);
+      return;
+    }
+
+    auto count_handler = make_count_handler(_offsets.get_buffer());
+    cl_int err = Count_engine{}(tree, count_handler);
+    qcl::check_cl_error(err, "Could not enqueue CSR count query");
+
+    boost::compute::command_queue boost_queue{ctx->get_command_queue().get()};
+    boost::compute::exclusive_scan(
+          qcl::create_buffer_iterator<cl_ulong>(_offsets.get_buffer(), 0),
+          qcl::create_buffer_iterator<cl_ulong>(_offsets.get_buffer(), num_queries + 1),
+          qcl::create_buffer_iterator<cl_ulong>(_offsets.get_buffer(), 0),
+          boost_queue);
+
+    cl_ulong num_results = 0;
+    err = ctx->get_command_queue().enqueueReadBuffer(
+          _offsets.get_buffer(), CL_TRUE,
+          num_queries * sizeof(cl_ulong), sizeof(cl_ulong), &num_results);
+    qcl::check_cl_error(err, "Could not read number of CSR query results");
+
+    _num_results = static_cast<std::size_t>(num_results);
+    // The pool allocates at least one result, since buffers cannot be empty
+    _results = pool->allocate<result_type>(_num_results);
+
+    auto fill_handler = make_fill_handler(_offsets.get_buffer(),
+                                          _results.get_buffer());
+    err = Fill_engine{}(tree, fill_handler);
+    qcl::check_cl_error(err, "Could not enqueue CSR fill query");
+  }
+
+  /// \return The \c num_queries+1 offsets of the results of each query
+  const array_type<cl_ulong>& get_offsets() const
+  {
+    return _offsets;
+  }
+
+  /// \return The results of all queries. The buffer has room for
+  /// at least one element even if there are no results.
+  const array_type<result_type>& get_results() const
+  {
+    return _results;
+  }
+
+  std::size_t get_num_results() const
+  {
+    return _num_results;
+  }
+
+  std::size_t get_num_queries() const
+  {
+    return _num_queries;
+  }
+
+private:
+  array_type<cl_ulong> _offsets;
+  array_type<result_type> _results;
+  std::size_t _num_results = 0;
+  std::size_t _num_queries = 0;
+};
+
+/// Box range queries without a limit on the number of results per query.
+/// The results are stored in CSR format, see \c csr_query_driver:
+/// The particles in each box are counted by a \c box_range_count_query
+/// with \c Count_engine, and written by a \c box_range_fill_query
+/// with \c Fill_engine. The required memory is therefore proportional
+/// to the number of results.
+///
+/// Both engines must operate on the same tree type; see the
+/// csr range query aliases in query.hpp.
+template<class Count_engine, class Fill_engine>
+class csr_range_query
+{
+public:
+  using count_handler_type = typename Count_engine::handler_type;
+  using fill_handler_type = typename Fill_engine::handler_type;
+  using result_type = typename fill_handler_type::result_type;
+
+  /// Executes the query. The results remain valid until
+  /// the next execution.
+  /// \param query_ranges_min The minimum corners of the query boxes
+  /// \param query_ranges_max The maximum corners of the query boxes
+  template<class Tree_type>
+  void operator()(const Tree_type& tree,
+                  const cl::Buffer& query_ranges_min,
+                  const cl::Buffer& query_ranges_max,
+                  std::size_t num_queries)
+  {
+    assert(num_queries > 0);
+
+    _driver(tree,
+            num_queries,
+            [&](const cl::Buffer& offsets){
+              return count_handler_type{
+                query_ranges_min,
+                query_ranges_max,
+                offsets,
+                num_queries
+              };
+            },
+            [&](const cl::Buffer& offsets, const cl::Buffer& results){
+              return fill_handler_type{
+                query_ranges_min,
+                query_ranges_max,
+                offsets,
+                results,
+                num_queries
+              };
+            });
+  }
+
+  /// \return The \c num_queries+1 offsets of the results of each query
+  const device_memory_pool::pooled_array<cl_ulong>& get_offsets() const
+  {
+    return _driver.get_offsets();
+  }
+
+  /// \return The results of all queries. The buffer has room for
+  /// at least one element even if there are no results.
+  const device_memory_pool::pooled_array<result_type>& get_results() const
+  {
+    return _driver.get_results();
+  }
+
+  std::size_t get_num_results() const
+  {
+    return _driver.get_num_results();
+  }
+
+  std::size_t get_num_queries() const
+  {
+    return _driver.get_num_queries();
+  }
+
+private:
+  csr_query_driver<Count_engine, Fill_engine, result_type> _driver;
+};
+
+}
+}
+
+#endif
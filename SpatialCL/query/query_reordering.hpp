@@ -0,0 +1,163 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_REORDERING_HPP
+#define QUERY_REORDERING_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+#include <QCL/qcl_boost_compat.hpp>
+
+#include <boost/compute.hpp>
+
+#include <cassert>
+#include <utility>
+
+#include "../configuration.hpp"
+#include "../tree/particle_bvh_sfc_tree.hpp"
+#include "../sort/radix_sort.hpp"
+
+namespace spatialcl {
+namespace query {
+
+/// Calculates an order of queries along a space filling curve, such that
+/// consecutive queries are close to each other. This strongly improves the
+/// performance of \c grouped_depth_first engines for queries that are not
+/// already spatially ordered, since all queries of a subgroup then follow
+/// similar paths through the tree.
+/// \tparam Sort_key_generator_template The curve, e.g.
+/// \c hilbert_sort_key_generator or \c zcurve_sort_key_generator.
+/// It is instantiated for a type descriptor with \c vector_type "particles".
+/// \tparam Sort_engine The sort algorithm for the (key, query index) pairs
+template<class Type_descriptor,
+         template<class> class Sort_key_generator_template = hilbert_sort_key_generator,
+         template<class, class> class Sort_engine = sort::default_radix_sort_engine>
+class sfc_query_order
+{
+public:
+  using scalar = typename Type_descriptor::scalar;
+  using point_type_descriptor = type_descriptor::generic<
+    scalar,
+    Type_descriptor::dimension,
+    Type_descriptor::dimension
+  >;
+  using key_generator_type = Sort_key_generator_template<point_type_descriptor>;
+  using key_type = typename key_generator_type::key_type;
+  using sort_engine_type = Sort_engine<key_type, cl_uint>;
+
+  /// Calculates the order of the queries.
+  /// \param query_points One representative point per query (as
+  /// \c vector_type), e.g. the center of the query. For box queries, the
+  /// minimum corners of the boxes can be used as well.
+  void operator()(const qcl::device_context_ptr& ctx,
+                  const cl::Buffer& query_points,
+                  std::size_t num_queries)
+  {
+    assert(num_queries > 0);
+    assert(num_queries <= static_cast<std::size_t>(CL_UINT_MAX));
+
+    _permutation = qcl::device_array<cl_uint>{ctx, num_queries};
+    qcl::device_array<key_type> keys{ctx, num_queries};
+
+    key_generator_type key_generator;
+    key_generator(ctx, query_points, num_queries, keys.get_buffer());
+
+    boost::compute::command_queue boost_queue{ctx->get_command_queue().get()};
+    boost::compute::iota(
+          qcl::create_buffer_iterator<cl_uint>(_permutation.get_buffer(), 0),
+          qcl::create_buffer_iterator<cl_uint>(_permutation.get_buffer(), num_queries),
+          static_cast<cl_uint>(0),
+          boost_queue);
+
+    _sort_engine(ctx,
+                 keys.get_buffer(),
+                 _permutation.get_buffer(),
+                 num_queries,
+                 key_generator_type::num_key_bits);
+  }
+
+  /// \return The permutation of the queries: The i-th query along the
+  /// curve is the query \c get_permutation()[i].
+  const cl::Buffer& get_permutation() const
+  {
+    return _permutation.get_buffer();
+  }
+
+private:
+  qcl::device_array<cl_uint> _permutation;
+  sort_engine_type _sort_engine;
+};
+
+/// Runs the queries of a handler in the order given by a permutation
+/// (e.g. calculated by \c sfc_query_order). The handler accesses its
+/// queries and results through \c get_query_id(), so neither the queries
+/// nor the results have to be reordered; the results are stored in the
+/// original order of the queries.
+/// \tparam Handler The query handler, must satisfy the dfs handler concept
+template<class Handler>
+class reordered_query : public Handler
+{
+public:
+  QCL_MAKE_MODULE(reordered_query)
+
+  using base_handler_type = Handler;
+
+  /// \param query_permutation Work item i processes query
+  /// \c query_permutation[i], as \c cl_uint
+  /// \param handler_args The arguments of the constructor of \c Handler
+  template<class... Args>
+  reordered_query(const cl::Buffer& query_permutation,
+                  Args&&... handler_args)
+    : Handler{std::forward<Args>(handler_args)...},
+      _query_permutation{query_permutation}
+  {}
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    // The permutation precedes the arguments of the handler
+    call.partial_argument_list(_query_permutation);
+    Handler::push_full_arguments(call);
+  }
+
+  virtual ~reordered_query(){}
+
+private:
+  cl::Buffer _query_permutation;
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(Handler)
+    QCL_PREPROCESSOR(define, dfs_reordered_queries)
+  )
+};
+
+}
+}
+
+#endif
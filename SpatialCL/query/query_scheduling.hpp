@@ -0,0 +1,170 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef QUERY_SCHEDULING_HPP
+#define QUERY_SCHEDULING_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+namespace spatialcl {
+namespace query {
+namespace engine {
+
+enum dfs_scheduling
+{
+  /// Each work item processes the queries \c get_global_id(0)+n*get_global_size(0)
+  DFS_SCHEDULING_STATIC = 0,
+  /// A fixed number of persistent work groups is launched, whose
+  /// work items fetch new queries from a global counter once they
+  /// have finished their previous query
+  DFS_SCHEDULING_PERSISTENT = 1
+};
+
+/// Distributes the queries among the work items of the DFS engines.
+/// With \c DFS_SCHEDULING_PERSISTENT, only as many work groups are launched
+/// as the device can execute concurrently. Work items that have finished a
+/// query immediately take the next unprocessed query instead of
+/// waiting for the slowest query of their work group, which
+/// balances the load if the costs of the queries vary strongly
+/// (e.g. knn queries in regions of very different particle densities).
+///
+/// In the kernel, the engines obtain their queries with
+/// \code
+/// for(size_t tid = DFS_FIRST_QUERY(); tid < get_num_queries(); tid = DFS_NEXT_QUERY(tid))
+/// \endcode
+/// or, if several work items must process adjacent queries together,
+/// with \c dfs_fetch_query_batch(batch_size) which returns the first
+/// query of a new batch. The kernel must declare \c DFS_SCHEDULER_PARAMETER
+/// as parameter.
+template<dfs_scheduling Scheduling>
+class query_scheduler
+{
+public:
+  QCL_MAKE_MODULE(query_scheduler)
+
+  static constexpr int persistent_scheduling =
+      (Scheduling == DFS_SCHEDULING_PERSISTENT) ? 1 : 0;
+
+  /// The number of persistent work groups per compute unit. Several
+  /// work groups are necessary on each compute unit to hide the latency
+  /// of the memory accesses.
+  static constexpr std::size_t persistent_groups_per_compute_unit = 8;
+
+  /// \return The global size of the query kernel
+  /// \param num_work_items The number of work items that the query would
+  /// require with static scheduling.
+  /// \param group_size The work group size of the query kernel. For persistent
+  /// scheduling, it must be larger than 0.
+  std::size_t get_global_size(const qcl::device_context_ptr& ctx,
+                              std::size_t num_work_items,
+                              std::size_t group_size) const
+  {
+    if(!persistent_scheduling)
+      return num_work_items;
+
+    assert(group_size > 0);
+
+    const std::size_t num_compute_units =
+        ctx->get_device().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+
+    std::size_t num_groups = (num_work_items + group_size - 1) / group_size;
+    num_groups = std::min(num_groups,
+                          num_compute_units * persistent_groups_per_compute_unit);
+    num_groups = std::max<std::size_t>(num_groups, 1);
+
+    // Each work item fetches at most one query beyond the last query,
+    // so the counter cannot overflow if this holds
+    assert(num_work_items + num_groups * group_size <=
+           static_cast<std::size_t>(std::numeric_limits<cl_uint>::max()));
+
+    return num_groups * group_size;
+  }
+
+  /// For persistent scheduling, resets the query counter and adds it to
+  /// the arguments of the query kernel. Must be called before each execution
+  /// of the query kernel.
+  void push_arguments(const qcl::device_context_ptr& ctx,
+                      qcl::kernel_call& call)
+  {
+    if(!persistent_scheduling)
+      return;
+
+    if(_query_counter.size() == 0)
+      _query_counter = qcl::device_array<cl_uint>{ctx, 1};
+
+    // The reset is enqueued before the query kernel, so the in-order
+    // command queue guarantees that the query starts with a zero counter.
+    cl_int err = dfs_reset_query_counter(ctx,
+                                         cl::NDRange{1},
+                                         cl::NDRange{1})(_query_counter);
+    qcl::check_cl_error(err, "Could not enqueue dfs_reset_query_counter kernel");
+
+    call.partial_argument_list(_query_counter);
+  }
+
+private:
+  qcl::device_array<cl_uint> _query_counter;
+
+  QCL_ENTRYPOINT(dfs_reset_query_counter)
+  QCL_MAKE_SOURCE
+  (
+    QCL_IMPORT_CONSTANT(persistent_scheduling)
+    R"(
+      #if persistent_scheduling
+        #define DFS_SCHEDULER_PARAMETER __global uint* query_counter,
+        #define dfs_fetch_query_batch(batch_size) \
+          ((size_t)atomic_add(query_counter, (uint)(batch_size)))
+        #define DFS_FIRST_QUERY() dfs_fetch_query_batch(1)
+        #define DFS_NEXT_QUERY(tid) dfs_fetch_query_batch(1)
+      #else
+        #define DFS_SCHEDULER_PARAMETER
+        #define DFS_FIRST_QUERY() get_global_id(0)
+        #define DFS_NEXT_QUERY(tid) ((tid) + get_global_size(0))
+      #endif
+    )"
+    QCL_RAW
+    (
+      __kernel void dfs_reset_query_counter(__global uint* counter)
+      {
+        counter[0] = 0;
+      }
+    )
+  )
+};
+
+}
+}
+}
+
+#endif
@@ -41,9 +41,12 @@ class position_generator
 public:
   using vector_type = typename configuration<Type_descriptor>::vector_type;
 
+  /// Generates the positions of the particles along the curve.
+  /// \param particles_extent A device buffer containing the minimum
+  /// and maximum corner of the particles' bounding box as two
+  /// consecutive \c vector_type elements
   virtual void operator()(const qcl::device_context_ptr& ctx,
-                          const vector_type& particles_min,
-                          const vector_type& particles_max,
+                          const cl::Buffer& particles_extent,
                           const cl::Buffer& particles,
                           cl_ulong num_particles,
                           const cl::Buffer& out) const = 0;
@@ -0,0 +1,100 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BOOST_SORT_HPP
+#define BOOST_SORT_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_boost_compat.hpp>
+
+#include <boost/compute.hpp>
+
+namespace spatialcl {
+namespace sort {
+
+/// Maps OpenCL host types to the types boost.compute expects.
+/// Vector types are translated by QCL, scalar types can be
+/// used directly.
+template<class T>
+struct boost_compatible_type
+{
+  using type = typename qcl::to_boost_vector_type<T>::type;
+};
+
+template<> struct boost_compatible_type<cl_uint> { using type = cl_uint; };
+template<> struct boost_compatible_type<cl_ulong> { using type = cl_ulong; };
+
+/// Key-value sort engine based on \c boost::compute::sort_by_key().
+/// Always sorts the full key, \c num_key_bits is ignored.
+///
+/// A sort engine must provide
+/// \code
+/// void operator()(const qcl::device_context_ptr& ctx,
+///                 const cl::Buffer& keys,
+///                 const cl::Buffer& values,
+///                 std::size_t num_elements,
+///                 unsigned num_key_bits) const;
+/// \endcode
+/// which sorts \c keys and \c values in place by ascending keys,
+/// where only the lowest \c num_key_bits bits of the keys can be non-zero.
+template<class Key_type, class Value_type>
+class boost_sort_engine
+{
+public:
+  using key_type = Key_type;
+  using value_type = Value_type;
+
+  void operator()(const qcl::device_context_ptr& ctx,
+                  const cl::Buffer& keys,
+                  const cl::Buffer& values,
+                  std::size_t num_elements,
+                  unsigned num_key_bits) const
+  {
+    using boost_key_type = typename boost_compatible_type<key_type>::type;
+    using boost_value_type = typename boost_compatible_type<value_type>::type;
+
+    boost::compute::command_queue boost_queue{
+      ctx->get_command_queue().get()
+    };
+
+    auto keys_begin = qcl::create_buffer_iterator<boost_key_type>(keys, 0);
+    auto keys_end = qcl::create_buffer_iterator<boost_key_type>(keys, num_elements);
+    auto values_begin = qcl::create_buffer_iterator<boost_value_type>(values, 0);
+
+    boost::compute::sort_by_key(
+          keys_begin,
+          keys_end,
+          values_begin,
+          boost_queue);
+  }
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RADIX_SORT_HPP
+#define RADIX_SORT_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_boost_compat.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <boost/compute.hpp>
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+#include "../binary_utils.hpp"
+#include "../memory_pool.hpp"
+
+namespace spatialcl {
+namespace sort {
+
+/// A least-significant-digit radix sort for integer keys that
+/// only processes the bits of the key that can actually be set.
+/// Space filling curve keys only use dimension*num_resolved_levels
+/// bits (64 bits in 2D, 63 bits in 3D), and tree quality usually does
+/// not depend on the lowest bits at all - those can be skipped
+/// entirely by setting \c num_ignored_low_bits. Since the sort is stable,
+/// particles in the same (coarser) cell simply keep their relative order.
+///
+/// Each pass computes a histogram of the current digit per work group
+/// in local memory, scans the histograms on the device and scatters
+/// the elements to their new position. The ranking within a work group
+/// is obtained from a local memory scan over packed 16 bit digit counters.
+///
+/// Satisfies the sort engine concept (see \c boost_sort_engine).
+/// \tparam Key_type The (unsigned integer) key type
+/// \tparam Value_type The type of the values that are sorted with the keys
+/// \tparam Radix_bits The number of bits sorted per pass, at most 6
+/// \tparam Group_size The work group size. Each work group processes
+/// \c Group_size elements per pass.
+template<class Key_type,
+         class Value_type,
+         unsigned Radix_bits = 4,
+         std::size_t Group_size = 256>
+class radix_sort_engine
+{
+public:
+  QCL_MAKE_MODULE(radix_sort_engine)
+
+  using key_type = Key_type;
+  using value_type = Value_type;
+
+  static constexpr unsigned radix_bits = Radix_bits;
+  static constexpr unsigned radix_size = 1u << Radix_bits;
+  static constexpr unsigned radix_mask = radix_size - 1;
+  static constexpr std::size_t group_size = Group_size;
+  // Two 16 bit digit counters are packed into one uint
+  static constexpr unsigned num_counter_words = radix_size / 2;
+
+  // The scatter kernel keeps num_counter_words counters per work item in
+  // local memory and in registers, which grows exponentially with the
+  // number of radix bits
+  static_assert(radix_bits >= 1 && radix_bits <= 6,
+                "The number of radix bits must be between 1 and 6");
+  static_assert(spatialcl::utils::binary::is_small_power2<group_size>::value,
+                "The group size must be a power of two.");
+  static_assert(group_size >= radix_size,
+                "The group size cannot be smaller than the number of buckets");
+  static_assert(group_size < (1 << 16),
+                "The group size must fit into the 16 bit digit counters");
+
+  /// The local memory required by the scatter kernel, in bytes
+  static constexpr std::size_t required_local_memory =
+      num_counter_words * group_size * sizeof(cl_uint);
+
+  /// \param num_ignored_low_bits The number of lowest key bits that
+  /// will not be sorted.
+  explicit radix_sort_engine(unsigned num_ignored_low_bits = 0)
+    : _num_ignored_low_bits{num_ignored_low_bits}
+  {}
+
+  /// \throws std::runtime_error if the device does not provide
+  /// \c required_local_memory bytes of local memory
+  void operator()(const qcl::device_context_ptr& ctx,
+                  const cl::Buffer& keys,
+                  const cl::Buffer& values,
+                  std::size_t num_elements,
+                  unsigned num_key_bits) const
+  {
+    assert(num_key_bits <= 8 * sizeof(key_type));
+    // The block offsets are stored as uint
+    assert(num_elements <= static_cast<std::size_t>(CL_UINT_MAX));
+
+    if(num_elements < 2)
+      return;
+
+    const cl_ulong available_local_memory =
+        ctx->get_device().getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    if(required_local_memory > available_local_memory)
+      throw std::runtime_error{
+        "radix_sort_engine: " + std::to_string(radix_size) +
+        " digit counters for " + std::to_string(group_size) +
+        " work items require " + std::to_string(required_local_memory) +
+        " bytes of local memory, but the device only provides " +
+        std::to_string(available_local_memory) +
+        " bytes. Use fewer radix bits or a smaller group size."};
+
+    const unsigned begin_bit = std::min(_num_ignored_low_bits, num_key_bits);
+    const unsigned num_passes = (num_key_bits - begin_bit + radix_bits - 1) / radix_bits;
+
+    if(num_passes == 0)
+      return;
+
+    const std::size_t num_blocks = (num_elements + group_size - 1) / group_size;
+    const std::size_t num_histogram_entries = radix_size * num_blocks;
+
+    auto keys_scratch = get_memory_pool(ctx)->allocate<key_type>(num_elements);
+    auto values_scratch = get_memory_pool(ctx)->allocate<value_type>(num_elements);
+    auto block_histograms = get_memory_pool(ctx)->allocate<cl_uint>(num_histogram_entries);
+    auto block_offsets = get_memory_pool(ctx)->allocate<cl_uint>(num_histogram_entries);
+
+    boost::compute::command_queue boost_queue{
+      ctx->get_command_queue().get()
+    };
+
+    const cl::Buffer* keys_in = &keys;
+    const cl::Buffer* values_in = &values;
+    const cl::Buffer* keys_out = &keys_scratch.get_buffer();
+    const cl::Buffer* values_out = &values_scratch.get_buffer();
+
+    cl::NDRange global_size{num_blocks * group_size};
+    cl::NDRange local_size{group_size};
+
+    for(unsigned pass = 0; pass < num_passes; ++pass)
+    {
+      cl_uint shift = static_cast<cl_uint>(begin_bit + pass * radix_bits);
+
+      cl_int err = radix_sort_histogram(ctx, global_size, local_size)(
+            *keys_in,
+            static_cast<cl_ulong>(num_elements),
+            shift,
+            block_histograms.get_buffer(),
+            static_cast<cl_ulong>(num_blocks));
+      qcl::check_cl_error(err, "Could not enqueue radix_sort_histogram kernel");
+
+      // The histograms are stored in digit-major order, so the exclusive
+      // scan directly yields the global output offset for each
+      // digit and block.
+      boost::compute::exclusive_scan(
+            qcl::create_buffer_iterator<cl_uint>(block_histograms.get_buffer(), 0),
+            qcl::create_buffer_iterator<cl_uint>(block_histograms.get_buffer(),
+                                                 num_histogram_entries),
+            qcl::create_buffer_iterator<cl_uint>(block_offsets.get_buffer(), 0),
+            boost_queue);
+
+      err = radix_sort_scatter(ctx, global_size, local_size)(
+            *keys_in,
+            *values_in,
+            static_cast<cl_ulong>(num_elements),
+            shift,
+            block_offsets.get_buffer(),
+            static_cast<cl_ulong>(num_blocks),
+            *keys_out,
+            *values_out);
+      qcl::check_cl_error(err, "Could not enqueue radix_sort_scatter kernel");
+
+      std::swap(keys_in, keys_out);
+      std::swap(values_in, values_out);
+    }
+
+    // After an odd number of passes, the result is in the scratch buffers
+    if(num_passes % 2 != 0)
+    {
+      cl_int err = ctx->get_command_queue().enqueueCopyBuffer(
+            *keys_in, keys, 0, 0, num_elements * sizeof(key_type));
+      qcl::check_cl_error(err, "Could not copy sorted keys");
+
+      err = ctx->get_command_queue().enqueueCopyBuffer(
+            *values_in, values, 0, 0, num_elements * sizeof(value_type));
+      qcl::check_cl_error(err, "Could not copy sorted values");
+    }
+  }
+
+private:
+  unsigned _num_ignored_low_bits;
+
+  QCL_ENTRYPOINT(radix_sort_histogram)
+  QCL_ENTRYPOINT(radix_sort_scatter)
+  QCL_MAKE_SOURCE
+  (
+    QCL_IMPORT_TYPE(key_type)
+    QCL_IMPORT_TYPE(value_type)
+    QCL_IMPORT_CONSTANT(radix_size)
+    QCL_IMPORT_CONSTANT(radix_mask)
+    QCL_IMPORT_CONSTANT(group_size)
+    QCL_IMPORT_CONSTANT(num_counter_words)
+    QCL_RAW
+    (
+      __kernel void radix_sort_histogram(__global key_type* keys,
+                                         ulong num_elements,
+                                         uint shift,
+                                         __global uint* block_histograms,
+                                         ulong num_blocks)
+      {
+        __local uint local_histogram [radix_size];
+
+        const size_t lid = get_local_id(0);
+        const ulong block = get_group_id(0);
+
+        if(lid < radix_size)
+          local_histogram[lid] = 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        const ulong element = block * group_size + lid;
+        if(element < num_elements)
+        {
+          uint digit = (uint)(keys[element] >> shift) & radix_mask;
+          atomic_inc(&local_histogram[digit]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if(lid < radix_size)
+          block_histograms[lid * num_blocks + block] = local_histogram[lid];
+      }
+
+      __kernel void radix_sort_scatter(__global key_type* keys_in,
+                                       __global value_type* values_in,
+                                       ulong num_elements,
+                                       uint shift,
+                                       __global uint* block_offsets,
+                                       ulong num_blocks,
+                                       __global key_type* keys_out,
+                                       __global value_type* values_out)
+      {
+        __local uint digit_counters [num_counter_words * group_size];
+
+        const size_t lid = get_local_id(0);
+        const ulong block = get_group_id(0);
+        const ulong element = block * group_size + lid;
+        const int is_valid = element < num_elements;
+
+        key_type key = 0;
+        uint digit = 0;
+        if(is_valid)
+        {
+          key = keys_in[element];
+          digit = (uint)(key >> shift) & radix_mask;
+        }
+
+        // Each work item starts with a one-hot counter for its digit
+        for(uint w = 0; w < num_counter_words; ++w)
+          digit_counters[w * group_size + lid] = 0;
+        if(is_valid)
+          digit_counters[(digit >> 1) * group_size + lid] = 1u << (16 * (digit & 1));
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Inclusive scan over the packed counters. Counters cannot
+        // exceed the group size, so there is never a carry into
+        // the neighboring counter.
+        for(uint offset = 1; offset < group_size; offset <<= 1)
+        {
+          uint partial_sums [num_counter_words];
+          for(uint w = 0; w < num_counter_words; ++w)
+            partial_sums[w] = (lid >= offset) ?
+                              digit_counters[w * group_size + lid - offset] : 0;
+          barrier(CLK_LOCAL_MEM_FENCE);
+
+          for(uint w = 0; w < num_counter_words; ++w)
+            digit_counters[w * group_size + lid] += partial_sums[w];
+          barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if(is_valid)
+        {
+          // Number of elements of this block with the same digit, up to and
+          // including this one. This preserves the order within the block
+          // and hence makes the sort stable.
+          uint rank = (digit_counters[(digit >> 1) * group_size + lid] >> (16 * (digit & 1)))
+                    & 0xffff;
+
+          ulong target = block_offsets[digit * num_blocks + block] + rank - 1;
+          keys_out[target] = key;
+          values_out[target] = values_in[element];
+        }
+      }
+    )
+  )
+};
+
+/// Radix sort engine with default parameters. This alias can be used directly
+/// as sort engine template argument of \c key_based_sorter.
+template<class Key_type, class Value_type>
+using default_radix_sort_engine = radix_sort_engine<Key_type, Value_type>;
+
+}
+}
+
+#endif
@@ -30,6 +30,15 @@
 #define TREE_HPP
 
 #include "tree/particle_bvh_sfc_tree.hpp"
+#include "tree/particle_wide_bvh_tree.hpp"
+#include "tree/particle_quantized_bvh_tree.hpp"
+#include "tree/particle_mixed_precision_bvh_tree.hpp"
+#include "tree/particle_soa_bvh_tree.hpp"
+#include "tree/particle_aggregate_bvh_tree.hpp"
+#include "tree/rebuild_policy.hpp"
+#include "tree/distributed_tree.hpp"
+#include "tree/out_of_core_tree.hpp"
+#include "tree/particle_bvh_forest.hpp"
 
 namespace spatialcl {
 
@@ -67,6 +76,88 @@ using hilbert_bvh_dp2d_tree = hilbert_bvh_tree<type_descriptor::double_precision
 template<std::size_t Num_particle_components>
 using hilbert_bvh_dp3d_tree = hilbert_bvh_tree<type_descriptor::double_precision3d<Num_particle_components>>;
 
+/// Trees sorted with the radix sort engine, which only sorts the
+/// key bits that are actually used by the space filling curve.
+template<class Type_descriptor>
+using zcurve_radix_bvh_tree =
+  particle_bvh_tree<key_based_sorter<zcurve_sort_key_generator<Type_descriptor>,
+                                     sort::default_radix_sort_engine>,
+                    Type_descriptor>;
+
+template<class Type_descriptor>
+using hilbert_radix_bvh_tree =
+  particle_bvh_tree<key_based_sorter<hilbert_sort_key_generator<Type_descriptor>,
+                                     sort::default_radix_sort_engine>,
+                    Type_descriptor>;
+
+/// Hilbert curve sorted trees with leaf buckets of \c Leaf_bucket_size
+/// particles, which are processed linearly by the query engines.
+template<class Type_descriptor, std::size_t Leaf_bucket_size>
+using hilbert_bucket_bvh_tree =
+  particle_bvh_tree<key_based_sorter<hilbert_sort_key_generator<Type_descriptor>,
+                                     sort::default_radix_sort_engine>,
+                    Type_descriptor,
+                    Leaf_bucket_size>;
+
+/// Hilbert curve sorted wide trees with up to \c Branching_factor
+/// children per node, see \c particle_wide_bvh_tree
+template<class Type_descriptor,
+         std::size_t Branching_factor = 4,
+         std::size_t Leaf_bucket_size = 2>
+using hilbert_wide_bvh_tree =
+  particle_wide_bvh_tree<key_based_sorter<hilbert_sort_key_generator<Type_descriptor>,
+                                          sort::default_radix_sort_engine>,
+                         Type_descriptor,
+                         Branching_factor,
+                         Leaf_bucket_size>;
+
+/// Hilbert curve sorted trees whose bounding boxes are read by the
+/// query engines as 16 bit quantized boxes, see \c particle_quantized_bvh_tree
+template<class Type_descriptor, std::size_t Leaf_bucket_size = 2>
+using hilbert_quantized_bvh_tree =
+  particle_quantized_bvh_tree<key_based_sorter<hilbert_sort_key_generator<Type_descriptor>,
+                                               sort::default_radix_sort_engine>,
+                              Type_descriptor,
+                              Leaf_bucket_size>;
+
+/// Hilbert curve sorted double precision trees whose bounding boxes are
+/// read by the query engines as single precision offsets,
+/// see \c particle_mixed_precision_bvh_tree
+template<class Type_descriptor, std::size_t Leaf_bucket_size = 2>
+using hilbert_mixed_precision_bvh_tree =
+  particle_mixed_precision_bvh_tree<key_based_sorter<hilbert_sort_key_generator<Type_descriptor>,
+                                                     sort::default_radix_sort_engine>,
+                                    Type_descriptor,
+                                    Leaf_bucket_size>;
+
+/// Hilbert curve sorted trees that store the particle positions
+/// separately from the other particle components,
+/// see \c particle_soa_bvh_tree
+template<class Type_descriptor, std::size_t Leaf_bucket_size = 2>
+using hilbert_soa_bvh_tree =
+  particle_soa_bvh_tree<key_based_sorter<hilbert_sort_key_generator<Type_descriptor>,
+                                         sort::default_radix_sort_engine>,
+                        Type_descriptor,
+                        Leaf_bucket_size>;
+
+/// Hilbert curve sorted trees that store aggregates of the particle
+/// component \c Component for each node, see \c particle_aggregate_bvh_tree
+template<class Type_descriptor, std::size_t Component, std::size_t Leaf_bucket_size = 2>
+using hilbert_aggregate_bvh_tree =
+  particle_aggregate_bvh_tree<key_based_sorter<hilbert_sort_key_generator<Type_descriptor>,
+                                               sort::default_radix_sort_engine>,
+                              Type_descriptor,
+                              Component,
+                              Leaf_bucket_size>;
+
+/// Forest of Hilbert curve sorted trees that are built and
+/// queried together, see \c particle_bvh_forest
+template<class Type_descriptor, std::size_t Leaf_bucket_size = 2>
+using hilbert_bvh_forest =
+  particle_bvh_forest<hilbert_sort_key_generator<Type_descriptor>,
+                      Type_descriptor,
+                      Leaf_bucket_size>;
+
 //using kd_bvh_tree = particle_bvh_tree<key_based_sorter<kd_sort_key_generator>>;
 
 
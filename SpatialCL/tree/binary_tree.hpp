@@ -32,6 +32,9 @@
 #include "../configuration.hpp"
 #include "../bit_manipulation.hpp"
 
+#include <cstddef>
+#include <algorithm>
+
 
 /**
 General binary tree layout
@@ -106,6 +109,38 @@ contained by a node is smaller than the number of leaves. The index of the first
 can be easily obtained using binary_tree_get_leaves_begin(). A shortcut for this check
 exists in the form of the binary_tree_is_node_used() function.
 
+Compact node storage
+====================
+
+The padded layout described above wastes almost half of the node memory if the
+number of leaves is slightly larger than a power of 2. The trees therefore only store
+the used nodes: The nodes of each level are still stored contiguously, starting
+with the lowest node level and ending with the root, but each level only contains
+its populated nodes. For the example of 6 leaves, the nodes are stored as
+| l2: 3 nodes | l1: 2 nodes | l0: 1 node |
+The keys (level and local node id) are the same as in the padded layout, only the
+offset of each level changes. With m = num_leaves - 1, a node level containing
+2^k leaves per node has (m >> k) + 1 populated nodes. Summing over the k
+levels below a given level yields the closed form
+  offset = k + m - (m >> k) - popcount(m & (2^k - 1))
+which is calculated by binary_tree_get_level_offset(). The node storage index of
+a key is obtained with binary_tree_key_encode_node_index().
+If the number of leaves is a power of 2, this layout is identical to the padded
+layout (with the leaves removed).
+
+Leaf buckets
+============
+
+The lowest stored node level does not need to be the level directly above the
+leaves. With a leaf bucket size of 2^b, the lowest stored nodes (the leaf buckets)
+each contain 2^b leaves, and the b-1 levels between the buckets and the leaves are
+not stored at all. Query engines process the leaves of a bucket linearly. The default
+bucket size of 2 corresponds to the layout described above. With buckets, the
+offsets are obtained by subtracting the (not stored) node levels below the
+buckets from the closed form above, i.e. offset = S(k) - S(b-1), if S(k) denotes
+the closed form for k levels. If there are less leaves than the bucket size,
+the tree consists of a single bucket.
+
 */
 
 
@@ -115,7 +150,83 @@ class binary_tree
 {
 public:
   QCL_MAKE_MODULE(binary_tree)
+
+  /// \return The number of nodes (excluding the leaves) of a tree with
+  /// \c num_leaves leaves in the compact node storage layout.
+  /// \param leaf_bucket_size The number of leaves of the lowest stored
+  /// nodes. Must be a power of two >= 2.
+  static std::size_t get_num_nodes(std::size_t num_leaves,
+                                   std::size_t leaf_bucket_size = 2)
+  {
+    if(num_leaves == 0)
+      return 0;
+
+    const std::size_t m = num_leaves - 1;
+    const unsigned bucket_depth = get_num_bits(leaf_bucket_size - 1);
+    // The number of levels above the leaves is the number of bits of m,
+    // but there is at least the level of the leaf buckets.
+    const unsigned num_node_levels = std::max(get_num_bits(m), bucket_depth);
+
+    return get_num_populated_nodes_below(m, num_node_levels)
+         - get_num_populated_nodes_below(m, bucket_depth - 1);
+  }
+
+  /// \return The number of levels (including the leaves) of a tree with
+  /// \c num_leaves leaves.
+  static std::size_t get_num_levels(std::size_t num_leaves,
+                                    std::size_t leaf_bucket_size = 2)
+  {
+    const std::size_t m = (num_leaves == 0) ? 0 : num_leaves - 1;
+    return std::max(get_num_bits(m), get_num_bits(leaf_bucket_size - 1)) + 1;
+  }
+
+  /// \return The index of a node in the compact node storage. This is the
+  /// host counterpart of \c binary_tree_key_encode_node_index().
+  /// \param level The level of the node, counted from the root
+  /// \param local_node_id The index of the node within its level
+  /// \param num_levels The number of levels including the leaves,
+  /// see \c get_num_levels()
+  static std::size_t get_node_index(unsigned level,
+                                    std::size_t local_node_id,
+                                    std::size_t num_levels,
+                                    std::size_t num_leaves,
+                                    std::size_t leaf_bucket_size = 2)
+  {
+    const std::size_t m = num_leaves - 1;
+    const unsigned bucket_depth = get_num_bits(leaf_bucket_size - 1);
+    // Number of node levels stored before this level, see
+    // binary_tree_get_level_offset()
+    const unsigned k = static_cast<unsigned>(num_levels) - 2 - level;
+
+    return get_num_populated_nodes_below(m, k)
+         - get_num_populated_nodes_below(m, bucket_depth - 1)
+         + local_node_id;
+  }
 private:
+  static unsigned get_num_bits(std::size_t x)
+  {
+    unsigned result = 0;
+    for(; x != 0; x >>= 1)
+      ++result;
+    return result;
+  }
+
+  static unsigned get_num_set_bits(std::size_t x)
+  {
+    unsigned result = 0;
+    for(; x != 0; x >>= 1)
+      result += x & 1;
+    return result;
+  }
+
+  /// \return The number of populated nodes in the \c k levels above
+  /// the leaves. \c m must be the number of leaves - 1.
+  static std::size_t get_num_populated_nodes_below(std::size_t m, unsigned k)
+  {
+    const std::size_t low_bits = (std::size_t{1} << k) - 1;
+    return k + m - (m >> k) - get_num_set_bits(m & low_bits);
+  }
+
   QCL_MAKE_SOURCE
   (
     QCL_INCLUDE_MODULE(bit_manipulation)
@@ -225,6 +336,43 @@ private:
         return ctx->local_node_id & 1;
       }
 
+      /// \return The number of populated nodes in the \c k levels
+      /// above the leaves
+      index_type binary_tree_get_num_populated_nodes_below(uint k,
+                                                           index_type num_leaves)
+      {
+        index_type m = num_leaves - 1;
+        return k + m - (m >> k) - popcount(m & n_bits_set(k));
+      }
+
+      /// \return The index of the first node of the given level in the
+      /// compact node storage
+      /// \param leaf_bucket_depth The binary logarithm of the leaf bucket size
+      index_type binary_tree_get_level_offset(uint level,
+                                              index_type num_levels,
+                                              index_type num_leaves,
+                                              uint leaf_bucket_depth)
+      {
+        // Number of node levels stored before this level, plus
+        // the levels below the buckets that are not stored
+        uint k = num_levels - 2 - level;
+        return binary_tree_get_num_populated_nodes_below(k, num_leaves)
+             - binary_tree_get_num_populated_nodes_below(leaf_bucket_depth - 1, num_leaves);
+      }
+
+      /// \return The index of the node in the compact node storage
+      index_type binary_tree_key_encode_node_index(binary_tree_key_t* ctx,
+                                                   index_type num_levels,
+                                                   index_type num_leaves,
+                                                   uint leaf_bucket_depth)
+      {
+        return binary_tree_get_level_offset(ctx->level,
+                                            num_levels,
+                                            num_leaves,
+                                            leaf_bucket_depth)
+             + ctx->local_node_id;
+      }
+
       index_type binary_tree_get_num_populated_nodes(uint level,
                                                      uint num_levels,
                                                      uint num_leaves)
@@ -0,0 +1,381 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BOTTOM_UP_BUILDER_HPP
+#define BOTTOM_UP_BUILDER_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include "binary_tree.hpp"
+#include "../configuration.hpp"
+#include "../bit_manipulation.hpp"
+#include "../binary_utils.hpp"
+#include "../memory_pool.hpp"
+
+namespace spatialcl {
+
+/// Builds the node data of all levels of a binary tree in a single
+/// kernel launch. Each work item builds one node of the lowest node level
+/// and then walks up the tree. At each parent, the work item that arrives
+/// first terminates, while the second one (which then knows that both children
+/// are complete) builds the parent node. Compared to one kernel launch per
+/// level, this avoids the launch overhead and the almost idle device
+/// for the upper levels.
+///
+/// The content of the nodes is defined by the combiner, a QCL module that
+/// defines the following macros:
+/// \code
+/// bottom_up_build_leaf_node(particles, particles_begin, particles_end,
+///                           node0_ptr, node1_ptr)
+/// \endcode
+/// Initializes the node values \c *node0_ptr and \c *node1_ptr of a node
+/// of the lowest level (a leaf bucket) from the particles in
+/// [particles_begin, particles_end). This range always contains at least one
+/// and at most \c Leaf_bucket_size particles.
+/// \code
+/// bottom_up_combine_nodes(left_child0, left_child1,
+///                         right_child0, right_child1,
+///                         right_child_exists,
+///                         node0_ptr, node1_ptr)
+/// \endcode
+/// Calculates the node values of a parent node from its children. The values
+/// of the right child must be ignored if \c right_child_exists is 0.
+///
+/// The arrival counters are stored in the builder, so the same builder
+/// object should be reused when the tree is rebuilt.
+/// \tparam Type_descriptor The type system of the tree
+/// \tparam Node_type0 The type of the first node value
+/// \tparam Node_type1 The type of the second node value
+/// \tparam Combiner The combiner module, see above
+/// \tparam Leaf_bucket_size The number of particles per leaf bucket
+template<class Type_descriptor,
+         class Node_type0,
+         class Node_type1,
+         class Combiner,
+         std::size_t Leaf_bucket_size = 2>
+class bottom_up_builder
+{
+public:
+  QCL_MAKE_MODULE(bottom_up_builder)
+
+  using node_type0 = Node_type0;
+  using node_type1 = Node_type1;
+
+  static constexpr std::size_t leaf_bucket_size = Leaf_bucket_size;
+  static constexpr std::size_t leaf_bucket_depth =
+      utils::binary::small_binary_logarithm<leaf_bucket_size>::value;
+
+  /// Builds all nodes of the tree.
+  /// \param particles The sorted particles
+  /// \param num_particles The number of particles
+  /// \param nodes0 Buffer for the first node values, in the compact
+  /// layout described in binary_tree.hpp
+  /// \param nodes1 Buffer for the second node values
+  void operator()(const qcl::device_context_ptr& ctx,
+                  const cl::Buffer& particles,
+                  std::size_t num_particles,
+                  const cl::Buffer& nodes0,
+                  const cl::Buffer& nodes1)
+  {
+    if(num_particles == 0)
+      return;
+
+    this->init_arrival_counters(ctx, binary_tree::get_num_nodes(num_particles,
+                                                                leaf_bucket_size));
+
+    const std::size_t num_lowest_level_nodes =
+        (num_particles + leaf_bucket_size - 1) / leaf_bucket_size;
+    const std::size_t num_levels = binary_tree::get_num_levels(num_particles,
+                                                               leaf_bucket_size);
+
+    cl_int err = bottom_up_build_tree(ctx,
+                                      cl::NDRange{num_lowest_level_nodes},
+                                      cl::NDRange{local_size})(
+          particles,
+          static_cast<cl_ulong>(num_particles),
+          static_cast<cl_uint>(num_levels),
+          nodes0,
+          nodes1,
+          _arrival_counters.get_buffer());
+    qcl::check_cl_error(err, "Could not enqueue bottom_up_build_tree kernel");
+  }
+
+  /// Builds all nodes of a forest of trees in a single kernel launch.
+  /// The particles and nodes of the trees are stored one after another:
+  /// Tree t consists of the sorted particles
+  /// [tree_particle_offsets[t], tree_particle_offsets[t+1]), and its nodes
+  /// start at \c tree_node_offsets[t], in the compact layout of each tree.
+  /// \param tree_particle_offsets The \c cl_ulong particle offsets of the
+  /// trees, with \c num_trees+1 entries
+  /// \param tree_node_offsets The \c cl_ulong offsets of the first node of
+  /// each tree
+  /// \param tree_bucket_offsets The \c cl_ulong index of the first leaf bucket
+  /// of each tree among all leaf buckets of the forest, with \c num_trees+1
+  /// entries
+  /// \param tree_num_levels The \c cl_uint number of levels of each tree
+  /// \param num_leaf_buckets The total number of leaf buckets
+  /// \param num_nodes The total number of nodes
+  void build_forest(const qcl::device_context_ptr& ctx,
+                    const cl::Buffer& particles,
+                    const cl::Buffer& tree_particle_offsets,
+                    const cl::Buffer& tree_node_offsets,
+                    const cl::Buffer& tree_bucket_offsets,
+                    const cl::Buffer& tree_num_levels,
+                    std::size_t num_trees,
+                    std::size_t num_leaf_buckets,
+                    std::size_t num_nodes,
+                    const cl::Buffer& nodes0,
+                    const cl::Buffer& nodes1)
+  {
+    if(num_leaf_buckets == 0)
+      return;
+
+    // The counters of the trees are stored like their nodes
+    this->init_arrival_counters(ctx, num_nodes);
+
+    cl_int err = bottom_up_build_forest(ctx,
+                                        cl::NDRange{num_leaf_buckets},
+                                        cl::NDRange{local_size})(
+          particles,
+          tree_particle_offsets,
+          tree_node_offsets,
+          tree_bucket_offsets,
+          tree_num_levels,
+          static_cast<cl_uint>(num_trees),
+          nodes0,
+          nodes1,
+          _arrival_counters.get_buffer());
+    qcl::check_cl_error(err, "Could not enqueue bottom_up_build_forest kernel");
+  }
+
+private:
+  static constexpr std::size_t local_size = 256;
+
+  void init_arrival_counters(const qcl::device_context_ptr& ctx,
+                             std::size_t num_counters)
+  {
+    // One counter per node, indexed like the nodes themselves. The counters
+    // are reset by the work items when they build the parent node, so they
+    // only need to be initialized once.
+    if(_arrival_counters.size() != num_counters)
+    {
+      _arrival_counters = get_memory_pool(ctx)->allocate<cl_uint>(num_counters);
+
+      cl_int err = bottom_up_reset_counters(ctx,
+                                            cl::NDRange{num_counters},
+                                            cl::NDRange{local_size})(
+            _arrival_counters.get_buffer(),
+            static_cast<cl_ulong>(num_counters));
+      qcl::check_cl_error(err, "Could not enqueue bottom_up_reset_counters kernel");
+    }
+  }
+
+  device_memory_pool::pooled_array<cl_uint> _arrival_counters;
+
+  QCL_ENTRYPOINT(bottom_up_reset_counters)
+  QCL_ENTRYPOINT(bottom_up_build_tree)
+  QCL_ENTRYPOINT(bottom_up_build_forest)
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(binary_tree)
+    QCL_INCLUDE_MODULE(Combiner)
+    QCL_IMPORT_TYPE(node_type0)
+    QCL_IMPORT_TYPE(node_type1)
+    QCL_IMPORT_CONSTANT(leaf_bucket_size)
+    QCL_IMPORT_CONSTANT(leaf_bucket_depth)
+    R"(
+      // Loads bypassing non-coherent caches, since the data has been
+      // written by other work items during the same kernel launch
+      #define BOTTOM_UP_LOAD(type, buffer, idx) \
+        (*((volatile __global type*)((buffer) + (idx))))
+    )"
+    QCL_RAW
+    (
+      __kernel void bottom_up_reset_counters(__global uint* arrival_counters,
+                                             ulong num_counters)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_counters;
+            tid += get_global_size(0))
+          arrival_counters[tid] = 0;
+      }
+
+      /// Builds the leaf bucket \c bucket_idx and all parents
+      /// for which it is the last child to arrive
+      void bottom_up_build_from_bucket(__global particle_type* particles,
+                                       index_type num_particles,
+                                       uint num_levels,
+                                       __global node_type0* nodes0,
+                                       __global node_type1* nodes1,
+                                       __global uint* arrival_counters,
+                                       index_type bucket_idx)
+      {
+        binary_tree_key_t node_key;
+        binary_tree_key_init(&node_key, num_levels - 1 - leaf_bucket_depth, bucket_idx);
+
+        const index_type particles_begin = bucket_idx << leaf_bucket_depth;
+        const index_type particles_end = min(particles_begin + leaf_bucket_size,
+                                             num_particles);
+
+        node_type0 node_value0;
+        node_type1 node_value1;
+        bottom_up_build_leaf_node(particles,
+                                  particles_begin,
+                                  particles_end,
+                                  &node_value0,
+                                  &node_value1);
+
+        index_type node_idx = binary_tree_key_encode_node_index(&node_key,
+                                                                num_levels,
+                                                                num_particles,
+                                                                leaf_bucket_depth);
+        nodes0[node_idx] = node_value0;
+        nodes1[node_idx] = node_value1;
+
+        while(node_key.level > 0)
+        {
+          // Make sure the node is visible to the work item
+          // that will build the parent
+          mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+          binary_tree_key_t parent_key = binary_tree_get_parent(&node_key);
+          binary_tree_key_t left_child = binary_tree_get_children_begin(&parent_key);
+          binary_tree_key_t right_child = binary_tree_get_children_last(&parent_key);
+
+          const index_type parent_idx =
+              binary_tree_key_encode_node_index(&parent_key, num_levels,
+                                                num_particles, leaf_bucket_depth);
+
+          const int right_child_exists = binary_tree_is_node_used(&right_child,
+                                                                  num_levels,
+                                                                  num_particles);
+          if(right_child_exists)
+          {
+            // The first child to arrive is done, the second one
+            // builds the parent.
+            if(atomic_inc(arrival_counters + parent_idx) == 0)
+              return;
+            // Reset the counter for the next build
+            arrival_counters[parent_idx] = 0;
+            mem_fence(CLK_GLOBAL_MEM_FENCE);
+          }
+
+          const index_type left_idx =
+              binary_tree_key_encode_node_index(&left_child, num_levels,
+                                                num_particles, leaf_bucket_depth);
+
+          node_type0 left_value0 = BOTTOM_UP_LOAD(node_type0, nodes0, left_idx);
+          node_type1 left_value1 = BOTTOM_UP_LOAD(node_type1, nodes1, left_idx);
+          node_type0 right_value0 = left_value0;
+          node_type1 right_value1 = left_value1;
+          if(right_child_exists)
+          {
+            right_value0 = BOTTOM_UP_LOAD(node_type0, nodes0, left_idx + 1);
+            right_value1 = BOTTOM_UP_LOAD(node_type1, nodes1, left_idx + 1);
+          }
+
+          bottom_up_combine_nodes(left_value0, left_value1,
+                                  right_value0, right_value1,
+                                  right_child_exists,
+                                  &node_value0, &node_value1);
+
+          nodes0[parent_idx] = node_value0;
+          nodes1[parent_idx] = node_value1;
+
+          node_key = parent_key;
+        }
+      }
+
+      __kernel void bottom_up_build_tree(__global particle_type* particles,
+                                         index_type num_particles,
+                                         uint num_levels,
+                                         __global node_type0* nodes0,
+                                         __global node_type1* nodes1,
+                                         __global uint* arrival_counters)
+      {
+        const index_type num_lowest_level_nodes =
+            (num_particles + leaf_bucket_size - 1) >> leaf_bucket_depth;
+
+        for(index_type tid = get_global_id(0);
+            tid < num_lowest_level_nodes;
+            tid += get_global_size(0))
+          bottom_up_build_from_bucket(particles, num_particles, num_levels,
+                                      nodes0, nodes1, arrival_counters, tid);
+      }
+
+      __kernel void bottom_up_build_forest(__global particle_type* particles,
+                                           __global ulong* tree_particle_offsets,
+                                           __global ulong* tree_node_offsets,
+                                           __global ulong* tree_bucket_offsets,
+                                           __global uint* tree_num_levels,
+                                           uint num_trees,
+                                           __global node_type0* nodes0,
+                                           __global node_type1* nodes1,
+                                           __global uint* arrival_counters)
+      {
+        const index_type num_lowest_level_nodes = tree_bucket_offsets[num_trees];
+
+        for(index_type tid = get_global_id(0);
+            tid < num_lowest_level_nodes;
+            tid += get_global_size(0))
+        {
+          // Find the last tree whose first bucket is not behind this one.
+          // Empty trees have no buckets and are skipped automatically.
+          uint tree = 0;
+          uint trees_end = num_trees;
+          while(trees_end - tree > 1)
+          {
+            const uint mid = (tree + trees_end) / 2;
+            if(tree_bucket_offsets[mid] <= tid)
+              tree = mid;
+            else
+              trees_end = mid;
+          }
+
+          const index_type particles_begin = tree_particle_offsets[tree];
+          const index_type node_offset = tree_node_offsets[tree];
+
+          bottom_up_build_from_bucket(particles + particles_begin,
+                                      tree_particle_offsets[tree + 1] - particles_begin,
+                                      tree_num_levels[tree],
+                                      nodes0 + node_offset,
+                                      nodes1 + node_offset,
+                                      arrival_counters + node_offset,
+                                      tid - tree_bucket_offsets[tree]);
+        }
+      }
+    )
+  )
+};
+
+}
+
+#endif
@@ -0,0 +1,563 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DISTRIBUTED_TREE_HPP
+#define DISTRIBUTED_TREE_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_array.hpp>
+#include <QCL/qcl_boost_compat.hpp>
+
+#include <boost/compute.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include "../configuration.hpp"
+#include "../particle_extent.hpp"
+
+namespace spatialcl {
+
+/// The bounding boxes of the slices of a partitioned tree, i.e. a tree
+/// that consists of several trees over contiguous ranges of the sorted
+/// particles (see \c distributed_tree and \c out_of_core_tree). Queries
+/// use them to only run on the slices they may find results in.
+template<class Type_descriptor>
+class slice_bounding_boxes
+{
+public:
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+  using scalar = typename configuration<Type_descriptor>::scalar;
+
+  static constexpr std::size_t dimension = Type_descriptor::dimension;
+
+  std::size_t size() const
+  {
+    return _min_corners.size();
+  }
+
+  void resize(std::size_t num_slices)
+  {
+    _min_corners.resize(num_slices);
+    _max_corners.resize(num_slices);
+  }
+
+  /// Enqueues the download of the bounding box of the root node of \c tree,
+  /// which is the last node (see binary_tree.hpp), as box of \c slice.
+  /// The box is only valid once the command queue of the tree has finished,
+  /// and the boxes must not be resized in the meantime.
+  template<class Tree_type>
+  void read_root_bounding_box(std::size_t slice, const Tree_type& tree)
+  {
+    assert(slice < size());
+    assert(tree.get_num_nodes() > 0);
+
+    const std::size_t root_offset = (tree.get_num_nodes() - 1) * sizeof(vector_type);
+    const cl::CommandQueue& queue = tree.get_device_context()->get_command_queue();
+
+    cl_int err = queue.enqueueReadBuffer(tree.get_bbox_min_corners(), CL_FALSE,
+                                         root_offset, sizeof(vector_type),
+                                         &_min_corners[slice]);
+    qcl::check_cl_error(err, "Could not read slice bounding box");
+    err = queue.enqueueReadBuffer(tree.get_bbox_max_corners(), CL_FALSE,
+                                  root_offset, sizeof(vector_type),
+                                  &_max_corners[slice]);
+    qcl::check_cl_error(err, "Could not read slice bounding box");
+  }
+
+  const vector_type& get_min_corner(std::size_t slice) const
+  {
+    assert(slice < size());
+    return _min_corners[slice];
+  }
+
+  const vector_type& get_max_corner(std::size_t slice) const
+  {
+    assert(slice < size());
+    return _max_corners[slice];
+  }
+
+  /// \return Whether the bounding box of \c slice intersects
+  /// the box given by \c box_min and \c box_max
+  bool overlaps_box(std::size_t slice,
+                    const vector_type& box_min,
+                    const vector_type& box_max) const
+  {
+    const vector_type& slice_min = get_min_corner(slice);
+    const vector_type& slice_max = get_max_corner(slice);
+
+    for(std::size_t i = 0; i < dimension; ++i)
+      if(box_max.s[i] < slice_min.s[i] || box_min.s[i] > slice_max.s[i])
+        return false;
+    return true;
+  }
+
+  /// \return The squared distance of \c point to the bounding box
+  /// of \c slice, or zero if the box contains the point
+  scalar get_distance2(std::size_t slice,
+                       const vector_type& point) const
+  {
+    const vector_type& slice_min = get_min_corner(slice);
+    const vector_type& slice_max = get_max_corner(slice);
+
+    scalar result = 0;
+    for(std::size_t i = 0; i < dimension; ++i)
+    {
+      const scalar delta = std::max({slice_min.s[i] - point.s[i],
+                                     point.s[i] - slice_max.s[i],
+                                     scalar{0}});
+      result += delta * delta;
+    }
+    return result;
+  }
+
+private:
+  std::vector<vector_type> _min_corners;
+  std::vector<vector_type> _max_corners;
+};
+
+/// A particle tree that is distributed across several devices. The particles
+/// are ordered along the space filling curve of the sorter, and the ordered
+/// particles are split into contiguous slices of about equal size, one per
+/// device. Each slice hence covers a contiguous range of the global sort
+/// keys, and each device builds a tree of type \c Tree_type over its slice.
+///
+/// The build never sorts all particles on one device:
+/// 1. The particles are split into equal parts, one per device. Each device
+///    calculates the extent of its part, and the extents are combined into
+///    the extent of all particles.
+/// 2. Each device generates the keys of its part relative to this extent
+///    and sorts its part by these keys.
+/// 3. The slice boundaries are chosen as quantiles of a sample of the
+///    sorted keys of all devices, and located in the keys of each device.
+/// 4. Each device receives the particles of its slice from all devices.
+///    Since these are sorted runs, they are merged on the host and the
+///    tree of the slice is built without sorting again.
+///
+/// The bounding boxes of the slices form the top level of the distributed
+/// tree. Queries use them to only run on the devices whose slices they may
+/// find results in (see \c query::distributed_box_range_query and
+/// \c query::distributed_knn_query). With one slice per device there are
+/// only a few boxes, so the queries test them in turn instead of descending
+/// a tree over them. Since each device has its own command queue, the
+/// devices process their queries concurrently.
+///
+/// Particle indices reported by a query on device \c i refer to the sorted
+/// particles of \c get_slice_tree(i). Adding \c get_particle_offset(i) turns
+/// them into indices of the concatenated sorted particles of all devices.
+/// \tparam Tree_type The tree type of the slices. Must be derived from
+/// \c particle_bvh_tree and sorted by a \c key_based_sorter with a key
+/// generator that accepts the particle extent, e.g. \c hilbert_sort_key_generator.
+template<class Tree_type>
+class distributed_tree
+{
+public:
+  using tree_type = Tree_type;
+  using type_system = typename Tree_type::type_system;
+  using sorter_type = typename Tree_type::sorter_type;
+  using key_generator_type = typename sorter_type::key_generator_type;
+  using sort_engine_type = typename sorter_type::sort_engine_type;
+  using key_type = typename key_generator_type::key_type;
+  using particle_type = typename configuration<type_system>::particle_type;
+  using vector_type = typename configuration<type_system>::vector_type;
+  using scalar = typename configuration<type_system>::scalar;
+
+  static constexpr std::size_t dimension = type_system::dimension;
+  /// The number of sort keys that each device contributes to the
+  /// sample from which the slice boundaries are chosen, per slice
+  static constexpr std::size_t samples_per_slice = 64;
+
+  /// Sorts the particles across the devices and builds the trees
+  /// of the slices. Blocks until all trees have been built.
+  /// \param device_contexts The devices to distribute the tree across.
+  /// If there are fewer particles than devices, only the first devices
+  /// receive a slice. Devices whose slices would be empty because
+  /// many particles share the same key do not receive a slice either.
+  distributed_tree(const std::vector<qcl::device_context_ptr>& device_contexts,
+                   const std::vector<particle_type>& particles,
+                   const sorter_type& sorter = sorter_type{})
+    : _num_particles{particles.size()}
+  {
+    if(device_contexts.empty())
+      throw std::invalid_argument{"A distributed tree requires at least one device"};
+
+    if(particles.empty())
+      return;
+
+    const std::size_t num_slices = std::min(device_contexts.size(), particles.size());
+
+    std::vector<device_part> parts = this->sort_parts(device_contexts, num_slices, particles);
+    this->split_parts(parts, num_slices);
+    // The particles arrive at the slices in the order of the keys
+    this->build_slices(device_contexts, parts, num_slices, sorter.presorted());
+
+    this->update_slice_bounds();
+  }
+
+  /// \return The number of devices that have received a slice
+  std::size_t get_num_slices() const
+  {
+    return _slices.size();
+  }
+
+  std::size_t get_num_particles() const
+  {
+    return _num_particles;
+  }
+
+  const Tree_type& get_slice_tree(std::size_t device) const
+  {
+    assert(device < _slices.size());
+    return *(_slices[device].tree);
+  }
+
+  Tree_type& get_slice_tree(std::size_t device)
+  {
+    assert(device < _slices.size());
+    return *(_slices[device].tree);
+  }
+
+  const qcl::device_context_ptr& get_slice_context(std::size_t device) const
+  {
+    return get_slice_tree(device).get_device_context();
+  }
+
+  /// \return The position of the first particle of the slice of \c device
+  /// in the concatenated sorted particles of all devices
+  std::size_t get_particle_offset(std::size_t device) const
+  {
+    assert(device < _slices.size());
+    return _slices[device].particle_offset;
+  }
+
+  const vector_type& get_slice_min_corner(std::size_t device) const
+  {
+    return _bounds.get_min_corner(device);
+  }
+
+  const vector_type& get_slice_max_corner(std::size_t device) const
+  {
+    return _bounds.get_max_corner(device);
+  }
+
+  /// \return Whether the bounding box of the slice of \c device
+  /// intersects the box given by \c box_min and \c box_max
+  bool slice_overlaps_box(std::size_t device,
+                          const vector_type& box_min,
+                          const vector_type& box_max) const
+  {
+    return _bounds.overlaps_box(device, box_min, box_max);
+  }
+
+  /// \return The squared distance of \c point to the bounding box
+  /// of the slice of \c device, or zero if the box contains the point
+  scalar get_slice_distance2(std::size_t device,
+                             const vector_type& point) const
+  {
+    return _bounds.get_distance2(device, point);
+  }
+
+  /// Refits the trees of all devices (see \c particle_bvh_tree::refit())
+  /// and updates the bounding boxes of the slices. Particles remain in
+  /// their slices, so the distributed tree should be rebuilt once particles
+  /// have moved far.
+  void refit()
+  {
+    for(slice& current_slice : _slices)
+    {
+      current_slice.tree->refit();
+      cl_int err = current_slice.tree->get_device_context()->get_command_queue().flush();
+      qcl::check_cl_error(err, "Could not flush command queue");
+    }
+    this->update_slice_bounds();
+  }
+
+  /// Blocks until all commands on all devices have completed
+  void finish() const
+  {
+    for(const slice& current_slice : _slices)
+    {
+      cl_int err = current_slice.tree->get_device_context()->get_command_queue().finish();
+      qcl::check_cl_error(err, "Error while waiting for device");
+    }
+  }
+
+private:
+  struct slice
+  {
+    std::unique_ptr<Tree_type> tree;
+    std::size_t particle_offset;
+  };
+
+  /// The part of the particles that a device sorts during the build
+  struct device_part
+  {
+    qcl::device_context_ptr ctx;
+    std::size_t num_particles;
+    qcl::device_array<particle_type> particles;
+    qcl::device_array<key_type> keys;
+    qcl::device_array<vector_type> extent;
+    /// The position of the first particle of each slice in the
+    /// sorted part, followed by the number of particles of the part
+    std::vector<std::size_t> slice_begin;
+  };
+
+  /// Distributes the particles across the first \c num_parts devices and
+  /// sorts each part by the keys relative to the extent of all particles
+  std::vector<device_part> sort_parts(const std::vector<qcl::device_context_ptr>& device_contexts,
+                                      std::size_t num_parts,
+                                      const std::vector<particle_type>& particles) const
+  {
+    std::vector<device_part> parts(num_parts);
+    std::vector<vector_type> part_extents(2 * num_parts);
+    particle_extent<type_system> extent_reducer;
+
+    for(std::size_t i = 0; i < num_parts; ++i)
+    {
+      const std::size_t part_begin = i * particles.size() / num_parts;
+      const std::size_t part_end = (i + 1) * particles.size() / num_parts;
+
+      device_part& part = parts[i];
+      part.ctx = device_contexts[i];
+      part.num_particles = part_end - part_begin;
+      part.particles = qcl::device_array<particle_type>{part.ctx, part.num_particles};
+      part.keys = qcl::device_array<key_type>{part.ctx, part.num_particles};
+      part.extent = qcl::device_array<vector_type>{part.ctx, 2};
+
+      const cl::CommandQueue& queue = part.ctx->get_command_queue();
+      cl_int err = queue.enqueueWriteBuffer(part.particles.get_buffer(), CL_FALSE,
+                                            0, part.num_particles * sizeof(particle_type),
+                                            particles.data() + part_begin);
+      qcl::check_cl_error(err, "Could not upload particles");
+
+      extent_reducer(part.ctx, part.particles.get_buffer(), part.num_particles,
+                     part.extent.get_buffer());
+
+      err = queue.enqueueReadBuffer(part.extent.get_buffer(), CL_FALSE,
+                                    0, 2 * sizeof(vector_type), &part_extents[2 * i]);
+      qcl::check_cl_error(err, "Could not read particle extent");
+      err = queue.flush();
+      qcl::check_cl_error(err, "Could not flush command queue");
+    }
+    this->finish_parts(parts);
+
+    std::vector<vector_type> global_extent{part_extents[0], part_extents[1]};
+    for(std::size_t i = 1; i < num_parts; ++i)
+      for(std::size_t j = 0; j < dimension; ++j)
+      {
+        global_extent[0].s[j] = std::min(global_extent[0].s[j], part_extents[2 * i].s[j]);
+        global_extent[1].s[j] = std::max(global_extent[1].s[j], part_extents[2 * i + 1].s[j]);
+      }
+
+    key_generator_type key_generator;
+    sort_engine_type sort_engine;
+    for(device_part& part : parts)
+    {
+      const cl::CommandQueue& queue = part.ctx->get_command_queue();
+      cl_int err = queue.enqueueWriteBuffer(part.extent.get_buffer(), CL_TRUE,
+                                            0, 2 * sizeof(vector_type),
+                                            global_extent.data());
+      qcl::check_cl_error(err, "Could not write particle extent");
+
+      key_generator(part.ctx,
+                    part.particles.get_buffer(),
+                    part.num_particles,
+                    part.extent.get_buffer(),
+                    part.keys.get_buffer());
+
+      sort_engine(part.ctx,
+                  part.keys.get_buffer(),
+                  part.particles.get_buffer(),
+                  part.num_particles,
+                  key_generator_type::num_key_bits);
+
+      err = queue.flush();
+      qcl::check_cl_error(err, "Could not flush command queue");
+    }
+
+    return parts;
+  }
+
+  /// Chooses the keys at which the slices begin from a sample of the
+  /// sorted keys of all parts, and locates them in each part
+  void split_parts(std::vector<device_part>& parts,
+                   std::size_t num_slices) const
+  {
+    std::size_t num_samples = 0;
+    for(const device_part& part : parts)
+      num_samples += std::min(part.num_particles, samples_per_slice * num_slices);
+
+    std::vector<key_type> samples(num_samples);
+    std::size_t sample = 0;
+    for(const device_part& part : parts)
+    {
+      const std::size_t num_part_samples =
+          std::min(part.num_particles, samples_per_slice * num_slices);
+
+      for(std::size_t i = 0; i < num_part_samples; ++i, ++sample)
+      {
+        const std::size_t position = i * part.num_particles / num_part_samples;
+        cl_int err = part.ctx->get_command_queue().enqueueReadBuffer(
+              part.keys.get_buffer(), CL_FALSE,
+              position * sizeof(key_type), sizeof(key_type), &samples[sample]);
+        qcl::check_cl_error(err, "Could not read key sample");
+      }
+    }
+    this->finish_parts(parts);
+
+    std::sort(samples.begin(), samples.end());
+
+    for(device_part& part : parts)
+    {
+      boost::compute::command_queue boost_queue{
+        part.ctx->get_command_queue().get()
+      };
+      auto keys_begin = qcl::create_buffer_iterator<key_type>(part.keys.get_buffer(), 0);
+      auto keys_end = qcl::create_buffer_iterator<key_type>(part.keys.get_buffer(),
+                                                            part.num_particles);
+
+      part.slice_begin.assign(1, 0);
+      for(std::size_t i = 1; i < num_slices; ++i)
+      {
+        const key_type splitter = samples[i * num_samples / num_slices];
+        auto slice_begin = boost::compute::lower_bound(keys_begin, keys_end,
+                                                       splitter, boost_queue);
+        part.slice_begin.push_back(static_cast<std::size_t>(slice_begin - keys_begin));
+      }
+      part.slice_begin.push_back(part.num_particles);
+    }
+  }
+
+  /// Collects the particles of each slice from all parts, merges them by
+  /// their keys and builds the tree of the slice on its device
+  void build_slices(const std::vector<qcl::device_context_ptr>& device_contexts,
+                    const std::vector<device_part>& parts,
+                    std::size_t num_slices,
+                    const sorter_type& presorted_sorter)
+  {
+    std::size_t particle_offset = 0;
+    for(std::size_t i = 0; i < num_slices; ++i)
+    {
+      std::vector<std::size_t> run_begin{0};
+      for(const device_part& part : parts)
+        run_begin.push_back(run_begin.back() +
+                            part.slice_begin[i + 1] - part.slice_begin[i]);
+
+      const std::size_t num_slice_particles = run_begin.back();
+      if(num_slice_particles == 0)
+        continue;
+
+      // Only the particles of the slice leave their devices
+      std::vector<key_type> run_keys(num_slice_particles);
+      std::vector<particle_type> run_particles(num_slice_particles);
+      std::vector<cl::Event> read_events;
+      for(std::size_t j = 0; j < parts.size(); ++j)
+      {
+        const device_part& part = parts[j];
+        const std::size_t num_run_particles = run_begin[j + 1] - run_begin[j];
+        if(num_run_particles == 0)
+          continue;
+
+        const cl::CommandQueue& queue = part.ctx->get_command_queue();
+        read_events.push_back(cl::Event{});
+        cl_int err = queue.enqueueReadBuffer(part.keys.get_buffer(), CL_FALSE,
+                                             part.slice_begin[i] * sizeof(key_type),
+                                             num_run_particles * sizeof(key_type),
+                                             run_keys.data() + run_begin[j],
+                                             nullptr, &read_events.back());
+        qcl::check_cl_error(err, "Could not read slice keys");
+        read_events.push_back(cl::Event{});
+        err = queue.enqueueReadBuffer(part.particles.get_buffer(), CL_FALSE,
+                                      part.slice_begin[i] * sizeof(particle_type),
+                                      num_run_particles * sizeof(particle_type),
+                                      run_particles.data() + run_begin[j],
+                                      nullptr, &read_events.back());
+        qcl::check_cl_error(err, "Could not read slice particles");
+        err = queue.flush();
+        qcl::check_cl_error(err, "Could not flush command queue");
+      }
+      // Wait for the reads only, not for the trees that are being built
+      for(cl::Event& evt : read_events)
+      {
+        cl_int err = evt.wait();
+        qcl::check_cl_error(err, "Error while reading slice");
+      }
+
+      std::vector<std::size_t> order(num_slice_particles);
+      std::iota(order.begin(), order.end(), 0);
+      for(std::size_t j = 1; j < parts.size(); ++j)
+        std::inplace_merge(order.begin(),
+                           order.begin() + run_begin[j],
+                           order.begin() + run_begin[j + 1],
+                           [&run_keys](std::size_t a, std::size_t b)
+                           { return run_keys[a] < run_keys[b]; });
+
+      std::vector<particle_type> slice_particles(num_slice_particles);
+      for(std::size_t j = 0; j < num_slice_particles; ++j)
+        slice_particles[j] = run_particles[order[j]];
+
+      slice current_slice;
+      current_slice.particle_offset = particle_offset;
+      current_slice.tree.reset(new Tree_type{device_contexts[i],
+                                             slice_particles,
+                                             presorted_sorter});
+      _slices.push_back(std::move(current_slice));
+
+      particle_offset += num_slice_particles;
+    }
+  }
+
+  void finish_parts(const std::vector<device_part>& parts) const
+  {
+    for(const device_part& part : parts)
+    {
+      cl_int err = part.ctx->get_command_queue().finish();
+      qcl::check_cl_error(err, "Error while waiting for device");
+    }
+  }
+
+  void update_slice_bounds()
+  {
+    _bounds.resize(_slices.size());
+    for(std::size_t i = 0; i < _slices.size(); ++i)
+      _bounds.read_root_bounding_box(i, *(_slices[i].tree));
+    this->finish();
+  }
+
+  std::vector<slice> _slices;
+  slice_bounding_boxes<type_system> _bounds;
+  std::size_t _num_particles;
+};
+
+}
+
+#endif
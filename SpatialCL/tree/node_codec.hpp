@@ -0,0 +1,336 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NODE_CODEC_HPP
+#define NODE_CODEC_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+
+#include <type_traits>
+
+#include "../configuration.hpp"
+#include "binary_tree.hpp"
+
+namespace spatialcl {
+
+/// Node codecs define how the query engines read the node values
+/// from the node storage of a tree. A codec is a QCL module that
+/// defines the types \c storage_node_type0 and \c storage_node_type1
+/// of the node buffers, and the macro
+/// \code
+/// load_tree_node(node_values0, node_values1, node_idx,
+///                node_value0_ptr, node_value1_ptr)
+/// \endcode
+/// which stores the values of the node \c node_idx as \c node_type0
+/// and \c node_type1 in \c *node_value0_ptr and \c *node_value1_ptr.
+///
+/// Values that are shared by all nodes are loaded only once: a codec also
+/// defines the type \c node_codec_state_t and the function
+/// \code
+/// node_codec_state_t node_codec_init_state(node_values0, node_values1)
+/// \endcode
+/// The engines store its result in a variable \c node_codec_state before
+/// the traversal (or pass it as parameter of this name to functions that
+/// load nodes), which \c load_tree_node may read.
+///
+/// The state of codecs that do not need one.
+class stateless_node_codec
+{
+public:
+  QCL_MAKE_MODULE(stateless_node_codec)
+
+private:
+  QCL_MAKE_SOURCE
+  (
+    QCL_RAW
+    (
+      typedef struct
+      {
+        uchar unused;
+      } node_codec_state_t;
+
+      node_codec_state_t node_codec_empty_state()
+      {
+        node_codec_state_t state;
+        state.unused = 0;
+        return state;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      node_codec_init_state(node_values0, node_values1)
+        node_codec_empty_state()
+    )
+  )
+};
+
+/// This codec reads the node values as they are stored.
+template<class Node_type0, class Node_type1>
+class identity_node_codec
+{
+public:
+  QCL_MAKE_MODULE(identity_node_codec)
+
+  using storage_node_type0 = Node_type0;
+  using storage_node_type1 = Node_type1;
+
+private:
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(stateless_node_codec)
+    QCL_IMPORT_TYPE(storage_node_type0)
+    QCL_IMPORT_TYPE(storage_node_type1)
+    QCL_PREPROCESSOR(define,
+      load_tree_node(node_values0,
+                     node_values1,
+                     node_idx,
+                     node_value0_ptr,
+                     node_value1_ptr)
+      {
+        *(node_value0_ptr) = (node_values0)[node_idx];
+        *(node_value1_ptr) = (node_values1)[node_idx];
+      }
+    )
+  )
+};
+
+/// Codec for bounding boxes that are quantized to 16 bit integer
+/// coordinates relative to the bounding box of the root node.
+/// The first node buffer contains the quantized minimum and maximum
+/// corners of each node (as \c ushort4 in 2D and \c ushort8 in 3D), the
+/// second buffer only contains two vectors, the origin and the cell size of the
+/// quantization grid. The grid is part of the codec state, so it is only
+/// loaded once instead of with every node. Boxes are rounded outwards during
+/// the quantization, so the decoded boxes always contain the original boxes.
+template<class Type_descriptor>
+class quantized_bbox_codec
+{
+public:
+  QCL_MAKE_MODULE(quantized_bbox_codec)
+
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+  using quantized_bbox_type =
+      typename std::conditional<Type_descriptor::dimension == 2,
+                                cl_ushort4,
+                                cl_ushort8>::type;
+
+  using storage_node_type0 = quantized_bbox_type;
+  using storage_node_type1 = vector_type;
+
+  /// The largest quantized coordinate
+  static constexpr unsigned max_quantized_coordinate = 65535;
+
+private:
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_IMPORT_TYPE(storage_node_type0)
+    QCL_IMPORT_TYPE(storage_node_type1)
+    QCL_IMPORT_CONSTANT(max_quantized_coordinate)
+    R"(
+      #if dimension == 2
+        #define QUANTIZED_BBOX_MIN(q) ((vector_type)((scalar)(q).s0, (scalar)(q).s1))
+        #define QUANTIZED_BBOX_MAX(q) ((vector_type)((scalar)(q).s2, (scalar)(q).s3))
+        #define MAKE_QUANTIZED_BBOX(min_corner, max_corner) \
+          ((ushort4)(convert_ushort2_sat(min_corner), convert_ushort2_sat(max_corner)))
+      #else
+        #define QUANTIZED_BBOX_MIN(q) \
+          ((vector_type)((scalar)(q).s0, (scalar)(q).s1, (scalar)(q).s2, (scalar)0))
+        #define QUANTIZED_BBOX_MAX(q) \
+          ((vector_type)((scalar)(q).s4, (scalar)(q).s5, (scalar)(q).s6, (scalar)0))
+        #define MAKE_QUANTIZED_BBOX(min_corner, max_corner) \
+          ((ushort8)(convert_ushort4_sat(min_corner), convert_ushort4_sat(max_corner)))
+      #endif
+    )"
+    QCL_PREPROCESSOR(define,
+      load_tree_node(node_values0,
+                     node_values1,
+                     node_idx,
+                     node_value0_ptr,
+                     node_value1_ptr)
+      {
+        const storage_node_type0 quantized_bbox = (node_values0)[node_idx];
+
+        *(node_value0_ptr) = node_codec_state.grid_origin +
+                             node_codec_state.grid_cell_size * QUANTIZED_BBOX_MIN(quantized_bbox);
+        *(node_value1_ptr) = node_codec_state.grid_origin +
+                             node_codec_state.grid_cell_size * QUANTIZED_BBOX_MAX(quantized_bbox);
+      }
+    )
+    QCL_RAW
+    (
+      typedef struct
+      {
+        vector_type grid_origin;
+        vector_type grid_cell_size;
+      } node_codec_state_t;
+
+      node_codec_state_t node_codec_init_state(__global storage_node_type0* node_values0,
+                                               __global storage_node_type1* node_values1)
+      {
+        node_codec_state_t state;
+        state.grid_origin = node_values1[0];
+        state.grid_cell_size = node_values1[1];
+        return state;
+      }
+
+      /// Quantizes a bounding box such that the decoded box
+      /// contains the original box. The additional grid cell on each
+      /// side absorbs the rounding errors of the decoding.
+      storage_node_type0 quantize_bbox(vector_type bbox_min,
+                                       vector_type bbox_max,
+                                       vector_type grid_origin,
+                                       vector_type grid_cell_size)
+      {
+        vector_type quantized_min = floor((bbox_min - grid_origin) / grid_cell_size) - (scalar)1;
+        vector_type quantized_max = ceil ((bbox_max - grid_origin) / grid_cell_size) + (scalar)1;
+
+        quantized_min = fmax(quantized_min, (vector_type)0);
+        quantized_max = fmin(quantized_max, (vector_type)max_quantized_coordinate);
+
+        return MAKE_QUANTIZED_BBOX(quantized_min, quantized_max);
+      }
+    )
+  )
+};
+
+
+/// Codec for bounding boxes of double precision trees that are stored
+/// as single precision offsets relative to double precision origins of
+/// the tree (see \c particle_mixed_precision_bvh_tree). Both node buffers
+/// contain the offsets of the corners (as \c float2 in 2D and \c float4
+/// in 3D), the minimum corners in the first buffer and the maximum corners
+/// in the second one. The offsets are passed to the handlers as they are,
+/// such that the node tests can be carried out in single precision.
+/// The corners are rounded outwards, so the offset boxes always contain the
+/// original boxes. Queries must be converted to offsets with
+/// \c mixed_precision_offset_min() and \c mixed_precision_offset_max(),
+/// which round outwards as well.
+///
+/// Each subtree below the nodes of level \c offset_origin_level has an
+/// origin of its own, the center of its root, since the single precision
+/// offsets are only accurate relative to the extent of the subtree. The
+/// nodes above these subtrees use the center of the root of the tree.
+/// \c mixed_precision_get_origin_index() yields the index of the origin
+/// of a node from its key, so queries can convert themselves again
+/// whenever the traversal enters another subtree.
+template<class Type_descriptor>
+class mixed_precision_bbox_codec
+{
+public:
+  QCL_MAKE_MODULE(mixed_precision_bbox_codec)
+
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+  using offset_vector_type =
+      typename cl_vector_type<float, Type_descriptor::dimension>::value;
+
+  using storage_node_type0 = offset_vector_type;
+  using storage_node_type1 = offset_vector_type;
+
+  /// The level (counted from the root) of the roots of the
+  /// subtrees that have an origin of their own
+  static constexpr unsigned offset_origin_level = 3;
+  /// The number of origins: one for the nodes above the subtrees,
+  /// and one per subtree
+  static constexpr std::size_t num_offset_origins = 1 + (1u << offset_origin_level);
+
+private:
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(binary_tree)
+    QCL_INCLUDE_MODULE(stateless_node_codec)
+    QCL_IMPORT_CONSTANT(offset_origin_level)
+    QCL_IMPORT_CONSTANT(num_offset_origins)
+    QCL_IMPORT_TYPE(offset_vector_type)
+    QCL_IMPORT_TYPE(storage_node_type0)
+    QCL_IMPORT_TYPE(storage_node_type1)
+    R"(
+      #if dimension == 2
+        #define CONVERT_OFFSET_RTN(v) convert_float2_rtn(v)
+        #define CONVERT_OFFSET_RTP(v) convert_float2_rtp(v)
+      #else
+        #define CONVERT_OFFSET_RTN(v) convert_float4_rtn(v)
+        #define CONVERT_OFFSET_RTP(v) convert_float4_rtp(v)
+      #endif
+    )"
+    QCL_PREPROCESSOR(define,
+      load_tree_node(node_values0,
+                     node_values1,
+                     node_idx,
+                     node_value0_ptr,
+                     node_value1_ptr)
+      {
+        *(node_value0_ptr) = (node_values0)[node_idx];
+        *(node_value1_ptr) = (node_values1)[node_idx];
+      }
+    )
+    QCL_RAW
+    (
+      /// The additional step towards -infinity absorbs the rounding
+      /// error of the double precision subtraction
+      offset_vector_type mixed_precision_offset_min(vector_type v,
+                                                    vector_type origin)
+      {
+        const offset_vector_type offset = CONVERT_OFFSET_RTN(v - origin);
+        return nextafter(offset, (offset_vector_type)(-INFINITY));
+      }
+
+      offset_vector_type mixed_precision_offset_max(vector_type v,
+                                                    vector_type origin)
+      {
+        const offset_vector_type offset = CONVERT_OFFSET_RTP(v - origin);
+        return nextafter(offset, (offset_vector_type)INFINITY);
+      }
+
+      /// \return The index of the origin of the offsets of a node
+      uint mixed_precision_get_origin_index(binary_tree_key_t* node_key)
+      {
+        if(node_key->level < offset_origin_level)
+          return 0;
+        return 1 + (uint)(node_key->local_node_id >>
+                          (node_key->level - offset_origin_level));
+      }
+
+      /// Single precision test for the intersection of two offset boxes
+      int mixed_precision_offset_box_intersection(offset_vector_type a_min,
+                                                  offset_vector_type a_max,
+                                                  offset_vector_type b_min,
+                                                  offset_vector_type b_max)
+      {
+        int_vector_type intersects = ((a_max >= b_min) && (b_max >= a_min));
+        return DIMENSIONALITY_SWITCH(intersects.x & intersects.y & 1,
+                                     intersects.x & intersects.y & intersects.z & 1);
+      }
+    )
+  )
+};
+
+}
+
+#endif
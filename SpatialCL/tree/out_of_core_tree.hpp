@@ -0,0 +1,566 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OUT_OF_CORE_TREE_HPP
+#define OUT_OF_CORE_TREE_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <memory>
+#include <numeric>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../configuration.hpp"
+#include "../particle_extent.hpp"
+#include "../file_utils.hpp"
+#include "distributed_tree.hpp"
+#include "tree_snapshot.hpp"
+
+namespace spatialcl {
+
+/// A particle tree for particle sets that do not fit into device memory.
+/// The tree is built in a streaming fashion, with at most \c chunk_size
+/// particles on the device at a time:
+/// 1. The bounding box of all particles is calculated chunk by chunk.
+/// 2. For each chunk, the sort keys relative to this bounding box are
+///    generated and sorted on the device together with the particle
+///    indices. The sorted chunks are downloaded and spilled to a run file
+///    in the snapshot directory as sorted runs.
+/// 3. The runs are streamed back from the run file and merged on the host,
+///    which yields the global order of the particles along the space
+///    filling curve. This order is cut into subtrees of \c chunk_size
+///    particles, each of which is built on the device without sorting
+///    again and saved as snapshot (see tree_snapshot.hpp).
+///
+/// The bounding boxes of the subtrees remain resident as top level of the
+/// tree. Subtrees are paged in from their snapshots when a query needs them,
+/// and at most \c max_resident_subtrees subtrees are kept on the device,
+/// evicting the least recently used subtree first. Queries are executed with
+/// the queries of distributed_query.hpp, which treat the subtrees as slices
+/// and only page in the subtrees that may contain results.
+///
+/// During the build, the host holds the particles of one subtree and a
+/// read buffer of \c run_buffer_size keys and indices per sorted run,
+/// independently of the total number of particles. The run file takes
+/// 12 bytes per particle on disk and is removed once the subtrees have
+/// been built. The particles themselves are only read from \c particles,
+/// which may e.g. be a memory-mapped file.
+///
+/// The snapshot names carry a prefix that is unique to the tree, such that
+/// several trees can share a snapshot directory. The snapshots are removed
+/// when the tree is destroyed.
+/// \tparam Tree_type The tree type of the subtrees. Must be derived from
+/// \c particle_bvh_tree and sorted by a \c key_based_sorter with a key
+/// generator that accepts the particle extent, e.g. \c hilbert_sort_key_generator.
+template<class Tree_type>
+class out_of_core_tree
+{
+public:
+  using tree_type = Tree_type;
+  using type_system = typename Tree_type::type_system;
+  using sorter_type = typename Tree_type::sorter_type;
+  using key_generator_type = typename sorter_type::key_generator_type;
+  using index_sort_engine_type = typename sorter_type::index_sort_engine_type;
+  using key_type = typename key_generator_type::key_type;
+  using particle_type = typename configuration<type_system>::particle_type;
+  using vector_type = typename configuration<type_system>::vector_type;
+  using scalar = typename configuration<type_system>::scalar;
+
+  static constexpr std::size_t dimension = type_system::dimension;
+  static constexpr std::size_t default_chunk_size = std::size_t{1} << 24;
+  /// The number of keys and indices that are read from the run file
+  /// at once for each sorted run while merging the runs
+  static constexpr std::size_t run_buffer_size = std::size_t{1} << 14;
+
+  /// Builds the tree and saves all subtrees. Blocks until the build
+  /// has completed.
+  /// \param particles The particles in host memory
+  /// \param snapshot_directory The directory in which the snapshots
+  /// of the subtrees are stored
+  /// \param chunk_size The number of particles that are processed at once,
+  /// which is also the size of the subtrees
+  /// \param max_resident_subtrees The maximum number of subtrees
+  /// that are kept on the device
+  /// \throws std::runtime_error if the snapshots or the run file
+  /// cannot be written
+  out_of_core_tree(const qcl::device_context_ptr& ctx,
+                   const particle_type* particles,
+                   std::size_t num_particles,
+                   const std::string& snapshot_directory,
+                   std::size_t chunk_size = default_chunk_size,
+                   std::size_t max_resident_subtrees = 4,
+                   const sorter_type& sorter = sorter_type{})
+    : _ctx{ctx},
+      _num_particles{num_particles},
+      _snapshot_prefix{utils::file::get_unique_name(snapshot_directory + "/subtree")},
+      _max_resident_subtrees{std::max<std::size_t>(max_resident_subtrees, 1)}
+  {
+    if(chunk_size == 0)
+      throw std::invalid_argument{"The chunk size must be non-zero"};
+    // The indices within a chunk are sorted as uint
+    assert(chunk_size <= static_cast<std::size_t>(CL_UINT_MAX));
+
+    if(num_particles == 0)
+      return;
+
+    chunk_size = std::min(chunk_size, num_particles);
+
+    qcl::device_array<particle_type> chunk{ctx, chunk_size};
+    qcl::device_array<vector_type> extent{ctx, 2};
+
+    const std::string run_filename = _snapshot_prefix + "_runs.tmp";
+    try
+    {
+      std::fstream run_file{run_filename.c_str(),
+                            std::ios::in | std::ios::out |
+                            std::ios::binary | std::ios::trunc};
+      if(!run_file)
+        throw std::runtime_error{"Could not create run file " + run_filename};
+
+      this->calculate_extent(particles, chunk, extent);
+      std::vector<sorted_run> runs = this->sort_chunks(particles, chunk, extent, run_file);
+      this->build_subtrees(particles, runs, run_file, chunk_size, sorter);
+    }
+    catch(...)
+    {
+      // The destructor is not called if the construction fails
+      std::remove(run_filename.c_str());
+      this->remove_snapshots();
+      throw;
+    }
+    std::remove(run_filename.c_str());
+  }
+
+  out_of_core_tree(const out_of_core_tree&) = delete;
+  out_of_core_tree& operator=(const out_of_core_tree&) = delete;
+
+  /// Removes the snapshots of the subtrees
+  ~out_of_core_tree()
+  {
+    this->remove_snapshots();
+  }
+
+  /// \return The number of subtrees
+  std::size_t get_num_slices() const
+  {
+    return _subtrees.size();
+  }
+
+  std::size_t get_num_particles() const
+  {
+    return _num_particles;
+  }
+
+  /// \return The number of subtrees that are currently on the device
+  std::size_t get_num_resident_subtrees() const
+  {
+    return _lru.size();
+  }
+
+  /// \return The tree of \c subtree. If it is not on the device, it is
+  /// loaded from its snapshot, which may evict the least recently used
+  /// subtree. References to evicted trees become invalid, but commands
+  /// that have already been enqueued for them remain valid.
+  Tree_type& get_slice_tree(std::size_t subtree)
+  {
+    assert(subtree < _subtrees.size());
+    subtree_info& info = _subtrees[subtree];
+
+    if(info.tree)
+    {
+      _lru.splice(_lru.begin(), _lru, info.lru_position);
+      return *(info.tree);
+    }
+
+    tree_snapshot_file file{info.snapshot_filename};
+    std::unique_ptr<Tree_type> tree{new Tree_type{_ctx, file.get_view()}};
+    // The snapshot must remain valid until it has been uploaded
+    cl_int err = _ctx->get_command_queue().finish();
+    qcl::check_cl_error(err, "Error while loading subtree");
+
+    this->make_resident(subtree, std::move(tree));
+    return *(info.tree);
+  }
+
+  const qcl::device_context_ptr& get_slice_context(std::size_t) const
+  {
+    return _ctx;
+  }
+
+  /// \return The position of the first particle of \c subtree
+  /// in the concatenated sorted particles of all subtrees
+  std::size_t get_particle_offset(std::size_t subtree) const
+  {
+    assert(subtree < _subtrees.size());
+    return _subtrees[subtree].particle_offset;
+  }
+
+  const std::string& get_snapshot_filename(std::size_t subtree) const
+  {
+    assert(subtree < _subtrees.size());
+    return _subtrees[subtree].snapshot_filename;
+  }
+
+  const vector_type& get_slice_min_corner(std::size_t subtree) const
+  {
+    return _bounds.get_min_corner(subtree);
+  }
+
+  const vector_type& get_slice_max_corner(std::size_t subtree) const
+  {
+    return _bounds.get_max_corner(subtree);
+  }
+
+  bool slice_overlaps_box(std::size_t subtree,
+                          const vector_type& box_min,
+                          const vector_type& box_max) const
+  {
+    return _bounds.overlaps_box(subtree, box_min, box_max);
+  }
+
+  scalar get_slice_distance2(std::size_t subtree,
+                             const vector_type& point) const
+  {
+    return _bounds.get_distance2(subtree, point);
+  }
+
+private:
+  struct subtree_info
+  {
+    std::string snapshot_filename;
+    std::size_t particle_offset;
+    std::unique_ptr<Tree_type> tree;
+    std::list<std::size_t>::iterator lru_position;
+  };
+
+  /// A chunk of particles sorted by their keys. The sorted keys and
+  /// indices are stored in the run file at the given offsets.
+  struct sorted_run
+  {
+    std::size_t particles_begin;
+    std::size_t num_particles;
+    std::uint64_t keys_offset;
+    std::uint64_t indices_offset;
+  };
+
+  /// The part of a sorted run that is currently read from the run file
+  struct run_buffer
+  {
+    std::size_t num_read = 0;
+    std::size_t position = 0;
+    std::vector<key_type> keys;
+    std::vector<cl_uint> indices;
+  };
+
+  void calculate_extent(const particle_type* particles,
+                        const qcl::device_array<particle_type>& chunk,
+                        qcl::device_array<vector_type>& extent) const
+  {
+    const std::size_t chunk_size = chunk.size();
+    const std::size_t num_chunks = (_num_particles + chunk_size - 1) / chunk_size;
+    std::vector<vector_type> chunk_extents(2 * num_chunks);
+
+    qcl::device_array<vector_type> chunk_extent{_ctx, 2};
+    particle_extent<type_system> extent_reducer;
+
+    for(std::size_t i = 0; i < num_chunks; ++i)
+    {
+      const std::size_t num_chunk_particles = this->upload_chunk(particles, chunk, i);
+      extent_reducer(_ctx, chunk.get_buffer(), num_chunk_particles, chunk_extent.get_buffer());
+
+      cl_int err = _ctx->get_command_queue().enqueueReadBuffer(
+            chunk_extent.get_buffer(), CL_FALSE,
+            0, 2 * sizeof(vector_type), &chunk_extents[2 * i]);
+      qcl::check_cl_error(err, "Could not read chunk extent");
+    }
+    cl_int err = _ctx->get_command_queue().finish();
+    qcl::check_cl_error(err, "Error while calculating the particle extent");
+
+    std::vector<vector_type> global_extent{chunk_extents[0], chunk_extents[1]};
+    for(std::size_t i = 1; i < num_chunks; ++i)
+      for(std::size_t j = 0; j < dimension; ++j)
+      {
+        global_extent[0].s[j] = std::min(global_extent[0].s[j], chunk_extents[2 * i].s[j]);
+        global_extent[1].s[j] = std::max(global_extent[1].s[j], chunk_extents[2 * i + 1].s[j]);
+      }
+
+    err = _ctx->get_command_queue().enqueueWriteBuffer(
+          extent.get_buffer(), CL_TRUE,
+          0, 2 * sizeof(vector_type), global_extent.data());
+    qcl::check_cl_error(err, "Could not write particle extent");
+  }
+
+  /// Sorts the chunks and writes them to \c run_file as sorted runs
+  std::vector<sorted_run> sort_chunks(const particle_type* particles,
+                                      const qcl::device_array<particle_type>& chunk,
+                                      const qcl::device_array<vector_type>& extent,
+                                      std::fstream& run_file) const
+  {
+    const std::size_t chunk_size = chunk.size();
+    const std::size_t num_chunks = (_num_particles + chunk_size - 1) / chunk_size;
+
+    qcl::device_array<key_type> keys{_ctx, chunk_size};
+    qcl::device_array<cl_uint> indices{_ctx, chunk_size};
+
+    std::vector<cl_uint> initial_indices(chunk_size);
+    std::iota(initial_indices.begin(), initial_indices.end(), 0);
+
+    std::vector<key_type> sorted_keys(chunk_size);
+    std::vector<cl_uint> sorted_indices(chunk_size);
+    std::uint64_t file_offset = 0;
+
+    key_generator_type key_generator;
+    index_sort_engine_type sort_engine;
+
+    std::vector<sorted_run> runs(num_chunks);
+    for(std::size_t i = 0; i < num_chunks; ++i)
+    {
+      const std::size_t num_chunk_particles = this->upload_chunk(particles, chunk, i);
+
+      key_generator(_ctx,
+                    chunk.get_buffer(),
+                    num_chunk_particles,
+                    extent.get_buffer(),
+                    keys.get_buffer());
+
+      cl_int err = _ctx->get_command_queue().enqueueWriteBuffer(
+            indices.get_buffer(), CL_FALSE,
+            0, num_chunk_particles * sizeof(cl_uint), initial_indices.data());
+      qcl::check_cl_error(err, "Could not write chunk indices");
+
+      sort_engine(_ctx,
+                  keys.get_buffer(),
+                  indices.get_buffer(),
+                  num_chunk_particles,
+                  key_generator_type::num_key_bits);
+
+      err = _ctx->get_command_queue().enqueueReadBuffer(
+            keys.get_buffer(), CL_FALSE,
+            0, num_chunk_particles * sizeof(key_type), sorted_keys.data());
+      qcl::check_cl_error(err, "Could not read sorted keys");
+      err = _ctx->get_command_queue().enqueueReadBuffer(
+            indices.get_buffer(), CL_TRUE,
+            0, num_chunk_particles * sizeof(cl_uint), sorted_indices.data());
+      qcl::check_cl_error(err, "Could not read sorted indices");
+
+      // Spill the run right away, such that the host
+      // never holds more than one chunk of keys
+      sorted_run& run = runs[i];
+      run.particles_begin = i * chunk_size;
+      run.num_particles = num_chunk_particles;
+      run.keys_offset = file_offset;
+      run.indices_offset = file_offset + num_chunk_particles * sizeof(key_type);
+      file_offset = run.indices_offset + num_chunk_particles * sizeof(cl_uint);
+
+      run_file.write(reinterpret_cast<const char*>(sorted_keys.data()),
+                     num_chunk_particles * sizeof(key_type));
+      run_file.write(reinterpret_cast<const char*>(sorted_indices.data()),
+                     num_chunk_particles * sizeof(cl_uint));
+      if(!run_file)
+        throw std::runtime_error{"Could not write sorted run"};
+    }
+    run_file.flush();
+    if(!run_file)
+      throw std::runtime_error{"Could not write sorted run"};
+
+    return runs;
+  }
+
+  /// Reads the next part of \c run from \c run_file into \c buffer
+  /// \return false, if the run has been read completely
+  bool read_run(std::fstream& run_file,
+                const sorted_run& run,
+                run_buffer& buffer) const
+  {
+    const std::size_t num_remaining = run.num_particles - buffer.num_read;
+    if(num_remaining == 0)
+      return false;
+
+    const std::size_t n = std::min(num_remaining, run_buffer_size);
+    buffer.keys.resize(n);
+    buffer.indices.resize(n);
+
+    run_file.seekg(static_cast<std::streamoff>(
+                     run.keys_offset + buffer.num_read * sizeof(key_type)));
+    run_file.read(reinterpret_cast<char*>(buffer.keys.data()), n * sizeof(key_type));
+    run_file.seekg(static_cast<std::streamoff>(
+                     run.indices_offset + buffer.num_read * sizeof(cl_uint)));
+    run_file.read(reinterpret_cast<char*>(buffer.indices.data()), n * sizeof(cl_uint));
+    if(!run_file)
+      throw std::runtime_error{"Could not read sorted run"};
+
+    buffer.num_read += n;
+    buffer.position = 0;
+    return true;
+  }
+
+  /// Merges the sorted runs and builds a subtree
+  /// from each \c chunk_size merged particles
+  void build_subtrees(const particle_type* particles,
+                      const std::vector<sorted_run>& runs,
+                      std::fstream& run_file,
+                      std::size_t chunk_size,
+                      const sorter_type& sorter)
+  {
+    using heap_entry = std::pair<key_type, std::size_t>;
+    std::priority_queue<heap_entry,
+                        std::vector<heap_entry>,
+                        std::greater<heap_entry>> heap;
+
+    std::vector<run_buffer> buffers(runs.size());
+    for(std::size_t i = 0; i < runs.size(); ++i)
+      if(this->read_run(run_file, runs[i], buffers[i]))
+        heap.push(heap_entry{buffers[i].keys[0], i});
+
+    // The merged particles are already in the order of the subtrees
+    const sorter_type subtree_sorter = sorter.presorted();
+
+    std::vector<particle_type> subtree_particles;
+    subtree_particles.reserve(chunk_size);
+
+    std::size_t num_merged_particles = 0;
+    while(!heap.empty())
+    {
+      const std::size_t run_idx = heap.top().second;
+      heap.pop();
+
+      run_buffer& buffer = buffers[run_idx];
+      const std::size_t position = buffer.position++;
+      subtree_particles.push_back(
+            particles[runs[run_idx].particles_begin + buffer.indices[position]]);
+
+      if(buffer.position < buffer.keys.size())
+        heap.push(heap_entry{buffer.keys[buffer.position], run_idx});
+      else if(this->read_run(run_file, runs[run_idx], buffer))
+        heap.push(heap_entry{buffer.keys[0], run_idx});
+      else
+      {
+        // Release the memory of exhausted runs early
+        std::vector<key_type>{}.swap(buffer.keys);
+        std::vector<cl_uint>{}.swap(buffer.indices);
+      }
+
+      if(subtree_particles.size() == chunk_size || heap.empty())
+      {
+        this->add_subtree(subtree_particles, num_merged_particles, subtree_sorter);
+        num_merged_particles += subtree_particles.size();
+        subtree_particles.clear();
+      }
+    }
+  }
+
+  /// Builds a subtree from particles that are already sorted
+  void add_subtree(const std::vector<particle_type>& subtree_particles,
+                   std::size_t particle_offset,
+                   const sorter_type& presorted_sorter)
+  {
+    const std::size_t subtree = _subtrees.size();
+
+    std::unique_ptr<Tree_type> tree{new Tree_type{_ctx, subtree_particles, presorted_sorter}};
+
+    _subtrees.push_back(subtree_info{});
+    subtree_info& info = _subtrees.back();
+    info.snapshot_filename = _snapshot_prefix + "_" +
+                             std::to_string(subtree) + ".snapshot";
+    info.particle_offset = particle_offset;
+
+    tree->save_snapshot(info.snapshot_filename);
+
+    _bounds.resize(_subtrees.size());
+    _bounds.read_root_bounding_box(subtree, *tree);
+    cl_int err = _ctx->get_command_queue().finish();
+    qcl::check_cl_error(err, "Could not read subtree bounding box");
+
+    this->make_resident(subtree, std::move(tree));
+  }
+
+  void remove_snapshots() noexcept
+  {
+    for(const subtree_info& info : _subtrees)
+      std::remove(info.snapshot_filename.c_str());
+  }
+
+  void make_resident(std::size_t subtree, std::unique_ptr<Tree_type> tree)
+  {
+    if(_lru.size() >= _max_resident_subtrees)
+    {
+      // Commands that are still pending on the evicted tree keep
+      // its buffers alive, so it can be released right away
+      _subtrees[_lru.back()].tree.reset();
+      _lru.pop_back();
+    }
+
+    _lru.push_front(subtree);
+    _subtrees[subtree].tree = std::move(tree);
+    _subtrees[subtree].lru_position = _lru.begin();
+  }
+
+  /// Enqueues the upload of the chunk \c chunk_idx
+  /// \return The number of particles of the chunk
+  std::size_t upload_chunk(const particle_type* particles,
+                           const qcl::device_array<particle_type>& chunk,
+                           std::size_t chunk_idx) const
+  {
+    const std::size_t chunk_begin = chunk_idx * chunk.size();
+    const std::size_t num_chunk_particles = std::min(chunk.size(),
+                                                     _num_particles - chunk_begin);
+
+    cl_int err = _ctx->get_command_queue().enqueueWriteBuffer(
+          chunk.get_buffer(), CL_FALSE,
+          0, num_chunk_particles * sizeof(particle_type),
+          particles + chunk_begin);
+    qcl::check_cl_error(err, "Could not upload particle chunk");
+
+    return num_chunk_particles;
+  }
+
+  qcl::device_context_ptr _ctx;
+  std::size_t _num_particles;
+  std::string _snapshot_prefix;
+  std::size_t _max_resident_subtrees;
+
+  std::vector<subtree_info> _subtrees;
+  std::list<std::size_t> _lru;
+  slice_bounding_boxes<type_system> _bounds;
+};
+
+}
+
+#endif
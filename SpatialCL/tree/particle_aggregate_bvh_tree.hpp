@@ -0,0 +1,257 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTICLE_AGGREGATE_BVH_TREE
+#define PARTICLE_AGGREGATE_BVH_TREE
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+
+#include "particle_bvh_tree.hpp"
+#include "bottom_up_builder.hpp"
+#include "../build_profiler.hpp"
+
+namespace spatialcl {
+
+/// Combiner for the \c bottom_up_builder that aggregates the particle
+/// component \c Component over the particles of each node. The first node
+/// value is the sum of the component, the second value stores its minimum
+/// in \c s0 and its maximum in \c s1.
+template<class Type_descriptor, std::size_t Component>
+class aggregate_bottom_up_combiner
+{
+public:
+  QCL_MAKE_MODULE(aggregate_bottom_up_combiner)
+private:
+  static constexpr int aggregated_component = static_cast<int>(Component);
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_IMPORT_CONSTANT(aggregated_component)
+    QCL_RAW(
+      scalar aggregate_get_component(particle_type p)
+      {
+        return ((scalar*)&p)[aggregated_component];
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      bottom_up_build_leaf_node(particles,
+                                particles_begin,
+                                particles_end,
+                                sum_ptr,
+                                extrema_ptr)
+      {
+        scalar value = aggregate_get_component(particles[particles_begin]);
+        *sum_ptr = value;
+        (*extrema_ptr).s0 = value;
+        (*extrema_ptr).s1 = value;
+
+        for(index_type i = particles_begin + 1; i < particles_end; ++i)
+        {
+          value = aggregate_get_component(particles[i]);
+          *sum_ptr += value;
+          (*extrema_ptr).s0 = fmin((*extrema_ptr).s0, value);
+          (*extrema_ptr).s1 = fmax((*extrema_ptr).s1, value);
+        }
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      bottom_up_combine_nodes(left_sum,
+                              left_extrema,
+                              right_sum,
+                              right_extrema,
+                              right_child_exists,
+                              sum_ptr,
+                              extrema_ptr)
+      {
+        *sum_ptr = left_sum;
+        *extrema_ptr = left_extrema;
+        if(right_child_exists)
+        {
+          *sum_ptr = left_sum + right_sum;
+          (*extrema_ptr).s0 = fmin(left_extrema.s0, right_extrema.s0);
+          (*extrema_ptr).s1 = fmax(left_extrema.s1, right_extrema.s1);
+        }
+      }
+    )
+  )
+};
+
+/// Bounding volume hierarchy that additionally stores aggregates of the
+/// particle component \c Component for each node: the sum, the minimum
+/// and the maximum over all particles of the node. The aggregates are
+/// stored in the same node layout as the bounding boxes and are built
+/// with the tree, and again by \c refit() and \c rebuild().
+/// \c box_reduction_query uses them to reduce nodes that are entirely
+/// inside a query box without descending to their particles.
+/// \tparam Component The index of the aggregated particle component
+/// \tparam Leaf_bucket_size The maximum number of particles per leaf node,
+/// see \c particle_tree
+template<class Particle_sorter,
+         class Type_descriptor,
+         std::size_t Component,
+         std::size_t Leaf_bucket_size = 2>
+class particle_aggregate_bvh_tree : public particle_bvh_tree<Particle_sorter,
+                                                             Type_descriptor,
+                                                             Leaf_bucket_size>
+{
+public:
+  using particle_type = typename configuration<Type_descriptor>::particle_type;
+  using scalar = typename configuration<Type_descriptor>::scalar;
+  /// Stores the minimum in \c s[0] and the maximum in \c s[1]
+  using extrema_type = typename cl_vector_type<scalar, 2>::value;
+
+  using base_type = particle_bvh_tree<
+    Particle_sorter,
+    Type_descriptor,
+    Leaf_bucket_size
+  >;
+
+  static_assert(Component < Type_descriptor::particle_dimension,
+                "The aggregated component must be a component of the particles");
+
+  static constexpr std::size_t aggregated_component = Component;
+
+  particle_aggregate_bvh_tree(const qcl::device_context_ptr& ctx,
+                              const std::vector<particle_type>& particles,
+                              const Particle_sorter& sorter = Particle_sorter{})
+    : base_type{ctx, particles, sorter}
+  {
+    this->init_node_aggregates();
+  }
+
+  particle_aggregate_bvh_tree(const qcl::device_context_ptr& ctx,
+                              const cl::Buffer& particles,
+                              std::size_t num_particles,
+                              const Particle_sorter& sorter = Particle_sorter{},
+                              cl::Event* evt = nullptr,
+                              const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, num_particles, sorter, nullptr, wait_events}
+  {
+    this->init_node_aggregates();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  particle_aggregate_bvh_tree(const qcl::device_context_ptr& ctx,
+                              const qcl::device_array<particle_type>& particles,
+                              const Particle_sorter& sorter = Particle_sorter{},
+                              cl::Event* evt = nullptr,
+                              const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, sorter, nullptr, wait_events}
+  {
+    this->init_node_aggregates();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Loads a tree saved with \c save_snapshot(). The aggregates
+  /// are recalculated from the loaded particles.
+  particle_aggregate_bvh_tree(const qcl::device_context_ptr& ctx,
+                              const tree_snapshot_view& snapshot)
+    : base_type{ctx, snapshot}
+  {
+    this->init_node_aggregates();
+  }
+
+  virtual ~particle_aggregate_bvh_tree(){}
+
+  /// Recalculates the bounding boxes and the aggregates,
+  /// see \c particle_bvh_tree::refit()
+  void refit(cl::Event* evt = nullptr,
+             const event_list* wait_events = nullptr)
+  {
+    base_type::refit(nullptr, wait_events);
+    this->rebuild_node_aggregates();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Sorts the particles again and rebuilds the bounding boxes
+  /// and the aggregates
+  void rebuild(const Particle_sorter& sorter = Particle_sorter{},
+               cl::Event* evt = nullptr,
+               const event_list* wait_events = nullptr)
+  {
+    base_type::rebuild(sorter, nullptr, wait_events);
+    this->rebuild_node_aggregates();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// \return The sums of the aggregated component for each node, as
+  /// \c scalar in the layout of the node values
+  const cl::Buffer& get_node_sums() const
+  {
+    return _node_sums.get_buffer();
+  }
+
+  /// \return The minima and maxima of the aggregated component for each
+  /// node, as \c extrema_type in the layout of the node values
+  const cl::Buffer& get_node_extrema() const
+  {
+    return _node_extrema.get_buffer();
+  }
+
+private:
+  void init_node_aggregates()
+  {
+    // Buffers cannot be empty, so we allocate at least one node
+    const std::size_t num_nodes = std::max<std::size_t>(this->get_num_nodes(), 1);
+    _node_sums = qcl::device_array<scalar>{this->get_device_context(), num_nodes};
+    _node_extrema = qcl::device_array<extrema_type>{this->get_device_context(), num_nodes};
+
+    this->rebuild_node_aggregates();
+  }
+
+  void rebuild_node_aggregates()
+  {
+    build_stage_scope stage{this->get_device_context(), "node aggregates"};
+    _aggregate_builder(this->get_device_context(),
+                       this->get_sorted_particles(),
+                       this->get_num_particles(),
+                       _node_sums.get_buffer(),
+                       _node_extrema.get_buffer());
+  }
+
+  using aggregate_builder_type = bottom_up_builder<
+    Type_descriptor,
+    scalar,
+    extrema_type,
+    aggregate_bottom_up_combiner<Type_descriptor, Component>,
+    Leaf_bucket_size
+  >;
+
+  aggregate_builder_type _aggregate_builder;
+
+  qcl::device_array<scalar> _node_sums;
+  qcl::device_array<extrema_type> _node_extrema;
+};
+
+}
+
+#endif
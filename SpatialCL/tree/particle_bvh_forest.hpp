@@ -0,0 +1,485 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTICLE_BVH_FOREST_HPP
+#define PARTICLE_BVH_FOREST_HPP
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <vector>
+#include <cassert>
+#include <algorithm>
+
+#include "binary_tree.hpp"
+#include "bottom_up_builder.hpp"
+#include "node_codec.hpp"
+#include "particle_bvh_tree.hpp"
+#include "../configuration.hpp"
+#include "../async.hpp"
+#include "../memory_pool.hpp"
+#include "../sort/radix_sort.hpp"
+
+namespace spatialcl {
+
+/// A forest of many independent bounding volume hierarchies that are
+/// sorted and built together. This is meant for many small trees
+/// (e.g. one per simulation cell or per mesh), where building and querying
+/// each tree separately would be dominated by the kernel launch overhead.
+///
+/// The particles of all trees are concatenated, tree t consisting of the
+/// particles [tree_offsets[t], tree_offsets[t+1]). All particles are sorted
+/// by their keys, and then stably by the tree they belong to, such that each
+/// tree is stored as a contiguous, spatially sorted range of the sorted
+/// particles. The particles of any tree remain at the same offsets. The
+/// nodes of all trees are then built in a single launch of the
+/// \c bottom_up_builder, and stored one tree after another in the compact
+/// layout of binary_tree.hpp.
+///
+/// Queries on the forest are executed by \c query::engine::forest_depth_first,
+/// which processes the queries of all trees in a single launch. Within a
+/// query, particle indices refer to the particles of the tree of the query.
+/// \tparam Key_generator Generates the sort keys, e.g. \c hilbert_sort_key_generator.
+/// The keys of all trees are generated relative to the extent of the
+/// whole forest.
+/// \tparam Leaf_bucket_size The maximum number of particles per leaf node,
+/// see \c particle_tree
+/// \tparam Sort_engine The key-value sort algorithm. Must be stable,
+/// e.g. \c sort::default_radix_sort_engine.
+template<class Key_generator,
+         class Type_descriptor,
+         std::size_t Leaf_bucket_size = 2,
+         template<class, class> class Sort_engine = sort::default_radix_sort_engine>
+class particle_bvh_forest
+{
+public:
+  QCL_MAKE_MODULE(particle_bvh_forest)
+
+  static constexpr std::size_t leaf_bucket_size = Leaf_bucket_size;
+
+  static_assert(utils::binary::is_small_power2<leaf_bucket_size>::value &&
+                leaf_bucket_size >= 2,
+                "The leaf bucket size must be a power of two >= 2");
+
+  using particle_type = typename configuration<Type_descriptor>::particle_type;
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+  using node_type0 = vector_type;
+  using node_type1 = vector_type;
+  /// Defines how the query engines read the node values,
+  /// see node_codec.hpp
+  using node_codec = identity_node_codec<node_type0, node_type1>;
+
+  using type_system = Type_descriptor;
+  using key_type = typename Key_generator::key_type;
+
+  /// \param particles The particles of all trees
+  /// \param tree_offsets The offsets of the particles of each tree, with
+  /// one additional entry at the end. The first entry must be 0 and the
+  /// last entry the number of particles. Trees may be empty.
+  particle_bvh_forest(const qcl::device_context_ptr& ctx,
+                      const std::vector<particle_type>& particles,
+                      const std::vector<cl_ulong>& tree_offsets)
+    : _ctx{ctx},
+      _num_particles{particles.size()}
+  {
+    // Buffers cannot be empty, so we allocate at least one particle
+    _ctx->create_buffer<particle_type>(_sorted_particles,
+                                       std::max<std::size_t>(_num_particles, 1));
+    if(_num_particles > 0)
+      _ctx->memcpy_h2d(_sorted_particles, particles.data(), _num_particles);
+
+    this->init_forest(tree_offsets);
+  }
+
+  /// Sorts the particles in the given buffer in place
+  /// and builds the forest on top of them.
+  particle_bvh_forest(const qcl::device_context_ptr& ctx,
+                      const cl::Buffer& particles,
+                      std::size_t num_particles,
+                      const std::vector<cl_ulong>& tree_offsets)
+    : _ctx{ctx},
+      _sorted_particles{particles},
+      _num_particles{num_particles}
+  {
+    this->init_forest(tree_offsets);
+  }
+
+  /// Recalculates the bounding boxes of all trees for the current
+  /// particle positions, without changing the particle order,
+  /// see \c particle_bvh_tree::refit()
+  void refit(cl::Event* evt = nullptr,
+             const event_list* wait_events = nullptr)
+  {
+    enqueue_wait_for_events(_ctx, wait_events);
+    this->rebuild_bounding_boxes();
+    enqueue_completion_event(_ctx, evt);
+  }
+
+  /// Sorts the particles within their trees again and rebuilds all
+  /// trees. The particles are not moved between trees.
+  void rebuild(cl::Event* evt = nullptr,
+               const event_list* wait_events = nullptr)
+  {
+    enqueue_wait_for_events(_ctx, wait_events);
+    this->sort_particles();
+    this->rebuild_bounding_boxes();
+    enqueue_completion_event(_ctx, evt);
+  }
+
+  std::size_t get_num_trees() const
+  {
+    return _tree_node_offsets.size();
+  }
+
+  /// \return The number of particles of all trees
+  std::size_t get_num_particles() const
+  {
+    return _num_particles;
+  }
+
+  /// \return The number of stored nodes of all trees
+  std::size_t get_num_nodes() const
+  {
+    return _num_nodes;
+  }
+
+  /// \return The number of leaf buckets of all trees
+  std::size_t get_num_leaf_buckets() const
+  {
+    return _tree_bucket_offsets.back();
+  }
+
+  /// \return The offset of the first particle of a tree
+  /// among the sorted particles
+  std::size_t get_tree_particles_begin(std::size_t tree) const
+  {
+    return _tree_particle_offsets[tree];
+  }
+
+  std::size_t get_num_tree_particles(std::size_t tree) const
+  {
+    return _tree_particle_offsets[tree + 1] - _tree_particle_offsets[tree];
+  }
+
+  /// \return The offset of the first node of a tree among the nodes
+  std::size_t get_tree_nodes_begin(std::size_t tree) const
+  {
+    return _tree_node_offsets[tree];
+  }
+
+  std::size_t get_tree_effective_num_levels(std::size_t tree) const
+  {
+    return _tree_num_levels[tree];
+  }
+
+  const qcl::device_context_ptr& get_device_context() const
+  {
+    return _ctx;
+  }
+
+  /// \return The sorted particles of all trees
+  const cl::Buffer& get_sorted_particles() const
+  {
+    return _sorted_particles;
+  }
+
+  const cl::Buffer& get_node_values0() const
+  {
+    return _nodes0.get_buffer();
+  }
+
+  const cl::Buffer& get_node_values1() const
+  {
+    return _nodes1.get_buffer();
+  }
+
+  const cl::Buffer& get_bbox_min_corners() const
+  {
+    return this->get_node_values0();
+  }
+
+  const cl::Buffer& get_bbox_max_corners() const
+  {
+    return this->get_node_values1();
+  }
+
+  /// \return The \c cl_ulong particle offsets of the trees
+  /// (with \c get_num_trees()+1 entries) on the device
+  const cl::Buffer& get_tree_particle_offsets() const
+  {
+    return _device_tree_particle_offsets.get_buffer();
+  }
+
+  /// \return The \c cl_ulong node offsets of the trees on the device
+  const cl::Buffer& get_tree_node_offsets() const
+  {
+    return _device_tree_node_offsets.get_buffer();
+  }
+
+  /// \return The \c cl_uint numbers of levels of the trees on the device
+  const cl::Buffer& get_tree_num_levels() const
+  {
+    return _device_tree_num_levels.get_buffer();
+  }
+
+  /// \return A buffer of \c cl_uint such that the sorted particle i
+  /// was the particle \c permutation[i] of all particles before the
+  /// most recent sort. Since the trees keep their offsets,
+  /// the permutation never maps between different trees.
+  const cl::Buffer& get_permutation() const
+  {
+    return _permutation.get_buffer();
+  }
+
+private:
+  static constexpr std::size_t local_size = 256;
+
+  void init_forest(const std::vector<cl_ulong>& tree_offsets)
+  {
+    assert(tree_offsets.size() >= 2);
+    assert(tree_offsets.front() == 0);
+    assert(tree_offsets.back() == _num_particles);
+    assert(_num_particles <= static_cast<std::size_t>(CL_UINT_MAX));
+
+    const std::size_t num_trees = tree_offsets.size() - 1;
+
+    // The layout of the forest only depends on the sizes
+    // of the trees and is calculated on the host
+    _tree_particle_offsets = tree_offsets;
+    _tree_node_offsets.resize(num_trees);
+    _tree_bucket_offsets.resize(num_trees + 1);
+    _tree_num_levels.resize(num_trees);
+
+    std::size_t num_nodes = 0;
+    std::size_t num_buckets = 0;
+    for(std::size_t tree = 0; tree < num_trees; ++tree)
+    {
+      assert(tree_offsets[tree] <= tree_offsets[tree + 1]);
+      const std::size_t n = tree_offsets[tree + 1] - tree_offsets[tree];
+
+      _tree_node_offsets[tree] = num_nodes;
+      _tree_bucket_offsets[tree] = num_buckets;
+      _tree_num_levels[tree] = static_cast<cl_uint>(
+            binary_tree::get_num_levels(n, leaf_bucket_size));
+
+      num_nodes += binary_tree::get_num_nodes(n, leaf_bucket_size);
+      num_buckets += (n + leaf_bucket_size - 1) / leaf_bucket_size;
+    }
+    _tree_bucket_offsets[num_trees] = num_buckets;
+    _num_nodes = num_nodes;
+
+    _device_tree_particle_offsets = qcl::device_array<cl_ulong>{_ctx, _tree_particle_offsets};
+    _device_tree_node_offsets = qcl::device_array<cl_ulong>{_ctx, _tree_node_offsets};
+    _device_tree_bucket_offsets = qcl::device_array<cl_ulong>{_ctx, _tree_bucket_offsets};
+    _device_tree_num_levels = qcl::device_array<cl_uint>{_ctx, _tree_num_levels};
+
+    // Buffers cannot be empty, so we allocate at least one element
+    _permutation = qcl::device_array<cl_uint>{_ctx, std::max<std::size_t>(_num_particles, 1)};
+    const std::size_t num_allocated_nodes = std::max<std::size_t>(_num_nodes, 1);
+    _nodes0 = qcl::device_array<node_type0>{_ctx, num_allocated_nodes};
+    _nodes1 = qcl::device_array<node_type1>{_ctx, num_allocated_nodes};
+
+    this->sort_particles();
+    this->rebuild_bounding_boxes();
+  }
+
+  /// Sorts the particles by (tree, key) with two passes of the sort engine:
+  /// First by key, and then stably by tree.
+  void sort_particles()
+  {
+    if(_num_particles == 0)
+      return;
+
+    cl::NDRange global_size{_num_particles};
+    cl::NDRange local_size{this->local_size};
+
+    auto sort_keys = get_memory_pool(_ctx)->allocate<key_type>(_num_particles);
+    Key_generator key_generator;
+    key_generator(_ctx, _sorted_particles, _num_particles, sort_keys.get_buffer());
+
+    cl_int err = forest_init_permutation(_ctx, global_size, local_size)(
+          _permutation,
+          static_cast<cl_ulong>(_num_particles));
+    qcl::check_cl_error(err, "Could not enqueue forest_init_permutation kernel");
+
+    _key_engine(_ctx,
+                sort_keys.get_buffer(),
+                _permutation.get_buffer(),
+                _num_particles,
+                Key_generator::num_key_bits);
+
+    auto tree_ids = get_memory_pool(_ctx)->allocate<cl_uint>(_num_particles);
+    err = forest_get_tree_ids(_ctx, global_size, local_size)(
+          _permutation,
+          _device_tree_particle_offsets,
+          static_cast<cl_uint>(this->get_num_trees()),
+          static_cast<cl_ulong>(_num_particles),
+          tree_ids.get_buffer());
+    qcl::check_cl_error(err, "Could not enqueue forest_get_tree_ids kernel");
+
+    _tree_id_engine(_ctx,
+                    tree_ids.get_buffer(),
+                    _permutation.get_buffer(),
+                    _num_particles,
+                    this->get_num_tree_id_bits());
+
+    auto unsorted_particles = get_memory_pool(_ctx)->allocate<particle_type>(_num_particles);
+    err = _ctx->get_command_queue().enqueueCopyBuffer(
+          _sorted_particles,
+          unsorted_particles.get_buffer(),
+          0, 0,
+          _num_particles * sizeof(particle_type));
+    qcl::check_cl_error(err, "Could not copy particles");
+
+    err = forest_gather_particles(_ctx, global_size, local_size)(
+          unsorted_particles.get_buffer(),
+          _permutation,
+          static_cast<cl_ulong>(_num_particles),
+          _sorted_particles);
+    qcl::check_cl_error(err, "Could not enqueue forest_gather_particles kernel");
+  }
+
+  void rebuild_bounding_boxes()
+  {
+    // All levels of all trees are built in one kernel launch
+    _builder.build_forest(_ctx,
+                          _sorted_particles,
+                          _device_tree_particle_offsets.get_buffer(),
+                          _device_tree_node_offsets.get_buffer(),
+                          _device_tree_bucket_offsets.get_buffer(),
+                          _device_tree_num_levels.get_buffer(),
+                          this->get_num_trees(),
+                          this->get_num_leaf_buckets(),
+                          _num_nodes,
+                          _nodes0.get_buffer(),
+                          _nodes1.get_buffer());
+  }
+
+  /// \return The number of bits of the largest tree index
+  unsigned get_num_tree_id_bits() const
+  {
+    unsigned result = 0;
+    for(std::size_t max_id = this->get_num_trees() - 1; max_id != 0; max_id >>= 1)
+      ++result;
+    return result;
+  }
+
+  using builder_type = bottom_up_builder<
+    Type_descriptor,
+    node_type0,
+    node_type1,
+    bvh_bottom_up_combiner<Type_descriptor>,
+    Leaf_bucket_size
+  >;
+
+  qcl::device_context_ptr _ctx;
+
+  cl::Buffer _sorted_particles;
+  std::size_t _num_particles;
+  std::size_t _num_nodes;
+
+  std::vector<cl_ulong> _tree_particle_offsets;
+  std::vector<cl_ulong> _tree_node_offsets;
+  std::vector<cl_ulong> _tree_bucket_offsets;
+  std::vector<cl_uint> _tree_num_levels;
+
+  qcl::device_array<cl_ulong> _device_tree_particle_offsets;
+  qcl::device_array<cl_ulong> _device_tree_node_offsets;
+  qcl::device_array<cl_ulong> _device_tree_bucket_offsets;
+  qcl::device_array<cl_uint> _device_tree_num_levels;
+
+  qcl::device_array<cl_uint> _permutation;
+  qcl::device_array<node_type0> _nodes0;
+  qcl::device_array<node_type1> _nodes1;
+
+  Sort_engine<key_type, cl_uint> _key_engine;
+  Sort_engine<cl_uint, cl_uint> _tree_id_engine;
+  builder_type _builder;
+
+  QCL_ENTRYPOINT(forest_init_permutation)
+  QCL_ENTRYPOINT(forest_get_tree_ids)
+  QCL_ENTRYPOINT(forest_gather_particles)
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_RAW
+    (
+      __kernel void forest_init_permutation(__global uint* permutation,
+                                            ulong num_particles)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_particles;
+            tid += get_global_size(0))
+          permutation[tid] = (uint)tid;
+      }
+
+      __kernel void forest_get_tree_ids(__global uint* permutation,
+                                        __global ulong* tree_offsets,
+                                        uint num_trees,
+                                        ulong num_particles,
+                                        __global uint* tree_ids_out)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_particles;
+            tid += get_global_size(0))
+        {
+          const ulong particle_idx = permutation[tid];
+
+          // Find the last tree that begins at or before the particle
+          uint tree = 0;
+          uint trees_end = num_trees;
+          while(trees_end - tree > 1)
+          {
+            const uint mid = (tree + trees_end) / 2;
+            if(tree_offsets[mid] <= particle_idx)
+              tree = mid;
+            else
+              trees_end = mid;
+          }
+          tree_ids_out[tid] = tree;
+        }
+      }
+
+      __kernel void forest_gather_particles(__global particle_type* unsorted_particles,
+                                            __global uint* permutation,
+                                            ulong num_particles,
+                                            __global particle_type* sorted_particles)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_particles;
+            tid += get_global_size(0))
+          sorted_particles[tid] = unsorted_particles[permutation[tid]];
+      }
+    )
+  )
+};
+
+}
+
+#endif
@@ -36,12 +36,18 @@
 
 #include <memory>
 #include <string>
+#include <cassert>
 
 #include "particle_bvh_tree.hpp"
 #include "../bit_manipulation.hpp"
 #include "../sfc_position_generator.hpp"
 #include "../zcurve.hpp"
 #include "../hilbert_curve.hpp"
+#include "../particle_extent.hpp"
+#include "../sort/boost_sort.hpp"
+#include "../sort/radix_sort.hpp"
+#include "../memory_pool.hpp"
+#include "../build_profiler.hpp"
 
 namespace spatialcl {
 
@@ -54,75 +60,47 @@ public:
   using vector_type = typename configuration<Type_descriptor>::vector_type;
   static constexpr std::size_t particle_dimension = Type_descriptor::particle_dimension;
   static constexpr std::size_t dimension = Type_descriptor::dimension;
+  static constexpr unsigned num_key_bits = Space_filling_curve::num_key_bits;
 
+  void operator()(const qcl::device_context_ptr& ctx,
+                  const cl::Buffer& particles,
+                  std::size_t num_particles,
+                  const cl::Buffer& particle_sort_keys_out) const
+  {
+    // The extent never leaves the device
+    qcl::device_array<vector_type> extent{ctx, 2};
+
+    {
+      build_stage_scope stage{ctx, "extent reduction"};
+      particle_extent<Type_descriptor> extent_reducer;
+      extent_reducer(ctx, particles, num_particles, extent.get_buffer());
+    }
 
+    (*this)(ctx,
+            particles,
+            num_particles,
+            extent.get_buffer(),
+            particle_sort_keys_out);
+  }
 
+  /// Generates the keys relative to a given bounding box.
+  /// \param particles_extent Device buffer with the minimum
+  /// and maximum corner of the bounding box.
   void operator()(const qcl::device_context_ptr& ctx,
                   const cl::Buffer& particles,
                   std::size_t num_particles,
+                  const cl::Buffer& particles_extent,
                   const cl::Buffer& particle_sort_keys_out) const
   {
-    vector_type min, max;
-    this->get_particle_extent(ctx, particles, num_particles, min, max);
-
+    build_stage_scope stage{ctx, "key generation"};
     Space_filling_curve curve;
 
     curve(ctx,
-          min,
-          max,
+          particles_extent,
           particles,
           static_cast<cl_ulong>(num_particles),
           particle_sort_keys_out);
   }
-
-private:
-
-  void get_particle_extent(const qcl::device_context_ptr& ctx,
-                           const cl::Buffer& particles,
-                           std::size_t num_particles,
-                           vector_type& min,
-                           vector_type& max) const
-  {
-
-    using boost_particle_type = typename qcl::to_boost_vector_type<particle_type>::type;
-
-
-    BOOST_COMPUTE_FUNCTION(int, vector_less_x, (boost_particle_type a, boost_particle_type b),
-    { return a.x < b.x; });
-    BOOST_COMPUTE_FUNCTION(int, vector_less_y, (boost_particle_type a, boost_particle_type b),
-    { return a.y < b.y; });
-    BOOST_COMPUTE_FUNCTION(int, vector_less_z, (boost_particle_type a, boost_particle_type b),
-    { return a.z < b.z; });
-
-    boost::compute::command_queue boost_queue{ctx->get_command_queue().get()};
-    auto begin = qcl::create_buffer_iterator<boost_particle_type>(particles,0);
-    auto end = qcl::create_buffer_iterator<boost_particle_type>(particles,num_particles);
-
-    auto result_x = boost::compute::minmax_element(begin, end, vector_less_x,
-                                                   boost_queue);
-    auto result_y = boost::compute::minmax_element(begin, end, vector_less_y,
-                                                   boost_queue);
-    auto result_z = result_y;
-    if(dimension >= 3)
-      result_z = boost::compute::minmax_element(begin, end, vector_less_z,
-                                                boost_queue);
-
-    min.s[0] = result_x.first.read(boost_queue)[0];
-    max.s[0] = result_x.second.read(boost_queue)[0];
-
-    min.s[1] = result_y.first.read(boost_queue)[1];
-    max.s[1] = result_y.second.read(boost_queue)[1];
-
-    if(dimension >= 3)
-    {
-      min.s[2] = result_z.first.read(boost_queue)[2];
-      max.s[2] = result_z.second.read(boost_queue)[2];
-    }
-
-  }
-
-
-  static constexpr std::size_t local_size = 256;
 };
 
 template<class Type_descriptor>
@@ -136,40 +114,603 @@ using hilbert_sort_key_generator =
 
 
 
-template<class Key_generator>
+/// Determines how \c key_based_sorter applies the sort order
+/// to the particles.
+enum key_based_sort_strategy
+{
+  /// Sort the particles directly as values together with the keys
+  SORT_STRATEGY_DIRECT = 0,
+  /// Sort (key, index) pairs and gather the particles once afterwards.
+  /// This is much cheaper for particles with many components, and
+  /// makes the permutation available to the tree.
+  SORT_STRATEGY_PERMUTATION = 1,
+  /// Assumes that the particles are already almost sorted, e.g. because
+  /// they have been sorted in the previous time step. Only the particles
+  /// whose keys are out of order with respect to their neighbors are
+  /// sorted, and then merged with the remaining particles. Falls back to \c SORT_STRATEGY_PERMUTATION if too
+  /// many particles are out of order. Also makes the permutation available
+  /// to the tree.
+  SORT_STRATEGY_INCREMENTAL = 2
+};
+
+/// Sorts particles by keys obtained from a key generator.
+/// \tparam Key_generator Generates one sort key per particle
+/// \tparam Sort_engine The key-value sort algorithm, e.g.
+/// \c sort::boost_sort_engine or \c sort::default_radix_sort_engine
+/// \tparam Strategy How the particles are reordered, see
+/// \c key_based_sort_strategy
+template<class Key_generator,
+         template<class, class> class Sort_engine = sort::boost_sort_engine,
+         key_based_sort_strategy Strategy = SORT_STRATEGY_DIRECT>
 class key_based_sorter
 {
 public:
+  QCL_MAKE_MODULE(key_based_sorter)
 
+  using key_generator_type = Key_generator;
   using key_type = typename Key_generator::key_type;
   using particle_type = typename Key_generator::particle_type;
-  using boost_particle_type = typename qcl::to_boost_vector_type<particle_type>::type;
+  using sort_engine_type = Sort_engine<key_type, particle_type>;
+  using index_sort_engine_type = Sort_engine<key_type, cl_uint>;
+
+  /// If true, the tree will request the permutation
+  /// from the sorter and store it.
+  static constexpr bool provides_permutation =
+      (Strategy == SORT_STRATEGY_PERMUTATION) ||
+      (Strategy == SORT_STRATEGY_INCREMENTAL);
+
+  /// \param max_incremental_fraction Only used with
+  /// \c SORT_STRATEGY_INCREMENTAL: If a larger fraction of particles
+  /// is out of order, all particles are sorted from scratch.
+  key_based_sorter(const sort_engine_type& engine = sort_engine_type{},
+                   const index_sort_engine_type& index_engine = index_sort_engine_type{},
+                   double max_incremental_fraction = 0.25)
+    : _engine{engine},
+      _index_engine{index_engine},
+      _max_incremental_fraction{max_incremental_fraction},
+      _presorted{false},
+      _last_sort_was_incremental{false},
+      _last_num_displaced{0}
+  {}
+
+  /// \return A copy of this sorter that assumes that the particles are
+  /// already in the order of the keys, e.g. because they are a contiguous
+  /// range of a larger data set that has been sorted before. It leaves the
+  /// particles untouched and only provides the identity permutation.
+  key_based_sorter presorted() const
+  {
+    key_based_sorter result = *this;
+    result._presorted = true;
+    return result;
+  }
 
+  /// \return Whether the sorter skips the sort, see \c presorted()
+  bool is_presorted() const
+  {
+    return _presorted;
+  }
+
+  /// \return Whether the last sort only moved the particles that were
+  /// out of order. Only true with \c SORT_STRATEGY_INCREMENTAL, and only
+  /// if the sort has not fallen back to sorting all particles.
+  bool last_sort_was_incremental() const
+  {
+    return _last_sort_was_incremental;
+  }
+
+  /// \return The number of particles that were out of order in the
+  /// last sort with \c SORT_STRATEGY_INCREMENTAL
+  std::size_t get_last_num_displaced() const
+  {
+    return _last_num_displaced;
+  }
+
+  /// Sorts the particles. The particle tree passes no events and
+  /// waits for its own wait list before sorting.
+  /// \param evt If not \c nullptr, receives an event that completes
+  /// once the particles have been sorted
+  /// \param wait_events If not \c nullptr, the sort only starts once
+  /// these events have completed
   void operator()(const qcl::device_context_ptr& ctx,
                   const cl::Buffer& particles,
-                  std::size_t num_particles) const
+                  std::size_t num_particles,
+                  cl::Event* evt = nullptr,
+                  const event_list* wait_events = nullptr) const
+  {
+    if(provides_permutation)
+    {
+      auto permutation = get_memory_pool(ctx)->allocate<cl_uint>(num_particles);
+      (*this)(ctx, particles, num_particles, permutation.get_buffer(),
+              evt, wait_events);
+    }
+    else if(_presorted)
+    {
+      enqueue_wait_for_events(ctx, wait_events);
+      enqueue_completion_event(ctx, evt);
+    }
+    else
+    {
+      enqueue_wait_for_events(ctx, wait_events);
+      auto sort_keys = get_memory_pool(ctx)->allocate<key_type>(num_particles);
+      this->generate_keys(ctx, particles, num_particles, sort_keys.get_buffer());
+
+      {
+        build_stage_scope stage{ctx, "sort"};
+        _engine(ctx,
+                sort_keys.get_buffer(),
+                particles,
+                num_particles,
+                Key_generator::num_key_bits);
+      }
+      enqueue_completion_event(ctx, evt);
+    }
+  }
+
+  /// Sorts the particles by sorting (key, index) pairs and gathering
+  /// the particles afterwards (or, with \c SORT_STRATEGY_INCREMENTAL, by
+  /// only sorting the particles that are out of order). Independently of
+  /// the strategy, this also stores the permutation in \c permutation_out,
+  /// such that the particle at sorted position i was at position
+  /// \c permutation_out[i] before sorting. The events are used as above.
+  /// With \c SORT_STRATEGY_INCREMENTAL, this blocks until the number of
+  /// particles that are out of order has been read back.
+  void operator()(const qcl::device_context_ptr& ctx,
+                  const cl::Buffer& particles,
+                  std::size_t num_particles,
+                  const cl::Buffer& permutation_out,
+                  cl::Event* evt = nullptr,
+                  const event_list* wait_events = nullptr) const
   {
-    qcl::device_array<key_type> sort_keys{ctx, num_particles};
+    assert(num_particles <= static_cast<std::size_t>(CL_UINT_MAX));
 
+    enqueue_wait_for_events(ctx, wait_events);
+
+    _last_sort_was_incremental = false;
+    if(_presorted)
+    {
+      cl_int err = init_permutation(ctx,
+                                    cl::NDRange{num_particles},
+                                    cl::NDRange{this->local_size})(
+            permutation_out,
+            static_cast<cl_ulong>(num_particles));
+      qcl::check_cl_error(err, "Could not enqueue init_permutation kernel");
+
+      enqueue_completion_event(ctx, evt);
+      return;
+    }
+
+    auto sort_keys = get_memory_pool(ctx)->allocate<key_type>(num_particles);
+    this->generate_keys(ctx, particles, num_particles, sort_keys.get_buffer());
+
+    if(Strategy == SORT_STRATEGY_INCREMENTAL)
+      _last_sort_was_incremental =
+          this->try_incremental_sort(ctx,
+                                     particles,
+                                     num_particles,
+                                     sort_keys.get_buffer(),
+                                     permutation_out);
+
+    if(!_last_sort_was_incremental)
+      this->full_sort(ctx,
+                      particles,
+                      num_particles,
+                      sort_keys.get_buffer(),
+                      permutation_out);
+
+    enqueue_completion_event(ctx, evt);
+  }
+
+protected:
+  void generate_keys(const qcl::device_context_ptr& ctx,
+                     const cl::Buffer& particles,
+                     std::size_t num_particles,
+                     const cl::Buffer& keys_out) const
+  {
     Key_generator sort_key_generator;
-    sort_key_generator(ctx, particles, num_particles, sort_keys.get_buffer());
+    sort_key_generator(ctx, particles, num_particles, keys_out);
+  }
+
+  /// Sorts all (key, index) pairs and gathers the particles
+  void full_sort(const qcl::device_context_ptr& ctx,
+                 const cl::Buffer& particles,
+                 std::size_t num_particles,
+                 const cl::Buffer& sort_keys,
+                 const cl::Buffer& permutation_out) const
+  {
+    {
+      build_stage_scope stage{ctx, "sort"};
+
+      cl::NDRange global_size{num_particles};
+      cl::NDRange local_size{this->local_size};
+
+      cl_int err = init_permutation(ctx, global_size, local_size)(
+            permutation_out,
+            static_cast<cl_ulong>(num_particles));
+      qcl::check_cl_error(err, "Could not enqueue init_permutation kernel");
+
+      _index_engine(ctx,
+                    sort_keys,
+                    permutation_out,
+                    num_particles,
+                    Key_generator::num_key_bits);
+    }
+
+    this->apply_permutation(ctx, particles, num_particles, permutation_out);
+  }
+
+  /// Sorts the particles by only sorting the particles that are out of order.
+  /// A particle is displaced if its key is out of order with respect to
+  /// the key of its preceding or subsequent neighbor. The keys of the
+  /// remaining particles are compacted and checked the same way, until
+  /// they are in order. A particle that has moved far therefore only
+  /// displaces itself and the particle it has moved next to, instead of
+  /// all particles in between. The displaced particles are sorted among
+  /// themselves and merged with the ordered ones. Apart from linear passes
+  /// over the keys and the final gather of the particles, the cost only
+  /// depends on the number of displaced particles.
+  /// \return false, if too many particles are out of order. In this case,
+  /// neither the particles nor \c permutation_out are modified.
+  bool try_incremental_sort(const qcl::device_context_ptr& ctx,
+                            const cl::Buffer& particles,
+                            std::size_t num_particles,
+                            const cl::Buffer& sort_keys,
+                            const cl::Buffer& permutation_out) const
+  {
+    _last_num_displaced = 0;
+    if(num_particles < 2)
+    {
+      this->full_sort(ctx, particles, num_particles, sort_keys, permutation_out);
+      return true;
+    }
+
+    // If the incremental sort gives up, the fallback
+    // to the full sort is reported as a separate stage.
+    build_stage_scope stage{ctx, "incremental sort"};
 
     boost::compute::command_queue boost_queue{
       ctx->get_command_queue().get()
     };
 
-    auto keys_begin = qcl::create_buffer_iterator<key_type>(sort_keys.get_buffer(),0);
-    auto keys_end = qcl::create_buffer_iterator<key_type>(sort_keys.get_buffer(),sort_keys.size());
-    auto values_begin = qcl::create_buffer_iterator<boost_particle_type>(particles, 0);
+    cl::NDRange global_size{num_particles};
+    cl::NDRange local_size{this->local_size};
+
+    auto displaced_flags = get_memory_pool(ctx)->allocate<cl_uint>(num_particles);
+    auto displaced_positions = get_memory_pool(ctx)->allocate<cl_uint>(num_particles);
+    auto ordered_keys = get_memory_pool(ctx)->allocate<key_type>(num_particles);
+    auto ordered_origins = get_memory_pool(ctx)->allocate<cl_uint>(num_particles);
+    auto flags_changed = get_memory_pool(ctx)->allocate<cl_uint>(1);
+
+    cl_int err = ctx->get_command_queue().enqueueFillBuffer(
+          displaced_flags.get_buffer(), cl_uint{0}, 0, num_particles * sizeof(cl_uint));
+    qcl::check_cl_error(err, "Could not reset displaced flags");
+
+    std::size_t num_displaced = 0;
+    for(std::size_t pass = 0;; ++pass)
+    {
+      boost::compute::exclusive_scan(
+            qcl::create_buffer_iterator<cl_uint>(displaced_flags.get_buffer(), 0),
+            qcl::create_buffer_iterator<cl_uint>(displaced_flags.get_buffer(), num_particles),
+            qcl::create_buffer_iterator<cl_uint>(displaced_positions.get_buffer(), 0),
+            boost_queue);
+
+      // The number of displaced particles decides how to continue,
+      // so it has to be read back.
+      cl_uint last_flag = 0;
+      cl_uint last_position = 0;
+      err = ctx->get_command_queue().enqueueReadBuffer(
+            displaced_flags.get_buffer(), CL_FALSE,
+            (num_particles - 1) * sizeof(cl_uint), sizeof(cl_uint), &last_flag);
+      qcl::check_cl_error(err, "Could not read displaced flags");
+      err = ctx->get_command_queue().enqueueReadBuffer(
+            displaced_positions.get_buffer(), CL_TRUE,
+            (num_particles - 1) * sizeof(cl_uint), sizeof(cl_uint), &last_position);
+      qcl::check_cl_error(err, "Could not read displaced positions");
+
+      num_displaced = last_position + last_flag;
+      _last_num_displaced = num_displaced;
+
+      if(static_cast<double>(num_displaced) >
+         _max_incremental_fraction * static_cast<double>(num_particles) ||
+         pass == max_displacement_passes)
+        return false;
+
+      const std::size_t num_ordered = num_particles - num_displaced;
+      // The compacted keys need to be available for the merge
+      // even if they cannot be out of order.
+      err = compact_ordered_keys(ctx, global_size, local_size)(
+            sort_keys,
+            displaced_flags.get_buffer(),
+            displaced_positions.get_buffer(),
+            static_cast<cl_ulong>(num_particles),
+            ordered_keys.get_buffer(),
+            ordered_origins.get_buffer());
+      qcl::check_cl_error(err, "Could not enqueue compact_ordered_keys kernel");
+
+      if(num_ordered < 2)
+        break;
+
+      cl_uint changed = 0;
+      err = ctx->get_command_queue().enqueueFillBuffer(
+            flags_changed.get_buffer(), cl_uint{0}, 0, sizeof(cl_uint));
+      qcl::check_cl_error(err, "Could not reset displacement change flag");
+
+      err = mark_displaced_keys(ctx, cl::NDRange{num_ordered}, local_size)(
+            ordered_keys.get_buffer(),
+            ordered_origins.get_buffer(),
+            static_cast<cl_ulong>(num_ordered),
+            displaced_flags.get_buffer(),
+            flags_changed.get_buffer());
+      qcl::check_cl_error(err, "Could not enqueue mark_displaced_keys kernel");
+
+      err = ctx->get_command_queue().enqueueReadBuffer(
+            flags_changed.get_buffer(), CL_TRUE, 0, sizeof(cl_uint), &changed);
+      qcl::check_cl_error(err, "Could not read displacement change flag");
+
+      // The compacted keys of the last pass are in order
+      if(!changed)
+        break;
+    }
 
-    boost::compute::sort_by_key(
-          keys_begin,
-          keys_end,
-          values_begin,
-          boost_queue);
+    if(num_displaced == 0)
+    {
+      err = init_permutation(ctx, global_size, local_size)(
+            permutation_out,
+            static_cast<cl_ulong>(num_particles));
+      qcl::check_cl_error(err, "Could not enqueue init_permutation kernel");
+      return true;
+    }
 
+    const std::size_t num_ordered = num_particles - num_displaced;
+
+    auto displaced_keys = get_memory_pool(ctx)->allocate<key_type>(num_displaced);
+    auto displaced_origins = get_memory_pool(ctx)->allocate<cl_uint>(num_displaced);
+
+    err = compact_displaced_keys(ctx, global_size, local_size)(
+          sort_keys,
+          displaced_flags.get_buffer(),
+          displaced_positions.get_buffer(),
+          static_cast<cl_ulong>(num_particles),
+          displaced_keys.get_buffer(),
+          displaced_origins.get_buffer());
+    qcl::check_cl_error(err, "Could not enqueue compact_displaced_keys kernel");
+
+    _index_engine(ctx,
+                  displaced_keys.get_buffer(),
+                  displaced_origins.get_buffer(),
+                  num_displaced,
+                  Key_generator::num_key_bits);
+
+    err = merge_displaced_keys(ctx, cl::NDRange{num_displaced}, local_size)(
+          displaced_keys.get_buffer(),
+          displaced_origins.get_buffer(),
+          static_cast<cl_ulong>(num_displaced),
+          ordered_keys.get_buffer(),
+          static_cast<cl_ulong>(num_ordered),
+          permutation_out);
+    qcl::check_cl_error(err, "Could not enqueue merge_displaced_keys kernel");
+
+    if(num_ordered > 0)
+    {
+      err = merge_ordered_keys(ctx, cl::NDRange{num_ordered}, local_size)(
+            ordered_keys.get_buffer(),
+            ordered_origins.get_buffer(),
+            static_cast<cl_ulong>(num_ordered),
+            displaced_keys.get_buffer(),
+            static_cast<cl_ulong>(num_displaced),
+            permutation_out);
+      qcl::check_cl_error(err, "Could not enqueue merge_ordered_keys kernel");
+    }
+
+    this->apply_permutation(ctx, particles, num_particles, permutation_out);
+    return true;
   }
 
+  /// Reorders the particles such that particles[i] = old_particles[permutation[i]]
+  void apply_permutation(const qcl::device_context_ptr& ctx,
+                         const cl::Buffer& particles,
+                         std::size_t num_particles,
+                         const cl::Buffer& permutation) const
+  {
+    build_stage_scope stage{ctx, "gather"};
+    auto unsorted_particles = get_memory_pool(ctx)->allocate<particle_type>(num_particles);
+
+    cl_int err = ctx->get_command_queue().enqueueCopyBuffer(
+          particles,
+          unsorted_particles.get_buffer(),
+          0, 0,
+          num_particles * sizeof(particle_type));
+    qcl::check_cl_error(err, "Could not copy particles");
+
+    cl::NDRange global_size{num_particles};
+    cl::NDRange local_size{this->local_size};
+
+    err = gather_particles(ctx, global_size, local_size)(
+          unsorted_particles.get_buffer(),
+          permutation,
+          static_cast<cl_ulong>(num_particles),
+          particles);
+    qcl::check_cl_error(err, "Could not enqueue gather_particles kernel");
+  }
+
+private:
+  static constexpr std::size_t local_size = 256;
+  /// The maximum number of passes of the incremental sort that search
+  /// for displaced keys, before it falls back to the full sort
+  static constexpr std::size_t max_displacement_passes = 8;
+
+  sort_engine_type _engine;
+  index_sort_engine_type _index_engine;
+  double _max_incremental_fraction;
+  bool _presorted;
+
+  // Statistics of the last sort, see last_sort_was_incremental()
+  mutable bool _last_sort_was_incremental;
+  mutable std::size_t _last_num_displaced;
+
+  QCL_ENTRYPOINT(init_permutation)
+  QCL_ENTRYPOINT(gather_particles)
+  QCL_ENTRYPOINT(compact_ordered_keys)
+  QCL_ENTRYPOINT(mark_displaced_keys)
+  QCL_ENTRYPOINT(compact_displaced_keys)
+  QCL_ENTRYPOINT(merge_displaced_keys)
+  QCL_ENTRYPOINT(merge_ordered_keys)
+  QCL_MAKE_SOURCE
+  (
+    QCL_IMPORT_TYPE(particle_type)
+    QCL_IMPORT_TYPE(key_type)
+    QCL_RAW
+    (
+      __kernel void init_permutation(__global uint* permutation,
+                                     ulong num_particles)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_particles;
+            tid += get_global_size(0))
+          permutation[tid] = (uint)tid;
+      }
+
+      __kernel void gather_particles(__global particle_type* unsorted_particles,
+                                     __global uint* permutation,
+                                     ulong num_particles,
+                                     __global particle_type* sorted_particles)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_particles;
+            tid += get_global_size(0))
+          sorted_particles[tid] = unsorted_particles[permutation[tid]];
+      }
+
+      // Compacts the keys of the particles that are not displaced,
+      // together with their positions
+      __kernel void compact_ordered_keys(__global key_type* keys,
+                                         __global uint* displaced_flags,
+                                         __global uint* displaced_positions,
+                                         ulong num_particles,
+                                         __global key_type* ordered_keys,
+                                         __global uint* ordered_origins)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_particles;
+            tid += get_global_size(0))
+        {
+          if(!displaced_flags[tid])
+          {
+            uint pos = (uint)tid - displaced_positions[tid];
+            ordered_keys[pos] = keys[tid];
+            ordered_origins[pos] = (uint)tid;
+          }
+        }
+      }
+
+      // A key is displaced if it is smaller than its preceding or larger
+      // than its subsequent key among the keys that are not yet displaced.
+      // Sets *changed if any key has been marked.
+      __kernel void mark_displaced_keys(__global key_type* ordered_keys,
+                                        __global uint* ordered_origins,
+                                        ulong num_ordered,
+                                        __global uint* displaced_flags,
+                                        __global uint* changed)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_ordered;
+            tid += get_global_size(0))
+        {
+          key_type key = ordered_keys[tid];
+          uint is_displaced = 0;
+
+          if(tid > 0)
+            is_displaced |= (key < ordered_keys[tid - 1]);
+          if(tid + 1 < num_ordered)
+            is_displaced |= (key > ordered_keys[tid + 1]);
+
+          if(is_displaced)
+          {
+            displaced_flags[ordered_origins[tid]] = 1;
+            *changed = 1;
+          }
+        }
+      }
+
+      __kernel void compact_displaced_keys(__global key_type* keys,
+                                           __global uint* displaced_flags,
+                                           __global uint* displaced_positions,
+                                           ulong num_particles,
+                                           __global key_type* displaced_keys,
+                                           __global uint* displaced_origins)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_particles;
+            tid += get_global_size(0))
+        {
+          if(displaced_flags[tid])
+          {
+            uint pos = displaced_positions[tid];
+            displaced_keys[pos] = keys[tid];
+            displaced_origins[pos] = (uint)tid;
+          }
+        }
+      }
+
+      // \return The number of keys in the sorted array that are smaller
+      // than key (or, if inclusive, not larger than key)
+      ulong count_smaller_keys(__global key_type* sorted_keys,
+                               ulong num_keys,
+                               key_type key,
+                               int inclusive)
+      {
+        ulong begin = 0;
+        ulong end = num_keys;
+        while(begin < end)
+        {
+          ulong mid = begin + (end - begin) / 2;
+          key_type current = sorted_keys[mid];
+          if(current < key || (inclusive && current == key))
+            begin = mid + 1;
+          else
+            end = mid;
+        }
+        return begin;
+      }
+
+      // The sorted displaced keys and the ordered keys are merged. The
+      // final position of a key is its rank in its own array plus the
+      // number of keys of the other array before it. Displaced keys are
+      // placed before ordered keys that are equal to them.
+      __kernel void merge_displaced_keys(__global key_type* displaced_keys,
+                                         __global uint* displaced_origins,
+                                         ulong num_displaced,
+                                         __global key_type* ordered_keys,
+                                         ulong num_ordered,
+                                         __global uint* permutation)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_displaced;
+            tid += get_global_size(0))
+        {
+          ulong target = tid + count_smaller_keys(ordered_keys, num_ordered,
+                                                  displaced_keys[tid], 0);
+          permutation[target] = displaced_origins[tid];
+        }
+      }
+
+      __kernel void merge_ordered_keys(__global key_type* ordered_keys,
+                                       __global uint* ordered_origins,
+                                       ulong num_ordered,
+                                       __global key_type* displaced_keys,
+                                       ulong num_displaced,
+                                       __global uint* permutation)
+      {
+        for(size_t tid = get_global_id(0);
+            tid < num_ordered;
+            tid += get_global_size(0))
+        {
+          ulong target = tid + count_smaller_keys(displaced_keys, num_displaced,
+                                                  ordered_keys[tid], 1);
+          permutation[target] = ordered_origins[tid];
+        }
+      }
+    )
+  )
 };
 
 }
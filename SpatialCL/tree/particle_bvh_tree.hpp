@@ -33,27 +33,90 @@
 #include <QCL/qcl_module.hpp>
 #include <QCL/qcl_array.hpp>
 #include "particle_tree.hpp"
+#include "bottom_up_builder.hpp"
 
 namespace spatialcl {
 
+/// Combiner for the \c bottom_up_builder that calculates the bounding
+/// boxes of the nodes. The first node value is the minimum corner,
+/// the second value the maximum corner.
+template<class Type_descriptor>
+class bvh_bottom_up_combiner
+{
+public:
+  QCL_MAKE_MODULE(bvh_bottom_up_combiner)
+private:
+  QCL_MAKE_SOURCE
+  (
+    QCL_PREPROCESSOR(define,
+      bottom_up_build_leaf_node(particles,
+                                particles_begin,
+                                particles_end,
+                                bbox_min_ptr,
+                                bbox_max_ptr)
+      {
+        vector_type bb_min = PARTICLE_POSITION(particles[particles_begin]);
+        vector_type bb_max = bb_min;
+
+        for(index_type i = particles_begin + 1; i < particles_end; ++i)
+        {
+          vector_type position = PARTICLE_POSITION(particles[i]);
+          bb_min = fmin(bb_min, position);
+          bb_max = fmax(bb_max, position);
+        }
+
+        *bbox_min_ptr = bb_min;
+        *bbox_max_ptr = bb_max;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      bottom_up_combine_nodes(left_bbox_min,
+                              left_bbox_max,
+                              right_bbox_min,
+                              right_bbox_max,
+                              right_child_exists,
+                              bbox_min_ptr,
+                              bbox_max_ptr)
+      {
+        *bbox_min_ptr = left_bbox_min;
+        *bbox_max_ptr = left_bbox_max;
+        if(right_child_exists)
+        {
+          *bbox_min_ptr = fmin(left_bbox_min, right_bbox_min);
+          *bbox_max_ptr = fmax(left_bbox_max, right_bbox_max);
+        }
+      }
+    )
+  )
+};
+
+/// Bounding volume hierarchy over spatially sorted particles. The first
+/// node value is the minimum corner and the second node value the maximum
+/// corner of the bounding box of the node.
+/// \tparam Leaf_bucket_size The maximum number of particles per leaf node,
+/// see \c particle_tree
 template<class Particle_sorter,
-         class Type_descriptor>
+         class Type_descriptor,
+         std::size_t Leaf_bucket_size = 2>
 class particle_bvh_tree : public particle_tree<Particle_sorter,
                                                Type_descriptor,
                                                typename configuration<Type_descriptor>::vector_type,
-                                               typename configuration<Type_descriptor>::vector_type>
+                                               typename configuration<Type_descriptor>::vector_type,
+                                               Leaf_bucket_size>
 {
 public:
   QCL_MAKE_MODULE(particle_bvh_tree)
 
   using particle_type = typename configuration<Type_descriptor>::particle_type;
   using vector_type = typename configuration<Type_descriptor>::vector_type;
+  using scalar = typename configuration<Type_descriptor>::scalar;
 
   using base_type = particle_tree<
     Particle_sorter,
     Type_descriptor,
     typename configuration<Type_descriptor>::vector_type,
-    typename configuration<Type_descriptor>::vector_type
+    typename configuration<Type_descriptor>::vector_type,
+    Leaf_bucket_size
   >;
 
   particle_bvh_tree(const qcl::device_context_ptr& ctx,
@@ -64,41 +127,121 @@ public:
     this->rebuild_bounding_boxes();
   }
 
+  /// Builds the tree over particles that reside on the device.
+  /// Does not block unless the sorter does (see \c rebuild()).
+  /// \param evt If not \c nullptr, receives an event that completes
+  /// once the tree has been built
+  /// \param wait_events If not \c nullptr, the construction only starts
+  /// once these events have completed, e.g. the upload of the particles
+  /// on a \c transfer_queue
   particle_bvh_tree(const qcl::device_context_ptr& ctx,
                     const cl::Buffer& particles,
                     std::size_t num_particles,
-                    const Particle_sorter& sorter = Particle_sorter{})
-    : base_type{ctx, particles, num_particles, sorter}
+                    const Particle_sorter& sorter = Particle_sorter{},
+                    cl::Event* evt = nullptr,
+                    const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, num_particles, sorter, nullptr, wait_events}
   {
     this->rebuild_bounding_boxes();
+    enqueue_completion_event(this->get_device_context(), evt);
   }
 
   particle_bvh_tree(const qcl::device_context_ptr& ctx,
                     const qcl::device_array<particle_type>& particles,
-                    const Particle_sorter& sorter = Particle_sorter{})
-    : base_type{ctx, particles, sorter}
+                    const Particle_sorter& sorter = Particle_sorter{},
+                    cl::Event* evt = nullptr,
+                    const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, sorter, nullptr, wait_events}
   {
     this->rebuild_bounding_boxes();
+    enqueue_completion_event(this->get_device_context(), evt);
   }
 
+  /// Loads a tree saved with \c save_snapshot(), see \c particle_tree
+  particle_bvh_tree(const qcl::device_context_ptr& ctx,
+                    const tree_snapshot_view& snapshot)
+    : base_type{ctx, snapshot}
+  {}
+
   virtual ~particle_bvh_tree(){}
 
+  /// Recalculates the bounding boxes for the current particle
+  /// positions without changing the particle order or reallocating
+  /// any buffers. Use this if the particles have moved only a little,
+  /// otherwise the tree quality will degrade (see \c get_quality_metric()).
+  /// \param evt If not \c nullptr, receives an event that completes
+  /// once the tree has been refitted
+  /// \param wait_events If not \c nullptr, the refit only starts once
+  /// these events have completed, e.g. the upload of the new particles
+  /// on a \c transfer_queue
+  void refit(cl::Event* evt = nullptr,
+             const event_list* wait_events = nullptr)
+  {
+    enqueue_wait_for_events(this->get_device_context(), wait_events);
+    this->rebuild_bounding_boxes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Sorts the particles again and rebuilds the bounding boxes,
+  /// reusing the existing buffers. The events are used as in \c refit().
+  /// Note that the sorter may block until its data is available.
+  void rebuild(const Particle_sorter& sorter = Particle_sorter{},
+               cl::Event* evt = nullptr,
+               const event_list* wait_events = nullptr)
+  {
+    enqueue_wait_for_events(this->get_device_context(), wait_events);
+    this->resort(sorter);
+    this->rebuild_bounding_boxes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// \return A measure for the tree quality (smaller is better), calculated
+  /// as the sum of the bounding box extents of the leaf buckets.
+  /// If the tree is only refitted while particles move, this increases
+  /// as the particle order deviates from the spatial distribution.
+  /// This can be passed to a \c tree_rebuild_policy.
+  /// Note: This function blocks until the result is available.
+  double get_quality_metric() const
+  {
+    const std::size_t num_lowest_level_nodes = this->get_num_leaf_buckets();
+
+    qcl::device_array<scalar> node_extents{this->get_device_context(),
+                                           num_lowest_level_nodes};
+
+    cl_int err = bvh_tree_node_extents(this->get_device_context(),
+                                       cl::NDRange{num_lowest_level_nodes},
+                                       cl::NDRange{this->local_size})(
+          this->get_node_values0(),
+          this->get_node_values1(),
+          static_cast<cl_ulong>(num_lowest_level_nodes),
+          node_extents);
+    qcl::check_cl_error(err, "Could not enqueue bvh_tree_node_extents kernel");
+
+    boost::compute::command_queue boost_queue{
+      this->get_device_context()->get_command_queue().get()
+    };
+
+    scalar result = 0;
+    boost::compute::reduce(
+          qcl::create_buffer_iterator<scalar>(node_extents.get_buffer(), 0),
+          qcl::create_buffer_iterator<scalar>(node_extents.get_buffer(),
+                                              num_lowest_level_nodes),
+          &result,
+          boost_queue);
+
+    return static_cast<double>(result);
+  }
+
   void rebuild_bounding_boxes()
   {
-    // Build the lowest layer of nodes. Because the particles
-    // themselves are the lowest level, this is actually the second level.
-    this->build_lowest_level_bboxes();
-
-    // Build the next layers. We start from num_levels-3, because num_levels-1 corresponds
-    // to the particle layer, and num_levels-2 is the lowest node layer that was already
-    // built by build_lowest_level_bboxes().
-    for(int i = static_cast<int>(this->get_effective_num_levels())-3; i >= 0; --i)
-    {
-#ifndef NODEBUG
-      std::cout << "Building level " << i << std::endl;
-#endif
-      build_higher_level_bboxes(static_cast<unsigned>(i));
-    }
+    // All levels are built in one kernel launch, see bottom_up_builder,
+    // so the leaves and the upper levels can only be timed together.
+    build_stage_scope stage{this->get_device_context(), "bounding boxes"};
+    _builder(this->get_device_context(),
+             this->get_sorted_particles(),
+             this->get_num_particles(),
+             this->get_node_values0(),
+             this->get_node_values1());
   }
 
   const cl::Buffer& get_bbox_min_corners() const
@@ -115,40 +258,17 @@ private:
 
   static constexpr std::size_t local_size = 256;
 
-  void build_lowest_level_bboxes() const
-  {
-    cl::NDRange global_size {this->get_effective_num_particles()/2};
-    cl::NDRange local_size {this->local_size};
-
-    cl_int err = bvh_tree_build_ll_bbox(this->get_device_context(), global_size, local_size)(
-         this->get_sorted_particles(),
-         static_cast<cl_ulong>(this->get_num_particles()),
-         this->get_node_values0(),
-         this->get_node_values1());
-
-    qcl::check_cl_error(err, "Could not enqueue bvh_tree_build_ll_bbox kernel");
-  }
-
-  void build_higher_level_bboxes(unsigned level_id) const
-  {
-    assert(level_id < this->get_effective_num_levels());
-
-
-    cl::NDRange global_size {1ull << level_id};
-    cl::NDRange local_size {local_size};
-
-    cl_int err = bvh_tree_build_bbox(this->get_device_context(), global_size, local_size)(
-        this->get_node_values0(),
-        this->get_node_values1(),
-        static_cast<cl_uint>(level_id),
-        static_cast<cl_uint>(this->get_effective_num_levels()),
-        static_cast<cl_ulong>(this->get_num_particles()));
+  using builder_type = bottom_up_builder<
+    Type_descriptor,
+    vector_type,
+    vector_type,
+    bvh_bottom_up_combiner<Type_descriptor>,
+    Leaf_bucket_size
+  >;
 
-    qcl::check_cl_error(err, "Could not enqueue bvh_tree_build_bbox kernel.");
-  }
+  builder_type _builder;
 
-  QCL_ENTRYPOINT(bvh_tree_build_ll_bbox)
-  QCL_ENTRYPOINT(bvh_tree_build_bbox)
+  QCL_ENTRYPOINT(bvh_tree_node_extents)
   QCL_MAKE_SOURCE
   (
     QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
@@ -157,105 +277,19 @@ private:
     QCL_RAW
     (
 
-      __kernel void bvh_tree_build_ll_bbox(__global particle_type* particles,
-                                           index_type num_particles,
-                                           __global vector_type* nodes_min_corner,
-                                           __global vector_type* nodes_max_corner)
+      __kernel void bvh_tree_node_extents(__global vector_type* nodes_min_corner,
+                                          __global vector_type* nodes_max_corner,
+                                          index_type num_nodes,
+                                          __global scalar* extents_out)
       {
-        index_type num_threads = get_global_size(0);
-
-        index_type effective_num_particles = BT_EFFECTIVE_NUM_LEAVES(num_particles);
-        uint num_levels = find_most_significant_bit(effective_num_particles) + 1;
-
-        for(index_type tid = get_global_id(0);
-            tid < effective_num_particles/2;
-            tid += num_threads)
-        {
-          index_type particle0_idx = 2 * tid;
-          index_type particle1_idx = 2 * tid + 1;
-
-          particle_type particle0 = (particle_type)(0.0f);
-
-          if(particle0_idx < num_particles)
-            particle0 = particles[particle0_idx];
-
-          particle_type particle1 = particle0;
-
-          if(particle1_idx < num_particles)
-            particle1 = particles[particle1_idx];
-
-          vector_type bb_min_position = fmin(PARTICLE_POSITION(particle0),
-                                             PARTICLE_POSITION(particle1));
-
-
-          vector_type bb_max_position = fmax(PARTICLE_POSITION(particle0),
-                                             PARTICLE_POSITION(particle1));
-
-          nodes_min_corner[tid] = bb_min_position;
-          nodes_max_corner[tid] = bb_max_position;
-        }
-      }
-
-      /// Builds bounding boxed for higher nodes - assumes that the lowest
-      /// level of nodes has already been constructed using
-      /// bvh_tree_build_ll_bbox()
-      __kernel void bvh_tree_build_bbox(__global vector_type* nodes_min_corner,
-                                        __global vector_type* nodes_max_corner,
-                                        uint level,
-                                        uint num_levels,
-                                        index_type num_particles)
-      {
-        index_type num_threads = get_global_size(0);
-
-        index_type num_nodes = BT_NUM_NODES(level);
-        //index_type offset_correction = BT_EFFECTIVE_NUM_LEAVES(num_particles) - num_particles;
-        index_type offset_correction = BT_EFFECTIVE_NUM_LEAVES(num_particles);
-
         for(index_type tid = get_global_id(0);
             tid < num_nodes;
-            tid += num_threads)
+            tid += get_global_size(0))
         {
-          binary_tree_key_t node_key;
-          binary_tree_key_init(&node_key, level, tid);
-
-          int node_exists = binary_tree_is_node_used(&node_key,
-                                                     num_levels,
-                                                     num_particles);
-
-          vector_type bb_min = (vector_type)(0.0f);
-          vector_type bb_max = (vector_type)(0.0f);
-
-          if(node_exists)
-          {
-            binary_tree_key_t children_begin = binary_tree_get_children_begin(&node_key);
-            binary_tree_key_t children_last  = binary_tree_get_children_last (&node_key);
-
-            int right_child_exists = binary_tree_is_node_used(&children_last,
-                                                              num_levels,
-                                                              num_particles);
-
-            index_type child_idx = binary_tree_key_encode_global_id(&children_begin,
-                                                                    num_levels);
-
-            // We already know that the new parent node exists, so at least the left
-            // child must exist as well. We therefore do not need to check the existence
-            // of the left child, and can directly access its data.
-            ASSERT(child_idx >= offset_correction);
-            bb_min = nodes_min_corner[child_idx - offset_correction];
-            bb_max = nodes_max_corner[child_idx - offset_correction];
-
-            if(right_child_exists)
-            {
-              child_idx = binary_tree_key_encode_global_id(&children_last, num_levels);
-              ASSERT(child_idx >= offset_correction);
-              bb_min = fmin(bb_min, nodes_min_corner[child_idx - offset_correction]);
-              bb_max = fmax(bb_max, nodes_max_corner[child_idx - offset_correction]);
-            }
-          }
-
-          index_type node_idx = binary_tree_key_encode_global_id(&node_key, num_levels);
-          nodes_min_corner[node_idx - offset_correction] = bb_min;
-          nodes_max_corner[node_idx - offset_correction] = bb_max;
+          vector_type extent = nodes_max_corner[tid] - nodes_min_corner[tid];
+
+          extents_out[tid] = DIMENSIONALITY_SWITCH(extent.x + extent.y,
+                                                   extent.x + extent.y + extent.z);
         }
       }
     )
@@ -0,0 +1,340 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTICLE_MIXED_PRECISION_BVH_TREE
+#define PARTICLE_MIXED_PRECISION_BVH_TREE
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+#include <type_traits>
+
+#include "particle_bvh_tree.hpp"
+#include "node_codec.hpp"
+
+namespace spatialcl {
+
+/// Bounding volume hierarchy for double precision particles that provides
+/// the query engines with single precision bounding boxes, stored as
+/// offsets relative to the center of the root of the subtree that contains
+/// the node (see \c mixed_precision_bbox_codec). Query handlers can then carry out the node
+/// tests in single precision, and only test the particles in double precision.
+/// On GPUs with a low double precision throughput, this is much faster than
+/// testing the nodes in double precision, and it halves the memory traffic
+/// for the nodes. Since the offset boxes contain the exact boxes, query results
+/// do not change; only slightly more nodes may be selected.
+///
+/// The nodes passed to the handlers are offsets of type \c offset_vector_type,
+/// hence this tree requires handlers that are written for it, such as
+/// \c query::mixed_precision_box_range_query. Handlers obtain the origins
+/// of the offsets from \c get_coordinate_origin().
+///
+/// With a single origin at the center of the root, the offsets of the
+/// nodes far from the center have the absolute rounding error of the
+/// extent of the whole tree, so the small boxes near the leaves grow
+/// relative to their size and select more nodes. With one origin per
+/// subtree, the error scales with the extent of the subtree instead.
+///
+/// The full precision boxes are kept to refit the tree and are available
+/// through \c get_bbox_min_corners() and \c get_bbox_max_corners().
+/// \tparam Leaf_bucket_size The maximum number of particles per leaf node,
+/// see \c particle_tree
+template<class Particle_sorter,
+         class Type_descriptor,
+         std::size_t Leaf_bucket_size = 2>
+class particle_mixed_precision_bvh_tree : public particle_bvh_tree<Particle_sorter,
+                                                                   Type_descriptor,
+                                                                   Leaf_bucket_size>
+{
+public:
+  QCL_MAKE_MODULE(particle_mixed_precision_bvh_tree)
+
+  using particle_type = typename configuration<Type_descriptor>::particle_type;
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+  using scalar = typename configuration<Type_descriptor>::scalar;
+
+  static_assert(std::is_same<scalar, double>::value,
+                "Mixed precision trees require double precision particles");
+
+  using base_type = particle_bvh_tree<
+    Particle_sorter,
+    Type_descriptor,
+    Leaf_bucket_size
+  >;
+
+  using node_codec = mixed_precision_bbox_codec<Type_descriptor>;
+  using offset_vector_type = typename node_codec::offset_vector_type;
+
+  using node_type0 = offset_vector_type;
+  using node_type1 = offset_vector_type;
+
+  particle_mixed_precision_bvh_tree(const qcl::device_context_ptr& ctx,
+                                    const std::vector<particle_type>& particles,
+                                    const Particle_sorter& sorter = Particle_sorter{})
+    : base_type{ctx, particles, sorter}
+  {
+    this->init_offset_nodes();
+  }
+
+  particle_mixed_precision_bvh_tree(const qcl::device_context_ptr& ctx,
+                                    const cl::Buffer& particles,
+                                    std::size_t num_particles,
+                                    const Particle_sorter& sorter = Particle_sorter{},
+                                    cl::Event* evt = nullptr,
+                                    const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, num_particles, sorter, nullptr, wait_events}
+  {
+    this->init_offset_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  particle_mixed_precision_bvh_tree(const qcl::device_context_ptr& ctx,
+                                    const qcl::device_array<particle_type>& particles,
+                                    const Particle_sorter& sorter = Particle_sorter{},
+                                    cl::Event* evt = nullptr,
+                                    const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, sorter, nullptr, wait_events}
+  {
+    this->init_offset_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Loads a tree saved with \c save_snapshot(). The derived node
+  /// data is recalculated from the loaded nodes.
+  particle_mixed_precision_bvh_tree(const qcl::device_context_ptr& ctx,
+                                    const tree_snapshot_view& snapshot)
+    : base_type{ctx, snapshot}
+  {
+    this->init_offset_nodes();
+  }
+
+  virtual ~particle_mixed_precision_bvh_tree(){}
+
+  /// Recalculates the full precision and the offset bounding boxes,
+  /// see \c particle_bvh_tree::refit()
+  void refit(cl::Event* evt = nullptr,
+             const event_list* wait_events = nullptr)
+  {
+    base_type::refit(nullptr, wait_events);
+    this->encode_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Sorts the particles again and rebuilds all nodes
+  void rebuild(const Particle_sorter& sorter = Particle_sorter{},
+               cl::Event* evt = nullptr,
+               const event_list* wait_events = nullptr)
+  {
+    base_type::rebuild(sorter, nullptr, wait_events);
+    this->encode_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// \return The offsets of the minimum corners of the bounding boxes
+  const cl::Buffer& get_node_values0() const
+  {
+    return _offset_min_corners.get_buffer();
+  }
+
+  /// \return The offsets of the maximum corners of the bounding boxes
+  const cl::Buffer& get_node_values1() const
+  {
+    return _offset_max_corners.get_buffer();
+  }
+
+  /// \return A buffer with \c node_codec::num_offset_origins elements of
+  /// \c vector_type, the double precision origins of the offsets, indexed
+  /// by \c mixed_precision_get_origin_index(). They change with each refit
+  /// and rebuild.
+  const cl::Buffer& get_coordinate_origin() const
+  {
+    return _coordinate_origin.get_buffer();
+  }
+
+private:
+  static constexpr std::size_t local_size = 256;
+  static constexpr std::size_t leaf_bucket_depth =
+      utils::binary::small_binary_logarithm<Leaf_bucket_size>::value;
+  static constexpr std::size_t num_offset_origins = node_codec::num_offset_origins;
+
+  void init_offset_nodes()
+  {
+    const std::size_t num_allocated_nodes =
+        std::max<std::size_t>(this->get_num_nodes(), 1);
+
+    _offset_min_corners = qcl::device_array<offset_vector_type>{
+      this->get_device_context(),
+      num_allocated_nodes
+    };
+    _offset_max_corners = qcl::device_array<offset_vector_type>{
+      this->get_device_context(),
+      num_allocated_nodes
+    };
+    _coordinate_origin = qcl::device_array<vector_type>{
+      this->get_device_context(),
+      num_offset_origins
+    };
+
+    this->encode_nodes();
+  }
+
+  void encode_nodes()
+  {
+    const std::size_t num_nodes = this->get_num_nodes();
+    if(num_nodes == 0)
+      return;
+
+    build_stage_scope stage{this->get_device_context(), "node encoding"};
+    cl_int err = mixed_precision_bvh_compute_origins(this->get_device_context(),
+                                                     cl::NDRange{num_offset_origins},
+                                                     cl::NullRange)(
+          this->get_bbox_min_corners(),
+          this->get_bbox_max_corners(),
+          static_cast<cl_ulong>(num_nodes),
+          static_cast<cl_ulong>(this->get_effective_num_levels()),
+          static_cast<cl_ulong>(this->get_num_particles()),
+          _coordinate_origin);
+    qcl::check_cl_error(err, "Could not enqueue mixed_precision_bvh_compute_origins kernel");
+
+    err = mixed_precision_bvh_encode_nodes(this->get_device_context(),
+                                           cl::NDRange{num_nodes},
+                                           cl::NDRange{this->local_size})(
+          this->get_bbox_min_corners(),
+          this->get_bbox_max_corners(),
+          static_cast<cl_ulong>(num_nodes),
+          static_cast<cl_ulong>(this->get_effective_num_levels()),
+          static_cast<cl_ulong>(this->get_num_particles()),
+          _coordinate_origin,
+          _offset_min_corners,
+          _offset_max_corners);
+    qcl::check_cl_error(err, "Could not enqueue mixed_precision_bvh_encode_nodes kernel");
+  }
+
+  qcl::device_array<offset_vector_type> _offset_min_corners;
+  qcl::device_array<offset_vector_type> _offset_max_corners;
+  qcl::device_array<vector_type> _coordinate_origin;
+
+  QCL_ENTRYPOINT(mixed_precision_bvh_compute_origins)
+  QCL_ENTRYPOINT(mixed_precision_bvh_encode_nodes)
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(binary_tree)
+    QCL_INCLUDE_MODULE(node_codec)
+    QCL_IMPORT_CONSTANT(leaf_bucket_depth)
+    QCL_RAW
+    (
+      vector_type mixed_precision_bbox_center(__global vector_type* nodes_min_corner,
+                                              __global vector_type* nodes_max_corner,
+                                              index_type node_idx)
+      {
+        return (scalar)0.5 * (nodes_min_corner[node_idx] + nodes_max_corner[node_idx]);
+      }
+
+      /// Each origin is the center of the root of its subtree, which
+      /// minimizes the magnitude of the offsets. Origins of subtrees that
+      /// are not populated, and the origin of the nodes above the subtrees,
+      /// are the center of the root, the last node.
+      __kernel void mixed_precision_bvh_compute_origins(__global vector_type* nodes_min_corner,
+                                                        __global vector_type* nodes_max_corner,
+                                                        index_type num_nodes,
+                                                        index_type effective_num_levels,
+                                                        index_type num_particles,
+                                                        __global vector_type* coordinate_origin)
+      {
+        const index_type tid = get_global_id(0);
+        if(tid >= num_offset_origins)
+          return;
+
+        const uint leaf_bucket_level = effective_num_levels - 1 - leaf_bucket_depth;
+
+        index_type node_idx = num_nodes - 1;
+        if(tid > 0 && offset_origin_level <= leaf_bucket_level)
+        {
+          binary_tree_key_t subtree_root;
+          binary_tree_key_init(&subtree_root, offset_origin_level, tid - 1);
+          if(binary_tree_is_node_used(&subtree_root, effective_num_levels, num_particles))
+            node_idx = binary_tree_key_encode_node_index(&subtree_root,
+                                                         effective_num_levels,
+                                                         num_particles,
+                                                         leaf_bucket_depth);
+        }
+        coordinate_origin[tid] = mixed_precision_bbox_center(nodes_min_corner,
+                                                             nodes_max_corner,
+                                                             node_idx);
+      }
+
+      __kernel void mixed_precision_bvh_encode_nodes(__global vector_type* nodes_min_corner,
+                                                     __global vector_type* nodes_max_corner,
+                                                     index_type num_nodes,
+                                                     index_type effective_num_levels,
+                                                     index_type num_particles,
+                                                     __global vector_type* coordinate_origin,
+                                                     __global storage_node_type0* offset_min_corners,
+                                                     __global storage_node_type1* offset_max_corners)
+      {
+        const uint leaf_bucket_level = effective_num_levels - 1 - leaf_bucket_depth;
+
+        for(index_type tid = get_global_id(0);
+            tid < num_nodes;
+            tid += get_global_size(0))
+        {
+          // The levels are stored from the leaf buckets up to the root,
+          // so the level of the node follows from the level offsets
+          uint level = leaf_bucket_level;
+          while(level > 0 &&
+                binary_tree_get_level_offset(level - 1,
+                                             effective_num_levels,
+                                             num_particles,
+                                             leaf_bucket_depth) <= tid)
+            --level;
+
+          binary_tree_key_t node_key;
+          binary_tree_key_init(&node_key,
+                               level,
+                               tid - binary_tree_get_level_offset(level,
+                                                                  effective_num_levels,
+                                                                  num_particles,
+                                                                  leaf_bucket_depth));
+
+          const vector_type origin =
+              coordinate_origin[mixed_precision_get_origin_index(&node_key)];
+
+          offset_min_corners[tid] = mixed_precision_offset_min(nodes_min_corner[tid], origin);
+          offset_max_corners[tid] = mixed_precision_offset_max(nodes_max_corner[tid], origin);
+        }
+      }
+    )
+  )
+};
+
+}
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTICLE_QUANTIZED_BVH_TREE
+#define PARTICLE_QUANTIZED_BVH_TREE
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+#include <limits>
+
+#include "particle_bvh_tree.hpp"
+#include "node_codec.hpp"
+#include "../memory_pool.hpp"
+
+namespace spatialcl {
+
+/// Bounding volume hierarchy that provides the query engines with
+/// bounding boxes quantized to 16 bit coordinates (see \c quantized_bbox_codec).
+/// This reduces the memory traffic for node fetches during queries by a factor
+/// of 2 in single precision and 4 in double precision. Since the quantized boxes
+/// contain the exact boxes, query results do not change; only slightly more nodes
+/// may be selected.
+///
+/// The full precision boxes are kept in addition to the quantized ones, since
+/// \c refit() and \c rebuild() of the base tree compute the parent boxes from
+/// them; deriving them from the quantized boxes instead would enlarge the
+/// boxes with every refit. The tree therefore needs more device memory than a
+/// \c particle_bvh_tree, only the memory traffic of the queries is reduced.
+/// The full precision boxes are available through \c get_bbox_min_corners()
+/// and \c get_bbox_max_corners(), while \c get_node_values0() and
+/// \c get_node_values1() return the quantized node storage read by the
+/// query engines.
+/// \tparam Leaf_bucket_size The maximum number of particles per leaf node,
+/// see \c particle_tree
+template<class Particle_sorter,
+         class Type_descriptor,
+         std::size_t Leaf_bucket_size = 2>
+class particle_quantized_bvh_tree : public particle_bvh_tree<Particle_sorter,
+                                                             Type_descriptor,
+                                                             Leaf_bucket_size>
+{
+public:
+  QCL_MAKE_MODULE(particle_quantized_bvh_tree)
+
+  using particle_type = typename configuration<Type_descriptor>::particle_type;
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+  using scalar = typename configuration<Type_descriptor>::scalar;
+
+  using base_type = particle_bvh_tree<
+    Particle_sorter,
+    Type_descriptor,
+    Leaf_bucket_size
+  >;
+
+  using node_codec = quantized_bbox_codec<Type_descriptor>;
+  using quantized_bbox_type = typename node_codec::quantized_bbox_type;
+
+  particle_quantized_bvh_tree(const qcl::device_context_ptr& ctx,
+                              const std::vector<particle_type>& particles,
+                              const Particle_sorter& sorter = Particle_sorter{})
+    : base_type{ctx, particles, sorter}
+  {
+    this->init_quantized_nodes();
+  }
+
+  particle_quantized_bvh_tree(const qcl::device_context_ptr& ctx,
+                              const cl::Buffer& particles,
+                              std::size_t num_particles,
+                              const Particle_sorter& sorter = Particle_sorter{},
+                              cl::Event* evt = nullptr,
+                              const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, num_particles, sorter, nullptr, wait_events}
+  {
+    this->init_quantized_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  particle_quantized_bvh_tree(const qcl::device_context_ptr& ctx,
+                              const qcl::device_array<particle_type>& particles,
+                              const Particle_sorter& sorter = Particle_sorter{},
+                              cl::Event* evt = nullptr,
+                              const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, sorter, nullptr, wait_events}
+  {
+    this->init_quantized_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Loads a tree saved with \c save_snapshot(). The derived node
+  /// data is recalculated from the loaded nodes.
+  particle_quantized_bvh_tree(const qcl::device_context_ptr& ctx,
+                              const tree_snapshot_view& snapshot)
+    : base_type{ctx, snapshot}
+  {
+    this->init_quantized_nodes();
+  }
+
+  virtual ~particle_quantized_bvh_tree(){}
+
+  /// Recalculates the full precision and the quantized bounding boxes,
+  /// see \c particle_bvh_tree::refit()
+  void refit(cl::Event* evt = nullptr,
+             const event_list* wait_events = nullptr)
+  {
+    base_type::refit(nullptr, wait_events);
+    this->quantize_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Sorts the particles again and rebuilds all nodes
+  void rebuild(const Particle_sorter& sorter = Particle_sorter{},
+               cl::Event* evt = nullptr,
+               const event_list* wait_events = nullptr)
+  {
+    base_type::rebuild(sorter, nullptr, wait_events);
+    this->quantize_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// \return The quantized bounding boxes
+  const cl::Buffer& get_node_values0() const
+  {
+    return _quantized_nodes.get_buffer();
+  }
+
+  /// \return The origin and the cell size of the quantization grid, which the
+  /// query engines load once instead of with every node
+  /// (see \c quantized_bbox_codec)
+  const cl::Buffer& get_node_values1() const
+  {
+    return _quantization_grid.get_buffer();
+  }
+
+private:
+  static constexpr std::size_t local_size = 256;
+
+  void init_quantized_nodes()
+  {
+    _quantized_nodes = get_memory_pool(this->get_device_context())->
+        allocate<quantized_bbox_type>(std::max<std::size_t>(this->get_num_nodes(), 1));
+    _quantization_grid = qcl::device_array<vector_type>{this->get_device_context(), 2};
+
+    this->quantize_nodes();
+  }
+
+  void quantize_nodes()
+  {
+    const std::size_t num_nodes = this->get_num_nodes();
+    if(num_nodes == 0)
+      return;
+
+    build_stage_scope stage{this->get_device_context(), "node encoding"};
+    cl_int err = quantized_bvh_encode_nodes(this->get_device_context(),
+                                            cl::NDRange{num_nodes},
+                                            cl::NDRange{this->local_size})(
+          this->get_bbox_min_corners(),
+          this->get_bbox_max_corners(),
+          static_cast<cl_ulong>(num_nodes),
+          static_cast<scalar>(std::numeric_limits<scalar>::epsilon()),
+          _quantized_nodes.get_buffer(),
+          _quantization_grid);
+    qcl::check_cl_error(err, "Could not enqueue quantized_bvh_encode_nodes kernel");
+  }
+
+  device_memory_pool::pooled_array<quantized_bbox_type> _quantized_nodes;
+  qcl::device_array<vector_type> _quantization_grid;
+
+  QCL_ENTRYPOINT(quantized_bvh_encode_nodes)
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(binary_tree)
+    QCL_INCLUDE_MODULE(node_codec)
+    QCL_RAW
+    (
+      __kernel void quantized_bvh_encode_nodes(__global vector_type* nodes_min_corner,
+                                               __global vector_type* nodes_max_corner,
+                                               index_type num_nodes,
+                                               scalar epsilon,
+                                               __global storage_node_type0* quantized_nodes,
+                                               __global vector_type* quantization_grid)
+      {
+        // The root is the last node. All work items calculate the same grid.
+        const vector_type root_min = nodes_min_corner[num_nodes - 1];
+        const vector_type root_max = nodes_max_corner[num_nodes - 1];
+
+        // The cell size must be large enough that one cell covers
+        // the rounding errors of the decoding
+        const vector_type grid_origin = root_min;
+        vector_type grid_cell_size = fmax((root_max - root_min) / (scalar)(max_quantized_coordinate - 2),
+                                          (scalar)4 * epsilon * (fabs(root_min) + fabs(root_max)));
+        grid_cell_size = fmax(grid_cell_size, (vector_type)epsilon);
+
+        if(get_global_id(0) == 0)
+        {
+          quantization_grid[0] = grid_origin;
+          quantization_grid[1] = grid_cell_size;
+        }
+
+        for(index_type tid = get_global_id(0);
+            tid < num_nodes;
+            tid += get_global_size(0))
+        {
+          quantized_nodes[tid] = quantize_bbox(nodes_min_corner[tid],
+                                               nodes_max_corner[tid],
+                                               grid_origin,
+                                               grid_cell_size);
+        }
+      }
+    )
+  )
+};
+
+}
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTICLE_SOA_BVH_TREE
+#define PARTICLE_SOA_BVH_TREE
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+
+#include "particle_bvh_tree.hpp"
+
+namespace spatialcl {
+
+/// Bounding volume hierarchy that additionally stores the positions
+/// of the sorted particles in a separate, compact array. Query engines
+/// pass these positions to handlers that define a \c dfs_position_processor,
+/// so that the remaining particle components are only read for the
+/// selected particles. For particles with many components, this strongly
+/// reduces the memory traffic of the particle tests.
+///
+/// If the particles are modified (e.g. moved before \c refit()),
+/// the positions are extracted again by \c refit() and \c rebuild().
+/// \tparam Leaf_bucket_size The maximum number of particles per leaf node,
+/// see \c particle_tree
+template<class Particle_sorter,
+         class Type_descriptor,
+         std::size_t Leaf_bucket_size = 2>
+class particle_soa_bvh_tree : public particle_bvh_tree<Particle_sorter,
+                                                       Type_descriptor,
+                                                       Leaf_bucket_size>
+{
+public:
+  QCL_MAKE_MODULE(particle_soa_bvh_tree)
+
+  using particle_type = typename configuration<Type_descriptor>::particle_type;
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+
+  using base_type = particle_bvh_tree<
+    Particle_sorter,
+    Type_descriptor,
+    Leaf_bucket_size
+  >;
+
+  static constexpr bool provides_particle_positions = true;
+
+  particle_soa_bvh_tree(const qcl::device_context_ptr& ctx,
+                        const std::vector<particle_type>& particles,
+                        const Particle_sorter& sorter = Particle_sorter{})
+    : base_type{ctx, particles, sorter}
+  {
+    this->init_particle_positions();
+  }
+
+  particle_soa_bvh_tree(const qcl::device_context_ptr& ctx,
+                        const cl::Buffer& particles,
+                        std::size_t num_particles,
+                        const Particle_sorter& sorter = Particle_sorter{},
+                        cl::Event* evt = nullptr,
+                        const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, num_particles, sorter, nullptr, wait_events}
+  {
+    this->init_particle_positions();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  particle_soa_bvh_tree(const qcl::device_context_ptr& ctx,
+                        const qcl::device_array<particle_type>& particles,
+                        const Particle_sorter& sorter = Particle_sorter{},
+                        cl::Event* evt = nullptr,
+                        const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, sorter, nullptr, wait_events}
+  {
+    this->init_particle_positions();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Loads a tree saved with \c save_snapshot(). The derived node
+  /// data is recalculated from the loaded nodes.
+  particle_soa_bvh_tree(const qcl::device_context_ptr& ctx,
+                        const tree_snapshot_view& snapshot)
+    : base_type{ctx, snapshot}
+  {
+    this->init_particle_positions();
+  }
+
+  virtual ~particle_soa_bvh_tree(){}
+
+  /// Recalculates the bounding boxes and extracts the particle positions
+  /// again, see \c particle_bvh_tree::refit()
+  void refit(cl::Event* evt = nullptr,
+             const event_list* wait_events = nullptr)
+  {
+    base_type::refit(nullptr, wait_events);
+    this->extract_particle_positions();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Sorts the particles again and rebuilds the nodes and
+  /// the particle positions
+  void rebuild(const Particle_sorter& sorter = Particle_sorter{},
+               cl::Event* evt = nullptr,
+               const event_list* wait_events = nullptr)
+  {
+    base_type::rebuild(sorter, nullptr, wait_events);
+    this->extract_particle_positions();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// \return The positions of the sorted particles
+  const cl::Buffer& get_particle_positions() const
+  {
+    return _positions.get_buffer();
+  }
+
+private:
+  static constexpr std::size_t local_size = 256;
+
+  void init_particle_positions()
+  {
+    // Buffers cannot be empty, so we allocate at least one position
+    _positions = qcl::device_array<vector_type>{
+      this->get_device_context(),
+      std::max<std::size_t>(this->get_num_particles(), 1)
+    };
+    this->extract_particle_positions();
+  }
+
+  void extract_particle_positions()
+  {
+    if(this->get_num_particles() == 0)
+      return;
+
+    cl_int err = soa_tree_extract_positions(this->get_device_context(),
+                                            cl::NDRange{this->get_num_particles()},
+                                            cl::NDRange{this->local_size})(
+          this->get_sorted_particles(),
+          static_cast<cl_ulong>(this->get_num_particles()),
+          _positions);
+    qcl::check_cl_error(err, "Could not enqueue soa_tree_extract_positions kernel");
+  }
+
+  qcl::device_array<vector_type> _positions;
+
+  QCL_ENTRYPOINT(soa_tree_extract_positions)
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(binary_tree)
+    QCL_RAW
+    (
+      __kernel void soa_tree_extract_positions(__global particle_type* particles,
+                                               index_type num_particles,
+                                               __global vector_type* positions_out)
+      {
+        for(index_type tid = get_global_id(0);
+            tid < num_particles;
+            tid += get_global_size(0))
+          positions_out[tid] = PARTICLE_POSITION(particles[tid]);
+      }
+    )
+  )
+};
+
+}
+
+#endif
@@ -33,15 +33,87 @@
 #include <QCL/qcl_array.hpp>
 
 #include <boost/compute.hpp>
+#include <algorithm>
 #include <cassert>
 #include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
 #include "binary_tree.hpp"
+#include "node_codec.hpp"
+#include "tree_snapshot.hpp"
 #include "../configuration.hpp"
 #include "../cl_utils.hpp"
+#include "../async.hpp"
+#include "../binary_utils.hpp"
+#include "../build_profiler.hpp"
+#include "../memory_pool.hpp"
 
 
 namespace spatialcl {
 
+/// Sorters that can output the permutation that they have applied
+/// to the particles signal this with a
+/// \c static \c constexpr \c bool \c provides_permutation member
+/// that is set to true. They must then also provide
+/// \code
+/// void operator()(const qcl::device_context_ptr& ctx,
+///                 const cl::Buffer& particles,
+///                 std::size_t num_particles,
+///                 const cl::Buffer& permutation_out) const;
+/// \endcode
+template<class Particle_sorter, class Enable = void>
+struct sorter_provides_permutation : public std::false_type
+{};
+
+template<class Particle_sorter>
+struct sorter_provides_permutation<
+    Particle_sorter,
+    typename std::enable_if<Particle_sorter::provides_permutation>::type
+  > : public std::true_type
+{};
+
+/// Trees that additionally store the positions of the sorted particles
+/// in a separate array of \c vector_type signal this with a
+/// \c static \c constexpr \c bool \c provides_particle_positions member
+/// that is set to true. They must then also provide
+/// \code
+/// const cl::Buffer& get_particle_positions() const;
+/// \endcode
+/// Query engines then pass the positions to handlers that
+/// define a \c dfs_position_processor.
+template<class Tree_type, class Enable = void>
+struct tree_provides_particle_positions : public std::false_type
+{};
+
+template<class Tree_type>
+struct tree_provides_particle_positions<
+    Tree_type,
+    typename std::enable_if<Tree_type::provides_particle_positions>::type
+  > : public std::true_type
+{};
+
+/// \return A pointer to the particle positions of the tree, or
+/// \c nullptr if the tree does not store the positions separately.
+template<class Tree_type,
+         typename std::enable_if<
+           tree_provides_particle_positions<Tree_type>::value, int
+         >::type = 0>
+const cl::Buffer* get_particle_positions_if_available(const Tree_type& tree)
+{
+  return &tree.get_particle_positions();
+}
+
+template<class Tree_type,
+         typename std::enable_if<
+           !tree_provides_particle_positions<Tree_type>::value, int
+         >::type = 0>
+const cl::Buffer* get_particle_positions_if_available(const Tree_type&)
+{
+  return nullptr;
+}
+
 /// Base class for particle trees. Does not calculate
 /// the content of the tree nodes (this should be done
 /// by derived classes)
@@ -53,21 +125,36 @@ namespace spatialcl {
 /// per node
 /// \tparam Node_data_type1 Data type of the second value of the data
 /// per node
+/// \tparam Leaf_bucket_size The maximum number of particles in the lowest
+/// nodes of the tree (the leaf buckets). Must be a power of two >= 2. Query
+/// engines process the particles of a bucket linearly, so larger buckets
+/// reduce the node memory and the depth of the tree at the expense
+/// of more particles being processed per selected bucket.
 template<class Particle_sorter,
          class Type_descriptor,
          class Node_data_type0,
-         class Node_data_type1>
+         class Node_data_type1,
+         std::size_t Leaf_bucket_size = 2>
 class particle_tree
 {
 public:
+  static constexpr std::size_t leaf_bucket_size = Leaf_bucket_size;
+
+  static_assert(utils::binary::is_small_power2<leaf_bucket_size>::value &&
+                leaf_bucket_size >= 2,
+                "The leaf bucket size must be a power of two >= 2");
 
   using particle_type = typename configuration<Type_descriptor>::particle_type;
   using vector_type   = typename configuration<Type_descriptor>::vector_type;
   using boost_particle = typename qcl::to_boost_vector_type<particle_type>::type;
   using node_type0 = Node_data_type0;
   using node_type1 = Node_data_type1;
+  /// Defines how the query engines read the node values,
+  /// see node_codec.hpp
+  using node_codec = identity_node_codec<Node_data_type0, Node_data_type1>;
 
   using type_system = Type_descriptor;
+  using sorter_type = Particle_sorter;
 
   particle_tree(const qcl::device_context_ptr& ctx,
                 const std::vector<particle_type>& particles,
@@ -81,28 +168,56 @@ public:
     this->init_tree(sorter);
   }
 
+  /// Sorts the particles in the given buffer in place.
+  /// \param evt If not \c nullptr, receives an event that completes once
+  /// the particles have been sorted. Derived trees pass \c nullptr and
+  /// provide an event for their complete construction instead.
+  /// \param wait_events If not \c nullptr, the sort only starts once
+  /// these events have completed (see \c enqueue_wait_for_events())
   particle_tree(const qcl::device_context_ptr& ctx,
                 const cl::Buffer& particles,
                 std::size_t num_particles,
-                const Particle_sorter& sorter = Particle_sorter{})
+                const Particle_sorter& sorter = Particle_sorter{},
+                cl::Event* evt = nullptr,
+                const event_list* wait_events = nullptr)
     : _ctx{ctx},
       _sorted_particles{particles},
       _num_particles{num_particles}
   {
+    enqueue_wait_for_events(_ctx, wait_events);
     this->init_tree(sorter);
+    enqueue_completion_event(_ctx, evt);
   }
 
   particle_tree(const qcl::device_context_ptr& ctx,
                 const qcl::device_array<particle_type>& particles,
-                const Particle_sorter& sorter = Particle_sorter{})
-    : particle_tree{ctx, particles.get_buffer(), particles.size(), sorter}
+                const Particle_sorter& sorter = Particle_sorter{},
+                cl::Event* evt = nullptr,
+                const event_list* wait_events = nullptr)
+    : particle_tree{ctx, particles.get_buffer(), particles.size(),
+                    sorter, evt, wait_events}
   {}
 
+  /// Loads a tree that has been saved with \c save_snapshot(). The particles
+  /// are not sorted again and the node values are uploaded as they are stored,
+  /// so loading is bound by the transfer bandwidth.
+  /// \throws std::runtime_error if the snapshot does not match this tree type
+  particle_tree(const qcl::device_context_ptr& ctx,
+                const tree_snapshot_view& snapshot)
+    : _ctx{ctx},
+      _num_particles{snapshot.get_header().num_particles}
+  {
+    this->load_snapshot(snapshot);
+  }
+
   virtual ~particle_tree(){}
 
+  /// \return The number of stored nodes. Only the used nodes are
+  /// stored, see the description of the compact node storage in
+  /// binary_tree.hpp
   std::size_t get_num_nodes() const
   {
-    return this->_effective_num_particles-1;
+    return binary_tree::get_num_nodes(this->_num_particles, leaf_bucket_size);
   }
 
   std::size_t get_effective_num_levels() const
@@ -110,9 +225,19 @@ public:
     return this->_num_levels;
   }
 
+  /// \return The number of stored node levels, i.e. the number of levels
+  /// from the root to the leaf buckets
   std::size_t get_num_node_levels() const
   {
-    return get_effective_num_levels() - 1;
+    return get_effective_num_levels() -
+           utils::binary::small_binary_logarithm<leaf_bucket_size>::value;
+  }
+
+  /// \return The number of leaf buckets, which equals the number of
+  /// nodes of the lowest node level
+  std::size_t get_num_leaf_buckets() const
+  {
+    return (this->_num_particles + leaf_bucket_size - 1) / leaf_bucket_size;
   }
 
   const cl::Buffer& get_sorted_particles() const
@@ -145,27 +270,199 @@ public:
     return _nodes1.get_buffer();
   }
 
+  /// \return Whether the permutation applied by the sorter is available.
+  /// This is the case if the sorter provides permutations, see
+  /// \c sorter_provides_permutation.
+  bool has_permutation() const
+  {
+    return sorter_provides_permutation<Particle_sorter>::value;
+  }
+
+  /// \return A buffer of \c cl_uint such that the sorted particle i
+  /// was the particle \c permutation[i] in the particle order before
+  /// the most recent sort (i.e., the original order, unless the tree
+  /// has been re-sorted with \c resort()).
+  /// Only valid if \c has_permutation() returns true.
+  const cl::Buffer& get_permutation() const
+  {
+    assert(has_permutation());
+    return _permutation.get_buffer();
+  }
+
+  /// \return The times of the construction stages that have been recorded
+  /// by the build profiler of the device context (see \c get_build_profiler())
+  /// since the last collection. The profiler must have been enabled before
+  /// the tree was constructed or rebuilt, otherwise the report is empty.
+  /// Since the profiler is shared by all trees of the context, the report
+  /// contains the stages of all trees built in the meantime.
+  /// Note: This function blocks until the recorded stages have completed.
+  build_profile_report get_build_profile() const
+  {
+    return get_build_profiler(_ctx)->collect();
+  }
+
+  /// Saves the sorted particles, the nodes and (if available) the permutation
+  /// of the tree, such that the tree can be reconstructed with the snapshot
+  /// constructor of the same tree type. Blocks until the data has been
+  /// downloaded.
+  /// \throws std::runtime_error if the file cannot be written
+  void save_snapshot(const std::string& filename) const
+  {
+    const std::size_t num_nodes = get_num_nodes();
+
+    std::vector<particle_type> particles(_num_particles);
+    std::vector<Node_data_type0> nodes0(num_nodes);
+    std::vector<Node_data_type1> nodes1(num_nodes);
+    std::vector<cl_uint> permutation;
+
+    this->download(_sorted_particles, particles);
+    this->download(_nodes0.get_buffer(), nodes0);
+    this->download(_nodes1.get_buffer(), nodes1);
+    if(has_permutation())
+    {
+      permutation.resize(_num_particles);
+      this->download(_permutation.get_buffer(), permutation);
+    }
+
+    tree_snapshot_header header;
+    header.dimension = Type_descriptor::dimension;
+    header.scalar_size = sizeof(typename configuration<Type_descriptor>::scalar);
+    header.particle_size = sizeof(particle_type);
+    header.node_value0_size = sizeof(Node_data_type0);
+    header.node_value1_size = sizeof(Node_data_type1);
+    header.leaf_bucket_size = leaf_bucket_size;
+    header.num_particles = _num_particles;
+    header.effective_num_particles = _effective_num_particles;
+    header.num_levels = _num_levels;
+    header.num_nodes = num_nodes;
+
+    write_tree_snapshot(filename,
+                        header,
+                        particles.data(),
+                        nodes0.data(),
+                        nodes1.data(),
+                        has_permutation() ? permutation.data() : nullptr);
+  }
+
+
+protected:
+  /// Sorts the particles again, keeping the node buffers.
+  /// This is useful if the particles have moved and the old
+  /// order does not match the spatial distribution anymore.
+  /// Derived classes must afterwards recalculate the node data.
+  void resort(const Particle_sorter& sorter = Particle_sorter{})
+  {
+    this->sort_particles(sorter,
+                         sorter_provides_permutation<Particle_sorter>{});
+  }
 
 private:
   void init_tree(const Particle_sorter& sorter)
   {
     // First sort the particles spatially
-    sorter(_ctx, _sorted_particles, _num_particles);
+    this->sort_particles(sorter,
+                         sorter_provides_permutation<Particle_sorter>{});
 
-    // Calculate the required number of levels
-    // and the effective number of particles
-    _effective_num_particles = get_next_power_of_two(_num_particles);
-    _num_levels = get_highest_set_bit(_effective_num_particles)+1;
+    this->init_num_levels();
 #ifndef NODEBUG
     std::cout << "Building tree with "
               << _num_levels << " levels over "
               << _effective_num_particles << " effective particles and "
-              << _num_particles << " real particles." << std::endl;
+              << _num_particles << " real particles, storing "
+              << get_num_nodes() << " nodes." << std::endl;
 #endif
 
-    _nodes0 = qcl::device_array<Node_data_type0>{_ctx, _effective_num_particles};
-    _nodes1 = qcl::device_array<Node_data_type1>{_ctx, _effective_num_particles};
+    this->allocate_nodes();
+  }
+
+  /// Takes the node buffers from the memory pool of the device context,
+  /// such that rebuilt trees reuse the node buffers of destroyed trees
+  void allocate_nodes()
+  {
+    // Buffers cannot be empty, so we allocate at least one node
+    const std::size_t num_allocated_nodes = std::max<std::size_t>(get_num_nodes(), 1);
+    _nodes0 = get_memory_pool(_ctx)->allocate<Node_data_type0>(num_allocated_nodes);
+    _nodes1 = get_memory_pool(_ctx)->allocate<Node_data_type1>(num_allocated_nodes);
+  }
 
+  /// Calculates the required number of levels and the effective
+  /// number of particles from the number of particles
+  void init_num_levels()
+  {
+    // The tree contains at least one leaf bucket
+    _effective_num_particles = std::max<std::size_t>(get_next_power_of_two(_num_particles),
+                                                     leaf_bucket_size);
+    _num_levels = get_highest_set_bit(_effective_num_particles)+1;
+  }
+
+  void load_snapshot(const tree_snapshot_view& snapshot)
+  {
+    snapshot.check_compatibility<particle_tree>();
+    const tree_snapshot_header& header = snapshot.get_header();
+
+    // The layout of the tree follows from the number of particles. A
+    // snapshot with a different layout would make the uploads below
+    // and the later traversals access the buffers out of bounds.
+    this->init_num_levels();
+    if(header.effective_num_particles != _effective_num_particles ||
+       header.num_levels != _num_levels ||
+       header.num_nodes != get_num_nodes())
+      throw std::runtime_error{"Tree snapshot header is inconsistent "
+                               "with its number of particles"};
+
+    // Buffers cannot be empty, so we allocate at least one element
+    _ctx->create_buffer<particle_type>(_sorted_particles,
+                                       std::max<std::size_t>(_num_particles, 1));
+    this->allocate_nodes();
+
+    // Each section is uploaded in one bulk transfer
+    if(_num_particles > 0)
+      _ctx->memcpy_h2d(_sorted_particles,
+                       snapshot.get_section<particle_type>(header.particles_offset),
+                       _num_particles);
+    if(get_num_nodes() > 0)
+    {
+      _ctx->memcpy_h2d(_nodes0.get_buffer(),
+                       snapshot.get_section<Node_data_type0>(header.nodes0_offset),
+                       get_num_nodes());
+      _ctx->memcpy_h2d(_nodes1.get_buffer(),
+                       snapshot.get_section<Node_data_type1>(header.nodes1_offset),
+                       get_num_nodes());
+    }
+
+    if(has_permutation())
+    {
+      if(!snapshot.has_permutation())
+        throw std::runtime_error{"Tree snapshot does not contain the permutation"};
+
+      _permutation = qcl::device_array<cl_uint>{_ctx, _num_particles};
+      _ctx->memcpy_h2d(_permutation.get_buffer(),
+                       snapshot.get_section<cl_uint>(header.permutation_offset),
+                       _num_particles);
+    }
+  }
+
+  template<class T>
+  void download(const cl::Buffer& buffer, std::vector<T>& out) const
+  {
+    if(out.empty())
+      return;
+
+    cl_int err = _ctx->get_command_queue().enqueueReadBuffer(
+          buffer, CL_TRUE, 0, out.size() * sizeof(T), out.data());
+    qcl::check_cl_error(err, "Could not download tree data for snapshot");
+  }
+
+  void sort_particles(const Particle_sorter& sorter, std::true_type)
+  {
+    if(_permutation.size() != _num_particles)
+      _permutation = qcl::device_array<cl_uint>{_ctx, _num_particles};
+    sorter(_ctx, _sorted_particles, _num_particles, _permutation.get_buffer());
+  }
+
+  void sort_particles(const Particle_sorter& sorter, std::false_type)
+  {
+    sorter(_ctx, _sorted_particles, _num_particles);
   }
 
   static unsigned get_highest_set_bit(uint64_t x)
@@ -202,8 +499,10 @@ private:
   std::size_t _num_particles;
   std::size_t _effective_num_particles;
 
-  qcl::device_array<Node_data_type0> _nodes0;
-  qcl::device_array<Node_data_type1> _nodes1;
+  device_memory_pool::pooled_array<Node_data_type0> _nodes0;
+  device_memory_pool::pooled_array<Node_data_type1> _nodes1;
+
+  qcl::device_array<cl_uint> _permutation;
 };
 
 
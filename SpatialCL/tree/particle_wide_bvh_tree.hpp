@@ -0,0 +1,395 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTICLE_WIDE_BVH_TREE
+#define PARTICLE_WIDE_BVH_TREE
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_module.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include <algorithm>
+
+#include "particle_bvh_tree.hpp"
+#include "binary_tree.hpp"
+#include "../binary_utils.hpp"
+
+/**
+Wide tree layout
+================
+
+A wide tree with a branching factor of W = 2^s is obtained from the binary tree
+by only keeping every s-th node level, counted upwards from the leaf buckets.
+The children of a wide node are then the (up to) W binary descendants s levels
+below it. Since the nodes of a level are stored contiguously and ordered by
+their local node id, the children of a node always occupy W consecutive entries.
+
+Nodes keep their binary keys (level and local node id), so handlers can treat
+the nodes of wide trees exactly like binary tree nodes. The levels kept are
+  leaf_bucket_level, leaf_bucket_level - s, ..., top_level
+with top_level = leaf_bucket_level % s. If top_level is not 0, the binary root
+is not stored and the (at most W/2) nodes of the top level act as the children
+of a virtual root.
+As in the binary compact node storage, each kept level only stores its
+populated nodes, the lowest level comes first in memory and the top level last.
+A kept level at which each node contains 2^k leaves has ((num_leaves-1) >> k) + 1
+nodes, so the offsets of the levels can be calculated incrementally while
+descending or ascending the tree.
+
+*/
+
+namespace spatialcl {
+
+/// Device and host functions for the wide tree layout described above.
+/// \tparam Branching_factor The maximum number of children per node,
+/// must be 2, 4 or 8.
+template<std::size_t Branching_factor>
+class wide_tree
+{
+public:
+  QCL_MAKE_MODULE(wide_tree)
+
+  static constexpr std::size_t branching_factor = Branching_factor;
+  static constexpr std::size_t branching_depth =
+      utils::binary::small_binary_logarithm<branching_factor>::value;
+
+  static_assert(branching_factor == 2 || branching_factor == 4 || branching_factor == 8,
+                "The branching factor must be 2, 4 or 8");
+
+  /// The maximum number of kept levels for 64 bit indices
+  static constexpr std::size_t max_num_levels = 64 / branching_depth + 1;
+
+  /// \return The number of kept levels of a tree with \c num_leaves leaves
+  static std::size_t get_num_levels(std::size_t num_leaves,
+                                    std::size_t leaf_bucket_size)
+  {
+    return get_leaf_bucket_level(num_leaves, leaf_bucket_size) / branching_depth + 1;
+  }
+
+  /// \return The number of stored nodes of a tree with \c num_leaves leaves
+  static std::size_t get_num_nodes(std::size_t num_leaves,
+                                   std::size_t leaf_bucket_size)
+  {
+    if(num_leaves == 0)
+      return 0;
+
+    const std::size_t num_binary_levels = binary_tree::get_num_levels(num_leaves,
+                                                                      leaf_bucket_size);
+    const std::size_t leaf_bucket_level = get_leaf_bucket_level(num_leaves,
+                                                                leaf_bucket_size);
+    std::size_t result = 0;
+    for(std::size_t level = leaf_bucket_level % branching_depth;
+        level <= leaf_bucket_level;
+        level += branching_depth)
+      result += ((num_leaves - 1) >> (num_binary_levels - 1 - level)) + 1;
+
+    return result;
+  }
+
+private:
+  static std::size_t get_leaf_bucket_level(std::size_t num_leaves,
+                                           std::size_t leaf_bucket_size)
+  {
+    const std::size_t num_binary_levels = binary_tree::get_num_levels(num_leaves,
+                                                                      leaf_bucket_size);
+    // The number of binary levels between the leaf buckets and the leaves
+    std::size_t leaf_bucket_depth = 0;
+    while((std::size_t{1} << leaf_bucket_depth) < leaf_bucket_size)
+      ++leaf_bucket_depth;
+
+    return num_binary_levels - 1 - leaf_bucket_depth;
+  }
+
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(binary_tree)
+    QCL_IMPORT_CONSTANT(branching_factor)
+    QCL_IMPORT_CONSTANT(branching_depth)
+    QCL_RAW
+    (
+      /// \return The number of populated nodes of a binary level
+      index_type wide_tree_get_num_nodes(uint level,
+                                         index_type num_levels,
+                                         index_type num_leaves)
+      {
+        return ((num_leaves - 1) >> (num_levels - 1 - level)) + 1;
+      }
+
+      /// \return The top level of the wide tree, i.e. the highest kept
+      /// binary level
+      uint wide_tree_get_top_level(uint leaf_bucket_level)
+      {
+        return leaf_bucket_level % branching_depth;
+      }
+
+      /// \return The key of the first child of a node
+      binary_tree_key_t wide_tree_get_children_begin(binary_tree_key_t* node)
+      {
+        binary_tree_key_t child = *node;
+        child.level += branching_depth;
+        child.local_node_id <<= branching_depth;
+        return child;
+      }
+
+      /// \return The key of the first node of the group of siblings
+      /// that a node belongs to
+      binary_tree_key_t wide_tree_get_siblings_begin(binary_tree_key_t* node)
+      {
+        binary_tree_key_t result = *node;
+        result.local_node_id &= ~(index_type)(branching_factor - 1);
+        return result;
+      }
+
+      /// \return The key of the parent of a node
+      binary_tree_key_t wide_tree_get_parent(binary_tree_key_t* node)
+      {
+        binary_tree_key_t result = *node;
+        result.level -= branching_depth;
+        result.local_node_id >>= branching_depth;
+        return result;
+      }
+    )
+  )
+};
+
+/// Bounding volume hierarchy with up to \c Branching_factor children per
+/// node, obtained by collapsing the levels of a \c particle_bvh_tree as
+/// described in the wide tree layout above. This reduces the traversal depth
+/// by the binary logarithm of the branching factor, and since the bounding
+/// boxes of all children of a node are stored contiguously, they can be
+/// tested together. The wide nodes can be queried with the
+/// \c wide_depth_first query engine.
+///
+/// The binary nodes are kept (they are required to refit the tree), so the
+/// tree can also be used with the binary query engines.
+/// \tparam Branching_factor The maximum number of children per
+/// node, must be 2, 4 or 8.
+/// \tparam Leaf_bucket_size The maximum number of particles per leaf node,
+/// see \c particle_tree
+template<class Particle_sorter,
+         class Type_descriptor,
+         std::size_t Branching_factor = 4,
+         std::size_t Leaf_bucket_size = 2>
+class particle_wide_bvh_tree : public particle_bvh_tree<Particle_sorter,
+                                                        Type_descriptor,
+                                                        Leaf_bucket_size>
+{
+public:
+  QCL_MAKE_MODULE(particle_wide_bvh_tree)
+
+  using particle_type = typename configuration<Type_descriptor>::particle_type;
+  using vector_type = typename configuration<Type_descriptor>::vector_type;
+
+  using base_type = particle_bvh_tree<
+    Particle_sorter,
+    Type_descriptor,
+    Leaf_bucket_size
+  >;
+
+  using layout = wide_tree<Branching_factor>;
+
+  static constexpr std::size_t branching_factor = Branching_factor;
+
+  particle_wide_bvh_tree(const qcl::device_context_ptr& ctx,
+                         const std::vector<particle_type>& particles,
+                         const Particle_sorter& sorter = Particle_sorter{})
+    : base_type{ctx, particles, sorter}
+  {
+    this->init_wide_nodes();
+  }
+
+  particle_wide_bvh_tree(const qcl::device_context_ptr& ctx,
+                         const cl::Buffer& particles,
+                         std::size_t num_particles,
+                         const Particle_sorter& sorter = Particle_sorter{},
+                         cl::Event* evt = nullptr,
+                         const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, num_particles, sorter, nullptr, wait_events}
+  {
+    this->init_wide_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  particle_wide_bvh_tree(const qcl::device_context_ptr& ctx,
+                         const qcl::device_array<particle_type>& particles,
+                         const Particle_sorter& sorter = Particle_sorter{},
+                         cl::Event* evt = nullptr,
+                         const event_list* wait_events = nullptr)
+    : base_type{ctx, particles, sorter, nullptr, wait_events}
+  {
+    this->init_wide_nodes();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Loads a tree saved with \c save_snapshot(). The derived node
+  /// data is recalculated from the loaded nodes.
+  particle_wide_bvh_tree(const qcl::device_context_ptr& ctx,
+                         const tree_snapshot_view& snapshot)
+    : base_type{ctx, snapshot}
+  {
+    this->init_wide_nodes();
+  }
+
+  virtual ~particle_wide_bvh_tree(){}
+
+  /// Recalculates the bounding boxes of the binary and wide nodes,
+  /// see \c particle_bvh_tree::refit()
+  void refit(cl::Event* evt = nullptr,
+             const event_list* wait_events = nullptr)
+  {
+    base_type::refit(nullptr, wait_events);
+    this->collapse_levels();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// Sorts the particles again and rebuilds all nodes
+  void rebuild(const Particle_sorter& sorter = Particle_sorter{},
+               cl::Event* evt = nullptr,
+               const event_list* wait_events = nullptr)
+  {
+    base_type::rebuild(sorter, nullptr, wait_events);
+    this->collapse_levels();
+    enqueue_completion_event(this->get_device_context(), evt);
+  }
+
+  /// \return The number of stored wide nodes
+  std::size_t get_num_wide_nodes() const
+  {
+    return layout::get_num_nodes(this->get_num_particles(),
+                                 this->leaf_bucket_size);
+  }
+
+  const cl::Buffer& get_wide_node_values0() const
+  {
+    return _wide_nodes0.get_buffer();
+  }
+
+  const cl::Buffer& get_wide_node_values1() const
+  {
+    return _wide_nodes1.get_buffer();
+  }
+
+private:
+  static constexpr std::size_t local_size = 256;
+
+  void init_wide_nodes()
+  {
+    // Buffers cannot be empty, so we allocate at least one node
+    const std::size_t num_allocated_nodes =
+        std::max<std::size_t>(get_num_wide_nodes(), 1);
+
+    _wide_nodes0 = qcl::device_array<vector_type>{this->get_device_context(),
+                                                  num_allocated_nodes};
+    _wide_nodes1 = qcl::device_array<vector_type>{this->get_device_context(),
+                                                  num_allocated_nodes};
+    this->collapse_levels();
+  }
+
+  /// Copies the kept levels of the binary nodes into the wide node storage
+  void collapse_levels()
+  {
+    const std::size_t num_wide_nodes = get_num_wide_nodes();
+    if(num_wide_nodes == 0)
+      return;
+
+    cl_int err = wide_bvh_collapse_levels(this->get_device_context(),
+                                          cl::NDRange{num_wide_nodes},
+                                          cl::NDRange{this->local_size})(
+          this->get_node_values0(),
+          this->get_node_values1(),
+          static_cast<cl_ulong>(this->get_num_particles()),
+          static_cast<cl_ulong>(this->get_effective_num_levels()),
+          static_cast<cl_ulong>(num_wide_nodes),
+          _wide_nodes0,
+          _wide_nodes1);
+    qcl::check_cl_error(err, "Could not enqueue wide_bvh_collapse_levels kernel");
+  }
+
+  qcl::device_array<vector_type> _wide_nodes0;
+  qcl::device_array<vector_type> _wide_nodes1;
+
+  static constexpr std::size_t leaf_bucket_depth =
+      utils::binary::small_binary_logarithm<Leaf_bucket_size>::value;
+
+  QCL_ENTRYPOINT(wide_bvh_collapse_levels)
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(configuration<Type_descriptor>)
+    QCL_INCLUDE_MODULE(layout)
+    QCL_IMPORT_CONSTANT(leaf_bucket_depth)
+    QCL_RAW
+    (
+      __kernel void wide_bvh_collapse_levels(__global vector_type* binary_nodes_min_corner,
+                                             __global vector_type* binary_nodes_max_corner,
+                                             index_type num_particles,
+                                             index_type num_levels,
+                                             index_type num_wide_nodes,
+                                             __global vector_type* wide_nodes_min_corner,
+                                             __global vector_type* wide_nodes_max_corner)
+      {
+        const uint leaf_bucket_level = num_levels - 1 - leaf_bucket_depth;
+
+        for(index_type tid = get_global_id(0);
+            tid < num_wide_nodes;
+            tid += get_global_size(0))
+        {
+          // Find the kept level of this node, starting from the
+          // lowest level which comes first in memory
+          uint level = leaf_bucket_level;
+          index_type level_offset = 0;
+          index_type num_level_nodes = wide_tree_get_num_nodes(level,
+                                                               num_levels,
+                                                               num_particles);
+          while(tid >= level_offset + num_level_nodes)
+          {
+            level_offset += num_level_nodes;
+            level -= branching_depth;
+            num_level_nodes = wide_tree_get_num_nodes(level,
+                                                      num_levels,
+                                                      num_particles);
+          }
+
+          binary_tree_key_t node_key;
+          binary_tree_key_init(&node_key, level, tid - level_offset);
+
+          index_type binary_idx = binary_tree_key_encode_node_index(&node_key,
+                                                                    num_levels,
+                                                                    num_particles,
+                                                                    leaf_bucket_depth);
+
+          wide_nodes_min_corner[tid] = binary_nodes_min_corner[binary_idx];
+          wide_nodes_max_corner[tid] = binary_nodes_max_corner[binary_idx];
+        }
+      }
+    )
+  )
+};
+
+}
+
+#endif
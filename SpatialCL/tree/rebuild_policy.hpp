@@ -0,0 +1,133 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef REBUILD_POLICY_HPP
+#define REBUILD_POLICY_HPP
+
+#include <cstddef>
+
+namespace spatialcl {
+
+/// Decides whether a tree over moving particles can be updated with
+/// a cheap \c refit() (which keeps the particle order and only
+/// recalculates the node data), or whether it must be rebuilt with
+/// a full re-sort. A rebuild is requested after a fixed number of
+/// refits, or once the tree quality metric (see
+/// \c particle_bvh_tree::get_quality_metric()) has degraded by more
+/// than a given fraction compared to the last rebuild.
+class tree_rebuild_policy
+{
+public:
+  /// \param max_refits_between_rebuilds The maximum number of consecutive
+  /// refits until a rebuild is requested. If 0, a rebuild is requested
+  /// every time.
+  /// \param max_quality_degradation The maximum allowed relative increase
+  /// of the quality metric since the last rebuild. If 0, the
+  /// quality metric is not taken into account.
+  /// \param quality_check_interval Since evaluating the quality metric
+  /// requires a reduction and a readback, it is only evaluated every
+  /// \c quality_check_interval refits, see \c requires_quality_check().
+  explicit tree_rebuild_policy(std::size_t max_refits_between_rebuilds = 10,
+                               double max_quality_degradation = 0.0,
+                               std::size_t quality_check_interval = 1)
+    : _max_refits{max_refits_between_rebuilds},
+      _max_quality_degradation{max_quality_degradation},
+      _quality_check_interval{quality_check_interval > 0 ? quality_check_interval : 1},
+      _num_refits{0},
+      _reference_quality{0.0}
+  {}
+
+  /// \return Whether a rebuild is required based on the number of refits
+  /// since the last rebuild alone.
+  bool requires_rebuild() const
+  {
+    return _num_refits >= _max_refits;
+  }
+
+  /// \return Whether a rebuild is required, taking into account the
+  /// current value of the tree quality metric.
+  bool requires_rebuild(double current_quality) const
+  {
+    if(requires_rebuild())
+      return true;
+
+    if(_max_quality_degradation > 0.0 && _reference_quality > 0.0)
+      return current_quality > (1.0 + _max_quality_degradation) * _reference_quality;
+
+    return false;
+  }
+
+  /// Should be called after the tree has been rebuilt.
+  /// \param quality The quality metric of the rebuilt tree
+  void notify_rebuild(double quality = 0.0)
+  {
+    _num_refits = 0;
+    _reference_quality = quality;
+  }
+
+  /// Should be called after the tree has been refitted.
+  void notify_refit()
+  {
+    ++_num_refits;
+  }
+
+  std::size_t get_num_refits_since_rebuild() const
+  {
+    return _num_refits;
+  }
+
+  /// \return Whether the quality metric is used to decide when
+  /// to rebuild the tree.
+  bool uses_quality_metric() const
+  {
+    return _max_quality_degradation > 0.0;
+  }
+
+  /// \return Whether the quality metric should be evaluated and passed
+  /// to \c requires_rebuild(double) at this point. This is the case
+  /// every \c quality_check_interval refits, if the quality metric
+  /// is used at all.
+  bool requires_quality_check() const
+  {
+    return uses_quality_metric() &&
+           _num_refits > 0 &&
+           _num_refits % _quality_check_interval == 0;
+  }
+
+private:
+  std::size_t _max_refits;
+  double _max_quality_degradation;
+  std::size_t _quality_check_interval;
+
+  std::size_t _num_refits;
+  double _reference_quality;
+};
+
+}
+
+#endif
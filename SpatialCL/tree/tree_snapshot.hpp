@@ -0,0 +1,301 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TREE_SNAPSHOT_HPP
+#define TREE_SNAPSHOT_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../configuration.hpp"
+#include "../file_utils.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SPATIALCL_SNAPSHOT_MMAP
+#endif
+
+namespace spatialcl {
+
+/// Header of a tree snapshot. A snapshot is a single binary blob
+/// consisting of this header, followed by the sorted particles, the
+/// two node value arrays and optionally the permutation of the sorter.
+/// All offsets are in bytes from the beginning of the snapshot and
+/// aligned to \c tree_snapshot_alignment bytes, so that a memory-mapped
+/// snapshot can be uploaded directly. Snapshots are only valid for the
+/// same tree type and the same host byte order.
+struct tree_snapshot_header
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t dimension;
+  std::uint32_t scalar_size;
+  std::uint32_t particle_size;
+  std::uint32_t node_value0_size;
+  std::uint32_t node_value1_size;
+  std::uint64_t leaf_bucket_size;
+  std::uint64_t num_particles;
+  std::uint64_t effective_num_particles;
+  std::uint64_t num_levels;
+  std::uint64_t num_nodes;
+  std::uint64_t particles_offset;
+  std::uint64_t nodes0_offset;
+  std::uint64_t nodes1_offset;
+  /// 0, if the snapshot does not contain a permutation
+  std::uint64_t permutation_offset;
+  std::uint64_t total_size;
+};
+
+static constexpr std::uint32_t tree_snapshot_version = 1;
+static constexpr std::uint64_t tree_snapshot_alignment = 64;
+static constexpr char tree_snapshot_magic[8] = {'S','P','C','L','T','R','E','E'};
+
+/// A read-only view of a snapshot in host memory, e.g. a memory-mapped
+/// snapshot file. The memory must remain valid while the view is in use.
+class tree_snapshot_view
+{
+public:
+  /// \throws std::runtime_error if the data is not a valid snapshot
+  tree_snapshot_view(const void* data, std::size_t size)
+    : _data{static_cast<const char*>(data)}
+  {
+    if(size < sizeof(tree_snapshot_header))
+      throw std::runtime_error{"Tree snapshot is too small"};
+
+    std::memcpy(&_header, _data, sizeof(tree_snapshot_header));
+
+    if(std::memcmp(_header.magic, tree_snapshot_magic, sizeof(_header.magic)) != 0)
+      throw std::runtime_error{"Data is not a tree snapshot"};
+    if(_header.version != tree_snapshot_version)
+      throw std::runtime_error{"Unsupported tree snapshot version"};
+    if(_header.total_size > size)
+      throw std::runtime_error{"Tree snapshot is truncated"};
+
+    check_section(_header.particles_offset,
+                  _header.num_particles * _header.particle_size);
+    check_section(_header.nodes0_offset,
+                  _header.num_nodes * _header.node_value0_size);
+    check_section(_header.nodes1_offset,
+                  _header.num_nodes * _header.node_value1_size);
+    if(has_permutation())
+      check_section(_header.permutation_offset,
+                    _header.num_particles * sizeof(std::uint32_t));
+  }
+
+  const tree_snapshot_header& get_header() const
+  {
+    return _header;
+  }
+
+  bool has_permutation() const
+  {
+    return _header.permutation_offset != 0;
+  }
+
+  /// \throws std::runtime_error if the snapshot has been saved by a tree
+  /// with a different type system, node type or leaf bucket size than \c Tree_type
+  template<class Tree_type>
+  void check_compatibility() const
+  {
+    using config = configuration<typename Tree_type::type_system>;
+
+    if(_header.dimension != Tree_type::type_system::dimension ||
+       _header.scalar_size != sizeof(typename config::scalar) ||
+       _header.particle_size != sizeof(typename config::particle_type) ||
+       _header.node_value0_size != sizeof(typename Tree_type::node_type0) ||
+       _header.node_value1_size != sizeof(typename Tree_type::node_type1) ||
+       _header.leaf_bucket_size != Tree_type::leaf_bucket_size)
+      throw std::runtime_error{"Tree snapshot does not match the tree type"};
+  }
+
+  template<class T>
+  const T* get_section(std::uint64_t offset) const
+  {
+    return reinterpret_cast<const T*>(_data + offset);
+  }
+
+private:
+  void check_section(std::uint64_t offset, std::uint64_t size) const
+  {
+    if(offset % tree_snapshot_alignment != 0 ||
+       offset > _header.total_size ||
+       size > _header.total_size - offset)
+      throw std::runtime_error{"Tree snapshot contains an invalid section"};
+  }
+
+  const char* _data;
+  tree_snapshot_header _header;
+};
+
+/// A snapshot file in host memory. Where available, the file is
+/// memory-mapped, otherwise it is read completely.
+class tree_snapshot_file
+{
+public:
+  /// \throws std::runtime_error if the file cannot be opened
+  explicit tree_snapshot_file(const std::string& filename)
+  {
+#ifdef SPATIALCL_SNAPSHOT_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+      throw std::runtime_error{"Could not open tree snapshot " + filename};
+
+    struct stat file_status;
+    if(fstat(fd, &file_status) == 0 && file_status.st_size > 0)
+    {
+      _mapped_size = static_cast<std::size_t>(file_status.st_size);
+      void* mapping = mmap(nullptr, _mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(mapping != MAP_FAILED)
+        _mapped_data = mapping;
+    }
+    close(fd);
+
+    if(_mapped_data != nullptr)
+      return;
+    _mapped_size = 0;
+#endif
+    std::ifstream file{filename.c_str(), std::ios::binary | std::ios::ate};
+    if(!file.is_open())
+      throw std::runtime_error{"Could not open tree snapshot " + filename};
+
+    _data.resize(static_cast<std::size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(_data.data(), _data.size());
+  }
+
+  tree_snapshot_file(const tree_snapshot_file&) = delete;
+  tree_snapshot_file& operator=(const tree_snapshot_file&) = delete;
+
+  ~tree_snapshot_file()
+  {
+#ifdef SPATIALCL_SNAPSHOT_MMAP
+    if(_mapped_data != nullptr)
+      munmap(_mapped_data, _mapped_size);
+#endif
+  }
+
+  /// \throws std::runtime_error if the file is not a valid snapshot
+  tree_snapshot_view get_view() const
+  {
+    if(_mapped_data != nullptr)
+      return tree_snapshot_view{_mapped_data, _mapped_size};
+    return tree_snapshot_view{_data.data(), _data.size()};
+  }
+
+private:
+  void* _mapped_data = nullptr;
+  std::size_t _mapped_size = 0;
+  std::vector<char> _data;
+};
+
+/// Writes a snapshot with the given header to \c filename, filling in
+/// the magic number, version, offsets and total size of the header.
+/// \c permutation may be \c nullptr. An existing snapshot is only
+/// replaced once the new one has been written completely.
+/// \throws std::runtime_error if the snapshot cannot be written
+inline void write_tree_snapshot(const std::string& filename,
+                                tree_snapshot_header header,
+                                const void* particles,
+                                const void* nodes0,
+                                const void* nodes1,
+                                const void* permutation)
+{
+  auto aligned = [](std::uint64_t offset)
+  {
+    return (offset + tree_snapshot_alignment - 1) /
+            tree_snapshot_alignment * tree_snapshot_alignment;
+  };
+
+  const std::uint64_t particles_size = header.num_particles * header.particle_size;
+  const std::uint64_t nodes0_size = header.num_nodes * header.node_value0_size;
+  const std::uint64_t nodes1_size = header.num_nodes * header.node_value1_size;
+  const std::uint64_t permutation_size = header.num_particles * sizeof(std::uint32_t);
+
+  std::memcpy(header.magic, tree_snapshot_magic, sizeof(header.magic));
+  header.version = tree_snapshot_version;
+  header.particles_offset = aligned(sizeof(tree_snapshot_header));
+  header.nodes0_offset = aligned(header.particles_offset + particles_size);
+  header.nodes1_offset = aligned(header.nodes0_offset + nodes0_size);
+  header.total_size = header.nodes1_offset + nodes1_size;
+  header.permutation_offset = 0;
+  if(permutation != nullptr)
+  {
+    header.permutation_offset = aligned(header.total_size);
+    header.total_size = header.permutation_offset + permutation_size;
+  }
+
+  // The snapshot is written to a temporary file in the same directory
+  // that is then renamed to filename, so that a program loading the
+  // snapshot at the same time either sees the old or the new snapshot,
+  // never an incomplete one.
+  const std::string temporary_filename =
+      utils::file::get_unique_temporary_filename(filename);
+  bool success = false;
+  {
+    std::ofstream file{temporary_filename.c_str(),
+                       std::ios::binary | std::ios::trunc};
+    if(!file.is_open())
+      throw std::runtime_error{"Could not create tree snapshot " + filename};
+
+    auto write_section = [&](std::uint64_t offset, const void* data, std::uint64_t size)
+    {
+      // Zero padding up to the aligned offset
+      std::vector<char> padding(static_cast<std::size_t>(offset - static_cast<std::uint64_t>(file.tellp())), 0);
+      file.write(padding.data(), padding.size());
+      file.write(static_cast<const char*>(data), size);
+    };
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(tree_snapshot_header));
+    write_section(header.particles_offset, particles, particles_size);
+    write_section(header.nodes0_offset, nodes0, nodes0_size);
+    write_section(header.nodes1_offset, nodes1, nodes1_size);
+    if(permutation != nullptr)
+      write_section(header.permutation_offset, permutation, permutation_size);
+
+    file.flush();
+    file.close();
+    success = !file.fail();
+  }
+  if(!success || std::rename(temporary_filename.c_str(), filename.c_str()) != 0)
+  {
+    std::remove(temporary_filename.c_str());
+    throw std::runtime_error{"Could not write tree snapshot " + filename};
+  }
+}
+
+}
+
+#endif
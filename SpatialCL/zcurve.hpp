@@ -48,8 +48,7 @@ public:
   using vector_type = typename configuration<Type_descriptor>::vector_type;
 
   virtual void operator()(const qcl::device_context_ptr& ctx,
-                          const vector_type& particles_min,
-                          const vector_type& particles_max,
+                          const cl::Buffer& particles_extent,
                           const cl::Buffer& particles,
                           cl_ulong num_particles,
                           const cl::Buffer& out) const override
@@ -58,7 +57,7 @@ public:
     cl::NDRange local_size{128};
 
     qcl::kernel_call gen_position = this->generate_zcurve_position(ctx,global_size,local_size);
-    cl_int err = gen_position(particles_min, particles_max, particles, num_particles, out);
+    cl_int err = gen_position(particles_extent, particles, num_particles, out);
 
     qcl::check_cl_error(err, "Could not enqueue generate_zcurve_position kernel");
   }
@@ -70,6 +69,11 @@ public:
   static constexpr unsigned zcurve_num_cells3d = 0x1fffff; //21 bits set
   static constexpr unsigned zcurve_num_resolved_levels3d = 21;
 
+  // Number of bits of the generated keys that can be set
+  static constexpr unsigned num_key_bits =
+      (Type_descriptor::dimension == 2) ? 2 * zcurve_num_resolved_levels2d
+                                        : 3 * zcurve_num_resolved_levels3d;
+
 private:
   QCL_ENTRYPOINT(generate_zcurve_position)
   QCL_MAKE_SOURCE
@@ -109,8 +113,7 @@ private:
         return interleave_bits3(pos.x, pos.y, pos.z);
       }
 
-      __kernel void generate_zcurve_position(vector_type particles_min,
-                                             vector_type particles_max,
+      __kernel void generate_zcurve_position(__global vector_type* particles_extent,
                                              __global particle_type* particles,
                                              ulong num_particles,
                                              __global zcurve_key* out)
@@ -123,7 +126,7 @@ private:
           num_cells = zcurve_num_cells3d;
 
         grid_t grid;
-        grid_init(&grid, particles_min, particles_max, num_cells);
+        grid_init(&grid, particles_extent[0], particles_extent[1], num_cells);
 
         size_t num_threads = get_global_size(0);
 
@@ -0,0 +1,330 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <vector>
+#include <iostream>
+#include <string>
+#include <cmath>
+#include <random>
+
+#include <boost/preprocessor/stringize.hpp>
+
+#include <SpatialCL/tree.hpp>
+#include <SpatialCL/query.hpp>
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include "../../common/environment.hpp"
+#include "../../common/particle_distributions.hpp"
+#include "../../common/benchmark_results.hpp"
+#include "../../common/timer.hpp"
+
+// Usage: query_engines [--output results.json|results.csv]
+//                      [--particles N] [--queries N] [--runs N]
+
+constexpr std::size_t particle_dimension = 3;
+
+constexpr std::size_t max_retrieved_particles = 16;
+constexpr std::size_t K = 8;
+
+using tree_type = spatialcl::hilbert_bvh_sp3d_tree<particle_dimension>;
+using zcurve_tree_type = spatialcl::zcurve_bvh_sp3d_tree<particle_dimension>;
+using type_system = tree_type::type_system;
+using wide_tree_type = spatialcl::hilbert_wide_bvh_tree<type_system, 4>;
+using scalar = type_system::scalar;
+
+using particle_type = spatialcl::configuration<type_system>::particle_type;
+using vector_type = spatialcl::configuration<type_system>::vector_type;
+
+// Range queries
+using strict_dfs_range_engine =
+  spatialcl::query::strict_dfs_range_query_engine<tree_type, max_retrieved_particles>;
+
+using relaxed_dfs_range_engine =
+  spatialcl::query::relaxed_dfs_range_query_engine<tree_type, max_retrieved_particles>;
+
+template<std::size_t Group_size>
+using grouped_dfs_range_engine =
+  spatialcl::query::grouped_dfs_range_query_engine<tree_type,
+                                                   max_retrieved_particles,
+                                                   Group_size>;
+
+using wide_dfs_range_engine =
+  spatialcl::query::wide_dfs_range_query_engine<wide_tree_type, max_retrieved_particles>;
+
+// Range queries on z-curve sorted trees, to compare the tree qualities
+using zcurve_relaxed_dfs_range_engine =
+  spatialcl::query::relaxed_dfs_range_query_engine<zcurve_tree_type, max_retrieved_particles>;
+
+template<std::size_t Group_size>
+using zcurve_grouped_dfs_range_engine =
+  spatialcl::query::grouped_dfs_range_query_engine<zcurve_tree_type,
+                                                   max_retrieved_particles,
+                                                   Group_size>;
+
+// KNN queries
+using strict_dfs_knn_engine =
+  spatialcl::query::strict_dfs_knn_query_engine<tree_type, K>;
+
+using relaxed_dfs_knn_engine =
+  spatialcl::query::relaxed_dfs_knn_query_engine<tree_type, K>;
+
+template<std::size_t Group_size>
+using grouped_dfs_knn_engine =
+  spatialcl::query::grouped_dfs_knn_query_engine<tree_type, K, Group_size>;
+
+using wide_dfs_knn_engine =
+  spatialcl::query::wide_dfs_knn_query_engine<wide_tree_type, K>;
+
+using zcurve_relaxed_dfs_knn_engine =
+  spatialcl::query::relaxed_dfs_knn_query_engine<zcurve_tree_type, K>;
+
+template<std::size_t Group_size>
+using zcurve_grouped_dfs_knn_engine =
+  spatialcl::query::grouped_dfs_knn_query_engine<zcurve_tree_type, K, Group_size>;
+
+/// The queries of one particle distribution
+struct query_workload
+{
+  std::string distribution;
+  qcl::device_array<vector_type> query_points;
+  qcl::device_array<vector_type> query_ranges_min;
+  qcl::device_array<vector_type> query_ranges_max;
+};
+
+template<class Query_engine, class Tree_type>
+double time_query(const qcl::device_context_ptr& ctx,
+                  const Tree_type& tree,
+                  typename Query_engine::handler_type& query_handler,
+                  std::size_t num_runs)
+{
+  Query_engine query_engine;
+  // Compile the query kernel before measuring to make sure
+  // we do not take into account kernel compilation times.
+  query_engine.precompile(ctx);
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing query");
+
+  common::cumulative_timer timer;
+  for(std::size_t run = 0; run < num_runs; ++run)
+  {
+    timer.start();
+    query_engine(tree, query_handler);
+
+    err = ctx->get_command_queue().finish();
+    qcl::check_cl_error(err, "Error while executing query");
+    timer.stop();
+  }
+  return timer.get_average_runtime();
+}
+
+common::benchmark_record create_record(const std::string& query,
+                                       const std::string& engine,
+                                       const query_workload& workload,
+                                       std::size_t num_particles,
+                                       std::size_t num_queries,
+                                       double time)
+{
+  common::benchmark_record record;
+  record.set_parameter("query", query);
+  record.set_parameter("engine", engine);
+  record.set_parameter("distribution", workload.distribution);
+  record.set_parameter("num_particles", num_particles);
+  record.set_parameter("num_queries", num_queries);
+  record.set_metric("time", time);
+  record.set_metric("queries_per_second", static_cast<double>(num_queries) / time);
+  return record;
+}
+
+template<class Query_engine, class Tree_type>
+void run_range_benchmark(const std::string& name,
+                         const qcl::device_context_ptr& ctx,
+                         const Tree_type& tree,
+                         const query_workload& workload,
+                         std::size_t num_runs,
+                         common::benchmark_results& results)
+{
+  const std::size_t num_queries = workload.query_ranges_min.size();
+
+  qcl::device_array<particle_type> result{ctx, num_queries * max_retrieved_particles};
+  qcl::device_array<cl_uint> num_results{ctx, num_queries};
+
+  typename Query_engine::handler_type query_handler {
+    workload.query_ranges_min.get_buffer(),
+    workload.query_ranges_max.get_buffer(),
+    result.get_buffer(),
+    num_results.get_buffer(),
+    num_queries
+  };
+
+  const double time = time_query<Query_engine>(ctx, tree, query_handler, num_runs);
+
+  std::size_t total_num_retrieved_particles = 0;
+  std::vector<cl_uint> host_num_results;
+  num_results.read(host_num_results);
+  for(const cl_uint n : host_num_results)
+    total_num_retrieved_particles += n;
+
+  common::benchmark_record record = create_record("range", name, workload,
+                                                  tree.get_num_particles(),
+                                                  num_queries, time);
+  record.set_metric("retrieved_particles",
+                    static_cast<double>(total_num_retrieved_particles));
+  results.add(record);
+}
+
+template<class Query_engine, class Tree_type>
+void run_knn_benchmark(const std::string& name,
+                       const qcl::device_context_ptr& ctx,
+                       const Tree_type& tree,
+                       const query_workload& workload,
+                       std::size_t num_runs,
+                       common::benchmark_results& results)
+{
+  const std::size_t num_queries = workload.query_points.size();
+
+  qcl::device_array<particle_type> result{ctx, num_queries * K};
+
+  typename Query_engine::handler_type query_handler {
+    workload.query_points.get_buffer(),
+    result.get_buffer(),
+    num_queries
+  };
+
+  const double time = time_query<Query_engine>(ctx, tree, query_handler, num_runs);
+  results.add(create_record("knn", name, workload,
+                            tree.get_num_particles(), num_queries, time));
+}
+
+/// Creates queries at the positions of randomly selected particles, such
+/// that the queries follow the particle distribution. The range queries
+/// are cubes that would contain about 8 particles in a uniform distribution.
+query_workload create_workload(const qcl::device_context_ptr& ctx,
+                               const std::string& distribution,
+                               const std::vector<particle_type>& particles,
+                               std::size_t num_queries)
+{
+  std::mt19937 generator{4321};
+  std::uniform_int_distribution<std::size_t> particle_distribution{0, particles.size() - 1};
+
+  const scalar query_width = static_cast<scalar>(
+        std::cbrt(8.0 / static_cast<double>(particles.size())));
+
+  std::vector<vector_type> query_points;
+  std::vector<vector_type> query_ranges_min;
+  std::vector<vector_type> query_ranges_max;
+  for(std::size_t i = 0; i < num_queries; ++i)
+  {
+    const vector_type& p = particles[particle_distribution(generator)];
+    query_points.push_back(p);
+
+    vector_type query_min = {};
+    vector_type query_max = {};
+    for(std::size_t j = 0; j < type_system::dimension; ++j)
+    {
+      query_min.s[j] = p.s[j] - 0.5f * query_width;
+      query_max.s[j] = p.s[j] + 0.5f * query_width;
+    }
+    query_ranges_min.push_back(query_min);
+    query_ranges_max.push_back(query_max);
+  }
+
+  return query_workload{
+    distribution,
+    qcl::device_array<vector_type>{ctx, query_points},
+    qcl::device_array<vector_type>{ctx, query_ranges_min},
+    qcl::device_array<vector_type>{ctx, query_ranges_max}
+  };
+}
+
+int main(int argc, char* argv[])
+{
+  common::benchmark_options options{argc, argv};
+  const std::size_t num_particles = options.get_size("particles", 1000000);
+  const std::size_t num_queries = options.get_size("queries", 100000);
+  const std::size_t num_runs = options.get_size("runs", 10);
+
+  common::environment env;
+  qcl::device_context_ptr ctx = env.get_device_context();
+
+  common::benchmark_results results{"query_engines"};
+  results.set_info("device", ctx->get_device_name());
+
+  for(const std::string& distribution : common::get_particle_distribution_names())
+  {
+    std::vector<particle_type> particles;
+    common::generate_particle_distribution<scalar, particle_dimension>(
+          distribution, num_particles, particles);
+
+    const query_workload workload = create_workload(ctx, distribution,
+                                                    particles, num_queries);
+
+    tree_type gpu_tree{ctx, particles};
+    zcurve_tree_type gpu_zcurve_tree{ctx, particles};
+    wide_tree_type gpu_wide_tree{ctx, particles};
+
+#define RUN_RANGE_BENCHMARK(engine, tree) \
+    run_range_benchmark<engine>(BOOST_PP_STRINGIZE(engine), \
+                                ctx, tree, workload, num_runs, results)
+
+#define RUN_KNN_BENCHMARK(engine, tree) \
+    run_knn_benchmark<engine>(BOOST_PP_STRINGIZE(engine), \
+                              ctx, tree, workload, num_runs, results)
+
+    RUN_RANGE_BENCHMARK(strict_dfs_range_engine, gpu_tree);
+    RUN_RANGE_BENCHMARK(relaxed_dfs_range_engine, gpu_tree);
+    RUN_RANGE_BENCHMARK(grouped_dfs_range_engine<32>, gpu_tree);
+    RUN_RANGE_BENCHMARK(grouped_dfs_range_engine<64>, gpu_tree);
+    RUN_RANGE_BENCHMARK(grouped_dfs_range_engine<128>, gpu_tree);
+    RUN_RANGE_BENCHMARK(grouped_dfs_range_engine<256>, gpu_tree);
+    RUN_RANGE_BENCHMARK(wide_dfs_range_engine, gpu_wide_tree);
+    RUN_RANGE_BENCHMARK(zcurve_relaxed_dfs_range_engine, gpu_zcurve_tree);
+    RUN_RANGE_BENCHMARK(zcurve_grouped_dfs_range_engine<64>, gpu_zcurve_tree);
+
+    RUN_KNN_BENCHMARK(strict_dfs_knn_engine, gpu_tree);
+    RUN_KNN_BENCHMARK(relaxed_dfs_knn_engine, gpu_tree);
+    RUN_KNN_BENCHMARK(grouped_dfs_knn_engine<32>, gpu_tree);
+    RUN_KNN_BENCHMARK(grouped_dfs_knn_engine<64>, gpu_tree);
+    RUN_KNN_BENCHMARK(grouped_dfs_knn_engine<128>, gpu_tree);
+    RUN_KNN_BENCHMARK(grouped_dfs_knn_engine<256>, gpu_tree);
+    RUN_KNN_BENCHMARK(wide_dfs_knn_engine, gpu_wide_tree);
+    RUN_KNN_BENCHMARK(zcurve_relaxed_dfs_knn_engine, gpu_zcurve_tree);
+    RUN_KNN_BENCHMARK(zcurve_grouped_dfs_knn_engine<64>, gpu_zcurve_tree);
+
+#undef RUN_RANGE_BENCHMARK
+#undef RUN_KNN_BENCHMARK
+  }
+
+  if(options.has("output"))
+    results.write(options.get("output", ""));
+
+  return 0;
+}
@@ -41,6 +41,7 @@
 #include "../../common/environment.hpp"
 #include "../../common/random_vectors.hpp"
 #include "../../common/timer.hpp"
+#include "../../common/benchmark_results.hpp"
 
 
 constexpr std::size_t particle_dimension = 3;
@@ -83,7 +84,8 @@ void run_benchmark(const std::string& name,
                    const qcl::device_array<vector_type>& queries_min,
                    const qcl::device_array<vector_type>& queries_max,
                    qcl::device_array<particle_type>& result,
-                   qcl::device_array<cl_uint>& num_results)
+                   qcl::device_array<cl_uint>& num_results,
+                   common::benchmark_results& results)
 {
   Query_engine query_engine;
 
@@ -96,9 +98,9 @@ void run_benchmark(const std::string& name,
   };
 
   common::timer t;
-  // Execute the query once before measuring to make sure
+  // Compile the query kernel before measuring to make sure
   // we do not take into account kernel compilation times.
-  query_engine(tree, query_handler);
+  query_engine.precompile(ctx);
 
   cl_int err = ctx->get_command_queue().finish();
   qcl::check_cl_error(err, "Error while executing range query");
@@ -121,24 +123,41 @@ void run_benchmark(const std::string& name,
     total_num_retrieved_particles += n;
   
 
-  std::cout << "Benchmark " << name << " completed in "
-            << time << "s => " << num_runs * queries_min.size() / time << " Queries/s"
-            << " (retrieved: " << total_num_retrieved_particles << " particles)" << std::endl;
+  common::benchmark_record record;
+  record.set_parameter("engine", name);
+  record.set_parameter("num_particles", tree.get_num_particles());
+  record.set_parameter("num_queries", queries_min.size());
+  record.set_metric("time", time);
+  record.set_metric("queries_per_second", num_runs * queries_min.size() / time);
+  record.set_metric("retrieved_particles",
+                    static_cast<double>(total_num_retrieved_particles));
+  results.add(record);
 }
 
-int main()
+// Usage: range_query_on_grid [--output results.json|results.csv]
+int main(int argc, char* argv[])
 {
+  common::benchmark_options options{argc, argv};
+
   common::environment env;
   qcl::device_context_ptr ctx = env.get_device_context();
 
+  common::benchmark_results results{"range_query_on_grid"};
+  results.set_info("device", ctx->get_device_name());
+
   // Setup tree
 
   std::vector<particle_type> particles;
   common::random_vectors<scalar, particle_dimension> rnd;
   rnd(num_particles, particles);
   
+  spatialcl::get_build_profiler(ctx)->enable();
   tree_type gpu_tree{ctx, particles};
 
+  std::cout << "Tree construction stages:" << std::endl;
+  gpu_tree.get_build_profile().print(std::cout);
+  spatialcl::get_build_profiler(ctx)->disable();
+
   // Create queries
   std::size_t total_num_queries = 
     num_query_groups_xy * num_query_groups_xy * query_group_size_xy * query_group_size_xy;
@@ -195,7 +214,8 @@ int main()
                         device_ranges_min, \
                         device_ranges_max, \
                         result_particles, \
-                        result_num_retrieved_particles)
+                        result_num_retrieved_particles, \
+                        results)
 
   RUN_BENCHMARK(strict_dfs_range_engine);
   RUN_BENCHMARK(relaxed_dfs_range_engine);
@@ -206,5 +226,8 @@ int main()
   RUN_BENCHMARK(grouped_dfs_range_engine<256>);
   RUN_BENCHMARK(grouped_dfs_range_engine<512>);
 
+  if(options.has("output"))
+    results.write(options.get("output", ""));
+
   return 0;
 }
@@ -0,0 +1,184 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <vector>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+
+#include <boost/preprocessor/stringize.hpp>
+
+#include <SpatialCL/tree.hpp>
+
+#include <QCL/qcl.hpp>
+#include <QCL/qcl_array.hpp>
+
+#include "../../common/environment.hpp"
+#include "../../common/particle_distributions.hpp"
+#include "../../common/benchmark_results.hpp"
+#include "../../common/timer.hpp"
+
+// Usage: tree_construction [--output results.json|results.csv]
+//                          [--min-particles N] [--max-particles N] [--runs N]
+
+constexpr std::size_t particle_dimension = 3;
+
+using type_system = spatialcl::type_descriptor::single_precision3d<particle_dimension>;
+using scalar = type_system::scalar;
+using particle_type = spatialcl::configuration<type_system>::particle_type;
+
+using zcurve_tree_type = spatialcl::zcurve_bvh_tree<type_system>;
+using hilbert_tree_type = spatialcl::hilbert_bvh_tree<type_system>;
+using zcurve_radix_tree_type = spatialcl::zcurve_radix_bvh_tree<type_system>;
+using hilbert_radix_tree_type = spatialcl::hilbert_radix_bvh_tree<type_system>;
+
+template<class Tree_type>
+void run_benchmark(const std::string& name,
+                   const std::string& distribution,
+                   const qcl::device_context_ptr& ctx,
+                   const qcl::device_array<particle_type>& particles,
+                   std::size_t num_runs,
+                   common::benchmark_results& results)
+{
+  const std::size_t num_particles = particles.size();
+  // The trees sort the particles in place, so each run
+  // starts from a copy of the unsorted particles.
+  qcl::device_array<particle_type> tree_particles{ctx, num_particles};
+
+  auto reset_particles = [&]()
+  {
+    cl_int err = ctx->get_command_queue().enqueueCopyBuffer(
+          particles.get_buffer(),
+          tree_particles.get_buffer(),
+          0, 0,
+          num_particles * sizeof(particle_type));
+    qcl::check_cl_error(err, "Could not copy particles");
+    err = ctx->get_command_queue().finish();
+    qcl::check_cl_error(err, "Error while copying particles");
+  };
+
+  // Build once before measuring to exclude the kernel compilation times
+  reset_particles();
+  {
+    Tree_type tree{ctx, tree_particles.get_buffer(), num_particles};
+  }
+
+  common::cumulative_timer timer;
+  for(std::size_t run = 0; run < num_runs; ++run)
+  {
+    reset_particles();
+
+    timer.start();
+    Tree_type tree{ctx, tree_particles.get_buffer(), num_particles};
+    cl_int err = ctx->get_command_queue().finish();
+    qcl::check_cl_error(err, "Error while constructing tree");
+    timer.stop();
+  }
+
+  // The stage breakdown is measured in a separate build, since
+  // without queue profiling the profiler synchronizes at each stage.
+  reset_particles();
+  spatialcl::get_build_profiler(ctx)->enable();
+  spatialcl::build_profile_report stages;
+  {
+    Tree_type tree{ctx, tree_particles.get_buffer(), num_particles};
+    stages = tree.get_build_profile();
+  }
+  spatialcl::get_build_profiler(ctx)->disable();
+
+  common::benchmark_record record;
+  record.set_parameter("tree", name);
+  record.set_parameter("distribution", distribution);
+  record.set_parameter("num_particles", num_particles);
+  record.set_metric("time", timer.get_average_runtime());
+  record.set_metric("particles_per_second",
+                    static_cast<double>(num_particles) / timer.get_average_runtime());
+  for(const spatialcl::build_stage_timing& stage : stages.get_stages())
+    record.set_metric("stage " + stage.name, stage.seconds);
+
+  results.add(record);
+}
+
+int main(int argc, char* argv[])
+{
+  common::benchmark_options options{argc, argv};
+  const std::size_t min_num_particles =
+      std::max<std::size_t>(options.get_size("min-particles", 10000), 1);
+  // Trees with 10^8 particles require several GB of device memory,
+  // so they have to be requested explicitly with --max-particles 1e8
+  const std::size_t max_num_particles = options.get_size("max-particles", 10000000);
+  const std::size_t num_runs = options.get_size("runs", 5);
+
+  common::environment env;
+  qcl::device_context_ptr ctx = env.get_device_context();
+
+  common::benchmark_results results{"tree_construction"};
+  results.set_info("device", ctx->get_device_name());
+
+  for(const std::string& distribution : common::get_particle_distribution_names())
+  {
+    for(std::size_t num_particles = min_num_particles;
+        num_particles <= max_num_particles;
+        num_particles *= 10)
+    {
+      try
+      {
+        std::vector<particle_type> host_particles;
+        common::generate_particle_distribution<scalar, particle_dimension>(
+              distribution, num_particles, host_particles);
+
+        qcl::device_array<particle_type> particles{ctx, host_particles};
+
+#define RUN_BENCHMARK(tree_type) \
+        run_benchmark<tree_type>(BOOST_PP_STRINGIZE(tree_type), \
+                                 distribution, \
+                                 ctx, \
+                                 particles, \
+                                 num_runs, \
+                                 results)
+
+        RUN_BENCHMARK(zcurve_tree_type);
+        RUN_BENCHMARK(hilbert_tree_type);
+        RUN_BENCHMARK(zcurve_radix_tree_type);
+        RUN_BENCHMARK(hilbert_radix_tree_type);
+      }
+      catch(std::exception& e)
+      {
+        // Usually, the device has run out of memory
+        std::cout << "Skipping " << num_particles << " particles ("
+                  << distribution << "): " << e.what() << std::endl;
+      }
+    }
+  }
+
+  if(options.has("output"))
+    results.write(options.get("output", ""));
+
+  return 0;
+}
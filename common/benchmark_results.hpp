@@ -0,0 +1,358 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BENCHMARK_RESULTS_HPP
+#define BENCHMARK_RESULTS_HPP
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace common {
+
+/// One measurement of a benchmark, consisting of the parameters
+/// that identify the measured case (e.g. the tree type and the number
+/// of particles) and the measured metrics (e.g. the runtime)
+class benchmark_record
+{
+public:
+  using entry_type = std::pair<std::string, std::string>;
+  using metric_type = std::pair<std::string, double>;
+
+  template<class T>
+  void set_parameter(const std::string& name, const T& value)
+  {
+    std::stringstream sstr;
+    sstr << value;
+    set(_parameters, name, sstr.str());
+  }
+
+  void set_metric(const std::string& name, double value)
+  {
+    set(_metrics, name, value);
+  }
+
+  const std::vector<entry_type>& get_parameters() const
+  {
+    return _parameters;
+  }
+
+  const std::vector<metric_type>& get_metrics() const
+  {
+    return _metrics;
+  }
+
+private:
+  template<class Value_type>
+  static void set(std::vector<std::pair<std::string, Value_type>>& entries,
+                  const std::string& name,
+                  const Value_type& value)
+  {
+    for(auto& entry : entries)
+    {
+      if(entry.first == name)
+      {
+        entry.second = value;
+        return;
+      }
+    }
+    entries.push_back(std::make_pair(name, value));
+  }
+
+  std::vector<entry_type> _parameters;
+  std::vector<metric_type> _metrics;
+};
+
+/// Collects the records of a benchmark and writes them in
+/// machine-readable form, such that results can be compared
+/// across devices and releases.
+class benchmark_results
+{
+public:
+  explicit benchmark_results(const std::string& benchmark_name)
+    : _benchmark_name{benchmark_name}
+  {}
+
+  /// Sets information that applies to all records, e.g. the device name
+  void set_info(const std::string& name, const std::string& value)
+  {
+    for(auto& entry : _info)
+    {
+      if(entry.first == name)
+      {
+        entry.second = value;
+        return;
+      }
+    }
+    _info.push_back(std::make_pair(name, value));
+  }
+
+  /// Adds a record and prints it in human-readable form
+  void add(const benchmark_record& record)
+  {
+    _records.push_back(record);
+
+    std::cout << _benchmark_name << ":";
+    for(const auto& parameter : record.get_parameters())
+      std::cout << " " << parameter.first << "=" << parameter.second;
+    std::cout << " =>";
+    for(const auto& metric : record.get_metrics())
+      std::cout << " " << metric.first << "=" << metric.second;
+    std::cout << std::endl;
+  }
+
+  const std::vector<benchmark_record>& get_records() const
+  {
+    return _records;
+  }
+
+  /// Writes one line per record. The columns are the information set with
+  /// \c set_info(), followed by all parameters and metrics in the order of
+  /// their first occurrence. Entries that a record lacks remain empty.
+  void write_csv(std::ostream& ostr) const
+  {
+    const std::vector<std::string> parameter_names = get_parameter_names();
+    const std::vector<std::string> metric_names = get_metric_names();
+
+    std::vector<std::string> header{"benchmark"};
+    for(const auto& entry : _info)
+      header.push_back(entry.first);
+    header.insert(header.end(), parameter_names.begin(), parameter_names.end());
+    header.insert(header.end(), metric_names.begin(), metric_names.end());
+    write_csv_line(ostr, header);
+
+    for(const benchmark_record& record : _records)
+    {
+      std::vector<std::string> line{_benchmark_name};
+      for(const auto& entry : _info)
+        line.push_back(entry.second);
+      for(const std::string& name : parameter_names)
+        line.push_back(find(record.get_parameters(), name));
+
+      for(const std::string& name : metric_names)
+      {
+        line.push_back("");
+        for(const auto& metric : record.get_metrics())
+          if(metric.first == name)
+            line.back() = format_number(metric.second);
+      }
+      write_csv_line(ostr, line);
+    }
+  }
+
+  void write_json(std::ostream& ostr) const
+  {
+    ostr << "{\n  \"benchmark\": " << quote_json(_benchmark_name) << ",\n";
+    ostr << "  \"info\": {";
+    for(std::size_t i = 0; i < _info.size(); ++i)
+      ostr << (i == 0 ? "" : ", ")
+           << quote_json(_info[i].first) << ": " << quote_json(_info[i].second);
+    ostr << "},\n  \"results\": [";
+
+    for(std::size_t i = 0; i < _records.size(); ++i)
+    {
+      const benchmark_record& record = _records[i];
+      ostr << (i == 0 ? "\n" : ",\n") << "    {\"parameters\": {";
+      for(std::size_t j = 0; j < record.get_parameters().size(); ++j)
+        ostr << (j == 0 ? "" : ", ")
+             << quote_json(record.get_parameters()[j].first) << ": "
+             << quote_json(record.get_parameters()[j].second);
+
+      ostr << "}, \"metrics\": {";
+      for(std::size_t j = 0; j < record.get_metrics().size(); ++j)
+        ostr << (j == 0 ? "" : ", ")
+             << quote_json(record.get_metrics()[j].first) << ": "
+             << format_json_number(record.get_metrics()[j].second);
+      ostr << "}}";
+    }
+    ostr << "\n  ]\n}\n";
+  }
+
+  /// Writes the results to \c filename, as JSON if the file name ends
+  /// with \c .json and as CSV otherwise.
+  /// \throws std::runtime_error if the file cannot be written
+  void write(const std::string& filename) const
+  {
+    std::ofstream file{filename.c_str()};
+    if(!file.is_open())
+      throw std::runtime_error{"Could not open benchmark output file: "+filename};
+
+    const std::string json_extension = ".json";
+    if(filename.size() >= json_extension.size() &&
+       filename.compare(filename.size() - json_extension.size(),
+                        json_extension.size(), json_extension) == 0)
+      write_json(file);
+    else
+      write_csv(file);
+
+    std::cout << "Wrote " << _records.size() << " results to " << filename << std::endl;
+  }
+
+private:
+  std::vector<std::string> get_parameter_names() const
+  {
+    std::vector<std::string> names;
+    for(const benchmark_record& record : _records)
+      for(const auto& parameter : record.get_parameters())
+        add_name(names, parameter.first);
+    return names;
+  }
+
+  std::vector<std::string> get_metric_names() const
+  {
+    std::vector<std::string> names;
+    for(const benchmark_record& record : _records)
+      for(const auto& metric : record.get_metrics())
+        add_name(names, metric.first);
+    return names;
+  }
+
+  static void add_name(std::vector<std::string>& names, const std::string& name)
+  {
+    for(const std::string& existing_name : names)
+      if(existing_name == name)
+        return;
+    names.push_back(name);
+  }
+
+  static std::string find(const std::vector<benchmark_record::entry_type>& entries,
+                          const std::string& name)
+  {
+    for(const auto& entry : entries)
+      if(entry.first == name)
+        return entry.second;
+    return "";
+  }
+
+  static std::string format_number(double x)
+  {
+    std::stringstream sstr;
+    sstr.precision(9);
+    sstr << x;
+    return sstr.str();
+  }
+
+  /// JSON has no representation for infinity and NaN
+  static std::string format_json_number(double x)
+  {
+    if(x != x || x - x != 0.0)
+      return "null";
+    return format_number(x);
+  }
+
+  static std::string quote_json(const std::string& s)
+  {
+    std::string result = "\"";
+    for(char c : s)
+    {
+      if(c == '"' || c == '\\')
+        result += '\\';
+      if(static_cast<unsigned char>(c) < 0x20)
+        result += ' ';
+      else
+        result += c;
+    }
+    return result + "\"";
+  }
+
+  static void write_csv_line(std::ostream& ostr, const std::vector<std::string>& fields)
+  {
+    for(std::size_t i = 0; i < fields.size(); ++i)
+    {
+      if(i != 0)
+        ostr << ",";
+      if(fields[i].find_first_of(",\"\n") != std::string::npos)
+      {
+        ostr << "\"";
+        for(char c : fields[i])
+          ostr << (c == '"' ? "\"\"" : std::string(1, c));
+        ostr << "\"";
+      }
+      else
+        ostr << fields[i];
+    }
+    ostr << "\n";
+  }
+
+  std::string _benchmark_name;
+  std::vector<std::pair<std::string, std::string>> _info;
+  std::vector<benchmark_record> _records;
+};
+
+/// Command line options of the form \c --name \c value
+class benchmark_options
+{
+public:
+  benchmark_options(int argc, char* argv[])
+  {
+    for(int i = 1; i < argc; ++i)
+    {
+      const std::string argument = argv[i];
+      if(argument.compare(0, 2, "--") != 0 || i + 1 >= argc)
+        throw std::invalid_argument{"Invalid argument: "+argument+
+                                    ", expected --<option> <value>"};
+      _options.push_back(std::make_pair(argument.substr(2), std::string{argv[++i]}));
+    }
+  }
+
+  bool has(const std::string& name) const
+  {
+    for(const auto& option : _options)
+      if(option.first == name)
+        return true;
+    return false;
+  }
+
+  std::string get(const std::string& name, const std::string& default_value) const
+  {
+    for(const auto& option : _options)
+      if(option.first == name)
+        return option.second;
+    return default_value;
+  }
+
+  std::size_t get_size(const std::string& name, std::size_t default_value) const
+  {
+    if(!has(name))
+      return default_value;
+    // Also accept values like 1e7
+    return static_cast<std::size_t>(std::strtod(get(name, "").c_str(), nullptr));
+  }
+
+private:
+  std::vector<std::pair<std::string, std::string>> _options;
+};
+
+}
+
+#endif
@@ -32,6 +32,7 @@
 
 #include <QCL/qcl.hpp>
 #include <iostream>
+#include <vector>
 
 namespace common {
 
@@ -49,6 +50,8 @@ public:
       throw std::runtime_error("No available OpenCL devices!");
 
     _ctx = global_ctx->device();
+    for(std::size_t i = 0; i < global_ctx->get_num_devices(); ++i)
+      _device_contexts.push_back(global_ctx->device(i));
 
     std::cout << "Using OpenCL device:\n";
     std::cout << "  Vendor:      " << _ctx->get_device_vendor() << std::endl;
@@ -64,9 +67,17 @@ public:
     return _ctx;
   }
 
+  /// \return The contexts of all available devices, starting
+  /// with the device of \c get_device_context()
+  const std::vector<qcl::device_context_ptr>& get_device_contexts() const
+  {
+    return _device_contexts;
+  }
+
 private:
   qcl::environment _env;
   qcl::device_context_ptr _ctx;
+  std::vector<qcl::device_context_ptr> _device_contexts;
 };
 
 }
@@ -0,0 +1,207 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTICLE_DISTRIBUTIONS_HPP
+#define PARTICLE_DISTRIBUTIONS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <SpatialCL/types.hpp>
+
+#include "random_vectors.hpp"
+
+namespace common {
+
+/// Gaussian clusters with random centers in the unit cube. Each particle
+/// belongs to a random cluster, coordinates outside of the unit cube
+/// are clamped to its boundary.
+template<class Scalar_type,
+         std::size_t Num_dimensions>
+class clustered_vectors
+{
+public:
+  using vector_type = typename spatialcl::cl_vector_type
+                      <
+                         Scalar_type,
+                         Num_dimensions
+                      >::value;
+
+  clustered_vectors(std::size_t num_clusters = 32,
+                    Scalar_type cluster_width = 0.02f,
+                    std::size_t seed = 1245)
+    : _num_clusters{num_clusters},
+      _cluster_width{cluster_width},
+      _generator{seed}
+  {}
+
+  void operator()(std::size_t num_particles,
+                  std::vector<vector_type>& out)
+  {
+    out.clear();
+
+    std::uniform_real_distribution<Scalar_type> center_distribution{0.0f, 1.0f};
+    std::vector<vector_type> centers;
+    for(std::size_t i = 0; i < _num_clusters; ++i)
+    {
+      vector_type center = {};
+      for(std::size_t j = 0; j < Num_dimensions; ++j)
+        center.s[j] = center_distribution(_generator);
+      centers.push_back(center);
+    }
+
+    std::uniform_int_distribution<std::size_t> cluster_distribution{0, _num_clusters - 1};
+    std::normal_distribution<Scalar_type> offset_distribution{0.0f, _cluster_width};
+
+    for(std::size_t i = 0; i < num_particles; ++i)
+    {
+      const vector_type& center = centers[cluster_distribution(_generator)];
+
+      vector_type v = {};
+      for(std::size_t j = 0; j < Num_dimensions; ++j)
+      {
+        Scalar_type x = center.s[j] + offset_distribution(_generator);
+        v.s[j] = std::min(std::max(x, Scalar_type{0}), Scalar_type{1});
+      }
+      out.push_back(v);
+    }
+  }
+private:
+  std::size_t _num_clusters;
+  Scalar_type _cluster_width;
+  std::mt19937 _generator;
+};
+
+/// Particles following a Plummer density profile centered in the
+/// unit cube, as used for the initial conditions of star clusters.
+/// The radial distribution is truncated at \c max_radius, such that
+/// all particles lie within the unit cube.
+template<class Scalar_type,
+         std::size_t Num_dimensions>
+class plummer_vectors
+{
+public:
+  using vector_type = typename spatialcl::cl_vector_type
+                      <
+                         Scalar_type,
+                         Num_dimensions
+                      >::value;
+
+  /// \param scale_radius The Plummer radius, which contains
+  /// about 35% of the particles
+  plummer_vectors(Scalar_type scale_radius = 0.05f,
+                  Scalar_type max_radius = 0.5f,
+                  std::size_t seed = 1245)
+    : _scale_radius{scale_radius},
+      _max_radius{max_radius},
+      _generator{seed}
+  {}
+
+  void operator()(std::size_t num_particles,
+                  std::vector<vector_type>& out)
+  {
+    out.clear();
+
+    std::uniform_real_distribution<double> mass_distribution{0.0, 1.0};
+    std::normal_distribution<double> direction_distribution{0.0, 1.0};
+
+    while(out.size() < num_particles)
+    {
+      // Invert the cumulative mass profile m(r) = r^3/(r^2 + a^2)^(3/2)
+      const double m = mass_distribution(_generator);
+      if(m <= 0.0)
+        continue;
+      const double r = _scale_radius / std::sqrt(std::pow(m, -2.0 / 3.0) - 1.0);
+      if(!(r < _max_radius))
+        continue;
+
+      // Normalized gaussian vectors are uniformly distributed on the sphere
+      double direction [Num_dimensions];
+      double norm2 = 0.0;
+      for(std::size_t j = 0; j < Num_dimensions; ++j)
+      {
+        direction[j] = direction_distribution(_generator);
+        norm2 += direction[j] * direction[j];
+      }
+      if(norm2 == 0.0)
+        continue;
+
+      const double scale = r / std::sqrt(norm2);
+      vector_type v = {};
+      for(std::size_t j = 0; j < Num_dimensions; ++j)
+        v.s[j] = static_cast<Scalar_type>(0.5 + scale * direction[j]);
+      out.push_back(v);
+    }
+  }
+private:
+  Scalar_type _scale_radius;
+  Scalar_type _max_radius;
+  std::mt19937 _generator;
+};
+
+/// The names of the distributions supported by \c generate_particle_distribution()
+inline std::vector<std::string> get_particle_distribution_names()
+{
+  return {"uniform", "clustered", "plummer"};
+}
+
+/// Generates particles in the unit cube following the distribution \c name
+/// \throws std::invalid_argument if the distribution is unknown
+template<class Scalar_type,
+         std::size_t Num_dimensions>
+void generate_particle_distribution(
+    const std::string& name,
+    std::size_t num_particles,
+    std::vector<typename spatialcl::cl_vector_type<Scalar_type, Num_dimensions>::value>& out,
+    std::size_t seed = 1245)
+{
+  if(name == "uniform")
+  {
+    random_vectors<Scalar_type, Num_dimensions> rnd{seed};
+    rnd(num_particles, out);
+  }
+  else if(name == "clustered")
+  {
+    clustered_vectors<Scalar_type, Num_dimensions> rnd{32, 0.02f, seed};
+    rnd(num_particles, out);
+  }
+  else if(name == "plummer")
+  {
+    plummer_vectors<Scalar_type, Num_dimensions> rnd{0.05f, 0.5f, seed};
+    rnd(num_particles, out);
+  }
+  else
+    throw std::invalid_argument{"Unknown particle distribution: "+name};
+}
+
+}
+
+#endif
@@ -34,6 +34,9 @@
 #include <vector>
 #include <array>
 #include <limits>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 
 // This is necessary to use std::find with cl_float4's
 // which is required in the verification process
@@ -108,8 +111,85 @@ public:
     return num_errors;
   }
 
+  /// Verifies the result distances of an approximate KNN query
+  /// \return The number of results whose distance exceeds
+  /// (1 + \c epsilon) times the distance of the exact neighbor
+  /// of the same rank
+  /// \param result_distances2 The squared distances of the results,
+  /// sorted by distance for each query and laid out as in \c operator()
+  std::size_t verify_distances(const std::vector<particle_type>& particles,
+                               const std::vector<scalar>& result_distances2,
+                               scalar epsilon) const
+  {
+    assert(result_distances2.size() == this->_query_points.size() * K);
+
+    // Allow for rounding errors of the distances calculated on the device
+    const scalar tolerance = 1.e-5f;
+    const scalar max_ratio2 = (1 + epsilon) * (1 + epsilon) * (1 + tolerance);
+
+    std::size_t num_errors = 0;
+    for(std::size_t i = 0; i < _query_points.size(); ++i)
+    {
+      std::array<particle_type, K> knn =
+          this->naive_knn_query(particles, _query_points[i]);
+
+      std::array<scalar, K> exact_distances2;
+      for(std::size_t j = 0; j < K; ++j)
+        exact_distances2[j] = this->distance2(knn[j], _query_points[i]);
+      std::sort(exact_distances2.begin(), exact_distances2.end());
+
+      for(std::size_t j = 0; j < K; ++j)
+        if(result_distances2[i * K + j] > max_ratio2 * exact_distances2[j] + tolerance)
+          ++num_errors;
+    }
+    return num_errors;
+  }
+
+  /// Verifies the result distances of an exact KNN query
+  /// \return The number of results whose distance differs from the
+  /// distance of the exact neighbor of the same rank
+  /// \param result_distances2 The squared distances of the results,
+  /// sorted by distance for each query and laid out as in \c operator()
+  std::size_t verify_exact_distances(const std::vector<particle_type>& particles,
+                                     const std::vector<scalar>& result_distances2) const
+  {
+    assert(result_distances2.size() == this->_query_points.size() * K);
+
+    // Allow for rounding errors of the distances calculated on the device
+    const scalar tolerance = 1.e-5f;
+
+    std::size_t num_errors = 0;
+    for(std::size_t i = 0; i < _query_points.size(); ++i)
+    {
+      std::array<particle_type, K> knn =
+          this->naive_knn_query(particles, _query_points[i]);
+
+      std::array<scalar, K> exact_distances2;
+      for(std::size_t j = 0; j < K; ++j)
+        exact_distances2[j] = this->distance2(knn[j], _query_points[i]);
+      std::sort(exact_distances2.begin(), exact_distances2.end());
+
+      for(std::size_t j = 0; j < K; ++j)
+        if(std::abs(result_distances2[i * K + j] - exact_distances2[j]) >
+           tolerance * (1 + exact_distances2[j]))
+          ++num_errors;
+    }
+    return num_errors;
+  }
+
 private:
 
+  scalar distance2(const particle_type& p, const vector_type& query_point) const
+  {
+    scalar result = 0.0f;
+    for(std::size_t i = 0; i < dimension; ++i)
+    {
+      scalar delta = query_point.s[i] - p.s[i];
+      result += delta * delta;
+    }
+    return result;
+  }
+
   std::array<particle_type, K>
   naive_knn_query(const std::vector<particle_type>& particles,
                   vector_type query_point) const
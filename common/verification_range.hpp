@@ -31,7 +31,9 @@
 
 #include <SpatialCL/configuration.hpp>
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <vector>
 
 namespace common {
@@ -100,6 +102,83 @@ public:
     }
     return num_errors;
   }
+  /// Verifies the result of a range query without limit on the
+  /// number of results, stored in CSR format.
+  /// \return The number of detected wrong results
+  /// \param offsets The results of query i are located in
+  /// \c [offsets[i], offsets[i+1]) of \c results.
+  std::size_t verify_csr(const std::vector<particle_type>& particles,
+                         const std::vector<particle_type>& results,
+                         const std::vector<cl_ulong>& offsets) const
+  {
+    std::size_t num_errors = 0;
+    assert(offsets.size() == _queries_min.size() + 1);
+
+    for(std::size_t i = 0; i < _queries_min.size(); ++i)
+    {
+      for(std::size_t j = offsets[i]; j < offsets[i+1]; ++j)
+      {
+        if(!is_particle_within_box(results[j], _queries_min[i], _queries_max[i]))
+          ++num_errors;
+      }
+      std::size_t correct_num_particles =
+          get_num_particles_in_range(particles,
+                                     _queries_min[i],
+                                     _queries_max[i]);
+      if(offsets[i+1] - offsets[i] != correct_num_particles)
+      {
+        ++num_errors;
+      }
+    }
+    return num_errors;
+  }
+  /// Verifies the result of a counting range query
+  /// \return The number of wrong counts
+  std::size_t verify_counts(const std::vector<particle_type>& particles,
+                            const std::vector<cl_uint>& counts) const
+  {
+    std::size_t num_errors = 0;
+    assert(counts.size() == _queries_min.size());
+
+    for(std::size_t i = 0; i < _queries_min.size(); ++i)
+      if(counts[i] != get_num_particles_in_range(particles,
+                                                 _queries_min[i],
+                                                 _queries_max[i]))
+        ++num_errors;
+
+    return num_errors;
+  }
+  /// Verifies the result of a reduction range query
+  /// \return The number of wrong results
+  /// \param component The reduced particle component
+  /// \param identity The result of queries without particles
+  /// \param reduce The reduction operation
+  /// \param tolerance The maximum allowed relative deviation, since
+  /// the device may reduce the particles in a different order
+  template<class Binary_operation>
+  std::size_t verify_reductions(const std::vector<particle_type>& particles,
+                                const std::vector<scalar>& results,
+                                std::size_t component,
+                                scalar identity,
+                                Binary_operation reduce,
+                                scalar tolerance = 0.0f) const
+  {
+    std::size_t num_errors = 0;
+    assert(results.size() == _queries_min.size());
+
+    for(std::size_t i = 0; i < _queries_min.size(); ++i)
+    {
+      scalar correct_result = identity;
+      for(const particle_type& p : particles)
+        if(is_particle_within_box(p, _queries_min[i], _queries_max[i]))
+          correct_result = reduce(correct_result, p.s[component]);
+
+      if(std::abs(results[i] - correct_result) >
+         tolerance * std::max(std::abs(correct_result), static_cast<scalar>(1)))
+        ++num_errors;
+    }
+    return num_errors;
+  }
 private:
   bool is_particle_within_box(particle_type particle,
                               vector_type box_min,
@@ -135,6 +214,100 @@ private:
   const std::size_t _max_retrieved_particles;
 };
 
+/// Verifies sphere range and counting queries with a naive search
+template<class Type_descriptor>
+class naive_cpu_sphere_verifier
+{
+public:
+  using particle_type =
+    typename spatialcl::configuration<Type_descriptor>::particle_type;
+  using vector_type =
+    typename spatialcl::configuration<Type_descriptor>::vector_type;
+  using scalar =
+    typename spatialcl::configuration<Type_descriptor>::scalar;
+
+  static constexpr std::size_t dimension = Type_descriptor::dimension;
+
+  naive_cpu_sphere_verifier(const std::vector<vector_type>& query_centers,
+                            const std::vector<scalar>& query_radii,
+                            const std::size_t max_num_retrieved_particles)
+    : _query_centers{query_centers},
+      _query_radii{query_radii},
+      _max_retrieved_particles{max_num_retrieved_particles}
+  {
+    assert(_query_centers.size() == _query_radii.size());
+  }
+
+  /// Verifies the result of a sphere range query, with the same memory
+  /// layout as in \c naive_cpu_range_verifier::operator()
+  /// \return The number of detected wrong results
+  std::size_t operator()(const std::vector<particle_type>& particles,
+                         const std::vector<particle_type>& results,
+                         const std::vector<cl_uint>& num_results) const
+  {
+    std::size_t num_errors = 0;
+    assert(_query_centers.size() == num_results.size());
+    assert(results.size() == _query_centers.size()*_max_retrieved_particles);
+
+    for(std::size_t i = 0; i < _query_centers.size(); ++i)
+    {
+      std::size_t num_particles = num_results[i];
+      for(std::size_t j = 0; j < num_particles; ++j)
+        if(!is_particle_within_sphere(results[i*_max_retrieved_particles + j], i))
+          ++num_errors;
+
+      std::size_t correct_num_particles =
+          std::min(get_num_particles_in_sphere(particles, i),
+                   _max_retrieved_particles);
+      if(num_particles != correct_num_particles)
+        ++num_errors;
+    }
+    return num_errors;
+  }
+
+  /// Verifies the result of a sphere counting query
+  /// \return The number of wrong counts
+  std::size_t verify_counts(const std::vector<particle_type>& particles,
+                            const std::vector<cl_uint>& counts) const
+  {
+    std::size_t num_errors = 0;
+    assert(counts.size() == _query_centers.size());
+
+    for(std::size_t i = 0; i < _query_centers.size(); ++i)
+      if(counts[i] != get_num_particles_in_sphere(particles, i))
+        ++num_errors;
+
+    return num_errors;
+  }
+private:
+  bool is_particle_within_sphere(particle_type particle,
+                                 std::size_t query_id) const
+  {
+    scalar dist2 = 0.0f;
+    for(std::size_t k = 0; k < dimension; ++k)
+    {
+      scalar delta = particle.s[k] - _query_centers[query_id].s[k];
+      dist2 += delta * delta;
+    }
+    return dist2 <= _query_radii[query_id] * _query_radii[query_id];
+  }
+
+  std::size_t get_num_particles_in_sphere(const std::vector<particle_type>& particles,
+                                          std::size_t query_id) const
+  {
+    std::size_t counter = 0;
+    for(const particle_type& p : particles)
+      if(is_particle_within_sphere(p, query_id))
+        ++counter;
+    return counter;
+  }
+
+  std::vector<vector_type> _query_centers;
+  std::vector<scalar> _query_radii;
+
+  const std::size_t _max_retrieved_particles;
+};
+
 }
 }
 
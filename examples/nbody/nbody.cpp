@@ -32,6 +32,7 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <stdexcept>
 
 #include <QCL/qcl.hpp>
 
@@ -48,7 +49,12 @@ using particle_type =
 
 constexpr scalar final_time = 100.f;
 constexpr scalar dt = 0.1f;
-constexpr scalar opening_angle = 0.5f;
+// The quadrupole moments allow larger opening angles at the same accuracy
+constexpr scalar opening_angle = 0.7f;
+
+// The grouped walk may only deviate from the per-particle walk by the
+// error of the multipole approximation
+constexpr double max_walk_mode_deviation = 0.05;
 
 constexpr std::array<scalar,3> viewport_center{0.0f, 0.0f, 0.0f};
 constexpr std::array<scalar,2> viewport_width{400.f, 400.f};
@@ -150,9 +156,26 @@ int main()
     // Copy particles to the GPU
     qcl::device_array<particle_type> device_particles{ctx, particles};
 
-    nbody::nbody_simulation<scalar> simulation{ctx, device_particles};
+    // Adjacent particles walk the tree together, which saves most
+    // of the node tests of the per-particle walk
+    nbody::nbody_simulation<scalar> simulation{
+      ctx,
+      device_particles,
+      spatialcl::tree_rebuild_policy{10, 0.25, 3},
+      nbody::NBODY_WALK_GROUPED
+    };
     nbody::particle_renderer<scalar> renderer{ctx, 512, 512};
 
+    // Check the grouped walk against the per-particle walk on the same tree
+    const double walk_mode_deviation =
+        simulation.get_walk_mode_deviation(opening_angle);
+    std::cout << "Largest relative deviation of the grouped walk from the "
+                 "per-particle walk: " << walk_mode_deviation << std::endl;
+    if(!(walk_mode_deviation <= max_walk_mode_deviation))
+      throw std::runtime_error{"The grouped walk deviates from the "
+                               "per-particle walk by more than " +
+                               std::to_string(max_walk_mode_deviation)};
+
     common::timer t;
 
     std::size_t step_id = 0;
@@ -31,8 +31,12 @@
 #define NBODY_HPP
 
 #include <cassert>
+#include <cmath>
+#include <limits>
 #include <memory>
 #include <array>
+#include <algorithm>
+#include <vector>
 
 #include <QCL/qcl.hpp>
 #include <QCL/qcl_module.hpp>
@@ -40,12 +44,67 @@
 
 #include <SpatialCL/query/query_base.hpp>
 #include <SpatialCL/query.hpp>
+#include <SpatialCL/binary_utils.hpp>
 
 #include "nbody_tree.hpp"
 
 
 namespace nbody {
 
+/// Defines the gravitational accelerations caused by single particles
+/// and by the multipoles of the nodes of an \c nbody_tree
+template<class Scalar>
+class nbody_interactions
+{
+public:
+  QCL_MAKE_MODULE(nbody_interactions)
+private:
+  QCL_MAKE_SOURCE(
+    QCL_INCLUDE_MODULE(spatialcl::configuration<nbody_type_descriptor<Scalar>>)
+    QCL_INCLUDE_MODULE(nbody_quadrupole)
+    QCL_PREPROCESSOR(define, gravitational_softening_squared 1.e-4f)
+    QCL_PREPROCESSOR(define,
+        NBODY_ADD_PARTICLE_CONTRIBUTION(acceleration,
+                                        evaluation_position,
+                                        current_particle)
+        {
+          vector_type delta = PARTICLE_POSITION(current_particle)-evaluation_position;
+          scalar r2 = VECTOR_NORM2(delta);
+          vector_type contribution = (vector_type)0.0f;
+          contribution.s012 =
+              current_particle.s3 * delta.s012 * rsqrt(r2) /
+                       (r2 + gravitational_softening_squared);
+          acceleration += contribution;
+        }
+    )
+    QCL_PREPROCESSOR(define,
+        NBODY_ADD_NODE_CONTRIBUTION(acceleration,
+                                    evaluation_position,
+                                    monopole,
+                                    node_moments)
+        {
+          // Evaluate monopole
+          vector_type delta = (monopole) - evaluation_position;
+          scalar r2 = VECTOR_NORM2(delta);
+
+          acceleration.s012 +=
+              native_divide((monopole).w * fast_normalize(delta.s012), r2+gravitational_softening_squared);
+
+          // Evaluate quadrupole. delta points from the evaluation
+          // position to the center of mass, hence the signs.
+          scalar inv_r2 = 1.0f / (r2 + gravitational_softening_squared);
+          scalar inv_r5 = sqrt(inv_r2) * inv_r2 * inv_r2;
+          vector_type quadrupole_delta = (vector_type)0.0f;
+          quadrupole_delta.s012 = NBODY_APPLY_QUADRUPOLE(node_moments, delta);
+          scalar delta_quadrupole_delta = dot(delta.s012, quadrupole_delta.s012);
+
+          acceleration.s012 += inv_r5 * (2.5f * delta_quadrupole_delta * inv_r2 * delta.s012
+                                         - quadrupole_delta.s012);
+        }
+    )
+  )
+};
+
 template<class Scalar>
 class nbody_query_handler : public spatialcl::query::basic_query
 {
@@ -93,8 +152,7 @@ private:
   Scalar _opening_angle_squared;
 public:
   QCL_MAKE_SOURCE(
-    QCL_INCLUDE_MODULE(spatialcl::configuration<nbody_type_descriptor<Scalar>>)
-    QCL_PREPROCESSOR(define, gravitational_softening_squared 1.e-4f)
+    QCL_INCLUDE_MODULE(nbody_interactions<Scalar>)
     QCL_PREPROCESSOR(define,
         dfs_node_selector(selection_result_ptr,
                           current_node_key_ptr,
@@ -102,7 +160,7 @@ public:
                           bbox_min_corner,
                           bbox_max_corner)
         {
-          scalar node_width = bbox_max_corner.w;
+          scalar node_width = bbox_max_corner.s3;
           vector_type delta = bbox_min_corner - evaluation_position;
           scalar r2 = VECTOR_NORM2(delta);
           *selection_result_ptr = (node_width*node_width > r2*opening_angle_squared);
@@ -113,12 +171,10 @@ public:
                                       bbox_min_corner,
                                       bbox_max_corner)
         {
-          // Evaluate monopole
-          vector_type delta = bbox_min_corner - evaluation_position;
-          scalar r2 = VECTOR_NORM2(delta);
-
-          acceleration.s012 +=
-              native_divide(bbox_min_corner.w * fast_normalize(delta.s012), r2+gravitational_softening_squared);
+          NBODY_ADD_NODE_CONTRIBUTION(acceleration,
+                                      evaluation_position,
+                                      bbox_min_corner,
+                                      bbox_max_corner);
         }
     )
     QCL_PREPROCESSOR(define,
@@ -126,22 +182,275 @@ public:
                                particle_idx,
                                current_particle)
         {
-          // Add particle's contribution
-          vector_type delta = PARTICLE_POSITION(current_particle)-evaluation_position;
+          // This ensures that the force is not calculated from
+          // the particle to itself
+          if(particle_idx != get_query_id())
+            NBODY_ADD_PARTICLE_CONTRIBUTION(acceleration,
+                                            evaluation_position,
+                                            current_particle);
+
+          *selection_result_ptr = 0;
+        }
+    )
+  R"(
+    #define declare_full_query_parameter_set() \
+      __global particle_type* evaluated_particles, \
+      __global vector_type* accelerations, \
+      ulong num_evaluated_particles, \
+      scalar opening_angle_squared
+  )"
+  QCL_PREPROCESSOR(define,
+    at_query_init()
+      vector_type evaluation_position;
+      if(get_query_id() < num_evaluated_particles)
+        evaluation_position = PARTICLE_POSITION(evaluated_particles[get_query_id()]);
+      vector_type acceleration = (vector_type)0.0f;
+  )
+  QCL_PREPROCESSOR(define,
+    at_query_exit()
+      if(get_query_id() < num_evaluated_particles)
+        accelerations[get_query_id()] = acceleration;
+  )
+  QCL_PREPROCESSOR(define,
+    get_num_queries()
+      num_evaluated_particles
+  )
+  )
+};
+
+/// Calculates the bounding boxes of groups of \c Walk_group_size
+/// consecutive particles, which are used by \c nbody_group_query_handler
+/// as conservative stand-ins for the positions of the particles of a group.
+template<class Scalar, std::size_t Walk_group_size>
+class nbody_group_boxes
+{
+public:
+  QCL_MAKE_MODULE(nbody_group_boxes)
+
+  using vector_type =
+    typename spatialcl::configuration<nbody_type_descriptor<Scalar>>::vector_type;
+
+  static constexpr std::size_t local_size = 256;
+  static constexpr std::size_t walk_group_size = Walk_group_size;
+
+  static_assert(spatialcl::utils::binary::is_small_power2<Walk_group_size>::value,
+                "The walk group size must be a power of two");
+  static_assert(local_size % Walk_group_size == 0,
+                "The local size must be a multiple of the walk group size");
+
+  static std::size_t get_num_groups(std::size_t num_particles)
+  {
+    return (num_particles + Walk_group_size - 1) / Walk_group_size;
+  }
+
+  nbody_group_boxes(const qcl::device_context_ptr& ctx,
+                    std::size_t num_particles)
+    : _ctx{ctx},
+      _num_particles{num_particles},
+      _group_min_corners{ctx, std::max<std::size_t>(get_num_groups(num_particles), 1)},
+      _group_max_corners{ctx, std::max<std::size_t>(get_num_groups(num_particles), 1)}
+  {}
+
+  /// Recalculates the group boxes from the current particle positions.
+  /// Does not block.
+  void update(const cl::Buffer& particles)
+  {
+    if(_num_particles == 0)
+      return;
+
+    const std::size_t global_size =
+        ((_num_particles + local_size - 1) / local_size) * local_size;
+
+    cl_int err = nbody_compute_group_boxes(_ctx,
+                                           cl::NDRange{global_size},
+                                           cl::NDRange{local_size})(
+          particles,
+          static_cast<cl_ulong>(_num_particles),
+          _group_min_corners,
+          _group_max_corners);
+    qcl::check_cl_error(err, "Could not enqueue nbody_compute_group_boxes kernel");
+  }
+
+  const cl::Buffer& get_group_min_corners() const
+  {
+    return _group_min_corners.get_buffer();
+  }
+
+  const cl::Buffer& get_group_max_corners() const
+  {
+    return _group_max_corners.get_buffer();
+  }
+
+private:
+  qcl::device_context_ptr _ctx;
+  std::size_t _num_particles;
+
+  qcl::device_array<vector_type> _group_min_corners;
+  qcl::device_array<vector_type> _group_max_corners;
+
+  QCL_ENTRYPOINT(nbody_compute_group_boxes)
+  QCL_MAKE_SOURCE(
+    QCL_INCLUDE_MODULE(spatialcl::configuration<nbody_type_descriptor<Scalar>>)
+    QCL_IMPORT_CONSTANT(local_size)
+    QCL_IMPORT_CONSTANT(walk_group_size)
+    QCL_RAW(
+      __kernel void nbody_compute_group_boxes(__global particle_type* particles,
+                                              ulong num_particles,
+                                              __global vector_type* group_min_corners,
+                                              __global vector_type* group_max_corners)
+      {
+        __local vector_type min_corners [local_size];
+        __local vector_type max_corners [local_size];
+
+        const size_t tid = get_global_id(0);
+        const size_t lid = get_local_id(0);
+
+        // Work items beyond the end repeat the last particle,
+        // which does not change the box of the last group
+        const vector_type position =
+            PARTICLE_POSITION(particles[min((ulong)tid, num_particles - 1)]);
+        min_corners[lid] = position;
+        max_corners[lid] = position;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for(size_t stride = walk_group_size / 2; stride > 0; stride >>= 1)
+        {
+          if(lid % walk_group_size < stride)
+          {
+            min_corners[lid] = fmin(min_corners[lid], min_corners[lid + stride]);
+            max_corners[lid] = fmax(max_corners[lid], max_corners[lid + stride]);
+          }
+          barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if(lid % walk_group_size == 0 && tid < num_particles)
+        {
+          group_min_corners[tid / walk_group_size] = min_corners[lid];
+          group_max_corners[tid / walk_group_size] = max_corners[lid];
+        }
+      }
+    )
+  )
+};
+
+/// Barnes-Hut handler for a group-wise tree walk with the
+/// \c grouped_depth_first engine. The opening criterion is evaluated
+/// for the bounding box of the group of \c Walk_group_size consecutive
+/// evaluation particles that a query belongs to, instead of the position
+/// of the particle itself: A node is accepted if its width is smaller than
+/// the opening angle times the distance between its center of mass and
+/// the closest point of the group box. Since this is conservative for all
+/// particles of the group, the criterion is at least as accurate as the
+/// per-particle criterion of \c nbody_query_handler.
+///
+/// Because all queries of a group now make the same decisions, a subgroup
+/// of the engine walks the tree exactly once, and the nodes and particles
+/// it collectively loads into local memory form the interaction list
+/// that all particles of the group evaluate.
+/// For this to hold, the evaluation particles must be ordered like
+/// the particles of the tree, and the subgroup size of the engine must
+/// equal \c Walk_group_size.
+template<class Scalar, std::size_t Walk_group_size>
+class nbody_group_query_handler : public spatialcl::query::basic_query
+{
+public:
+  QCL_MAKE_MODULE(nbody_group_query_handler)
+
+  using group_boxes_type = nbody_group_boxes<Scalar, Walk_group_size>;
+
+  static constexpr std::size_t walk_group_size = Walk_group_size;
+
+  /// \param evaluation_particles particles at whose location the
+  /// acceleration should be calculated
+  /// \param accelerations output buffer for the accelerations,
+  /// must have \c num_particles entries of \c vector_type
+  /// \param num_particles The number of particles in the \c
+  /// evaluation_particles buffer.
+  /// \param group_boxes The boxes of the groups of evaluation particles.
+  /// Must be up to date with \c evaluation_particles.
+  /// \param The opening angle for the tree walk
+  nbody_group_query_handler(const cl::Buffer& evaluation_particles,
+                            std::size_t num_particles,
+                            const group_boxes_type& group_boxes,
+                            Scalar opening_angle,
+                            const cl::Buffer& accelerations)
+    : _eval_particles{evaluation_particles},
+      _accelerations{accelerations},
+      _group_min_corners{group_boxes.get_group_min_corners()},
+      _group_max_corners{group_boxes.get_group_max_corners()},
+      _eval_num_particles{num_particles},
+      _opening_angle_squared{opening_angle * opening_angle}
+  {
+    assert(opening_angle > 0.0f);
+  }
+
+  virtual void push_full_arguments(qcl::kernel_call& call) override
+  {
+    call.partial_argument_list(_eval_particles,
+                               _accelerations,
+                               _group_min_corners,
+                               _group_max_corners,
+                               static_cast<cl_ulong>(_eval_num_particles),
+                               _opening_angle_squared);
+  }
+
+  virtual std::size_t get_num_independent_queries() const override
+  {
+    return _eval_num_particles;
+  }
+
+  virtual ~nbody_group_query_handler(){}
+private:
+  cl::Buffer _eval_particles;
+  cl::Buffer _accelerations;
+  cl::Buffer _group_min_corners;
+  cl::Buffer _group_max_corners;
+
+  std::size_t _eval_num_particles;
+  Scalar _opening_angle_squared;
+public:
+  QCL_MAKE_SOURCE(
+    QCL_INCLUDE_MODULE(nbody_interactions<Scalar>)
+    QCL_IMPORT_CONSTANT(walk_group_size)
+    QCL_PREPROCESSOR(define,
+        dfs_node_selector(selection_result_ptr,
+                          current_node_key_ptr,
+                          node_index,
+                          bbox_min_corner,
+                          bbox_max_corner)
+        {
+          scalar node_width = bbox_max_corner.s3;
+          // Distance from the center of mass to the closest point of the group box
+          vector_type delta = fmax(group_min_corner - bbox_min_corner,
+                                   bbox_min_corner - group_max_corner);
+          delta = fmax(delta, (vector_type)0.0f);
           scalar r2 = VECTOR_NORM2(delta);
-          vector_type contribution;
-          contribution.s012 =
-              current_particle.s3 * delta.s012 * rsqrt(r2) /
-                       (r2 + gravitational_softening_squared);
+          *selection_result_ptr = (node_width*node_width > r2*opening_angle_squared);
+        }
+      )
+    QCL_PREPROCESSOR(define,
+        dfs_unique_node_discard_event(node_idx,
+                                      bbox_min_corner,
+                                      bbox_max_corner)
+        {
+          NBODY_ADD_NODE_CONTRIBUTION(acceleration,
+                                      evaluation_position,
+                                      bbox_min_corner,
+                                      bbox_max_corner);
+        }
+    )
+    QCL_PREPROCESSOR(define,
+        dfs_particle_processor(selection_result_ptr,
+                               particle_idx,
+                               current_particle)
+        {
           // This ensures that the force is not calculated from
           // the particle to itself
           if(particle_idx != get_query_id())
-            acceleration += contribution;
+            NBODY_ADD_PARTICLE_CONTRIBUTION(acceleration,
+                                            evaluation_position,
+                                            current_particle);
 
-          // For the relaxed and grouped dfs engine, we need to avoid remaining
-          // at the lowest node indefinitely. We ensure this by
-          // deselecting particles. This causes the query engine to go
-          // up again if we are at a right node.
           *selection_result_ptr = 0;
         }
     )
@@ -149,14 +458,22 @@ public:
     #define declare_full_query_parameter_set() \
       __global particle_type* evaluated_particles, \
       __global vector_type* accelerations, \
+      __global vector_type* group_min_corners, \
+      __global vector_type* group_max_corners, \
       ulong num_evaluated_particles, \
       scalar opening_angle_squared
   )"
   QCL_PREPROCESSOR(define,
     at_query_init()
       vector_type evaluation_position;
+      vector_type group_min_corner;
+      vector_type group_max_corner;
       if(get_query_id() < num_evaluated_particles)
+      {
         evaluation_position = PARTICLE_POSITION(evaluated_particles[get_query_id()]);
+        group_min_corner = group_min_corners[get_query_id() / walk_group_size];
+        group_max_corner = group_max_corners[get_query_id() / walk_group_size];
+      }
       vector_type acceleration = (vector_type)0.0f;
   )
   QCL_PREPROCESSOR(define,
@@ -179,15 +496,19 @@ public:
     : _ctx{ctx}, _previous_dt{0.0f}, _t{0.0f}
   {}
 
+  /// Enqueues the time step. Does not block, \c evt (if not \c nullptr)
+  /// receives the event of the integration kernel.
   void advance(const cl::Buffer& particles,
                const cl::Buffer& accelerations,
                std::size_t num_particles,
-               Scalar dt)
+               Scalar dt,
+               cl::Event* evt = nullptr)
   {
     cl_int err =
         leapfrog_advance(_ctx,
                          cl::NDRange{num_particles},
-                         cl::NDRange{256})(
+                         cl::NDRange{256},
+                         evt)(
             particles,
             accelerations,
             static_cast<cl_ulong>(num_particles),
@@ -195,10 +516,6 @@ public:
             dt);
     qcl::check_cl_error(err, "Could not enqueue leapfrog_advance kernel");
 
-    err = _ctx->get_command_queue().finish();
-    qcl::check_cl_error(err, "Error while waiting for leapfrog_advance kernel"
-                             " to finish.");
-
     _t += dt;
 
     _previous_dt = dt;
@@ -254,10 +571,25 @@ private:
 
 
 
+/// How the accelerations are obtained from the tree
+enum nbody_walk_mode
+{
+  /// Each particle walks the tree with its own opening criterion,
+  /// see \c nbody_query_handler
+  NBODY_WALK_PER_PARTICLE,
+  /// Groups of adjacent particles walk the tree together with
+  /// a shared opening criterion, see \c nbody_group_query_handler
+  NBODY_WALK_GROUPED
+};
+
 template<class Scalar>
 class nbody_simulation
 {
 public:
+  /// The number of particles that walk the tree together
+  /// in \c NBODY_WALK_GROUPED mode
+  static constexpr std::size_t walk_group_size = 8;
+
   using nbody_tree_ptr = std::unique_ptr<nbody_tree<Scalar>>;
 
   using particle_type =
@@ -283,44 +615,60 @@ public:
   }
 
 
+  /// \param rebuild_policy Decides when the tree is rebuilt with a full
+  /// sort. In the remaining time steps, only the multipoles are
+  /// recalculated.
+  /// \param walk_mode How the particles walk the tree
   nbody_simulation(const qcl::device_context_ptr& ctx,
-                   const qcl::device_array<particle_type>& initial_particles)
+                   const qcl::device_array<particle_type>& initial_particles,
+                   const spatialcl::tree_rebuild_policy& rebuild_policy =
+                      spatialcl::tree_rebuild_policy{10, 0.25, 3},
+                   nbody_walk_mode walk_mode = NBODY_WALK_PER_PARTICLE)
     : _ctx{ctx},
       _particles{initial_particles},
       _integrator{ctx},
-      _acceleration{ctx, initial_particles.size()}
+      _acceleration{ctx, initial_particles.size()},
+      _rebuild_policy{rebuild_policy},
+      _walk_mode{walk_mode},
+      _group_boxes{ctx, initial_particles.size()}
   {}
 
   void time_step(Scalar opening_angle,
                  Scalar dt = 0.1f)
   {
     // Calculate acceleration
-    // - Build tree
-    // -- Discard old tree
-    _tree.reset(nullptr);
-    // -- Create new one
-    _tree = nbody_tree_ptr{new nbody_tree<Scalar>{_ctx, _particles}};
+    // - Build or update tree. The tree sorts the particles
+    //   in place, so it always refers to the current particle state.
+    if(!_tree)
+      this->build_tree();
+    else
+    {
+      // -- Refit the tree to the new particle positions, and only
+      //    re-sort if too many refits have been done, or if the
+      //    quality of the tree refitted in the previous step has
+      //    degraded too much. Deciding before the refit avoids refitting
+      //    a tree that is rebuilt anyway.
+      bool rebuild = _rebuild_policy.requires_rebuild();
+      if(!rebuild && _rebuild_policy.requires_quality_check())
+        rebuild = _rebuild_policy.requires_rebuild(this->get_tree_quality());
+
+      if(rebuild)
+      {
+        _tree->rebuild();
+        _rebuild_policy.notify_rebuild(this->get_tree_quality());
+      }
+      else
+      {
+        _tree->refit();
+        _rebuild_policy.notify_refit();
+      }
+    }
 
     // - Query tree to obtain accelerations
-    // -- Define queries
-    using query_handler = nbody_query_handler<Scalar>;
-    using query_engine =
-      spatialcl::query::grouped_dfs_query_engine<
-        nbody_tree<Scalar>,
-        query_handler,
-        32
-      >;
-
-    query_engine engine;
-    query_handler handler{
-      _particles.get_buffer(),
-      _particles.size(),
-      opening_angle,
-      _acceleration.get_buffer()
-    };
-    // -- Execute query to obtain accelerations
-    cl_int err = engine(*_tree, handler);
-    qcl::check_cl_error(err, "Error during tree query!");
+    if(_walk_mode == NBODY_WALK_GROUPED)
+      this->query_accelerations_grouped(opening_angle, _acceleration);
+    else
+      this->query_accelerations(opening_angle, _acceleration);
 
     // Perform time integration
     _integrator.advance(_particles.get_buffer(),
@@ -334,6 +682,47 @@ public:
     return _integrator.get_current_time();
   }
 
+  /// Calculates the accelerations of the current particles with both walk
+  /// modes on the same tree, without advancing the simulation. The grouped
+  /// walk opens at least the nodes the per-particle walk opens, so both
+  /// only differ by the error of the multipole approximation.
+  /// Blocks until the accelerations are available.
+  /// \return The largest relative deviation |a_grouped - a| / |a| of the
+  /// grouped accelerations from the per-particle accelerations a
+  double get_walk_mode_deviation(Scalar opening_angle)
+  {
+    if(!_tree)
+      this->build_tree();
+
+    qcl::device_array<vector_type> grouped_acceleration{_ctx, _particles.size()};
+    this->query_accelerations(opening_angle, _acceleration);
+    this->query_accelerations_grouped(opening_angle, grouped_acceleration);
+
+    std::vector<vector_type> host_acceleration;
+    std::vector<vector_type> host_grouped_acceleration;
+    _acceleration.read(host_acceleration);
+    grouped_acceleration.read(host_grouped_acceleration);
+
+    double max_deviation = 0.0;
+    for(std::size_t i = 0; i < host_acceleration.size(); ++i)
+    {
+      double norm2 = 0.0;
+      double difference2 = 0.0;
+      for(std::size_t j = 0; j < 3; ++j)
+      {
+        const double a = host_acceleration[i].s[j];
+        const double delta = host_grouped_acceleration[i].s[j] - a;
+        norm2 += a * a;
+        difference2 += delta * delta;
+      }
+      if(norm2 > 0.0)
+        max_deviation = std::max(max_deviation, std::sqrt(difference2 / norm2));
+      else if(difference2 > 0.0)
+        max_deviation = std::numeric_limits<double>::infinity();
+    }
+    return max_deviation;
+  }
+
   void retrieve_results(std::vector<host_vector3d>& positions,
                         std::vector<host_vector3d>& velocities,
                         std::vector<Scalar>& masses) const
@@ -358,6 +747,73 @@ public:
     }
   }
 private:
+  void build_tree()
+  {
+    _tree = nbody_tree_ptr{new nbody_tree<Scalar>{_ctx, _particles}};
+    _rebuild_policy.notify_rebuild(this->get_tree_quality());
+  }
+
+  void query_accelerations(Scalar opening_angle,
+                           const qcl::device_array<vector_type>& acceleration)
+  {
+    // -- Define queries
+    using query_handler = nbody_query_handler<Scalar>;
+    using query_engine =
+      spatialcl::query::grouped_dfs_query_engine<
+        nbody_tree<Scalar>,
+        query_handler,
+        32
+      >;
+
+    query_engine engine;
+    query_handler handler{
+      _particles.get_buffer(),
+      _particles.size(),
+      opening_angle,
+      acceleration.get_buffer()
+    };
+    // -- Execute query to obtain accelerations
+    cl_int err = engine(*_tree, handler);
+    qcl::check_cl_error(err, "Error during tree query!");
+  }
+
+  void query_accelerations_grouped(Scalar opening_angle,
+                                   const qcl::device_array<vector_type>& acceleration)
+  {
+    // The particles have been sorted by the tree, so groups of
+    // adjacent particles are also close in space
+    _group_boxes.update(_particles.get_buffer());
+
+    using query_handler = nbody_group_query_handler<Scalar, walk_group_size>;
+    // The subgroups of the engine must coincide with the walk groups
+    using query_engine =
+      spatialcl::query::engine::grouped_depth_first<
+        nbody_tree<Scalar>,
+        query_handler,
+        32,
+        walk_group_size
+      >;
+
+    query_engine engine;
+    query_handler handler{
+      _particles.get_buffer(),
+      _particles.size(),
+      _group_boxes,
+      opening_angle,
+      acceleration.get_buffer()
+    };
+    cl_int err = engine(*_tree, handler);
+    qcl::check_cl_error(err, "Error during tree query!");
+  }
+
+  double get_tree_quality() const
+  {
+    // Avoid the readback if the policy does not need it
+    if(!_rebuild_policy.uses_quality_metric())
+      return 0.0;
+    return _tree->get_quality_metric();
+  }
+
   qcl::device_context_ptr _ctx;
   nbody_tree_ptr _tree;
   qcl::device_array<particle_type> _particles;
@@ -365,6 +821,11 @@ private:
   nbody_integrator<Scalar> _integrator;
 
   qcl::device_array<vector_type> _acceleration;
+
+  spatialcl::tree_rebuild_policy _rebuild_policy;
+
+  nbody_walk_mode _walk_mode;
+  nbody_group_boxes<Scalar, walk_group_size> _group_boxes;
 };
 
 }
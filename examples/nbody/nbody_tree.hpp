@@ -38,6 +38,7 @@
 #include <SpatialCL/tree/binary_tree.hpp>
 #include <SpatialCL/configuration.hpp>
 #include <SpatialCL/tree.hpp>
+#include <SpatialCL/tree/bottom_up_builder.hpp>
 
 namespace nbody {
 
@@ -46,34 +47,186 @@ namespace nbody {
 template<class Scalar>
 using nbody_type_descriptor = spatialcl::type_descriptor::generic<Scalar,3,8>;
 
+// With 8 components per particle, it is cheaper to sort indices
+// and gather the particles once than to move the particles in each
+// sort pass. Since the tree is rebuilt over the particles sorted in the
+// previous rebuild, usually only few particles are out of order, which
+// the incremental strategy exploits.
 template<class Scalar>
 using hilbert_sorter =
   spatialcl::key_based_sorter<
     spatialcl::hilbert_sort_key_generator<
       nbody_type_descriptor<Scalar>
-    >
+    >,
+    spatialcl::sort::boost_sort_engine,
+    spatialcl::SORT_STRATEGY_INCREMENTAL
   >;
 
+/// The second node value holds the node extent and the quadrupole moment,
+/// see \c nbody_quadrupole
+template<class Scalar>
+using nbody_node_moments_type = typename spatialcl::cl_vector_type<Scalar, 16>::value;
+
 template<class Scalar>
 using nbody_basic_tree = spatialcl::particle_tree
 <
   hilbert_sorter<Scalar>,
   nbody_type_descriptor<Scalar>,
   typename spatialcl::configuration<nbody_type_descriptor<Scalar>>::vector_type,
-  typename spatialcl::configuration<nbody_type_descriptor<Scalar>>::vector_type
+  nbody_node_moments_type<Scalar>
 >;
 
+/// Defines the traceless quadrupole moments
+/// Q = sum_i m_i (3 d_i d_i^T - |d_i|^2 I)
+/// of the nodes, where d_i is the position of particle i relative to the
+/// center of mass of the node. The second node value stores the node extent
+/// (with the width of the node) in the components s0 to s3, and the
+/// symmetric tensor Q as (xx, yy, zz) in s4 to s6 and (xy, xz, yz) in s7 to s9.
+class nbody_quadrupole
+{
+public:
+  QCL_MAKE_MODULE(nbody_quadrupole)
+private:
+  QCL_MAKE_SOURCE(
+    QCL_PREPROCESSOR(define,
+      NBODY_ADD_POINT_QUADRUPOLE(moments, d, m)
+      {
+        const scalar d2 = dot((d).xyz, (d).xyz);
+        (moments).s456 += (m) * ((scalar)3 * (d).xyz * (d).xyz - d2);
+        (moments).s789 += (m) * (scalar)3 * (d).xxy * (d).yzz;
+      }
+    )
+    // Q d as three component vector
+    QCL_PREPROCESSOR(define,
+      NBODY_APPLY_QUADRUPOLE(moments, d)
+        ((moments).s456 * (d).xyz +
+         (moments).s778 * (d).yxx +
+         (moments).s899 * (d).zzy)
+    )
+  )
+};
+
+/// Combiner for the bottom up builder that calculates the monopoles
+/// (center of mass and total mass) as first node value, and the node
+/// extent with the width of the node in the s3 component, followed
+/// by the quadrupole moment (see \c nbody_quadrupole), as second
+/// node value. The quadrupoles of the parents are obtained from those
+/// of their children with the parallel axis theorem.
 template<class Scalar>
-class nbody_tree : public nbody_basic_tree<Scalar>
+class nbody_multipole_combiner
 {
 public:
-  QCL_MAKE_MODULE(nbody_tree)
+  QCL_MAKE_MODULE(nbody_multipole_combiner)
+private:
+  QCL_MAKE_SOURCE(
+    QCL_INCLUDE_MODULE(nbody_quadrupole)
+    QCL_PREPROCESSOR(define,
+      bottom_up_build_leaf_node(particles,
+                                particles_begin,
+                                particles_end,
+                                monopole_ptr,
+                                node_moments_ptr)
+      {
+        vector_type monopole = (vector_type)0.0f;
+        vector_type bb_min = particles[particles_begin].s0123;
+        vector_type bb_max = bb_min;
+
+        for(index_type i = particles_begin; i < particles_end; ++i)
+        {
+          particle_type p = particles[i];
+          monopole.xyz += p.s3 * p.s012;
+          monopole.w += p.s3;
 
+          bb_min = fmin(bb_min, p.s0123);
+          bb_max = fmax(bb_max, p.s0123);
+        }
+        monopole.xyz /= monopole.w;
+
+        node_type1 node_moments = (node_type1)0.0f;
+        node_moments.s012 = bb_max.xyz - bb_min.xyz;
+        node_moments.s3 = 0.33f * (node_moments.s0 + node_moments.s1 + node_moments.s2);
+
+        for(index_type i = particles_begin; i < particles_end; ++i)
+        {
+          particle_type p = particles[i];
+          vector_type d = p.s0123 - monopole;
+          NBODY_ADD_POINT_QUADRUPOLE(node_moments, d, p.s3);
+        }
+
+        *monopole_ptr = monopole;
+        *node_moments_ptr = node_moments;
+      }
+    )
+    QCL_PREPROCESSOR(define,
+      bottom_up_combine_nodes(left_child_monopole,
+                              left_child_node_moments,
+                              right_child_monopole_value,
+                              right_child_node_moments_value,
+                              right_child_exists,
+                              monopole_ptr,
+                              node_moments_ptr)
+      {
+        // A missing right child does not contribute any mass, and
+        // does not enlarge the node.
+        vector_type right_child_monopole = left_child_monopole;
+        node_type1 right_child_node_moments = left_child_node_moments;
+        scalar right_mass = 0.0f;
+        if(right_child_exists)
+        {
+          right_child_monopole = right_child_monopole_value;
+          right_child_node_moments = right_child_node_moments_value;
+          right_mass = right_child_monopole.w;
+        }
+
+        scalar left_mass = left_child_monopole.w;
+        // Calculate center of mass
+        vector_type parent_monopole =
+          left_mass * left_child_monopole + right_mass * right_child_monopole;
+        scalar total_mass = left_mass + right_mass;
+        parent_monopole.xyz /= total_mass;
+        // Set total mass
+        parent_monopole.w = total_mass;
+
+        node_type1 node_moments = (node_type1)0.0f;
+        node_moments.s012 = fmax(left_child_monopole.xyz + 0.5f * left_child_node_moments.s012,
+                                 right_child_monopole.xyz + 0.5f * right_child_node_moments.s012)
+                          - fmin(left_child_monopole.xyz - 0.5f * left_child_node_moments.s012,
+                                 right_child_monopole.xyz - 0.5f * right_child_node_moments.s012);
+
+        node_moments.s3 = fmax(node_moments.s0, fmax(node_moments.s1, node_moments.s2));
+
+        // Shift the quadrupoles of the children to the center
+        // of mass of the parent (parallel axis theorem)
+        node_moments.s456 = left_child_node_moments.s456;
+        node_moments.s789 = left_child_node_moments.s789;
+        if(right_child_exists)
+        {
+          node_moments.s456 += right_child_node_moments.s456;
+          node_moments.s789 += right_child_node_moments.s789;
+        }
+        vector_type left_shift = left_child_monopole - parent_monopole;
+        vector_type right_shift = right_child_monopole - parent_monopole;
+        NBODY_ADD_POINT_QUADRUPOLE(node_moments, left_shift, left_mass);
+        NBODY_ADD_POINT_QUADRUPOLE(node_moments, right_shift, right_mass);
+
+        *monopole_ptr = parent_monopole;
+        *node_moments_ptr = node_moments;
+      }
+    )
+  )
+};
+
+template<class Scalar>
+class nbody_tree : public nbody_basic_tree<Scalar>
+{
+public:
   using particle_type =
     typename spatialcl::configuration<nbody_type_descriptor<Scalar>>::particle_type;
   using vector_type =
     typename spatialcl::configuration<nbody_type_descriptor<Scalar>>::vector_type;
+  using node_moments_type = nbody_node_moments_type<Scalar>;
 
+  QCL_MAKE_MODULE(nbody_tree)
 
   nbody_tree(const qcl::device_context_ptr& ctx,
              const qcl::device_array<particle_type>& particles)
@@ -84,160 +237,102 @@ public:
     this->init_multipoles();
   }
 
-private:
-  void init_multipoles()
+  /// Recalculates the multipoles for the current particle positions,
+  /// keeping the particle order.
+  /// \param evt If not \c nullptr, receives an event that completes
+  /// once the multipoles have been calculated
+  void refit(cl::Event* evt = nullptr)
   {
-    assert(this->get_num_node_levels() > 0);
-    // Build monopoles for lowest level.
-
-    // First, build lowest level
-    cl_int err = this->build_ll_monopoles(_ctx,
-                                          cl::NDRange{this->get_num_particles()},
-                                          cl::NDRange{256})
-        (this->get_node_values0(),
-         this->get_node_values1(),
-         this->get_sorted_particles(),
-         static_cast<cl_ulong>(this->get_num_particles()));
-
-    qcl::check_cl_error(err, "Could not enqueue build_ll_monopoles kernel");
-
-    for(int level = this->get_num_node_levels()-2; level >= 0; --level)
-    {
-      // Build higher levels
-      err = this->build_monopoles(_ctx,
-                                  cl::NDRange{1ul << level},
-                                  cl::NDRange{256})
-          (this->get_node_values0(),
-           this->get_node_values1(),
-           static_cast<cl_uint>(level),
-           static_cast<cl_ulong>(this->get_num_particles()),
-           static_cast<cl_ulong>(this->get_effective_num_particles()),
-           static_cast<cl_ulong>(this->get_effective_num_levels()));
-      qcl::check_cl_error(err, "Could not enqueue build_monopoles kernel");
-    }
-    err = _ctx->get_command_queue().finish();
-    qcl::check_cl_error(err,"Error while waiting for build_monopoles kernel to finish");
+    this->init_multipoles();
+    spatialcl::enqueue_completion_event(_ctx, evt);
   }
 
-  qcl::device_context_ptr _ctx;
-
-
-  QCL_ENTRYPOINT(build_ll_monopoles)
-  QCL_ENTRYPOINT(build_monopoles)
-  QCL_MAKE_SOURCE(
-    QCL_INCLUDE_MODULE(spatialcl::configuration<nbody_type_descriptor<Scalar>>)
-    QCL_INCLUDE_MODULE(spatialcl::binary_tree)
-    QCL_RAW (
-      // Build monopoles on lowest level
-      __kernel void build_ll_monopoles(__global vector_type* monopoles,
-                                       __global vector_type* node_widths,
-                                       __global particle_type* particles,
-                                       ulong num_particles)
-      {
-        ulong num_nodes = num_particles >> 1;
-        if(num_particles & 1)
-          ++num_nodes;
-
-        for(ulong tid = get_global_id(0);
-            tid < num_nodes;
-            tid += get_global_size(0))
-        {
-          ulong left_particle_idx = tid << 1;
-          ulong right_particle_idx = left_particle_idx + 1;
-
-          particle_type left_particle = particles[left_particle_idx];
-          particle_type right_particle = left_particle;
-          if(right_particle < num_particles)
-            right_particle = particles[right_particle_idx];
+  /// Sorts the particles again and recalculates the multipoles.
+  void rebuild(cl::Event* evt = nullptr)
+  {
+    this->resort();
+    this->init_multipoles();
+    spatialcl::enqueue_completion_event(_ctx, evt);
+  }
 
-          vector_type monopole;
-          monopole.xyz = left_particle.s3 * left_particle.s012;
-          monopole.xyz += right_particle.s3 * right_particle.s012;
+  /// \return The sum of the node widths of the lowest node level.
+  /// Grows if the tree is refitted while the particles move apart,
+  /// see \c spatialcl::tree_rebuild_policy.
+  /// Note: This function blocks until the result is available.
+  double get_quality_metric() const
+  {
+    const std::size_t num_lowest_level_nodes = this->get_num_leaf_buckets();
+
+    qcl::device_array<Scalar> node_widths{_ctx, num_lowest_level_nodes};
+
+    const std::size_t global_size =
+        ((num_lowest_level_nodes + local_size - 1) / local_size) * local_size;
+
+    cl_int err = nbody_tree_node_widths(_ctx,
+                                        cl::NDRange{global_size},
+                                        cl::NDRange{local_size})(
+          this->get_node_values1(),
+          static_cast<cl_ulong>(num_lowest_level_nodes),
+          node_widths);
+    qcl::check_cl_error(err, "Could not enqueue nbody_tree_node_widths kernel");
+
+    boost::compute::command_queue boost_queue{
+      _ctx->get_command_queue().get()
+    };
+
+    Scalar result = 0;
+    boost::compute::reduce(
+          qcl::create_buffer_iterator<Scalar>(node_widths.get_buffer(), 0),
+          qcl::create_buffer_iterator<Scalar>(node_widths.get_buffer(),
+                                              num_lowest_level_nodes),
+          &result,
+          boost_queue);
+
+    return static_cast<double>(result);
+  }
 
-          scalar total_mass = left_particle.s3 + right_particle.s3;
+private:
+  void init_multipoles()
+  {
+    assert(this->get_num_node_levels() > 0);
 
-          monopole.xyz /= total_mass;
-          monopole.w = total_mass;
+    // Build the multipoles of all levels in one kernel launch
+    _builder(_ctx,
+             this->get_sorted_particles(),
+             this->get_num_particles(),
+             this->get_node_values0(),
+             this->get_node_values1());
+    // No need to wait for the builder, since all subsequent
+    // operations use the same in-order command queue
+  }
 
-          vector_type node_extent;
-          node_extent.xyz = fabs(left_particle.xyz - right_particle.xyz);
-          node_extent.w = 0.33f * (node_extent.x + node_extent.y + node_extent.z);
+  static constexpr std::size_t local_size = 256;
 
-          node_widths[tid] = node_extent;
-          monopoles  [tid] = monopole;
+  qcl::device_context_ptr _ctx;
 
-        }
-      }
-      // Build monopoles on higher levels
-      __kernel void build_monopoles(__global vector_type* monopoles,
-                                    __global vector_type* node_widths,
-                                    uint current_level,
-                                    ulong num_particles,
-                                    ulong effective_num_particles,
-                                    ulong effective_num_levels)
+  spatialcl::bottom_up_builder<
+    nbody_type_descriptor<Scalar>,
+    vector_type,
+    node_moments_type,
+    nbody_multipole_combiner<Scalar>,
+    nbody_basic_tree<Scalar>::leaf_bucket_size
+  > _builder;
+
+  QCL_ENTRYPOINT(nbody_tree_node_widths)
+  QCL_MAKE_SOURCE
+  (
+    QCL_INCLUDE_MODULE(spatialcl::tree_configuration<nbody_basic_tree<Scalar>>)
+    QCL_INCLUDE_MODULE(spatialcl::binary_tree)
+    QCL_RAW
+    (
+      __kernel void nbody_tree_node_widths(__global node_type1* node_moments,
+                                           index_type num_nodes,
+                                           __global scalar* widths_out)
       {
-        ulong num_nodes = BT_NUM_NODES(current_level);
-
-        for(ulong tid = get_global_id(0);
+        for(index_type tid = get_global_id(0);
             tid < num_nodes;
             tid += get_global_size(0))
-        {
-          binary_tree_key_t node_key;
-          binary_tree_key_init(&node_key, current_level, tid);
-
-          if(binary_tree_is_node_used(&node_key,
-                                      effective_num_levels,
-                                      num_particles))
-          {
-            binary_tree_key_t children_begin = binary_tree_get_children_begin(&node_key);
-            binary_tree_key_t children_last  = binary_tree_get_children_last (&node_key);
-
-            int right_child_exists = binary_tree_is_node_used(&children_last,
-                                                              effective_num_levels,
-                                                              num_particles);
-
-            ulong effective_child_idx = binary_tree_key_encode_global_id(&children_begin,
-                                                                         effective_num_levels)
-                                      - effective_num_particles;
-
-            vector_type left_child_monopole = monopoles[effective_child_idx];
-            vector_type right_child_monopole = left_child_monopole;
-
-            vector_type left_child_node_extent = node_widths[effective_child_idx];
-            vector_type right_child_node_extent = (vector_type)0.0f;
-
-            if(right_child_exists)
-            {
-              right_child_monopole   = monopoles[effective_child_idx + 1];
-              right_child_node_extent = node_widths[effective_child_idx + 1];
-            }
-            scalar left_mass = left_child_monopole.w;
-            scalar right_mass = right_child_monopole.w;
-            // Calculate center of mass
-            vector_type parent_monopole =
-              left_mass * left_child_monopole + right_mass * right_child_monopole;
-            scalar total_mass = left_mass + right_mass;
-            parent_monopole.xyz /= total_mass;
-            // Set total mass
-            parent_monopole.w = total_mass;
-
-            ulong effective_node_idx = binary_tree_key_encode_global_id(&node_key,
-                                                                        effective_num_levels)
-                                     - effective_num_particles;
-            // Set result
-            monopoles[effective_node_idx] = parent_monopole;
-
-            vector_type node_extent;
-            node_extent.xyz = fmax(left_child_monopole.xyz + 0.5f * left_child_node_extent.xyz,
-                                   right_child_monopole.xyz + 0.5f * right_child_node_extent.xyz)
-                            - fmin(left_child_monopole.xyz - 0.5f * left_child_node_extent.xyz,
-                                   right_child_monopole.xyz - 0.5f * right_child_node_extent.xyz);
-
-            //node_extent.w =  3.f/(4.f * M_PI) * cbrt(node_extent.x * node_extent.y * node_extent.z);
-            node_extent.w = fmax(node_extent.x, fmax(node_extent.y, node_extent.z));
-            node_widths[effective_node_idx] = node_extent;
-          }
-        }
+          widths_out[tid] = node_moments[tid].s3;
       }
     )
   )
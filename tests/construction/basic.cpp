@@ -26,8 +26,13 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <random>
+#include <stdexcept>
+#include <string>
 
 
 #include <SpatialCL/tree.hpp>
@@ -110,4 +115,104 @@ int main(int argc, char** argv)
 
   std::cout << "particles=";
   print_vector(sorted_particles, 0, sorted_particles.size());
+
+  // Save the tree and load it again from the snapshot
+  gpu_tree.save_snapshot("basic_tree.snapshot");
+  spatialcl::tree_snapshot_file snapshot_file{"basic_tree.snapshot"};
+  spatialcl::hilbert_bvh_sp3d_tree<3> loaded_tree{ctx, snapshot_file.get_view()};
+
+  std::vector<cl_float4> loaded_min_corners(loaded_tree.get_num_nodes());
+  std::vector<cl_float4> loaded_particles(loaded_tree.get_num_particles());
+  ctx->memcpy_d2h<cl_float4>(loaded_min_corners.data(),
+                             loaded_tree.get_bbox_min_corners(),
+                             loaded_tree.get_num_nodes());
+  ctx->memcpy_d2h<cl_float4>(loaded_particles.data(),
+                             loaded_tree.get_sorted_particles(),
+                             loaded_tree.get_num_particles());
+
+  std::size_t num_snapshot_errors = 0;
+  if(loaded_tree.get_num_nodes() != gpu_tree.get_num_nodes() ||
+     loaded_tree.get_effective_num_levels() != gpu_tree.get_effective_num_levels())
+    ++num_snapshot_errors;
+  for(std::size_t i = 0; i < loaded_min_corners.size() && i < host_min_corners.size(); ++i)
+    for(std::size_t j = 0; j < 3; ++j)
+      if(loaded_min_corners[i].s[j] != host_min_corners[i].s[j])
+        ++num_snapshot_errors;
+  for(std::size_t i = 0; i < loaded_particles.size(); ++i)
+    for(std::size_t j = 0; j < 3; ++j)
+      if(loaded_particles[i].s[j] != sorted_particles[i].s[j])
+        ++num_snapshot_errors;
+
+  // Replacing the snapshot while it is still loaded must leave the
+  // loaded data intact, since the new snapshot is renamed over the old
+  // file instead of overwriting it
+  loaded_tree.save_snapshot("basic_tree.snapshot");
+  {
+    spatialcl::tree_snapshot_file replaced_file{"basic_tree.snapshot"};
+    if(replaced_file.get_view().get_header().num_nodes !=
+       snapshot_file.get_view().get_header().num_nodes)
+      ++num_snapshot_errors;
+  }
+
+  // A snapshot whose layout does not match its number of particles
+  // must be rejected
+  {
+    std::ifstream file{"basic_tree.snapshot", std::ios::binary};
+    std::vector<char> corrupted{std::istreambuf_iterator<char>{file},
+                                std::istreambuf_iterator<char>{}};
+    spatialcl::tree_snapshot_header header;
+    std::memcpy(&header, corrupted.data(), sizeof(header));
+    ++header.num_levels;
+    std::memcpy(corrupted.data(), &header, sizeof(header));
+
+    bool rejected = false;
+    try
+    {
+      spatialcl::tree_snapshot_view view{corrupted.data(), corrupted.size()};
+      spatialcl::hilbert_bvh_sp3d_tree<3> corrupted_tree{ctx, view};
+    }
+    catch(const std::runtime_error&)
+    {
+      rejected = true;
+    }
+    if(!rejected)
+      ++num_snapshot_errors;
+  }
+
+  std::cout << "Snapshot reload completed with "
+            << num_snapshot_errors << " errors." << std::endl;
+
+  // Profile the stages of a tree construction
+  std::size_t num_profile_errors = 0;
+  spatialcl::get_build_profiler(ctx)->enable();
+  spatialcl::hilbert_bvh_sp3d_tree<3> profiled_tree{ctx, particles};
+  const spatialcl::build_profile_report profile = profiled_tree.get_build_profile();
+  spatialcl::get_build_profiler(ctx)->disable();
+
+  profile.print(std::cout);
+
+  bool has_sort_stage = false;
+  bool has_bounding_box_stage = false;
+  std::size_t previous_depth = 0;
+  for(const spatialcl::build_stage_timing& stage : profile.get_stages())
+  {
+    has_sort_stage |= stage.name == "sort";
+    has_bounding_box_stage |= stage.name == "bounding boxes";
+    if(stage.seconds < 0.0)
+      ++num_profile_errors;
+    // Stages can only be nested in the preceding stage
+    if(stage.depth > previous_depth + 1)
+      ++num_profile_errors;
+    previous_depth = stage.depth;
+  }
+  if(!has_sort_stage || !has_bounding_box_stage)
+    ++num_profile_errors;
+
+  // Trees built while the profiler is disabled do not record any stages
+  spatialcl::hilbert_bvh_sp3d_tree<3> unprofiled_tree{ctx, particles};
+  if(!unprofiled_tree.get_build_profile().empty())
+    ++num_profile_errors;
+
+  std::cout << "Build profile completed with "
+            << num_profile_errors << " errors." << std::endl;
 }
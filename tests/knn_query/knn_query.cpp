@@ -28,6 +28,8 @@
 
 #include <iostream>
 #include <vector>
+#include <cmath>
+#include <limits>
 
 #include <boost/preprocessor/stringize.hpp>
 
@@ -65,15 +67,175 @@ template <std::size_t Group_size>
 using grouped_dfs_knn_engine =
   spatialcl::query::grouped_dfs_knn_query_engine<tree_type, K, Group_size>;
 
-template<class Query_engine>
+using relaxed_dfs_sorted_knn_engine =
+  spatialcl::query::relaxed_dfs_sorted_knn_query_engine<tree_type, K>;
+
+// Small sorted list size to test the heap of the sorted knn handler
+using relaxed_dfs_heap_knn_engine =
+  spatialcl::query::relaxed_dfs_query_engine<
+    tree_type,
+    spatialcl::query::sorted_knn_query<
+      type_system, K, spatialcl::query::KNN_OUTPUT_PARTICLES, 4
+    >
+  >;
+
+template <std::size_t Group_size>
+using grouped_dfs_sorted_knn_engine =
+  spatialcl::query::grouped_dfs_sorted_knn_query_engine<
+    tree_type, K, spatialcl::query::KNN_OUTPUT_PARTICLES, Group_size
+  >;
+
+constexpr int all_knn_outputs =
+    spatialcl::query::KNN_OUTPUT_PARTICLES |
+    spatialcl::query::KNN_OUTPUT_DISTANCES |
+    spatialcl::query::KNN_OUTPUT_INDICES;
+
+using relaxed_dfs_sorted_knn_all_outputs_engine =
+  spatialcl::query::relaxed_dfs_sorted_knn_query_engine<tree_type, K, all_knn_outputs>;
+
+using relaxed_dfs_heap_knn_all_outputs_engine =
+  spatialcl::query::relaxed_dfs_query_engine<
+    tree_type,
+    spatialcl::query::sorted_knn_query<type_system, K, all_knn_outputs, 4>
+  >;
+
+template <std::size_t Group_size>
+using grouped_dfs_sorted_knn_all_outputs_engine =
+  spatialcl::query::grouped_dfs_sorted_knn_query_engine<
+    tree_type, K, all_knn_outputs, Group_size
+  >;
+
+using persistent_relaxed_dfs_knn_engine =
+  spatialcl::query::persistent_relaxed_dfs_query_engine<
+    tree_type, spatialcl::query::knn_query<type_system, K>
+  >;
+
+template <std::size_t Group_size>
+using persistent_grouped_dfs_knn_engine =
+  spatialcl::query::persistent_grouped_dfs_query_engine<
+    tree_type, spatialcl::query::knn_query<type_system, K>, Group_size
+  >;
+
+// The grouped engine visits the leaf buckets in batches in child order
+using bucket_tree_type = spatialcl::hilbert_bucket_bvh_tree<type_system, 16>;
+
+using bucket_grouped_dfs_knn_engine =
+  spatialcl::query::grouped_dfs_knn_query_engine<bucket_tree_type, K, 64>;
+
+using wide_tree_type = spatialcl::hilbert_wide_bvh_tree<type_system, 4>;
+
+using wide_dfs_knn_engine =
+  spatialcl::query::wide_dfs_knn_query_engine<wide_tree_type, K>;
+
+// Tests each child of a wide node separately instead of
+// using the group selector of the handler
+using wide_dfs_per_node_knn_engine =
+  spatialcl::query::wide_dfs_query_engine<
+    wide_tree_type,
+    spatialcl::query::engine::per_node_selection<
+      spatialcl::query::knn_query<type_system, K>
+    >
+  >;
+
+using approximate_knn_engine =
+  spatialcl::query::relaxed_dfs_approximate_knn_query_engine<
+    tree_type, K, all_knn_outputs
+  >;
+
+using distributed_knn_query =
+  spatialcl::query::distributed_sorted_knn_query<tree_type, K>;
+
+/// Overwrites all elements of \c data with \c value, such that the
+/// results of a previous query cannot be mistaken for new results
+template<class T>
+void reset_results(const qcl::device_context_ptr& ctx,
+                   qcl::device_array<T>& data,
+                   const T& value)
+{
+  std::vector<T> sentinels(data.size(), value);
+  ctx->memcpy_h2d(data.get_buffer(), sentinels.data(), sentinels.size());
+}
+
+/// A particle that is far away from all particles and queries
+particle_type get_sentinel_particle()
+{
+  particle_type sentinel;
+  for(std::size_t i = 0; i < sizeof(sentinel.s) / sizeof(sentinel.s[0]); ++i)
+    sentinel.s[i] = std::numeric_limits<scalar>::max();
+  return sentinel;
+}
+
+template<class Tree_type>
+std::vector<particle_type> read_sorted_particles(const qcl::device_context_ptr& ctx,
+                                                 const Tree_type& tree)
+{
+  std::vector<particle_type> sorted_particles(tree.get_num_particles());
+  cl_int err = ctx->get_command_queue().enqueueReadBuffer(
+        tree.get_sorted_particles(), CL_TRUE,
+        0, sorted_particles.size() * sizeof(particle_type), sorted_particles.data());
+  qcl::check_cl_error(err, "Could not read sorted particles");
+  return sorted_particles;
+}
+
+/// Checks the consistency of the outputs of sorted KNN queries: The
+/// results of each query must be sorted by distance, and each valid
+/// index must refer to the particle of the tree that has been returned
+/// as result, at the returned distance.
+std::size_t verify_knn_outputs(const std::vector<vector_type>& host_queries,
+                               const std::vector<particle_type>& sorted_particles,
+                               const std::vector<particle_type>& host_results,
+                               const std::vector<scalar>& host_distances2,
+                               const std::vector<cl_ulong>& host_indices)
+{
+  const cl_ulong invalid_index = std::numeric_limits<cl_ulong>::max();
+
+  std::size_t num_errors = 0;
+  for(std::size_t i = 0; i < host_queries.size(); ++i)
+  {
+    for(std::size_t j = 0; j < K; ++j)
+    {
+      const std::size_t result_idx = i * K + j;
+      const cl_ulong particle_idx = host_indices[result_idx];
+
+      if(j > 0 && host_distances2[result_idx] < host_distances2[result_idx - 1])
+        ++num_errors;
+
+      if(particle_idx == invalid_index)
+        continue;
+
+      if(particle_idx >= sorted_particles.size())
+      {
+        ++num_errors;
+        continue;
+      }
+
+      if(!(sorted_particles[particle_idx] == host_results[result_idx]))
+        ++num_errors;
+
+      scalar dist2 = 0.0f;
+      for(std::size_t k = 0; k < dimension; ++k)
+      {
+        scalar delta = sorted_particles[particle_idx].s[k] - host_queries[i].s[k];
+        dist2 += delta * delta;
+      }
+      if(std::abs(dist2 - host_distances2[result_idx]) > 1.e-5f * (1 + dist2))
+        ++num_errors;
+    }
+  }
+  return num_errors;
+}
+
+template<class Query_engine, class Tree_type>
 std::size_t execute_knn_query_test(const qcl::device_context_ptr& ctx,
-                                   const tree_type& tree,
+                                   const Tree_type& tree,
                                    const std::vector<vector_type>& host_queries,
                                    const qcl::device_array<vector_type>& queries,
                                    const std::vector<particle_type>& particles,
                                    qcl::device_array<particle_type>& result)
 {
-  // ToDo: Reset results
+  // All engines share the result buffer, so an engine that does not
+  // write its results must not pass with the results of the previous one
+  reset_results(ctx, result, get_sentinel_particle());
 
   Query_engine query_engine;
   typename Query_engine::handler_type query_handler {
@@ -102,6 +264,192 @@ std::size_t execute_knn_query_test(const qcl::device_context_ptr& ctx,
   return verifier(particles, host_results);
 }
 
+/// Compares the wide engine using the group selector of the KNN query
+/// with the wide engine testing each child separately. Both visit the
+/// same nodes in the same order, so the results must be identical.
+std::size_t execute_group_selection_comparison_test(const qcl::device_context_ptr& ctx,
+                                                    const wide_tree_type& tree,
+                                                    const std::vector<vector_type>& host_queries,
+                                                    const qcl::device_array<vector_type>& queries,
+                                                    const std::vector<particle_type>& particles)
+{
+  qcl::device_array<particle_type> group_result{ctx, K * queries.size()};
+  qcl::device_array<particle_type> per_node_result{ctx, K * queries.size()};
+
+  std::size_t num_errors =
+      execute_knn_query_test<wide_dfs_knn_engine>(ctx, tree, host_queries,
+                                                  queries, particles, group_result);
+  num_errors +=
+      execute_knn_query_test<wide_dfs_per_node_knn_engine>(ctx, tree, host_queries,
+                                                           queries, particles,
+                                                           per_node_result);
+
+  std::vector<particle_type> host_group_result, host_per_node_result;
+  group_result.read(host_group_result);
+  per_node_result.read(host_per_node_result);
+
+  for(std::size_t i = 0; i < host_group_result.size(); ++i)
+    for(std::size_t k = 0; k < particle_dimension; ++k)
+      if(host_group_result[i].s[k] != host_per_node_result[i].s[k])
+        ++num_errors;
+
+  return num_errors;
+}
+
+/// Executes a sorted KNN query that outputs particles, distances and
+/// indices. The particles must be the exact neighbors, the distances
+/// must be the exact distances in ascending order, and the indices must
+/// refer to the returned particles.
+template<class Query_engine>
+std::size_t execute_sorted_knn_query_test(const qcl::device_context_ptr& ctx,
+                                          const tree_type& tree,
+                                          const std::vector<vector_type>& host_queries,
+                                          const qcl::device_array<vector_type>& queries,
+                                          const std::vector<particle_type>& particles)
+{
+  qcl::device_array<particle_type> result{ctx, K * queries.size()};
+  qcl::device_array<scalar> result_distances2{ctx, K * queries.size()};
+  qcl::device_array<cl_ulong> result_indices{ctx, K * queries.size()};
+
+  reset_results(ctx, result, get_sentinel_particle());
+  reset_results(ctx, result_distances2, static_cast<scalar>(-1));
+  reset_results(ctx, result_indices, static_cast<cl_ulong>(tree.get_num_particles()));
+
+  Query_engine query_engine;
+  typename Query_engine::handler_type query_handler {
+    queries.get_buffer(),
+    result.get_buffer(),
+    result_distances2.get_buffer(),
+    result_indices.get_buffer(),
+    queries.size()
+  };
+
+  std::cout << "Executing query..." << std::endl;
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing sorted KNN query");
+
+  std::vector<particle_type> host_results;
+  std::vector<scalar> host_distances2;
+  std::vector<cl_ulong> host_indices;
+  result.read(host_results);
+  result_distances2.read(host_distances2);
+  result_indices.read(host_indices);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_knn_verifier<type_system, K> verifier{
+    host_queries
+  };
+
+  std::size_t num_errors = verifier(particles, host_results);
+  num_errors += verifier.verify_exact_distances(particles, host_distances2);
+  num_errors += verify_knn_outputs(host_queries,
+                                   read_sorted_particles(ctx, tree),
+                                   host_results,
+                                   host_distances2,
+                                   host_indices);
+  return num_errors;
+}
+
+/// Distributes a tree across the given devices and merges the
+/// nearest neighbors found on the devices
+std::size_t execute_distributed_knn_query_test(
+    const std::vector<qcl::device_context_ptr>& devices,
+    const std::vector<vector_type>& host_queries,
+    const std::vector<particle_type>& particles)
+{
+  spatialcl::distributed_tree<tree_type> tree{devices, particles};
+  distributed_knn_query query;
+
+  std::cout << "Executing query on " << tree.get_num_slices()
+            << " slices..." << std::endl;
+
+  std::vector<particle_type> host_results;
+  std::vector<scalar> host_distances2;
+  std::vector<cl_ulong> host_indices;
+  query(tree, host_queries, host_results, host_distances2, host_indices);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_knn_verifier<type_system, K> verifier{
+    host_queries
+  };
+
+  return verifier(particles, host_results);
+}
+
+/// Executes an approximate KNN query with the given error bound and
+/// leaf limit. The results are compared with the exact neighbors
+/// if \c epsilon is 0 without a leaf limit, and the distances are
+/// checked against the error bound if there is no leaf limit.
+/// In any case, the indices and distances must be consistent.
+std::size_t execute_approximate_knn_query_test(const qcl::device_context_ptr& ctx,
+                                               const tree_type& tree,
+                                               const std::vector<vector_type>& host_queries,
+                                               const qcl::device_array<vector_type>& queries,
+                                               const std::vector<particle_type>& particles,
+                                               scalar epsilon,
+                                               std::size_t max_visited_leaves)
+{
+  using handler_type = approximate_knn_engine::handler_type;
+
+  qcl::device_array<particle_type> result{ctx, K * queries.size()};
+  qcl::device_array<scalar> result_distances2{ctx, K * queries.size()};
+  qcl::device_array<cl_ulong> result_indices{ctx, K * queries.size()};
+
+  reset_results(ctx, result, get_sentinel_particle());
+  reset_results(ctx, result_distances2, static_cast<scalar>(-1));
+  reset_results(ctx, result_indices, static_cast<cl_ulong>(tree.get_num_particles()));
+
+  approximate_knn_engine query_engine;
+  handler_type query_handler {
+    queries.get_buffer(),
+    result.get_buffer(),
+    result_distances2.get_buffer(),
+    result_indices.get_buffer(),
+    queries.size(),
+    epsilon,
+    max_visited_leaves
+  };
+
+  std::cout << "Executing query with epsilon = " << epsilon
+            << ", leaf limit = " << max_visited_leaves << "..." << std::endl;
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing approximate KNN query");
+
+  std::vector<particle_type> host_results;
+  std::vector<scalar> host_distances2;
+  std::vector<cl_ulong> host_indices;
+  result.read(host_results);
+  result_distances2.read(host_distances2);
+  result_indices.read(host_indices);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_knn_verifier<type_system, K> verifier{
+    host_queries
+  };
+
+  std::size_t num_errors = 0;
+  if(max_visited_leaves == 0)
+  {
+    if(epsilon == 0)
+      num_errors += verifier(particles, host_results);
+    else
+      num_errors += verifier.verify_distances(particles, host_distances2, epsilon);
+  }
+
+  // Each result must either be empty, or refer to a particle of the tree
+  // at the reported distance. The results are sorted by distance.
+  num_errors += verify_knn_outputs(host_queries,
+                                   read_sorted_particles(ctx, tree),
+                                   host_results,
+                                   host_distances2,
+                                   host_indices);
+  return num_errors;
+}
+
 int main(int argc, char* argv[])
 {
   common::environment env;
@@ -113,6 +461,8 @@ int main(int argc, char* argv[])
   rnd(num_particles, particles);
 
   tree_type gpu_tree{ctx, particles};
+  wide_tree_type gpu_wide_tree{ctx, particles};
+  bucket_tree_type gpu_bucket_tree{ctx, particles};
 
   std::vector<vector_type> query_points;
   rnd(num_queries, query_points);
@@ -122,10 +472,10 @@ int main(int argc, char* argv[])
 
   std::size_t num_errors = 0;
 
-  #define RUN_TEST(test_name) \
+  #define RUN_TEST(test_name, tree) \
   num_errors = \
       execute_knn_query_test<test_name>(ctx,          \
-                                        gpu_tree,     \
+                                        tree,         \
                                         query_points, \
                                         queries,      \
                                         particles,    \
@@ -133,11 +483,65 @@ int main(int argc, char* argv[])
   std::cout << BOOST_PP_STRINGIZE(test_name) <<" completed queries with " \
             << num_errors << " errors." << std::endl
 
-  RUN_TEST(strict_dfs_knn_engine);
-  RUN_TEST(relaxed_dfs_knn_engine);
-  RUN_TEST(grouped_dfs_knn_engine<16>);
-  RUN_TEST(grouped_dfs_knn_engine<32>);
-  RUN_TEST(grouped_dfs_knn_engine<64>);
+  RUN_TEST(strict_dfs_knn_engine, gpu_tree);
+  RUN_TEST(relaxed_dfs_knn_engine, gpu_tree);
+  RUN_TEST(grouped_dfs_knn_engine<16>, gpu_tree);
+  RUN_TEST(grouped_dfs_knn_engine<32>, gpu_tree);
+  RUN_TEST(grouped_dfs_knn_engine<64>, gpu_tree);
+  RUN_TEST(bucket_grouped_dfs_knn_engine, gpu_bucket_tree);
+  RUN_TEST(wide_dfs_knn_engine, gpu_wide_tree);
+  RUN_TEST(relaxed_dfs_sorted_knn_engine, gpu_tree);
+  RUN_TEST(relaxed_dfs_heap_knn_engine, gpu_tree);
+  RUN_TEST(grouped_dfs_sorted_knn_engine<64>, gpu_tree);
+  RUN_TEST(persistent_relaxed_dfs_knn_engine, gpu_tree);
+  RUN_TEST(persistent_grouped_dfs_knn_engine<64>, gpu_tree);
+
+  num_errors = execute_group_selection_comparison_test(ctx, gpu_wide_tree,
+                                                      query_points, queries,
+                                                      particles);
+  std::cout << "wide_dfs_knn_engine group selection comparison completed with "
+            << num_errors << " errors." << std::endl;
+
+  #define RUN_SORTED_TEST(test_name) \
+  num_errors = \
+      execute_sorted_knn_query_test<test_name>(ctx,          \
+                                               gpu_tree,     \
+                                               query_points, \
+                                               queries,      \
+                                               particles);   \
+  std::cout << BOOST_PP_STRINGIZE(test_name) <<" completed queries with " \
+            << num_errors << " errors." << std::endl
+
+  RUN_SORTED_TEST(relaxed_dfs_sorted_knn_all_outputs_engine);
+  RUN_SORTED_TEST(relaxed_dfs_heap_knn_all_outputs_engine);
+  RUN_SORTED_TEST(grouped_dfs_sorted_knn_all_outputs_engine<64>);
+
+  // Without error bound and leaf limit, the results must be exact
+  num_errors = execute_approximate_knn_query_test(ctx, gpu_tree, query_points,
+                                                  queries, particles, 0.0f, 0);
+  std::cout << "approximate_knn_engine (exact) completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_approximate_knn_query_test(ctx, gpu_tree, query_points,
+                                                  queries, particles, 0.5f, 0);
+  std::cout << "approximate_knn_engine (epsilon = 0.5) completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  // A small leaf limit must still terminate with valid results
+  num_errors = execute_approximate_knn_query_test(ctx, gpu_tree, query_points,
+                                                  queries, particles, 0.0f, 2);
+  std::cout << "approximate_knn_engine (leaf limit) completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  // With a single device, two slices on the same device
+  // still exercise both query rounds and the merging
+  std::vector<qcl::device_context_ptr> devices = env.get_device_contexts();
+  if(devices.size() == 1)
+    devices.push_back(ctx);
+
+  num_errors = execute_distributed_knn_query_test(devices, query_points, particles);
+  std::cout << "distributed_knn_query completed queries with "
+            << num_errors << " errors." << std::endl;
 
   return 0;
 }
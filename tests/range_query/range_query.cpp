@@ -27,11 +27,15 @@
  */
 
 #include <iostream>
+#include <memory>
+#include <limits>
+#include <algorithm>
 
 #include <boost/preprocessor/stringize.hpp>
 
 #include <SpatialCL/tree.hpp>
 #include <SpatialCL/query.hpp>
+#include <SpatialCL/file_utils.hpp>
 
 #include <QCL/qcl.hpp>
 #include <QCL/qcl_array.hpp>
@@ -68,29 +72,1063 @@ using grouped_dfs_range_engine =
                                                     max_retrieved_particles,
                                                     Group_size>;
 
+// Tree with leaf buckets of 16 particles
+using bucket_tree_type = spatialcl::hilbert_bucket_bvh_tree<type_system, 16>;
+
+using bucket_strict_dfs_range_engine =
+  spatialcl::query::strict_dfs_range_query_engine<bucket_tree_type,
+                                                  max_retrieved_particles>;
+
+using bucket_relaxed_dfs_range_engine =
+  spatialcl::query::relaxed_dfs_range_query_engine<bucket_tree_type,
+                                                   max_retrieved_particles>;
+
+template<std::size_t Group_size>
+using bucket_grouped_dfs_range_engine =
+  spatialcl::query::grouped_dfs_range_query_engine<bucket_tree_type,
+                                                    max_retrieved_particles,
+                                                    Group_size>;
+
+// Wide trees with 4 and 8 children per node
+template<std::size_t Branching_factor>
+using wide_tree_type = spatialcl::hilbert_wide_bvh_tree<type_system, Branching_factor>;
+
+template<std::size_t Branching_factor>
+using wide_dfs_range_engine =
+  spatialcl::query::wide_dfs_range_query_engine<wide_tree_type<Branching_factor>,
+                                                max_retrieved_particles>;
+
+// Tests each child of a wide node separately instead of
+// using the group selector of the handler
+template<std::size_t Branching_factor>
+using wide_dfs_per_node_range_engine =
+  spatialcl::query::wide_dfs_query_engine<
+    wide_tree_type<Branching_factor>,
+    spatialcl::query::engine::per_node_selection<
+      spatialcl::query::box_range_query<type_system, max_retrieved_particles>
+    >
+  >;
+
+// Tree with 16 bit quantized bounding boxes
+using quantized_tree_type = spatialcl::hilbert_quantized_bvh_tree<type_system>;
+
+using quantized_strict_dfs_range_engine =
+  spatialcl::query::strict_dfs_range_query_engine<quantized_tree_type,
+                                                  max_retrieved_particles>;
+
+using quantized_grouped_dfs_range_engine =
+  spatialcl::query::grouped_dfs_range_query_engine<quantized_tree_type,
+                                                    max_retrieved_particles,
+                                                    64>;
+
+// Tree with separately stored particle positions
+using soa_tree_type = spatialcl::hilbert_soa_bvh_tree<type_system>;
+
+using soa_relaxed_dfs_range_engine =
+  spatialcl::query::relaxed_dfs_range_query_engine<soa_tree_type,
+                                                   max_retrieved_particles>;
+
+using soa_grouped_dfs_range_engine =
+  spatialcl::query::grouped_dfs_range_query_engine<soa_tree_type,
+                                                    max_retrieved_particles,
+                                                    64>;
+
+// Range queries without limit on the number of results
+using relaxed_dfs_csr_range =
+  spatialcl::query::relaxed_dfs_csr_range_query<tree_type,
+                                                spatialcl::query::RANGE_OUTPUT_PARTICLES>;
+
+using grouped_dfs_csr_range =
+  spatialcl::query::grouped_dfs_csr_range_query<tree_type,
+                                                spatialcl::query::RANGE_OUTPUT_PARTICLES>;
+
+// Grouped range query processing the queries along the Hilbert curve
+using reordered_grouped_dfs_range_engine =
+  spatialcl::query::grouped_dfs_query_engine<
+    tree_type,
+    spatialcl::query::reordered_query<
+      spatialcl::query::box_range_query<type_system, max_retrieved_particles>
+    >,
+    64
+  >;
+
+// Engines with traversal counters
+using instrumented_relaxed_dfs_range_engine =
+  spatialcl::query::instrumented_relaxed_dfs_query_engine<
+    tree_type,
+    spatialcl::query::box_range_query<type_system, max_retrieved_particles>
+  >;
+
+using instrumented_grouped_dfs_range_engine =
+  spatialcl::query::instrumented_grouped_dfs_query_engine<
+    tree_type,
+    spatialcl::query::box_range_query<type_system, max_retrieved_particles>,
+    64
+  >;
+
+// Grouped engines with subgroups as wide as the native sub-groups of
+// common hardware (Intel: 16, NVIDIA: 32, AMD: 64), once with native
+// sub-group operations and once with the local memory implementation
+template<std::size_t Subgroup_size,
+         std::size_t Group_coherence_size,
+         spatialcl::query::engine::dfs_subgroup_operations Subgroup_operations>
+using subgroup_grouped_dfs_range_engine =
+  spatialcl::query::engine::grouped_depth_first<
+    tree_type,
+    spatialcl::query::box_range_query<type_system, max_retrieved_particles>,
+    64, Subgroup_size, 16, 16, Group_coherence_size, 4,
+    spatialcl::query::engine::DFS_SCHEDULING_STATIC,
+    spatialcl::query::engine::DFS_INSTRUMENTATION_DISABLED,
+    Subgroup_operations
+  >;
+
+// A small parameter space keeps the number of compiled kernels low.
+// The last set is invalid (subgroups larger than the group) and must be skipped.
+using tuning_parameter_space =
+  spatialcl::query::engine::grouped_dfs_parameter_space<
+    spatialcl::query::engine::grouped_dfs_parameters<64, 8, 8, 8, 32>,
+    spatialcl::query::engine::grouped_dfs_parameters<32, 16, 8, 16, 32>,
+    spatialcl::query::engine::grouped_dfs_parameters<128, 16, 16, 16, 32>,
+    spatialcl::query::engine::grouped_dfs_parameters<32, 64, 8, 8, 32>
+  >;
+
+using tuned_grouped_dfs_range_engine =
+  spatialcl::query::tuned_grouped_dfs_range_query_engine<tree_type,
+                                                         max_retrieved_particles,
+                                                         tuning_parameter_space>;
+
+// Counting queries
+using relaxed_dfs_count_engine =
+  spatialcl::query::relaxed_dfs_query_engine<tree_type,
+                                             spatialcl::query::box_count_query<type_system>>;
+
+using grouped_dfs_count_engine =
+  spatialcl::query::grouped_dfs_query_engine<bucket_tree_type,
+                                             spatialcl::query::box_count_query<type_system>,
+                                             64>;
+
+using wide_dfs_count_engine =
+  spatialcl::query::wide_dfs_query_engine<wide_tree_type<4>,
+                                          spatialcl::query::box_count_query<type_system>>;
+
+// Sphere queries
+using relaxed_dfs_sphere_range_engine =
+  spatialcl::query::relaxed_dfs_sphere_range_query_engine<tree_type,
+                                                          max_retrieved_particles>;
+
+template<std::size_t Group_size>
+using grouped_dfs_sphere_range_engine =
+  spatialcl::query::grouped_dfs_sphere_range_query_engine<tree_type,
+                                                          max_retrieved_particles,
+                                                          Group_size>;
+
+using relaxed_dfs_sphere_count_engine =
+  spatialcl::query::relaxed_dfs_query_engine<tree_type,
+                                             spatialcl::query::sphere_count_query<type_system>>;
+
+// Reductions of the last particle component
+constexpr std::size_t reduced_component = particle_dimension - 1;
+
+// Trees storing the node aggregates of the reduced component
+using aggregate_tree_type =
+  spatialcl::hilbert_aggregate_bvh_tree<type_system, reduced_component>;
+using aggregate_bucket_tree_type =
+  spatialcl::hilbert_aggregate_bvh_tree<type_system, reduced_component, 16>;
+
+template<spatialcl::query::reduction_operation Operation>
+using reduction_handler =
+  spatialcl::query::box_reduction_query<type_system, reduced_component, Operation>;
+
+template<spatialcl::query::reduction_operation Operation>
+using relaxed_dfs_reduction_engine =
+  spatialcl::query::relaxed_dfs_query_engine<aggregate_tree_type,
+                                             reduction_handler<Operation>>;
+
+template<spatialcl::query::reduction_operation Operation>
+using grouped_dfs_reduction_engine =
+  spatialcl::query::grouped_dfs_query_engine<aggregate_bucket_tree_type,
+                                             reduction_handler<Operation>,
+                                             64>;
+
+using instrumented_relaxed_dfs_reduction_engine =
+  spatialcl::query::instrumented_relaxed_dfs_query_engine<
+    aggregate_tree_type,
+    reduction_handler<spatialcl::query::REDUCTION_SUM>
+  >;
+
+using grouped_dfs_neighbor_list =
+  spatialcl::query::grouped_dfs_neighbor_list<tree_type, 64>;
+
+using distributed_range_query =
+  spatialcl::query::distributed_range_query<tree_type, max_retrieved_particles>;
+
+// Forest of small trees, built and queried in one launch each
+using forest_type = spatialcl::hilbert_bvh_forest<type_system>;
+
+using forest_range_engine =
+  spatialcl::query::relaxed_dfs_forest_range_query_engine<forest_type,
+                                                          max_retrieved_particles>;
+
+constexpr std::size_t num_forest_trees = 37;
+
+// Range queries on a host copy of the tree, and dispatching
+// between the host and the device by batch size
+using host_range_engine = spatialcl::query::engine::host_depth_first<tree_type>;
+using host_range_handler =
+  spatialcl::query::host_box_range_query<type_system, max_retrieved_particles>;
+
+using range_query_dispatcher =
+  spatialcl::query::box_range_query_dispatcher<tree_type, max_retrieved_particles>;
+
+constexpr std::size_t num_host_queries = 64;
+
+// Double precision tree with single precision node tests. The particles
+// are shifted far away from the origin, where single precision coordinates
+// alone could not resolve the query ranges.
+using dp_type_system = spatialcl::type_descriptor::double_precision3d<particle_dimension>;
+using mixed_precision_tree_type = spatialcl::hilbert_mixed_precision_bvh_tree<dp_type_system>;
+
+using mixed_precision_range_engine =
+  spatialcl::query::relaxed_dfs_mixed_precision_range_query_engine<mixed_precision_tree_type,
+                                                                   max_retrieved_particles>;
+
+using grouped_mixed_precision_range_engine =
+  spatialcl::query::grouped_dfs_mixed_precision_range_query_engine<mixed_precision_tree_type,
+                                                                   max_retrieved_particles>;
+
+constexpr double mixed_precision_coordinate_shift = 4.0e6;
+
+// Double precision reductions
+using dp_aggregate_tree_type =
+  spatialcl::hilbert_aggregate_bvh_tree<dp_type_system, reduced_component>;
+
+template<spatialcl::query::reduction_operation Operation>
+using dp_relaxed_dfs_reduction_engine =
+  spatialcl::query::relaxed_dfs_query_engine<
+    dp_aggregate_tree_type,
+    spatialcl::query::box_reduction_query<dp_type_system, reduced_component, Operation>
+  >;
 
 using particle_type = spatialcl::configuration<type_system>::particle_type;
 using vector_type = spatialcl::configuration<type_system>::vector_type;
 constexpr std::size_t dimension = type_system::dimension;
 
+template<class Query_engine, class Tree_type>
+std::size_t execute_range_query_test(const qcl::device_context_ptr& ctx,
+                                     const Tree_type& tree,
+                                     const std::vector<vector_type>& host_queries_min,
+                                     const std::vector<vector_type>& host_queries_max,
+                                     const qcl::device_array<vector_type>& queries_min,
+                                     const qcl::device_array<vector_type>& queries_max,
+                                     const std::vector<particle_type>& particles,
+                                     qcl::device_array<particle_type>& result,
+                                     qcl::device_array<cl_uint>& num_results)
+{
+  Query_engine query_engine;
+
+  typename Query_engine::handler_type query_handler {
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    result.get_buffer(),
+    num_results.get_buffer(),
+    queries_min.size()
+  };
+
+  std::cout << "Executing query..." << std::endl;
+
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing range query");
+
+  // Retrieve results
+  std::vector<particle_type> host_results;
+  std::vector<cl_uint> host_num_results;
+  result.read(host_results);
+  num_results.read(host_num_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  // Verify results
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries_min,
+    host_queries_max,
+    max_retrieved_particles
+  };
+
+  return verifier(particles, host_results, host_num_results);
+}
+
+template<class Csr_query, class Tree_type>
+std::size_t execute_csr_range_query_test(const qcl::device_context_ptr& ctx,
+                                         const Tree_type& tree,
+                                         const std::vector<vector_type>& host_queries_min,
+                                         const std::vector<vector_type>& host_queries_max,
+                                         const qcl::device_array<vector_type>& queries_min,
+                                         const qcl::device_array<vector_type>& queries_max,
+                                         const std::vector<particle_type>& particles)
+{
+  Csr_query query;
+
+  std::cout << "Executing query..." << std::endl;
+
+  query(tree, queries_min.get_buffer(), queries_max.get_buffer(), queries_min.size());
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing range query");
+
+  // Retrieve results
+  std::vector<particle_type> host_results(query.get_num_results());
+  std::vector<cl_ulong> host_offsets(query.get_num_queries() + 1);
+  err = ctx->get_command_queue().enqueueReadBuffer(
+        query.get_offsets().get_buffer(), CL_TRUE,
+        0, host_offsets.size() * sizeof(cl_ulong), host_offsets.data());
+  qcl::check_cl_error(err, "Could not read range query offsets");
+
+  if(!host_results.empty())
+  {
+    err = ctx->get_command_queue().enqueueReadBuffer(
+          query.get_results().get_buffer(), CL_TRUE,
+          0, host_results.size() * sizeof(particle_type), host_results.data());
+    qcl::check_cl_error(err, "Could not read range query results");
+  }
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries_min,
+    host_queries_max,
+    max_retrieved_particles
+  };
+
+  return verifier.verify_csr(particles, host_results, host_offsets);
+}
+
+template<class Query_engine, class Tree_type>
+std::size_t execute_reordered_range_query_test(const qcl::device_context_ptr& ctx,
+                                               const Tree_type& tree,
+                                               const std::vector<vector_type>& host_queries_min,
+                                               const std::vector<vector_type>& host_queries_max,
+                                               const qcl::device_array<vector_type>& queries_min,
+                                               const qcl::device_array<vector_type>& queries_max,
+                                               const std::vector<particle_type>& particles,
+                                               qcl::device_array<particle_type>& result,
+                                               qcl::device_array<cl_uint>& num_results)
+{
+  spatialcl::query::sfc_query_order<type_system> query_order;
+  query_order(ctx, queries_min.get_buffer(), queries_min.size());
+
+  Query_engine query_engine;
+
+  typename Query_engine::handler_type query_handler {
+    query_order.get_permutation(),
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    result.get_buffer(),
+    num_results.get_buffer(),
+    queries_min.size()
+  };
+
+  std::cout << "Executing query..." << std::endl;
+
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing range query");
+
+  std::vector<particle_type> host_results;
+  std::vector<cl_uint> host_num_results;
+  result.read(host_results);
+  num_results.read(host_num_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries_min,
+    host_queries_max,
+    max_retrieved_particles
+  };
+
+  return verifier(particles, host_results, host_num_results);
+}
+
+template<class Query_engine, class Tree_type>
+std::size_t execute_count_query_test(const qcl::device_context_ptr& ctx,
+                                     const Tree_type& tree,
+                                     const std::vector<vector_type>& host_queries_min,
+                                     const std::vector<vector_type>& host_queries_max,
+                                     const qcl::device_array<vector_type>& queries_min,
+                                     const qcl::device_array<vector_type>& queries_max,
+                                     const std::vector<particle_type>& particles,
+                                     qcl::device_array<cl_uint>& counts)
+{
+  Query_engine query_engine;
+
+  typename Query_engine::handler_type query_handler {
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    counts.get_buffer(),
+    queries_min.size()
+  };
+
+  std::cout << "Executing query..." << std::endl;
+
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing count query");
+
+  std::vector<cl_uint> host_counts;
+  counts.read(host_counts);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries_min,
+    host_queries_max,
+    max_retrieved_particles
+  };
+
+  return verifier.verify_counts(particles, host_counts);
+}
+
+template<class Query_engine, class Tree_type>
+std::size_t execute_sphere_range_query_test(const qcl::device_context_ptr& ctx,
+                                            const Tree_type& tree,
+                                            const std::vector<vector_type>& host_query_centers,
+                                            const std::vector<scalar>& host_query_radii,
+                                            const qcl::device_array<vector_type>& query_centers,
+                                            const qcl::device_array<scalar>& query_radii,
+                                            const std::vector<particle_type>& particles,
+                                            qcl::device_array<particle_type>& result,
+                                            qcl::device_array<cl_uint>& num_results)
+{
+  Query_engine query_engine;
+
+  typename Query_engine::handler_type query_handler {
+    query_centers.get_buffer(),
+    query_radii.get_buffer(),
+    result.get_buffer(),
+    num_results.get_buffer(),
+    query_centers.size()
+  };
+
+  std::cout << "Executing query..." << std::endl;
+
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing sphere range query");
+
+  std::vector<particle_type> host_results;
+  std::vector<cl_uint> host_num_results;
+  result.read(host_results);
+  num_results.read(host_num_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_sphere_verifier<type_system> verifier{
+    host_query_centers,
+    host_query_radii,
+    max_retrieved_particles
+  };
+
+  return verifier(particles, host_results, host_num_results);
+}
+
+template<class Query_engine, class Tree_type>
+std::size_t execute_sphere_count_query_test(const qcl::device_context_ptr& ctx,
+                                            const Tree_type& tree,
+                                            const std::vector<vector_type>& host_query_centers,
+                                            const std::vector<scalar>& host_query_radii,
+                                            const qcl::device_array<vector_type>& query_centers,
+                                            const qcl::device_array<scalar>& query_radii,
+                                            const std::vector<particle_type>& particles,
+                                            qcl::device_array<cl_uint>& counts)
+{
+  Query_engine query_engine;
+
+  typename Query_engine::handler_type query_handler {
+    query_centers.get_buffer(),
+    query_radii.get_buffer(),
+    counts.get_buffer(),
+    query_centers.size()
+  };
+
+  std::cout << "Executing query..." << std::endl;
+
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing sphere count query");
+
+  std::vector<cl_uint> host_counts;
+  counts.read(host_counts);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_sphere_verifier<type_system> verifier{
+    host_query_centers,
+    host_query_radii,
+    max_retrieved_particles
+  };
+
+  return verifier.verify_counts(particles, host_counts);
+}
+
+/// Reduces the component \c reduced_component of the particles in each
+/// query box with the given engine and compares the results with a naive
+/// reduction
+template<class Query_engine, class Tree_type, class Binary_operation>
+std::size_t execute_reduction_query_test(const qcl::device_context_ptr& ctx,
+                                         Query_engine& query_engine,
+                                         const Tree_type& tree,
+                                         const std::vector<vector_type>& host_queries_min,
+                                         const std::vector<vector_type>& host_queries_max,
+                                         const qcl::device_array<vector_type>& queries_min,
+                                         const qcl::device_array<vector_type>& queries_max,
+                                         const std::vector<particle_type>& particles,
+                                         scalar identity,
+                                         Binary_operation reduce,
+                                         scalar tolerance)
+{
+  using handler_type = typename Query_engine::handler_type;
+
+  qcl::device_array<scalar> results{ctx, queries_min.size()};
+
+  handler_type query_handler {
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    handler_type::get_node_aggregates(tree),
+    results.get_buffer(),
+    queries_min.size()
+  };
+
+  std::cout << "Executing query..." << std::endl;
+
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing reduction query");
+
+  std::vector<scalar> host_results;
+  results.read(host_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries_min,
+    host_queries_max,
+    max_retrieved_particles
+  };
+
+  return verifier.verify_reductions(particles,
+                                    host_results,
+                                    reduced_component,
+                                    identity,
+                                    reduce,
+                                    tolerance);
+}
+
+template<class Query_engine, class Tree_type, class Binary_operation>
+std::size_t execute_reduction_query_test(const qcl::device_context_ptr& ctx,
+                                         const Tree_type& tree,
+                                         const std::vector<vector_type>& host_queries_min,
+                                         const std::vector<vector_type>& host_queries_max,
+                                         const qcl::device_array<vector_type>& queries_min,
+                                         const qcl::device_array<vector_type>& queries_max,
+                                         const std::vector<particle_type>& particles,
+                                         scalar identity,
+                                         Binary_operation reduce,
+                                         scalar tolerance)
+{
+  Query_engine query_engine;
+  return execute_reduction_query_test(ctx, query_engine, tree,
+                                      host_queries_min, host_queries_max,
+                                      queries_min, queries_max,
+                                      particles, identity, reduce, tolerance);
+}
+
+/// Sums the reduced component in large boxes that contain entire subtrees.
+/// Besides the results, this checks that the contained subtrees are
+/// reduced from their aggregates, i.e. that fewer particles are tested
+/// than there are particles inside the boxes.
+std::size_t execute_reduction_pruning_test(const qcl::device_context_ptr& ctx,
+                                           const aggregate_tree_type& tree,
+                                           const std::vector<vector_type>& query_points,
+                                           const std::vector<particle_type>& particles,
+                                           scalar diameter)
+{
+  std::vector<vector_type> host_queries_min = query_points;
+  std::vector<vector_type> host_queries_max = query_points;
+  for(std::size_t i = 0; i < query_points.size(); ++i)
+    for(std::size_t j = 0; j < dimension; ++j)
+    {
+      host_queries_min[i].s[j] -= diameter / 2;
+      host_queries_max[i].s[j] += diameter / 2;
+    }
+
+  qcl::device_array<vector_type> queries_min{ctx, host_queries_min};
+  qcl::device_array<vector_type> queries_max{ctx, host_queries_max};
+
+  instrumented_relaxed_dfs_reduction_engine query_engine;
+  std::size_t num_errors =
+      execute_reduction_query_test(ctx, query_engine, tree,
+                                   host_queries_min, host_queries_max,
+                                   queries_min, queries_max,
+                                   particles,
+                                   0.0f,
+                                   [](scalar a, scalar b){ return a + b; },
+                                   1.e-4f);
+
+  std::size_t num_contained_particles = 0;
+  for(std::size_t i = 0; i < query_points.size(); ++i)
+    for(const particle_type& p : particles)
+    {
+      bool is_contained = true;
+      for(std::size_t j = 0; j < dimension; ++j)
+        if(p.s[j] < host_queries_min[i].s[j] || p.s[j] > host_queries_max[i].s[j])
+          is_contained = false;
+      if(is_contained)
+        ++num_contained_particles;
+    }
+
+  const spatialcl::query::engine::dfs_traversal_totals totals =
+      query_engine.get_instrumentation().get_total_counters();
+
+  std::cout << "  particles inside the boxes: " << num_contained_particles
+            << ", particles tested: " << totals.particles_tested << std::endl;
+
+  if(totals.particles_tested >= num_contained_particles)
+    ++num_errors;
+
+  return num_errors;
+}
+
+/// Distributes a tree across the given devices and executes the
+/// queries on all devices whose slices they overlap
+std::size_t execute_distributed_range_query_test(
+    const std::vector<qcl::device_context_ptr>& devices,
+    const std::vector<vector_type>& host_queries_min,
+    const std::vector<vector_type>& host_queries_max,
+    const std::vector<particle_type>& particles)
+{
+  spatialcl::distributed_tree<tree_type> tree{devices, particles};
+  distributed_range_query query;
+
+  std::cout << "Executing query on " << tree.get_num_slices()
+            << " slices..." << std::endl;
+
+  std::vector<particle_type> host_results;
+  std::vector<cl_uint> host_num_results;
+  query(tree, host_queries_min, host_queries_max, host_results, host_num_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries_min,
+    host_queries_max,
+    max_retrieved_particles
+  };
+
+  return verifier(particles, host_results, host_num_results);
+}
+
+/// Builds an out-of-core tree with small subtrees, of which only a few
+/// are resident at once, and pages the subtrees in during the queries
+std::size_t execute_out_of_core_range_query_test(
+    const qcl::device_context_ptr& ctx,
+    const std::vector<vector_type>& host_queries_min,
+    const std::vector<vector_type>& host_queries_max,
+    const std::vector<particle_type>& particles)
+{
+  const std::string snapshot_directory =
+      spatialcl::utils::file::create_temporary_directory("spatialcl_out_of_core");
+
+  std::size_t num_errors = 0;
+  {
+    spatialcl::out_of_core_tree<tree_type> tree{ctx,
+                                                particles.data(),
+                                                particles.size(),
+                                                snapshot_directory,
+                                                num_particles / 8,
+                                                3};
+    // A second tree in the same directory must not overwrite the
+    // snapshots of the first tree, which are paged in by the query
+    std::vector<particle_type> other_particles(particles.begin(),
+                                               particles.begin() + particles.size() / 2);
+    spatialcl::out_of_core_tree<tree_type> other_tree{ctx,
+                                                      other_particles.data(),
+                                                      other_particles.size(),
+                                                      snapshot_directory,
+                                                      num_particles / 8,
+                                                      3};
+    distributed_range_query query;
+
+    std::cout << "Executing query on " << tree.get_num_slices()
+              << " subtrees..." << std::endl;
+
+    std::vector<particle_type> host_results;
+    std::vector<cl_uint> host_num_results;
+    query(tree, host_queries_min, host_queries_max, host_results, host_num_results);
+
+    std::cout << "Verifying results, please wait..." << std::endl;
+    common::verification::naive_cpu_range_verifier<type_system> verifier{
+      host_queries_min,
+      host_queries_max,
+      max_retrieved_particles
+    };
+
+    num_errors += verifier(particles, host_results, host_num_results);
+  }
+
+  // The trees must remove their snapshots
+  if(!spatialcl::utils::file::list_directory(snapshot_directory).empty())
+    ++num_errors;
+  spatialcl::utils::file::remove_directory(snapshot_directory);
+
+  return num_errors;
+}
+
+/// Splits the particles into trees of different sizes (including an
+/// empty tree), builds them as a forest and assigns the queries
+/// round-robin to the trees. The results of each tree are verified
+/// against the particles of this tree.
+std::size_t execute_forest_range_query_test(
+    const qcl::device_context_ptr& ctx,
+    const std::vector<vector_type>& host_queries_min,
+    const std::vector<vector_type>& host_queries_max,
+    const std::vector<particle_type>& particles)
+{
+  std::vector<cl_ulong> tree_offsets(num_forest_trees + 1, 0);
+  for(std::size_t tree = 1; tree < num_forest_trees; ++tree)
+    // Quadratically growing offsets yield trees of different sizes
+    tree_offsets[tree] = particles.size() * tree * tree /
+                         (num_forest_trees * num_forest_trees);
+  tree_offsets[2] = tree_offsets[1];
+  tree_offsets[num_forest_trees] = particles.size();
+
+  forest_type forest{ctx, particles, tree_offsets};
+
+  std::vector<cl_uint> host_query_tree_ids(host_queries_min.size());
+  for(std::size_t i = 0; i < host_query_tree_ids.size(); ++i)
+    host_query_tree_ids[i] = static_cast<cl_uint>(i % num_forest_trees);
+
+  qcl::device_array<cl_uint> query_tree_ids{ctx, host_query_tree_ids};
+  qcl::device_array<vector_type> queries_min{ctx, host_queries_min};
+  qcl::device_array<vector_type> queries_max{ctx, host_queries_max};
+  qcl::device_array<particle_type> result{ctx,
+                                          host_queries_min.size() * max_retrieved_particles};
+  qcl::device_array<cl_uint> num_results{ctx, host_queries_min.size()};
+
+  forest_range_engine query_engine;
+  forest_range_engine::handler_type query_handler {
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    result.get_buffer(),
+    num_results.get_buffer(),
+    queries_min.size()
+  };
+
+  std::cout << "Executing query on " << forest.get_num_trees()
+            << " trees..." << std::endl;
+
+  query_engine(forest, query_tree_ids.get_buffer(), query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing forest range query");
+
+  std::vector<particle_type> host_results;
+  std::vector<cl_uint> host_num_results;
+  result.read(host_results);
+  num_results.read(host_num_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  std::size_t num_errors = 0;
+  for(std::size_t tree = 0; tree < num_forest_trees; ++tree)
+  {
+    std::vector<particle_type> tree_particles{
+      particles.begin() + tree_offsets[tree],
+      particles.begin() + tree_offsets[tree + 1]
+    };
+
+    std::vector<vector_type> tree_queries_min;
+    std::vector<vector_type> tree_queries_max;
+    std::vector<particle_type> tree_results;
+    std::vector<cl_uint> tree_num_results;
+    for(std::size_t i = tree; i < host_queries_min.size(); i += num_forest_trees)
+    {
+      tree_queries_min.push_back(host_queries_min[i]);
+      tree_queries_max.push_back(host_queries_max[i]);
+      tree_results.insert(tree_results.end(),
+                          host_results.begin() + i * max_retrieved_particles,
+                          host_results.begin() + (i + 1) * max_retrieved_particles);
+      tree_num_results.push_back(host_num_results[i]);
+    }
+
+    common::verification::naive_cpu_range_verifier<type_system> verifier{
+      tree_queries_min,
+      tree_queries_max,
+      max_retrieved_particles
+    };
+    num_errors += verifier(tree_particles, tree_results, tree_num_results);
+  }
+  return num_errors;
+}
+
+/// Executes the queries with an instrumented engine and checks the
+/// results as well as the consistency of the counters
+template<class Query_engine>
+std::size_t execute_instrumented_range_query_test(const qcl::device_context_ptr& ctx,
+                                                  const tree_type& tree,
+                                                  const std::vector<vector_type>& host_queries_min,
+                                                  const std::vector<vector_type>& host_queries_max,
+                                                  const qcl::device_array<vector_type>& queries_min,
+                                                  const qcl::device_array<vector_type>& queries_max,
+                                                  const std::vector<particle_type>& particles,
+                                                  qcl::device_array<particle_type>& result,
+                                                  qcl::device_array<cl_uint>& num_results)
+{
+  Query_engine query_engine;
+
+  typename Query_engine::handler_type query_handler {
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    result.get_buffer(),
+    num_results.get_buffer(),
+    queries_min.size()
+  };
+
+  std::cout << "Executing query..." << std::endl;
+
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing instrumented range query");
+
+  std::vector<particle_type> host_results;
+  std::vector<cl_uint> host_num_results;
+  result.read(host_results);
+  num_results.read(host_num_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries_min,
+    host_queries_max,
+    max_retrieved_particles
+  };
+  std::size_t num_errors = verifier(particles, host_results, host_num_results);
+
+  const auto& instrumentation = query_engine.get_instrumentation();
+  const spatialcl::query::engine::dfs_traversal_totals totals =
+      instrumentation.get_total_counters();
+
+  // The grouped engine sums the counters of the queries of a subgroup,
+  // so only the means per query are comparable between the engines
+  const double num_counted_queries =
+      static_cast<double>(std::max<std::size_t>(instrumentation.get_num_queries(), 1));
+  std::cout << "  per query: nodes visited: " << totals.nodes_visited / num_counted_queries
+            << ", nodes selected: " << totals.nodes_selected / num_counted_queries
+            << ", particles tested: " << totals.particles_tested / num_counted_queries
+            << ", divergent steps: " << totals.divergent_steps / num_counted_queries
+            << std::endl;
+
+  // Each query visits at least the root, and only selected
+  // nodes lead to tested particles
+  if(instrumentation.get_num_queries() != host_queries_min.size() ||
+     totals.nodes_visited < host_queries_min.size() ||
+     totals.nodes_selected > totals.nodes_visited ||
+     (totals.nodes_selected == 0 && totals.particles_tested > 0))
+    ++num_errors;
+
+  // Each entry counts the root once for each of its queries
+  std::vector<spatialcl::query::engine::dfs_traversal_counters> entries;
+  instrumentation.read_counters(entries);
+  const std::size_t queries_per_entry = instrumentation.get_queries_per_entry();
+  for(std::size_t i = 0; i < entries.size(); ++i)
+  {
+    const std::size_t num_entry_queries =
+        std::min(queries_per_entry, host_queries_min.size() - i * queries_per_entry);
+    if(entries[i].nodes_visited < num_entry_queries)
+      ++num_errors;
+  }
+
+  return num_errors;
+}
+
+/// Queries the position of the first particle of the tree with the
+/// instrumented grouped engine. Since the leaf buckets of the tree are
+/// smaller than a particle batch, the first batch must extend beyond the
+/// selected leaf bucket and fill the entire batch.
+std::size_t execute_particle_batch_size_test(const qcl::device_context_ptr& ctx,
+                                             const tree_type& tree,
+                                             const std::vector<particle_type>& particles)
+{
+  // The particle_batch_load_size of instrumented_grouped_dfs_query_engine
+  constexpr std::size_t particle_batch_load_size = 8;
+  static_assert(tree_type::leaf_bucket_size < particle_batch_load_size,
+                "The leaf buckets must be smaller than a particle batch");
+
+  particle_type first_particle;
+  ctx->memcpy_d2h<particle_type>(&first_particle, tree.get_sorted_particles(), 1);
+
+  vector_type query_point{};
+  for(std::size_t i = 0; i < dimension; ++i)
+    query_point.s[i] = first_particle.s[i];
+
+  const std::vector<vector_type> host_queries{query_point};
+  qcl::device_array<vector_type> queries_min{ctx, host_queries};
+  qcl::device_array<vector_type> queries_max{ctx, host_queries};
+  qcl::device_array<particle_type> result{ctx, max_retrieved_particles};
+  qcl::device_array<cl_uint> num_results{ctx, 1};
+
+  instrumented_grouped_dfs_range_engine query_engine;
+  instrumented_grouped_dfs_range_engine::handler_type query_handler {
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    result.get_buffer(),
+    num_results.get_buffer(),
+    1
+  };
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing instrumented range query");
+
+  std::vector<particle_type> host_results;
+  std::vector<cl_uint> host_num_results;
+  result.read(host_results);
+  num_results.read(host_num_results);
+
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries,
+    host_queries,
+    max_retrieved_particles
+  };
+  std::size_t num_errors = verifier(particles, host_results, host_num_results);
+
+  const spatialcl::query::engine::dfs_traversal_totals totals =
+      query_engine.get_instrumentation().get_total_counters();
+
+  std::cout << "  particles tested by the query of the first particle: "
+            << totals.particles_tested << std::endl;
+
+  if(totals.particles_tested < std::min(particle_batch_load_size,
+                                        tree.get_num_particles()))
+    ++num_errors;
+
+  return num_errors;
+}
+
+/// Shifts the particles and queries and converts them to double precision,
+/// then executes the queries on a mixed precision tree
 template<class Query_engine>
-std::size_t execute_range_query_test(const qcl::device_context_ptr& ctx,
-                                     const tree_type& tree,
-                                     const std::vector<vector_type>& host_queries_min,
-                                     const std::vector<vector_type>& host_queries_max,
-                                     const qcl::device_array<vector_type>& queries_min,
-                                     const qcl::device_array<vector_type>& queries_max,
-                                     const std::vector<particle_type>& particles,
-                                     qcl::device_array<particle_type>& result,
-                                     qcl::device_array<cl_uint>& num_results)
+std::size_t execute_mixed_precision_range_query_test(
+    const qcl::device_context_ptr& ctx,
+    const std::vector<vector_type>& host_queries_min,
+    const std::vector<vector_type>& host_queries_max,
+    const std::vector<particle_type>& particles)
 {
-  Query_engine query_engine;
+  using dp_particle_type = spatialcl::configuration<dp_type_system>::particle_type;
+  using dp_vector_type = spatialcl::configuration<dp_type_system>::vector_type;
 
+  auto shift_vector = [](const vector_type& v){
+    dp_vector_type result;
+    for(std::size_t i = 0; i < 4; ++i)
+      result.s[i] = static_cast<double>(v.s[i]);
+    for(std::size_t i = 0; i < dimension; ++i)
+      result.s[i] += mixed_precision_coordinate_shift;
+    return result;
+  };
+
+  std::vector<dp_particle_type> dp_particles(particles.size());
+  for(std::size_t i = 0; i < particles.size(); ++i)
+    for(std::size_t j = 0; j < particle_dimension; ++j)
+      dp_particles[i].s[j] = static_cast<double>(particles[i].s[j]) +
+                             (j < dimension ? mixed_precision_coordinate_shift : 0.0);
+
+  std::vector<dp_vector_type> dp_queries_min(host_queries_min.size());
+  std::vector<dp_vector_type> dp_queries_max(host_queries_max.size());
+  std::transform(host_queries_min.begin(), host_queries_min.end(),
+                 dp_queries_min.begin(), shift_vector);
+  std::transform(host_queries_max.begin(), host_queries_max.end(),
+                 dp_queries_max.begin(), shift_vector);
+
+  mixed_precision_tree_type tree{ctx, dp_particles};
+
+  qcl::device_array<dp_vector_type> queries_min{ctx, dp_queries_min};
+  qcl::device_array<dp_vector_type> queries_max{ctx, dp_queries_max};
+  qcl::device_array<dp_particle_type> result{ctx,
+                                             dp_queries_min.size() * max_retrieved_particles};
+  qcl::device_array<cl_uint> num_results{ctx, dp_queries_min.size()};
+
+  Query_engine query_engine;
   typename Query_engine::handler_type query_handler {
     queries_min.get_buffer(),
     queries_max.get_buffer(),
     result.get_buffer(),
     num_results.get_buffer(),
+    queries_min.size(),
+    tree.get_coordinate_origin()
+  };
+
+  std::cout << "Executing query..." << std::endl;
+
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing mixed precision range query");
+
+  std::vector<dp_particle_type> host_results;
+  std::vector<cl_uint> host_num_results;
+  result.read(host_results);
+  num_results.read(host_num_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_range_verifier<dp_type_system> verifier{
+    dp_queries_min,
+    dp_queries_max,
+    max_retrieved_particles
+  };
+
+  return verifier(dp_particles, host_results, host_num_results);
+}
+
+/// Reduces the particles in double precision. Every second box is moved
+/// outside of the particle distribution, such that the results of the
+/// empty boxes must equal the double precision identity.
+template<spatialcl::query::reduction_operation Operation, class Binary_operation>
+std::size_t execute_double_precision_reduction_test(
+    const qcl::device_context_ptr& ctx,
+    const std::vector<vector_type>& host_queries_min,
+    const std::vector<vector_type>& host_queries_max,
+    const std::vector<particle_type>& particles,
+    double identity,
+    Binary_operation reduce)
+{
+  using dp_particle_type = spatialcl::configuration<dp_type_system>::particle_type;
+  using dp_vector_type = spatialcl::configuration<dp_type_system>::vector_type;
+  using engine_type = dp_relaxed_dfs_reduction_engine<Operation>;
+
+  std::vector<dp_particle_type> dp_particles(particles.size());
+  for(std::size_t i = 0; i < particles.size(); ++i)
+    for(std::size_t j = 0; j < particle_dimension; ++j)
+      dp_particles[i].s[j] = static_cast<double>(particles[i].s[j]);
+
+  std::vector<dp_vector_type> dp_queries_min(host_queries_min.size());
+  std::vector<dp_vector_type> dp_queries_max(host_queries_max.size());
+  for(std::size_t i = 0; i < host_queries_min.size(); ++i)
+    for(std::size_t j = 0; j < 4; ++j)
+    {
+      const double shift = (i % 2 == 1 && j < dimension) ? 10.0 : 0.0;
+      dp_queries_min[i].s[j] = static_cast<double>(host_queries_min[i].s[j]) + shift;
+      dp_queries_max[i].s[j] = static_cast<double>(host_queries_max[i].s[j]) + shift;
+    }
+
+  dp_aggregate_tree_type tree{ctx, dp_particles};
+
+  qcl::device_array<dp_vector_type> queries_min{ctx, dp_queries_min};
+  qcl::device_array<dp_vector_type> queries_max{ctx, dp_queries_max};
+  qcl::device_array<double> results{ctx, dp_queries_min.size()};
+
+  engine_type query_engine;
+  typename engine_type::handler_type query_handler {
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    engine_type::handler_type::get_node_aggregates(tree),
+    results.get_buffer(),
     queries_min.size()
   };
 
@@ -99,16 +1137,226 @@ std::size_t execute_range_query_test(const qcl::device_context_ptr& ctx,
   query_engine(tree, query_handler);
 
   cl_int err = ctx->get_command_queue().finish();
-  qcl::check_cl_error(err, "Error while executing range query");
+  qcl::check_cl_error(err, "Error while executing double precision reduction query");
+
+  std::vector<double> host_results;
+  results.read(host_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  common::verification::naive_cpu_range_verifier<dp_type_system> verifier{
+    dp_queries_min,
+    dp_queries_max,
+    max_retrieved_particles
+  };
+
+  return verifier.verify_reductions(dp_particles,
+                                    host_results,
+                                    reduced_component,
+                                    identity,
+                                    reduce,
+                                    0.0);
+}
+
+/// Executes the queries with native and with emulated sub-group operations.
+/// Since both follow the same path through the tree, the results must not
+/// only be correct, but identical.
+template<std::size_t Subgroup_size, std::size_t Group_coherence_size>
+std::size_t execute_subgroup_comparison_test(const qcl::device_context_ptr& ctx,
+                                             const tree_type& tree,
+                                             const std::vector<vector_type>& host_queries_min,
+                                             const std::vector<vector_type>& host_queries_max,
+                                             const qcl::device_array<vector_type>& queries_min,
+                                             const qcl::device_array<vector_type>& queries_max,
+                                             const std::vector<particle_type>& particles)
+{
+  using native_engine = subgroup_grouped_dfs_range_engine<
+    Subgroup_size, Group_coherence_size, spatialcl::query::engine::DFS_SUBGROUPS_NATIVE>;
+  using emulated_engine = subgroup_grouped_dfs_range_engine<
+    Subgroup_size, Group_coherence_size, spatialcl::query::engine::DFS_SUBGROUPS_EMULATED>;
+
+  qcl::device_array<particle_type> native_result{ctx, queries_min.size() * max_retrieved_particles};
+  qcl::device_array<cl_uint> native_num_results{ctx, queries_min.size()};
+  qcl::device_array<particle_type> emulated_result{ctx, queries_min.size() * max_retrieved_particles};
+  qcl::device_array<cl_uint> emulated_num_results{ctx, queries_min.size()};
+
+  std::size_t num_errors =
+      execute_range_query_test<native_engine>(ctx, tree,
+                                              host_queries_min, host_queries_max,
+                                              queries_min, queries_max,
+                                              particles,
+                                              native_result, native_num_results);
+  num_errors +=
+      execute_range_query_test<emulated_engine>(ctx, tree,
+                                                host_queries_min, host_queries_max,
+                                                queries_min, queries_max,
+                                                particles,
+                                                emulated_result, emulated_num_results);
+
+  std::vector<particle_type> host_native_result, host_emulated_result;
+  std::vector<cl_uint> host_native_num_results, host_emulated_num_results;
+  native_result.read(host_native_result);
+  native_num_results.read(host_native_num_results);
+  emulated_result.read(host_emulated_result);
+  emulated_num_results.read(host_emulated_num_results);
+
+  for(std::size_t i = 0; i < host_native_num_results.size(); ++i)
+  {
+    if(host_native_num_results[i] != host_emulated_num_results[i])
+    {
+      ++num_errors;
+      continue;
+    }
+    const std::size_t num_stored =
+        std::min<std::size_t>(host_native_num_results[i], max_retrieved_particles);
+    for(std::size_t j = 0; j < num_stored; ++j)
+      for(std::size_t k = 0; k < particle_dimension; ++k)
+        if(host_native_result[i * max_retrieved_particles + j].s[k] !=
+           host_emulated_result[i * max_retrieved_particles + j].s[k])
+          ++num_errors;
+  }
+  return num_errors;
+}
+
+/// Compares the wide engine using the group selector of the range query
+/// with the wide engine testing each child separately. Both visit the
+/// same nodes in the same order, so the results must be identical.
+template<std::size_t Branching_factor>
+std::size_t execute_group_selection_comparison_test(const qcl::device_context_ptr& ctx,
+                                                    const wide_tree_type<Branching_factor>& tree,
+                                                    const std::vector<vector_type>& host_queries_min,
+                                                    const std::vector<vector_type>& host_queries_max,
+                                                    const qcl::device_array<vector_type>& queries_min,
+                                                    const qcl::device_array<vector_type>& queries_max,
+                                                    const std::vector<particle_type>& particles)
+{
+  using group_engine = wide_dfs_range_engine<Branching_factor>;
+  using per_node_engine = wide_dfs_per_node_range_engine<Branching_factor>;
+
+  qcl::device_array<particle_type> group_result{ctx, queries_min.size() * max_retrieved_particles};
+  qcl::device_array<cl_uint> group_num_results{ctx, queries_min.size()};
+  qcl::device_array<particle_type> per_node_result{ctx, queries_min.size() * max_retrieved_particles};
+  qcl::device_array<cl_uint> per_node_num_results{ctx, queries_min.size()};
+
+  std::size_t num_errors =
+      execute_range_query_test<group_engine>(ctx, tree,
+                                             host_queries_min, host_queries_max,
+                                             queries_min, queries_max,
+                                             particles,
+                                             group_result, group_num_results);
+  num_errors +=
+      execute_range_query_test<per_node_engine>(ctx, tree,
+                                                host_queries_min, host_queries_max,
+                                                queries_min, queries_max,
+                                                particles,
+                                                per_node_result, per_node_num_results);
+
+  std::vector<particle_type> host_group_result, host_per_node_result;
+  std::vector<cl_uint> host_group_num_results, host_per_node_num_results;
+  group_result.read(host_group_result);
+  group_num_results.read(host_group_num_results);
+  per_node_result.read(host_per_node_result);
+  per_node_num_results.read(host_per_node_num_results);
+
+  for(std::size_t i = 0; i < host_group_num_results.size(); ++i)
+  {
+    if(host_group_num_results[i] != host_per_node_num_results[i])
+    {
+      ++num_errors;
+      continue;
+    }
+    const std::size_t num_stored =
+        std::min<std::size_t>(host_group_num_results[i], max_retrieved_particles);
+    for(std::size_t j = 0; j < num_stored; ++j)
+      for(std::size_t k = 0; k < particle_dimension; ++k)
+        if(host_group_result[i * max_retrieved_particles + j].s[k] !=
+           host_per_node_result[i * max_retrieved_particles + j].s[k])
+          ++num_errors;
+  }
+  return num_errors;
+}
+
+/// Tunes the grouped engine on the queries, then executes the queries with
+/// an engine that loads the tuned parameters from the tuning database
+std::size_t execute_tuned_range_query_test(const qcl::device_context_ptr& ctx,
+                                           const tree_type& tree,
+                                           const std::vector<vector_type>& host_queries_min,
+                                           const std::vector<vector_type>& host_queries_max,
+                                           const qcl::device_array<vector_type>& queries_min,
+                                           const qcl::device_array<vector_type>& queries_max,
+                                           const std::vector<particle_type>& particles,
+                                           qcl::device_array<particle_type>& result,
+                                           qcl::device_array<cl_uint>& num_results)
+{
+  auto database = std::make_shared<spatialcl::query::engine::grouped_dfs_tuning_database>();
+
+  tuned_grouped_dfs_range_engine::handler_type query_handler {
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    result.get_buffer(),
+    num_results.get_buffer(),
+    queries_min.size()
+  };
+
+  std::cout << "Tuning query engine..." << std::endl;
+  tuned_grouped_dfs_range_engine tuning_engine{"range_test", database};
+  const std::vector<spatialcl::query::engine::grouped_dfs_tuning_result> timings =
+      tuning_engine.tune(tree, query_handler);
+
+  for(const auto& timing : timings)
+    std::cout << "  " << timing.parameters << ": " << timing.seconds << "s" << std::endl;
+
+  std::size_t num_errors = 0;
+  // All valid parameter sets are measured
+  if(timings.size() != 3)
+    ++num_errors;
+
+  tuned_grouped_dfs_range_engine query_engine{"range_test", database};
+  if(query_engine.get_selected_parameters(ctx) !=
+     tuning_engine.get_selected_parameters(ctx))
+    ++num_errors;
+  std::cout << "Executing query with " << query_engine.get_selected_parameters(ctx)
+            << "..." << std::endl;
+
+  query_engine(tree, query_handler);
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing tuned range query");
 
-  // Retrieve results
   std::vector<particle_type> host_results;
   std::vector<cl_uint> host_num_results;
   result.read(host_results);
   num_results.read(host_num_results);
 
   std::cout << "Verifying results, please wait..." << std::endl;
-  // Verify results
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries_min,
+    host_queries_max,
+    max_retrieved_particles
+  };
+
+  return num_errors + verifier(particles, host_results, host_num_results);
+}
+
+/// Executes all queries with the host engine on a host copy of the tree
+std::size_t execute_host_range_query_test(const tree_type& tree,
+                                          const std::vector<vector_type>& host_queries_min,
+                                          const std::vector<vector_type>& host_queries_max,
+                                          const std::vector<particle_type>& particles)
+{
+  spatialcl::query::engine::host_tree_mirror<tree_type> host_tree{tree};
+
+  std::vector<particle_type> host_results;
+  std::vector<cl_uint> host_num_results;
+  host_range_handler handler{host_queries_min,
+                             host_queries_max,
+                             host_results,
+                             host_num_results};
+
+  std::cout << "Executing query on the host..." << std::endl;
+  host_range_engine query_engine;
+  query_engine(host_tree, handler);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
   common::verification::naive_cpu_range_verifier<type_system> verifier{
     host_queries_min,
     host_queries_max,
@@ -118,6 +1366,315 @@ std::size_t execute_range_query_test(const qcl::device_context_ptr& ctx,
   return verifier(particles, host_results, host_num_results);
 }
 
+/// Executes a small batch, which runs on the host, and all queries,
+/// which run on the device, through the dispatcher
+std::size_t execute_dispatched_range_query_test(const tree_type& tree,
+                                                const std::vector<vector_type>& host_queries_min,
+                                                const std::vector<vector_type>& host_queries_max,
+                                                const std::vector<particle_type>& particles)
+{
+  range_query_dispatcher dispatcher{tree, num_host_queries};
+
+  const std::vector<vector_type> small_batch_min{host_queries_min.begin(),
+                                                 host_queries_min.begin() + num_host_queries};
+  const std::vector<vector_type> small_batch_max{host_queries_max.begin(),
+                                                 host_queries_max.begin() + num_host_queries};
+
+  std::size_t num_errors = 0;
+  for(const auto& batch : {std::make_pair(&small_batch_min, &small_batch_max),
+                           std::make_pair(&host_queries_min, &host_queries_max)})
+  {
+    std::cout << "Executing " << batch.first->size() << " queries on the "
+              << (dispatcher.is_host_batch(batch.first->size()) ? "host" : "device")
+              << "..." << std::endl;
+
+    std::vector<particle_type> host_results;
+    std::vector<cl_uint> host_num_results;
+    dispatcher(*batch.first, *batch.second, host_results, host_num_results);
+
+    std::cout << "Verifying results, please wait..." << std::endl;
+    common::verification::naive_cpu_range_verifier<type_system> verifier{
+      *batch.first,
+      *batch.second,
+      max_retrieved_particles
+    };
+    num_errors += verifier(particles, host_results, host_num_results);
+  }
+  return num_errors;
+}
+
+/// Builds a neighbor list with a uniform radius and compares the neighbors
+/// of the first \c num_verified_particles particles with a naive search
+template<class Neighbor_list, class Tree_type>
+std::size_t execute_neighbor_list_test(const qcl::device_context_ptr& ctx,
+                                       const Tree_type& tree,
+                                       scalar radius,
+                                       std::size_t num_verified_particles)
+{
+  const std::size_t n = tree.get_num_particles();
+  std::vector<scalar> host_radii(n, radius);
+  qcl::device_array<scalar> radii{ctx, host_radii};
+
+  std::cout << "Building neighbor list..." << std::endl;
+  Neighbor_list neighbors;
+  neighbors(tree, radii.get_buffer());
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while building neighbor list");
+
+  std::vector<particle_type> sorted_particles(n);
+  std::vector<cl_ulong> host_offsets(n + 1);
+  std::vector<cl_ulong> host_indices(std::max<std::size_t>(neighbors.get_num_neighbors(), 1));
+
+  err = ctx->get_command_queue().enqueueReadBuffer(
+        tree.get_sorted_particles(), CL_TRUE,
+        0, n * sizeof(particle_type), sorted_particles.data());
+  qcl::check_cl_error(err, "Could not read sorted particles");
+  err = ctx->get_command_queue().enqueueReadBuffer(
+        neighbors.get_offsets().get_buffer(), CL_TRUE,
+        0, host_offsets.size() * sizeof(cl_ulong), host_offsets.data());
+  qcl::check_cl_error(err, "Could not read neighbor list offsets");
+  err = ctx->get_command_queue().enqueueReadBuffer(
+        neighbors.get_neighbor_indices().get_buffer(), CL_TRUE,
+        0, host_indices.size() * sizeof(cl_ulong), host_indices.data());
+  qcl::check_cl_error(err, "Could not read neighbor indices");
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  auto distance2 = [&](std::size_t i, std::size_t j){
+    scalar result = 0.0f;
+    for(std::size_t k = 0; k < dimension; ++k)
+    {
+      scalar delta = sorted_particles[i].s[k] - sorted_particles[j].s[k];
+      result += delta * delta;
+    }
+    return result;
+  };
+
+  std::size_t num_errors = 0;
+  for(std::size_t i = 0; i < std::min(n, num_verified_particles); ++i)
+  {
+    for(std::size_t j = host_offsets[i]; j < host_offsets[i+1]; ++j)
+      if(distance2(i, host_indices[j]) > radius * radius)
+        ++num_errors;
+
+    std::size_t correct_num_neighbors = 0;
+    for(std::size_t j = 0; j < n; ++j)
+      if(distance2(i, j) <= radius * radius)
+        ++correct_num_neighbors;
+
+    if(host_offsets[i+1] - host_offsets[i] != correct_num_neighbors)
+      ++num_errors;
+  }
+  return num_errors;
+}
+
+/// Uploads the particles on a \c transfer_queue, builds the tree and
+/// submits a batch of two queries, chaining all steps through events.
+/// The host only waits once for the downloads of the results, which must
+/// match the results of the blocking construction and query.
+std::size_t execute_event_chained_range_query_test(
+    const qcl::device_context_ptr& ctx,
+    const std::vector<vector_type>& host_queries_min,
+    const std::vector<vector_type>& host_queries_max,
+    const qcl::device_array<vector_type>& queries_min,
+    const qcl::device_array<vector_type>& queries_max,
+    const std::vector<particle_type>& particles)
+{
+  const std::size_t result_size = queries_min.size() * max_retrieved_particles;
+
+  spatialcl::transfer_queue transfers{ctx};
+
+  qcl::device_array<particle_type> device_particles{ctx, particles.size()};
+  cl::Event upload_event;
+  transfers.upload(device_particles.get_buffer(), particles.data(),
+                   particles.size(), &upload_event);
+  transfers.flush();
+
+  const spatialcl::event_list build_wait_events{upload_event};
+  cl::Event build_event;
+  tree_type tree{ctx, device_particles, tree_type::sorter_type{},
+                 &build_event, &build_wait_events};
+
+  // Two handlers with separate results form the batch
+  qcl::device_array<particle_type> results0{ctx, result_size};
+  qcl::device_array<particle_type> results1{ctx, result_size};
+  qcl::device_array<cl_uint> num_results0{ctx, queries_min.size()};
+  qcl::device_array<cl_uint> num_results1{ctx, queries_min.size()};
+  strict_dfs_range_engine::handler_type handler0{
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    results0.get_buffer(),
+    num_results0.get_buffer(),
+    queries_min.size()
+  };
+  strict_dfs_range_engine::handler_type handler1{
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    results1.get_buffer(),
+    num_results1.get_buffer(),
+    queries_min.size()
+  };
+  const qcl::device_array<particle_type>* results[] = {&results0, &results1};
+  const qcl::device_array<cl_uint>* num_results[] = {&num_results0, &num_results1};
+
+  std::cout << "Executing query batch..." << std::endl;
+
+  strict_dfs_range_engine query_engine;
+  std::vector<strict_dfs_range_engine::handler_type*> batch{&handler0, &handler1};
+  const spatialcl::event_list query_wait_events{build_event};
+  cl::Event query_event;
+  spatialcl::enqueue_query_batch(query_engine, tree, batch,
+                                 &query_event, &query_wait_events);
+
+  std::vector<std::vector<particle_type>> host_results(
+        2, std::vector<particle_type>(result_size));
+  std::vector<std::vector<cl_uint>> host_num_results(
+        2, std::vector<cl_uint>(queries_min.size()));
+
+  const spatialcl::event_list download_wait_events{query_event};
+  std::vector<cl::Event> download_events(4);
+  for(std::size_t i = 0; i < 2; ++i)
+  {
+    transfers.download(results[i]->get_buffer(), host_results[i].data(),
+                       result_size, &download_events[2 * i],
+                       &download_wait_events);
+    transfers.download(num_results[i]->get_buffer(), host_num_results[i].data(),
+                       queries_min.size(), &download_events[2 * i + 1],
+                       &download_wait_events);
+  }
+  transfers.flush();
+
+  cl_int err = cl::WaitForEvents(download_events);
+  qcl::check_cl_error(err, "Error while waiting for the query results");
+
+  // Blocking path
+  tree_type blocking_tree{ctx, particles};
+  qcl::device_array<particle_type> blocking_result{ctx, result_size};
+  qcl::device_array<cl_uint> blocking_num_results{ctx, queries_min.size()};
+  strict_dfs_range_engine::handler_type blocking_handler{
+    queries_min.get_buffer(),
+    queries_max.get_buffer(),
+    blocking_result.get_buffer(),
+    blocking_num_results.get_buffer(),
+    queries_min.size()
+  };
+  query_engine(blocking_tree, blocking_handler);
+
+  err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while executing range query");
+
+  std::vector<particle_type> host_blocking_result;
+  std::vector<cl_uint> host_blocking_num_results;
+  blocking_result.read(host_blocking_result);
+  blocking_num_results.read(host_blocking_num_results);
+
+  std::cout << "Verifying results, please wait..." << std::endl;
+  std::size_t num_errors = 0;
+  for(std::size_t i = 0; i < 2; ++i)
+  {
+    if(host_num_results[i] != host_blocking_num_results)
+      ++num_errors;
+    for(std::size_t query = 0; query < queries_min.size(); ++query)
+    {
+      const std::size_t num_retrieved =
+          std::min<std::size_t>(host_blocking_num_results[query],
+                                max_retrieved_particles);
+      for(std::size_t j = 0; j < num_retrieved; ++j)
+        for(std::size_t k = 0; k < dimension; ++k)
+        {
+          const std::size_t idx = query * max_retrieved_particles + j;
+          if(host_results[i][idx].s[k] != host_blocking_result[idx].s[k])
+            ++num_errors;
+        }
+    }
+  }
+
+  common::verification::naive_cpu_range_verifier<type_system> verifier{
+    host_queries_min,
+    host_queries_max,
+    max_retrieved_particles
+  };
+  return num_errors + verifier(particles, host_results[0], host_num_results[0]);
+}
+
+/// Moves the particles of a tree in a random walk, and updates the tree
+/// with refits and rebuilds as decided by a \c tree_rebuild_policy.
+/// After each step, the range queries are verified against the
+/// moved particles.
+std::size_t execute_moving_particles_range_query_test(
+    const qcl::device_context_ptr& ctx,
+    const std::vector<vector_type>& host_queries_min,
+    const std::vector<vector_type>& host_queries_max,
+    const qcl::device_array<vector_type>& queries_min,
+    const qcl::device_array<vector_type>& queries_max,
+    const std::vector<particle_type>& particles,
+    qcl::device_array<particle_type>& result,
+    qcl::device_array<cl_uint>& num_results)
+{
+  constexpr std::size_t num_steps = 8;
+  const scalar max_displacement = 0.01f;
+
+  tree_type tree{ctx, particles};
+  // Rebuild after at most 3 refits, or if the tree quality has
+  // degraded by more than 5%
+  spatialcl::tree_rebuild_policy rebuild_policy{3, 0.05};
+  rebuild_policy.notify_rebuild(tree.get_quality_metric());
+
+  common::random_vectors<scalar, particle_dimension> rnd{4321};
+
+  const std::size_t n = tree.get_num_particles();
+  std::vector<particle_type> moved_particles(n);
+
+  std::size_t num_errors = 0;
+  std::size_t num_rebuilds = 0;
+  for(std::size_t step = 0; step < num_steps; ++step)
+  {
+    cl_int err = ctx->get_command_queue().enqueueReadBuffer(
+          tree.get_sorted_particles(), CL_TRUE,
+          0, n * sizeof(particle_type), moved_particles.data());
+    qcl::check_cl_error(err, "Could not read sorted particles");
+
+    std::vector<particle_type> displacements;
+    rnd(n, displacements, -max_displacement, max_displacement);
+    for(std::size_t i = 0; i < n; ++i)
+      for(std::size_t j = 0; j < dimension; ++j)
+        moved_particles[i].s[j] += displacements[i].s[j];
+
+    err = ctx->get_command_queue().enqueueWriteBuffer(
+          tree.get_sorted_particles(), CL_TRUE,
+          0, n * sizeof(particle_type), moved_particles.data());
+    qcl::check_cl_error(err, "Could not write moved particles");
+
+    if(rebuild_policy.requires_rebuild(tree.get_quality_metric()))
+    {
+      tree.rebuild();
+      rebuild_policy.notify_rebuild(tree.get_quality_metric());
+      ++num_rebuilds;
+    }
+    else
+    {
+      tree.refit();
+      rebuild_policy.notify_refit();
+    }
+
+    num_errors += execute_range_query_test<strict_dfs_range_engine>(ctx,
+                                                                    tree,
+                                                                    host_queries_min,
+                                                                    host_queries_max,
+                                                                    queries_min,
+                                                                    queries_max,
+                                                                    moved_particles,
+                                                                    result,
+                                                                    num_results);
+  }
+
+  // The refit limit alone forces a rebuild within the first 4 steps
+  if(num_rebuilds == 0)
+    ++num_errors;
+
+  return num_errors;
+}
+
 int main()
 {
   // Setup particle tree
@@ -129,6 +1686,13 @@ int main()
   rnd(num_particles, particles);
 
   tree_type gpu_tree{ctx, particles};
+  bucket_tree_type gpu_bucket_tree{ctx, particles};
+  wide_tree_type<4> gpu_wide4_tree{ctx, particles};
+  wide_tree_type<8> gpu_wide8_tree{ctx, particles};
+  quantized_tree_type gpu_quantized_tree{ctx, particles};
+  soa_tree_type gpu_soa_tree{ctx, particles};
+  aggregate_tree_type gpu_aggregate_tree{ctx, particles};
+  aggregate_bucket_tree_type gpu_aggregate_bucket_tree{ctx, particles};
 
   // Create random ranges for the queries
   std::vector<vector_type> query_points;
@@ -164,10 +1728,10 @@ int main()
 
   std::size_t num_errors = 0;
 
-#define RUN_TEST(test_name) \
+#define RUN_TEST(test_name, tree) \
   num_errors = \
       execute_range_query_test<test_name>(ctx,              \
-                                          gpu_tree,         \
+                                          tree,             \
                                           host_ranges_min,  \
                                           host_ranges_max,  \
                                           ranges_min,       \
@@ -178,11 +1742,345 @@ int main()
   std::cout << BOOST_PP_STRINGIZE(test_name) <<" completed queries with " \
             << num_errors << " errors." << std::endl
 
-  RUN_TEST(strict_dfs_range_engine);
-  RUN_TEST(relaxed_dfs_range_engine);
-  //RUN_TEST(grouped_dfs_range_engine<16>);
-  RUN_TEST(grouped_dfs_range_engine<32>);
-  RUN_TEST(grouped_dfs_range_engine<64>);
+  RUN_TEST(strict_dfs_range_engine, gpu_tree);
+  RUN_TEST(relaxed_dfs_range_engine, gpu_tree);
+  //RUN_TEST(grouped_dfs_range_engine<16>, gpu_tree);
+  RUN_TEST(grouped_dfs_range_engine<32>, gpu_tree);
+  RUN_TEST(grouped_dfs_range_engine<64>, gpu_tree);
+
+  RUN_TEST(bucket_strict_dfs_range_engine, gpu_bucket_tree);
+  RUN_TEST(bucket_relaxed_dfs_range_engine, gpu_bucket_tree);
+  RUN_TEST(bucket_grouped_dfs_range_engine<64>, gpu_bucket_tree);
+
+  RUN_TEST(wide_dfs_range_engine<4>, gpu_wide4_tree);
+  RUN_TEST(wide_dfs_range_engine<8>, gpu_wide8_tree);
+
+  num_errors = execute_group_selection_comparison_test<4>(
+        ctx, gpu_wide4_tree, host_ranges_min, host_ranges_max,
+        ranges_min, ranges_max, particles);
+  std::cout << "wide_dfs_range_engine<4> group selection comparison completed with "
+            << num_errors << " errors." << std::endl;
+  num_errors = execute_group_selection_comparison_test<8>(
+        ctx, gpu_wide8_tree, host_ranges_min, host_ranges_max,
+        ranges_min, ranges_max, particles);
+  std::cout << "wide_dfs_range_engine<8> group selection comparison completed with "
+            << num_errors << " errors." << std::endl;
+
+  RUN_TEST(quantized_strict_dfs_range_engine, gpu_quantized_tree);
+  RUN_TEST(quantized_grouped_dfs_range_engine, gpu_quantized_tree);
+
+  RUN_TEST(soa_relaxed_dfs_range_engine, gpu_soa_tree);
+  RUN_TEST(soa_grouped_dfs_range_engine, gpu_soa_tree);
+
+  num_errors =
+      execute_reordered_range_query_test<reordered_grouped_dfs_range_engine>(
+        ctx,
+        gpu_tree,
+        host_ranges_min,
+        host_ranges_max,
+        ranges_min,
+        ranges_max,
+        particles,
+        result_particles,
+        result_num_retrieved_particles);
+  std::cout << "reordered_grouped_dfs_range_engine completed queries with "
+            << num_errors << " errors." << std::endl;
+
+#define RUN_INSTRUMENTED_TEST(test_name, tree) \
+  num_errors = \
+      execute_instrumented_range_query_test<test_name>(ctx,              \
+                                                       tree,             \
+                                                       host_ranges_min,  \
+                                                       host_ranges_max,  \
+                                                       ranges_min,       \
+                                                       ranges_max,       \
+                                                       particles,        \
+                                                       result_particles, \
+                                                       result_num_retrieved_particles); \
+  std::cout << BOOST_PP_STRINGIZE(test_name) <<" completed queries with " \
+            << num_errors << " errors." << std::endl
+
+  RUN_INSTRUMENTED_TEST(instrumented_relaxed_dfs_range_engine, gpu_tree);
+  RUN_INSTRUMENTED_TEST(instrumented_grouped_dfs_range_engine, gpu_tree);
+
+  num_errors = execute_particle_batch_size_test(ctx, gpu_tree, particles);
+  std::cout << "particle_batch_size_test completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_tuned_range_query_test(ctx,
+                                              gpu_tree,
+                                              host_ranges_min,
+                                              host_ranges_max,
+                                              ranges_min,
+                                              ranges_max,
+                                              particles,
+                                              result_particles,
+                                              result_num_retrieved_particles);
+  std::cout << "tuned_grouped_dfs_range_engine completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  if(spatialcl::query::engine::device_supports_subgroups(ctx))
+  {
+    std::cout << "Native sub-group size of the device: "
+              << spatialcl::query::engine::get_native_subgroup_size(ctx)
+              << std::endl;
+
+    num_errors = execute_subgroup_comparison_test<16, 32>(
+          ctx, gpu_tree, host_ranges_min, host_ranges_max,
+          ranges_min, ranges_max, particles);
+    std::cout << "subgroup_grouped_dfs_range_engine<16> completed queries with "
+              << num_errors << " errors." << std::endl;
+
+    num_errors = execute_subgroup_comparison_test<32, 32>(
+          ctx, gpu_tree, host_ranges_min, host_ranges_max,
+          ranges_min, ranges_max, particles);
+    std::cout << "subgroup_grouped_dfs_range_engine<32> completed queries with "
+              << num_errors << " errors." << std::endl;
+
+    num_errors = execute_subgroup_comparison_test<64, 64>(
+          ctx, gpu_tree, host_ranges_min, host_ranges_max,
+          ranges_min, ranges_max, particles);
+    std::cout << "subgroup_grouped_dfs_range_engine<64> completed queries with "
+              << num_errors << " errors." << std::endl;
+  }
+  else
+    std::cout << "Skipping native sub-group comparison, device does not support sub-groups."
+              << std::endl;
+
+#define RUN_CSR_TEST(test_name, tree) \
+  num_errors = \
+      execute_csr_range_query_test<test_name>(ctx,              \
+                                              tree,             \
+                                              host_ranges_min,  \
+                                              host_ranges_max,  \
+                                              ranges_min,       \
+                                              ranges_max,       \
+                                              particles);       \
+  std::cout << BOOST_PP_STRINGIZE(test_name) <<" completed queries with " \
+            << num_errors << " errors." << std::endl
+
+  RUN_CSR_TEST(relaxed_dfs_csr_range, gpu_tree);
+  RUN_CSR_TEST(grouped_dfs_csr_range, gpu_tree);
+
+#define RUN_COUNT_TEST(test_name, tree) \
+  num_errors = \
+      execute_count_query_test<test_name>(ctx,              \
+                                          tree,             \
+                                          host_ranges_min,  \
+                                          host_ranges_max,  \
+                                          ranges_min,       \
+                                          ranges_max,       \
+                                          particles,        \
+                                          result_num_retrieved_particles); \
+  std::cout << BOOST_PP_STRINGIZE(test_name) <<" completed queries with " \
+            << num_errors << " errors." << std::endl
+
+  RUN_COUNT_TEST(relaxed_dfs_count_engine, gpu_tree);
+  RUN_COUNT_TEST(grouped_dfs_count_engine, gpu_bucket_tree);
+  RUN_COUNT_TEST(wide_dfs_count_engine, gpu_wide4_tree);
+
+  // Spheres with the same centers as the boxes
+  std::vector<scalar> host_radii(num_queries, query_diameter / 2);
+  qcl::device_array<vector_type> sphere_centers{ctx, query_points};
+  qcl::device_array<scalar> sphere_radii{ctx, host_radii};
+
+#define RUN_SPHERE_TEST(test_name, tree) \
+  num_errors = \
+      execute_sphere_range_query_test<test_name>(ctx,              \
+                                                 tree,             \
+                                                 query_points,     \
+                                                 host_radii,       \
+                                                 sphere_centers,   \
+                                                 sphere_radii,     \
+                                                 particles,        \
+                                                 result_particles, \
+                                                 result_num_retrieved_particles); \
+  std::cout << BOOST_PP_STRINGIZE(test_name) <<" completed queries with " \
+            << num_errors << " errors." << std::endl
+
+  RUN_SPHERE_TEST(relaxed_dfs_sphere_range_engine, gpu_tree);
+  RUN_SPHERE_TEST(grouped_dfs_sphere_range_engine<64>, gpu_tree);
+
+  num_errors =
+      execute_sphere_count_query_test<relaxed_dfs_sphere_count_engine>(
+        ctx,
+        gpu_tree,
+        query_points,
+        host_radii,
+        sphere_centers,
+        sphere_radii,
+        particles,
+        result_num_retrieved_particles);
+  std::cout << "relaxed_dfs_sphere_count_engine completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  // The sums may be reduced in a different order on the device
+  num_errors =
+      execute_reduction_query_test<relaxed_dfs_reduction_engine<spatialcl::query::REDUCTION_SUM>>(
+        ctx, gpu_aggregate_tree,
+        host_ranges_min, host_ranges_max,
+        ranges_min, ranges_max,
+        particles,
+        0.0f,
+        [](scalar a, scalar b){ return a + b; },
+        1.e-4f);
+  std::cout << "relaxed_dfs_reduction_engine<REDUCTION_SUM> completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors =
+      execute_reduction_query_test<relaxed_dfs_reduction_engine<spatialcl::query::REDUCTION_MIN>>(
+        ctx, gpu_aggregate_tree,
+        host_ranges_min, host_ranges_max,
+        ranges_min, ranges_max,
+        particles,
+        std::numeric_limits<scalar>::max(),
+        [](scalar a, scalar b){ return std::min(a, b); },
+        0.0f);
+  std::cout << "relaxed_dfs_reduction_engine<REDUCTION_MIN> completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors =
+      execute_reduction_query_test<relaxed_dfs_reduction_engine<spatialcl::query::REDUCTION_MAX>>(
+        ctx, gpu_aggregate_tree,
+        host_ranges_min, host_ranges_max,
+        ranges_min, ranges_max,
+        particles,
+        -std::numeric_limits<scalar>::max(),
+        [](scalar a, scalar b){ return std::max(a, b); },
+        0.0f);
+  std::cout << "relaxed_dfs_reduction_engine<REDUCTION_MAX> completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors =
+      execute_reduction_query_test<grouped_dfs_reduction_engine<spatialcl::query::REDUCTION_SUM>>(
+        ctx, gpu_aggregate_bucket_tree,
+        host_ranges_min, host_ranges_max,
+        ranges_min, ranges_max,
+        particles,
+        0.0f,
+        [](scalar a, scalar b){ return a + b; },
+        1.e-4f);
+  std::cout << "grouped_dfs_reduction_engine<REDUCTION_SUM> completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors =
+      execute_reduction_query_test<grouped_dfs_reduction_engine<spatialcl::query::REDUCTION_MAX>>(
+        ctx, gpu_aggregate_bucket_tree,
+        host_ranges_min, host_ranges_max,
+        ranges_min, ranges_max,
+        particles,
+        -std::numeric_limits<scalar>::max(),
+        [](scalar a, scalar b){ return std::max(a, b); },
+        0.0f);
+  std::cout << "grouped_dfs_reduction_engine<REDUCTION_MAX> completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  // Boxes large enough to contain whole subtrees
+  num_errors = execute_reduction_pruning_test(ctx,
+                                              gpu_aggregate_tree,
+                                              query_points,
+                                              particles,
+                                              0.4f);
+  std::cout << "instrumented_relaxed_dfs_reduction_engine completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  // With a single device, two slices on the same device
+  // still exercise the routing and the merging of the results
+  std::vector<qcl::device_context_ptr> devices = env.get_device_contexts();
+  if(devices.size() == 1)
+    devices.push_back(ctx);
+
+  num_errors = execute_distributed_range_query_test(devices,
+                                                    host_ranges_min,
+                                                    host_ranges_max,
+                                                    particles);
+  std::cout << "distributed_range_query completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_out_of_core_range_query_test(ctx,
+                                                    host_ranges_min,
+                                                    host_ranges_max,
+                                                    particles);
+  std::cout << "out_of_core_range_query completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_forest_range_query_test(ctx,
+                                               host_ranges_min,
+                                               host_ranges_max,
+                                               particles);
+  std::cout << "forest_range_engine completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  if(ctx->get_device().getInfo<CL_DEVICE_DOUBLE_FP_CONFIG>() != 0)
+  {
+    num_errors = execute_mixed_precision_range_query_test<mixed_precision_range_engine>(
+          ctx, host_ranges_min, host_ranges_max, particles);
+    std::cout << "mixed_precision_range_engine completed queries with "
+              << num_errors << " errors." << std::endl;
+
+    num_errors = execute_mixed_precision_range_query_test<grouped_mixed_precision_range_engine>(
+          ctx, host_ranges_min, host_ranges_max, particles);
+    std::cout << "grouped_mixed_precision_range_engine completed queries with "
+              << num_errors << " errors." << std::endl;
+
+    num_errors = execute_double_precision_reduction_test<spatialcl::query::REDUCTION_MIN>(
+          ctx, host_ranges_min, host_ranges_max, particles,
+          std::numeric_limits<double>::max(),
+          [](double a, double b){ return std::min(a, b); });
+    std::cout << "dp_relaxed_dfs_reduction_engine<REDUCTION_MIN> completed queries with "
+              << num_errors << " errors." << std::endl;
+
+    num_errors = execute_double_precision_reduction_test<spatialcl::query::REDUCTION_MAX>(
+          ctx, host_ranges_min, host_ranges_max, particles,
+          -std::numeric_limits<double>::max(),
+          [](double a, double b){ return std::max(a, b); });
+    std::cout << "dp_relaxed_dfs_reduction_engine<REDUCTION_MAX> completed queries with "
+              << num_errors << " errors." << std::endl;
+  }
+  else
+    std::cout << "Skipping double precision tests, device does not support doubles."
+              << std::endl;
+
+  num_errors = execute_host_range_query_test(gpu_tree,
+                                             host_ranges_min,
+                                             host_ranges_max,
+                                             particles);
+  std::cout << "host_range_engine completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_dispatched_range_query_test(gpu_tree,
+                                                   host_ranges_min,
+                                                   host_ranges_max,
+                                                   particles);
+  std::cout << "range_query_dispatcher completed queries with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_neighbor_list_test<grouped_dfs_neighbor_list>(ctx,
+                                                                     gpu_tree,
+                                                                     query_diameter / 2,
+                                                                     500);
+  std::cout << "grouped_dfs_neighbor_list completed with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_event_chained_range_query_test(ctx,
+                                                      host_ranges_min,
+                                                      host_ranges_max,
+                                                      ranges_min,
+                                                      ranges_max,
+                                                      particles);
+  std::cout << "event chained construction and query batch completed with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_moving_particles_range_query_test(ctx,
+                                                         host_ranges_min,
+                                                         host_ranges_max,
+                                                         ranges_min,
+                                                         ranges_max,
+                                                         particles,
+                                                         result_particles,
+                                                         result_num_retrieved_particles);
+  std::cout << "refitted and rebuilt tree completed queries with "
+            << num_errors << " errors." << std::endl;
  
   return 0;
 }
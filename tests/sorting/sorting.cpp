@@ -0,0 +1,306 @@
+/*
+ * This file is part of SpatialCL, a library for the spatial processing of
+ * particles.
+ *
+ * Copyright (c) 2017, 2018 Aksel Alpay
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <utility>
+
+#include <boost/preprocessor/stringize.hpp>
+
+#include <SpatialCL/tree.hpp>
+
+#include <QCL/qcl.hpp>
+
+#include "../../common/environment.hpp"
+#include "../../common/random_vectors.hpp"
+
+constexpr std::size_t particle_dimension = 4;
+
+const std::size_t num_particles = 100000;
+
+using type_system = spatialcl::type_descriptor::single_precision3d<particle_dimension>;
+using particle_type = spatialcl::configuration<type_system>::particle_type;
+
+using zcurve_sorter =
+  spatialcl::key_based_sorter<spatialcl::zcurve_sort_key_generator<type_system>>;
+using zcurve_radix_sorter =
+  spatialcl::key_based_sorter<spatialcl::zcurve_sort_key_generator<type_system>,
+                              spatialcl::sort::default_radix_sort_engine>;
+
+using hilbert_sorter =
+  spatialcl::key_based_sorter<spatialcl::hilbert_sort_key_generator<type_system>>;
+using hilbert_radix_sorter =
+  spatialcl::key_based_sorter<spatialcl::hilbert_sort_key_generator<type_system>,
+                              spatialcl::sort::default_radix_sort_engine>;
+
+// The largest supported number of radix bits
+template<class Key_type, class Value_type>
+using wide_radix_sort_engine =
+  spatialcl::sort::radix_sort_engine<Key_type, Value_type, 6>;
+using hilbert_wide_radix_sorter =
+  spatialcl::key_based_sorter<spatialcl::hilbert_sort_key_generator<type_system>,
+                              wide_radix_sort_engine>;
+
+using hilbert_permutation_sorter =
+  spatialcl::key_based_sorter<spatialcl::hilbert_sort_key_generator<type_system>,
+                              spatialcl::sort::boost_sort_engine,
+                              spatialcl::SORT_STRATEGY_PERMUTATION>;
+using hilbert_radix_permutation_sorter =
+  spatialcl::key_based_sorter<spatialcl::hilbert_sort_key_generator<type_system>,
+                              spatialcl::sort::default_radix_sort_engine,
+                              spatialcl::SORT_STRATEGY_PERMUTATION>;
+
+using hilbert_incremental_sorter =
+  spatialcl::key_based_sorter<spatialcl::hilbert_sort_key_generator<type_system>,
+                              spatialcl::sort::default_radix_sort_engine,
+                              spatialcl::SORT_STRATEGY_INCREMENTAL>;
+
+using permutation_tree_type =
+  spatialcl::particle_bvh_tree<hilbert_radix_permutation_sorter, type_system>;
+
+template<class Sorter>
+std::vector<particle_type> sort_particles(const qcl::device_context_ptr& ctx,
+                                          const std::vector<particle_type>& particles,
+                                          const Sorter& sorter = Sorter{})
+{
+  qcl::device_array<particle_type> device_particles{ctx, particles};
+
+  sorter(ctx, device_particles.get_buffer(), device_particles.size());
+
+  cl_int err = ctx->get_command_queue().finish();
+  qcl::check_cl_error(err, "Error while sorting particles");
+
+  std::vector<particle_type> result;
+  device_particles.read(result);
+  return result;
+}
+
+/// \return The number of positions at which the particles differ
+std::size_t count_differences(const std::vector<particle_type>& reference,
+                              const std::vector<particle_type>& result)
+{
+  std::size_t num_errors = 0;
+  for(std::size_t i = 0; i < reference.size(); ++i)
+    for(std::size_t j = 0; j < particle_dimension; ++j)
+      if(reference[i].s[j] != result[i].s[j])
+      {
+        ++num_errors;
+        break;
+      }
+
+  return num_errors;
+}
+
+/// Compares the order obtained with the sorter under test with the
+/// order obtained with the reference sorter. Since the random particles
+/// have distinct keys (with overwhelming probability), the orders must
+/// be identical.
+template<class Reference_sorter, class Sorter>
+std::size_t execute_sort_test(const qcl::device_context_ptr& ctx,
+                              const std::vector<particle_type>& particles)
+{
+  std::vector<particle_type> reference = sort_particles<Reference_sorter>(ctx, particles);
+  std::vector<particle_type> result = sort_particles<Sorter>(ctx, particles);
+
+  return count_differences(reference, result);
+}
+
+/// Like \c execute_sort_test() for the incremental sorter, but also
+/// checks whether the sorter has only sorted the displaced particles
+/// or has fallen back to sorting all particles, and whether at most
+/// \c max_displaced particles have been displaced.
+std::size_t execute_incremental_sort_test(const qcl::device_context_ptr& ctx,
+                                          const std::vector<particle_type>& particles,
+                                          bool expect_incremental,
+                                          std::size_t max_displaced = num_particles)
+{
+  std::vector<particle_type> reference = sort_particles<hilbert_sorter>(ctx, particles);
+
+  hilbert_incremental_sorter sorter;
+  std::vector<particle_type> result = sort_particles(ctx, particles, sorter);
+
+  std::size_t num_errors = count_differences(reference, result);
+  if(sorter.last_sort_was_incremental() != expect_incremental)
+    ++num_errors;
+  if(sorter.get_last_num_displaced() > max_displaced)
+    ++num_errors;
+
+  std::cout << "  " << sorter.get_last_num_displaced() << " displaced particles, "
+            << (sorter.last_sort_was_incremental() ? "incremental" : "full")
+            << " sort" << std::endl;
+  return num_errors;
+}
+
+/// Checks that the permutation stored in the tree maps
+/// the sorted particles back to the original particles.
+std::size_t execute_permutation_test(const qcl::device_context_ptr& ctx,
+                                     const std::vector<particle_type>& particles)
+{
+  permutation_tree_type tree{ctx, particles};
+
+  std::vector<particle_type> sorted_particles(particles.size());
+  std::vector<cl_uint> permutation(particles.size());
+  ctx->memcpy_d2h<particle_type>(sorted_particles.data(),
+                                 tree.get_sorted_particles(),
+                                 particles.size());
+  ctx->memcpy_d2h<cl_uint>(permutation.data(),
+                           tree.get_permutation(),
+                           particles.size());
+
+  std::size_t num_errors = 0;
+  for(std::size_t i = 0; i < particles.size(); ++i)
+  {
+    if(permutation[i] >= particles.size())
+    {
+      ++num_errors;
+      continue;
+    }
+
+    for(std::size_t j = 0; j < particle_dimension; ++j)
+      if(particles[permutation[i]].s[j] != sorted_particles[i].s[j])
+      {
+        ++num_errors;
+        break;
+      }
+  }
+
+  return num_errors;
+}
+
+/// Swaps a small fraction of randomly chosen particles. The swapped
+/// particles are far apart, but each swap only displaces the swapped
+/// particles and their new neighbors.
+std::vector<particle_type> perturb_order(const std::vector<particle_type>& sorted_particles,
+                                         std::size_t num_swaps)
+{
+  std::vector<particle_type> result = sorted_particles;
+  std::mt19937 gen{1234};
+  std::uniform_int_distribution<std::size_t> dist{0, result.size() - 1};
+
+  for(std::size_t i = 0; i < num_swaps; ++i)
+    std::swap(result[dist(gen)], result[dist(gen)]);
+
+  return result;
+}
+
+/// Swaps a small fraction of randomly chosen particles with their next
+/// neighbor, like particles that have moved slightly. Only the swapped
+/// particles are out of order.
+std::vector<particle_type> perturb_order_locally(const std::vector<particle_type>& sorted_particles,
+                                                 std::size_t num_swaps)
+{
+  std::vector<particle_type> result = sorted_particles;
+  std::mt19937 gen{5678};
+  std::uniform_int_distribution<std::size_t> dist{0, result.size() - 2};
+
+  for(std::size_t i = 0; i < num_swaps; ++i)
+  {
+    const std::size_t pos = dist(gen);
+    std::swap(result[pos], result[pos + 1]);
+  }
+
+  return result;
+}
+
+/// Moves a single particle from the front to the back, like a particle
+/// that has moved far. All particles in between are shifted by one,
+/// but remain in order.
+std::vector<particle_type> move_single_particle(const std::vector<particle_type>& sorted_particles)
+{
+  std::vector<particle_type> result = sorted_particles;
+  const std::size_t from = result.size() / 10;
+  const std::size_t to = result.size() - result.size() / 10;
+  std::rotate(result.begin() + from, result.begin() + from + 1, result.begin() + to);
+  return result;
+}
+
+int main()
+{
+  common::environment env;
+  qcl::device_context_ptr ctx = env.get_device_context();
+
+  std::vector<particle_type> particles;
+  common::random_vectors<float, particle_dimension> rnd;
+  rnd(num_particles, particles);
+
+  std::size_t num_errors = 0;
+
+#define RUN_TEST(reference_sorter, sorter) \
+  num_errors = execute_sort_test<reference_sorter, sorter>(ctx, particles); \
+  std::cout << BOOST_PP_STRINGIZE(sorter) << " completed sort with " \
+            << num_errors << " errors." << std::endl
+
+  RUN_TEST(zcurve_sorter, zcurve_radix_sorter);
+  RUN_TEST(hilbert_sorter, hilbert_radix_sorter);
+  RUN_TEST(hilbert_sorter, hilbert_wide_radix_sorter);
+  RUN_TEST(hilbert_sorter, hilbert_permutation_sorter);
+  RUN_TEST(hilbert_sorter, hilbert_radix_permutation_sorter);
+  RUN_TEST(hilbert_sorter, hilbert_incremental_sorter);
+
+  // The incremental sorter should also be correct if the input is
+  // nearly sorted (the case for which it is optimized), and if it is
+  // already sorted.
+  std::vector<particle_type> sorted_particles =
+      sort_particles<hilbert_sorter>(ctx, particles);
+
+  num_errors = execute_incremental_sort_test(
+        ctx, perturb_order_locally(sorted_particles, num_particles / 100), true);
+  std::cout << "hilbert_incremental_sorter completed sort of locally perturbed particles with "
+            << num_errors << " errors." << std::endl;
+
+  // Each swap across the array displaces at most four particles
+  num_errors = execute_incremental_sort_test(
+        ctx, perturb_order(sorted_particles, num_particles / 100), true,
+        4 * (num_particles / 100));
+  std::cout << "hilbert_incremental_sorter completed sort of globally perturbed particles with "
+            << num_errors << " errors." << std::endl;
+
+  // A single particle that has moved far must not displace
+  // the particles it has moved past.
+  num_errors = execute_incremental_sort_test(
+        ctx, move_single_particle(sorted_particles), true, 2);
+  std::cout << "hilbert_incremental_sorter completed sort of a single moved particle with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_incremental_sort_test(ctx, sorted_particles, true, 0);
+  std::cout << "hilbert_incremental_sorter completed sort of sorted particles with "
+            << num_errors << " errors." << std::endl;
+
+  // Unsorted particles are mostly out of order,
+  // the sorter must fall back to the full sort.
+  num_errors = execute_incremental_sort_test(ctx, particles, false);
+  std::cout << "hilbert_incremental_sorter completed sort of unsorted particles with "
+            << num_errors << " errors." << std::endl;
+
+  num_errors = execute_permutation_test(ctx, particles);
+  std::cout << "Tree permutation test completed with "
+            << num_errors << " errors." << std::endl;
+
+  return 0;
+}